@@ -0,0 +1,128 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       cipherbench.c
+
+Note:       Measures what encryption adds to framing a packet. For
+            each payload size it writes and reads frames in a loop,
+            once in plaintext and once sealed and opened with
+            AES-256-GCM (see cipher.h), and prints the time per frame
+            and per byte and the throughput of each.
+
+            Build with "make cipherbench" and run ./cipherbench.
+*/
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cipher.h"
+#include "../frame.h"
+
+#define FRAME_COUNT 200000
+#define MAX_PAYLOAD_LEN 1024
+
+/******************************************
+ * secondsSince
+ *
+ * Arguments: struct timespec* start
+ * Returns: double
+ *
+ * Seconds elapsed since start
+ *****************************************/
+static double secondsSince(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/******************************************
+ * runFrames
+ *
+ * Arguments: FrameCipher* sender,
+ *            FrameCipher* receiver,
+ *            int payloadLength
+ * Returns: double
+ *
+ * Writes FRAME_COUNT frames with sender and
+ * reads each back with receiver, either of
+ * which may be NULL for plaintext
+ *
+ * Returns the seconds taken, or -1 if a frame
+ * did not read back as it was written
+ *****************************************/
+static double runFrames(FrameCipher* sender, FrameCipher* receiver, int payloadLength)
+{
+    static FrameReader reader;
+    FrameWriter writer = { 0 }; // isDatagram is left to the caller by resetFrameWriter
+    unsigned char payload[MAX_PAYLOAD_LEN];
+    unsigned char output[MAX_PAYLOAD_LEN];
+    uint32_t type, seqN, ackN, length;
+
+    memset(payload, 'x', sizeof(payload));
+    resetFrameWriter(&writer);
+    resetFrameReader(&reader);
+    writer.isCompact = 1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < FRAME_COUNT; i++)
+    {
+        // Write straight in to the reader, as if the frame had just been received
+        reader.start = 0;
+        reader.end = writeFrame(&writer, sender, reader.buffer, 1, i, 0, payloadLength, payload);
+        if (reader.end < 0 || readFrame(&reader, receiver, &type, &seqN, &ackN, &length, output, MAX_PAYLOAD_LEN) != 1
+            || length != (uint32_t) payloadLength)
+        {
+            return -1;
+        }
+    }
+
+    return secondsSince(&start);
+}
+
+int main()
+{
+    FrameCipher sender, receiver;
+    initCipher(&sender, 1);
+    initCipher(&receiver, 0);
+
+    // Any key will do, both sides only need the same one
+    memset(sender.preSharedKey, 0x5a, CIPHER_KEY_LEN);
+    memcpy(receiver.preSharedKey, sender.preSharedKey, CIPHER_KEY_LEN);
+    sender.isRequired = 1;
+    receiver.isRequired = 1;
+
+    resetCipher(&sender);
+    resetCipher(&receiver);
+    sentCipherNonce(&sender);
+    sentCipherNonce(&receiver);
+    if (keyCipher(&sender, receiver.localNonce) < 0 || keyCipher(&receiver, sender.localNonce) < 0)
+    {
+        return -1;
+    }
+
+    // The receiver's rx keys are the sender's tx keys, so frames go one way
+    printf("%8s %12s %12s %12s %12s %10s\n", "payload", "plain ns", "sealed ns", "added ns/B", "sealed MB/s", "overhead");
+
+    int sizes[] = { 1, 16, 64, 256, 1024 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        double plainSeconds = runFrames(NULL, NULL, sizes[i]);
+        double sealedSeconds = runFrames(&sender, &receiver, sizes[i]);
+        if (plainSeconds < 0 || sealedSeconds < 0)
+        {
+            printf("Frames of %i bytes did not read back\n", sizes[i]);
+            return -1;
+        }
+
+        double plainNs = plainSeconds * 1e9 / FRAME_COUNT;
+        double sealedNs = sealedSeconds * 1e9 / FRAME_COUNT;
+        printf("%8i %12.1f %12.1f %12.2f %12.1f %9.1fx\n", sizes[i], plainNs, sealedNs, (sealedNs - plainNs) / sizes[i],
+            sizes[i] * 1e3 / sealedNs, sealedNs / plainNs);
+    }
+
+    return 0;
+}
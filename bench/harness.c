@@ -0,0 +1,249 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       harness.c
+
+Note:       Implementation of the benchmarks' shared pieces. See harness.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "harness.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BACKEND_MAX_CONNECTIONS 128
+#define BACKEND_BUFFER_LEN 65536
+
+typedef struct {
+
+    int socketFD;
+    int isSource;           // !0 if the connection asked for a stream of output
+    int sawFirstByte;
+    int pendingStart;
+    int pendingEnd;
+    char pending[BACKEND_BUFFER_LEN]; // echo not yet accepted by the socket
+
+} BackendConnection;
+
+double nowSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/******************************************
+ * runBackend
+ *
+ * Arguments: int listenSocketFD
+ * Returns: void
+ *
+ * Stands in for the telnet daemon: echoes
+ * every connection, except ones whose first
+ * byte is SOURCE_REQUEST, which are sent a
+ * stream of output instead. Never returns
+ *****************************************/
+static void runBackend(int listenSocketFD)
+{
+    static BackendConnection connections[BACKEND_MAX_CONNECTIONS];
+    static char output[BACKEND_BUFFER_LEN];
+    int connectionCount = 0;
+    memset(output, 'y', sizeof(output));
+
+    while (1)
+    {
+        fd_set readSet, writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        FD_SET(listenSocketFD, &readSet);
+        int maxFD = listenSocketFD;
+        for (int i = 0; i < connectionCount; i++)
+        {
+            BackendConnection* connection = &connections[i];
+            if (connection->socketFD < 0)
+            {
+                continue;
+            }
+
+            // Only read more once the last echo was taken, so a slow reader slows its writer
+            if (connection->isSource == 0 && connection->pendingStart == connection->pendingEnd)
+            {
+                FD_SET(connection->socketFD, &readSet);
+            }
+            if (connection->isSource != 0 || connection->pendingStart != connection->pendingEnd)
+            {
+                FD_SET(connection->socketFD, &writeSet);
+            }
+            if (connection->socketFD > maxFD)
+            {
+                maxFD = connection->socketFD;
+            }
+        }
+
+        if (select(maxFD + 1, &readSet, &writeSet, NULL, NULL) < 0)
+        {
+            perror("Backend unable to use select");
+            _exit(1);
+        }
+
+        if (FD_ISSET(listenSocketFD, &readSet) && connectionCount < BACKEND_MAX_CONNECTIONS)
+        {
+            int socketFD = accept(listenSocketFD, NULL, NULL);
+            if (socketFD >= 0)
+            {
+                fcntl(socketFD, F_SETFL, O_NONBLOCK);
+                BackendConnection* connection = &connections[connectionCount++];
+                memset(connection, 0, sizeof(*connection));
+                connection->socketFD = socketFD;
+            }
+        }
+
+        for (int i = 0; i < connectionCount; i++)
+        {
+            BackendConnection* connection = &connections[i];
+            if (connection->socketFD >= 0 && FD_ISSET(connection->socketFD, &readSet))
+            {
+                ssize_t bytesRead = recv(connection->socketFD, connection->pending, sizeof(connection->pending), 0);
+                if (bytesRead <= 0)
+                {
+                    close(connection->socketFD);
+                    connection->socketFD = -1;
+                    continue;
+                }
+                connection->pendingStart = 0;
+                connection->pendingEnd = bytesRead;
+                if (connection->sawFirstByte == 0 && connection->pending[0] == SOURCE_REQUEST)
+                {
+                    connection->isSource = 1;
+                    connection->pendingEnd = 0;
+                }
+                connection->sawFirstByte = 1;
+            }
+
+            if (connection->socketFD >= 0 && FD_ISSET(connection->socketFD, &writeSet))
+            {
+                ssize_t bytesSent = (connection->isSource != 0)
+                    ? send(connection->socketFD, output, sizeof(output), MSG_NOSIGNAL)
+                    : send(connection->socketFD, connection->pending + connection->pendingStart,
+                        connection->pendingEnd - connection->pendingStart, MSG_NOSIGNAL);
+                if (bytesSent < 0 && errno != EAGAIN)
+                {
+                    close(connection->socketFD);
+                    connection->socketFD = -1;
+                    continue;
+                }
+                if (bytesSent > 0 && connection->isSource == 0)
+                {
+                    connection->pendingStart += bytesSent;
+                }
+            }
+        }
+    }
+}
+
+pid_t startBackend()
+{
+    int backendSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+    int reuseAddress = 1;
+    struct sockaddr_in backendAddress;
+    memset(&backendAddress, 0, sizeof(backendAddress));
+    backendAddress.sin_family = AF_INET;
+    backendAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    backendAddress.sin_port = htons(TELNET_PORT);
+    setsockopt(backendSocketFD, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+    if (bind(backendSocketFD, (struct sockaddr*) &backendAddress, sizeof(backendAddress)) < 0
+        || listen(backendSocketFD, BACKEND_MAX_CONNECTIONS) < 0)
+    {
+        perror("Unable to listen on the telnet port");
+        close(backendSocketFD);
+        return -1;
+    }
+
+    fflush(stdout); // before forking, so the child does not print it again
+    pid_t backendPID = fork();
+    if (backendPID == 0)
+    {
+        runBackend(backendSocketFD);
+    }
+    if (backendPID < 0)
+    {
+        perror("Unable to fork the backend");
+    }
+    close(backendSocketFD);
+
+    return backendPID;
+}
+
+pid_t startProcess(char** argv, int outputFD)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(outputFD, STDOUT_FILENO);
+        dup2(outputFD, STDERR_FILENO);
+        close(outputFD);
+        execv(argv[0], argv);
+        perror("Unable to start a proxy");
+        _exit(1);
+    }
+    if (pid < 0)
+    {
+        perror("Unable to fork");
+    }
+
+    return pid;
+}
+
+int connectSession(in_port_t port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        if (socketFD < 0)
+        {
+            perror("Unable to create a client socket");
+            return -1;
+        }
+        if (connect(socketFD, (struct sockaddr*) &address, sizeof(address)) == 0)
+        {
+            int noDelay = 1;
+            setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            fcntl(socketFD, F_SETFL, O_NONBLOCK);
+            return socketFD;
+        }
+        close(socketFD);
+
+        struct timespec wait = { .tv_sec = 0, .tv_nsec = 50000000 };
+        nanosleep(&wait, NULL);
+    }
+
+    printf("Unable to connect to cproxy on port %i\n", port);
+    return -1;
+}
+
+int splitOptions(const char* options, char** words, int wordCount)
+{
+    char* copy = strdup(options);
+    for (char* word = strtok(copy, " "); word != NULL && wordCount < MAX_PROXY_ARGS; word = strtok(NULL, " "))
+    {
+        words[wordCount++] = word;
+    }
+
+    return wordCount;
+}
@@ -0,0 +1,90 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       harness.h
+
+Note:       Pieces shared by the end to end benchmarks, loadgen and
+            impair: a stand-in for the telnet daemon on port 23, and
+            starting the proxies and connecting to them as telnet would.
+
+            The stand-in echoes every connection back, except ones whose
+            first byte is SOURCE_REQUEST, which it sends a stream of
+            output instead, as a long listing would. Port 23 must be
+            free to use it, which usually means running as root.
+*/
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#define TELNET_PORT 23              // where sproxy looks for the daemon
+#define SOURCE_REQUEST 0x02         // first byte of a connection that wants the daemon to stream output
+#define MAX_PROXY_ARGS 16           // most words splitOptions keeps
+
+/******************************************
+ * nowSeconds
+ *
+ * Arguments: none
+ * Returns: double
+ *
+ * Seconds on the monotonic clock
+ *****************************************/
+double nowSeconds();
+
+/******************************************
+ * startBackend
+ *
+ * Arguments: none
+ * Returns: pid_t
+ *
+ * Listens on the telnet port and forks a
+ * process that stands in for the daemon
+ *
+ * Returns the process's pid, or -1 on error
+ *****************************************/
+pid_t startBackend();
+
+/******************************************
+ * startProcess
+ *
+ * Arguments: char** argv, int outputFD
+ * Returns: pid_t
+ *
+ * Runs argv[0] with its output and errors
+ * going to outputFD
+ *
+ * Returns the child's pid, or -1 on error
+ *****************************************/
+pid_t startProcess(char** argv, int outputFD);
+
+/******************************************
+ * connectSession
+ *
+ * Arguments: in_port_t port
+ * Returns: int
+ *
+ * Connects to the cproxy listening on port
+ * over loopback, retrying while it starts up.
+ * The socket is non blocking, with Nagle's
+ * algorithm off as telnet has it
+ *
+ * Returns the socket, or -1 on error
+ *****************************************/
+int connectSession(in_port_t port);
+
+/******************************************
+ * splitOptions
+ *
+ * Arguments: const char* options,
+ *            char** words, int wordCount
+ * Returns: int
+ *
+ * Splits a copy of options at spaces in to
+ * words, after the wordCount already there,
+ * keeping at most MAX_PROXY_ARGS in all
+ *
+ * Returns the new count of words
+ *****************************************/
+int splitOptions(const char* options, char** words, int wordCount);
+
+#endif
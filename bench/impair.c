@@ -0,0 +1,1536 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       impair.c
+
+Note:       Measures how quickly a session recovers from a bad network.
+
+            impair stands in for the telnet daemon (see harness.h) and
+            starts one cproxy and sproxy pair, with a relay of its own
+            between them, which cproxy connects to in place of sproxy.
+            While a simulated telnet client types a keystroke every
+            KEY_INTERVAL_MS through the pair (or with -b keeps a stream
+            of payloads in flight), the relay impairs the link as a
+            script says, and impair times how the session copes.
+
+            A script has an event per line: a time in seconds from the
+            start of the run (after a second of warm up), an action and
+            its value, as in bench/recovery.txt:
+
+                0   delay 50            add 50 ms each way
+                2   jitter 20 for 5     and up to 20 ms more, for 5 s
+                10  loss 10 for 3       drop 10% of datagrams (UDP only)
+                15  rate 16 for 3       cap each way at 16 KB/s
+                20  blackhole for 5     pass nothing for 5 s
+                30  disconnect          reset the connection, or over UDP
+                                        give cproxy a new address
+                35  clear               lift every impairment
+                40  end
+
+            A setting given "for" a time goes back to what it was after
+            it, and "#" starts a comment. Over TCP the relay holds bytes
+            rather than dropping them, as the kernel would, so loss does
+            not apply there and a blackhole ends in a burst of what was
+            held.
+
+            For each event it prints the time to recover, from the
+            impairment lifting until everything sent up to then, and the
+            next keystroke, has come back. It also prints the longest
+            stall in delivery until the next event, the keystroke round
+            trip (or with -b the throughput), the retransmissions and
+            bytes retransmitted that the proxies logged, and how many
+            times cproxy rejoined sproxy. Every byte is checked to come
+            back once and in order.
+
+            Usage: ./impair [-U] [-b] [-a "proxy options"]
+                            [-c "cproxy options"] [-L] script
+
+            -U runs the proxies and the relay over UDP, and -a and -c
+            pass options on as loadgen's do. The proxies' output is read
+            through a pseudo terminal, so that it is line buffered and
+            each line can be timed. It is saved in a scratch directory
+            that is deleted afterwards, unless something failed or -L
+            was given. "make recovery" runs bench/recovery.txt over TCP
+            and over UDP.
+*/
+#define _GNU_SOURCE // Needed to use posix_openpt and cfmakeraw
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#define CPROXY_PORT 15200
+#define RELAY_PORT 15201            // cproxy connects here in place of sproxy
+#define SPROXY_PORT 15202
+#define MAX_EVENTS 64
+#define MAX_MAPPINGS 8              // cproxy addresses relayed at once over UDP, one per path
+#define CHUNK_LEN 2048              // most bytes relayed at once, more than any datagram
+#define LINK_SLOTS 512              // most chunks held in one direction
+#define MAX_QUEUED_BYTES 262144     // most bytes held in one direction, as a router's buffer
+#define KEY_INTERVAL_MS 20          // time between one keystroke's echo and the next keystroke
+#define BULK_CHUNK_LEN 1024
+#define BULK_WINDOW_LEN 65536       // most bytes a bulk session has sent but not had echoed
+#define MAX_SAMPLES 1048576
+#define WARM_UP_SECONDS 1.0
+#define TAIL_SECONDS 5.0            // run on after the last event, if the script has no end
+
+#define ACTION_DELAY 0
+#define ACTION_JITTER 1
+#define ACTION_LOSS 2
+#define ACTION_RATE 3
+#define ACTION_BLACKHOLE 4
+#define ACTION_DISCONNECT 5
+#define ACTION_CLEAR 6
+#define ACTION_END 7
+
+typedef struct {
+
+    double delayMs;         // added to every chunk each way
+    double jitterMs;        // most added at random on top of delayMs
+    double lossPercent;     // chance of dropping a datagram
+    double rateKBps;        // cap on each direction, 0 for none
+    int isBlackhole;        // !0 while nothing gets through
+
+} Impairment;
+
+typedef struct {
+
+    // From the script
+    double time;            // seconds after the run started
+    int action;
+    double value;
+    double duration;        // seconds until the setting goes back, 0 to keep it
+    char text[64];          // the script line, for the report
+
+    // While running
+    int isApplied;
+    int isLifted;
+    double previous;        // the setting before this event
+    double startTime;
+    double liftTime;        // when the impairment lifted
+    long liftSentBytes;     // bytes the session had sent when it lifted
+    int wasIdle;            // !0 if nothing was waiting to be echoed when it lifted
+    double firstSendTime;   // first time the session sent after it lifted
+    double recoverTime;     // when everything sent before it lifted came back
+
+    // Until the next event
+    double longestStall;
+    long deliveredBytes;
+    double endTime;
+    int sampleStart;
+    int sampleEnd;
+    int retransmissions;
+    long retransmittedBytes;
+    int rejoins;
+
+} Event;
+
+typedef struct {
+
+    int isUsed;
+    int hasLeftLine;        // !0 once it is past the rate cap, and on its way
+    double arrivalTime;
+    double releaseTime;     // when it has crossed the impaired link, once it has left the line
+    long order;             // when it was queued, to keep ties in order
+    int mapping;            // over UDP, which cproxy address it came from or goes to
+    int offset;             // over TCP, bytes of it already sent
+    int length;
+    char data[CHUNK_LEN];
+
+} Chunk;
+
+typedef struct {
+
+    Chunk chunks[LINK_SLOTS];
+    int count;
+    long queuedBytes;
+    long order;
+    double lastRelease;     // release time of the last chunk to leave the line, the order is kept
+    double lineFreeTime;    // when the line finished sending the last chunk to leave it
+    long relayedBytes;
+    long droppedBytes;
+
+} Link;
+
+typedef struct {
+
+    int isDatagram;
+    Impairment impairment;
+    struct sockaddr_in serverAddress; // where sproxy listens
+
+    int listenFD;           // TCP: accepts cproxy, UDP: receives from cproxy
+
+    // TCP
+    int clientFD;
+    int serverFD;
+
+    // UDP, a socket to sproxy for each cproxy address, as a NAT would have
+    struct sockaddr_in clientAddresses[MAX_MAPPINGS];
+    int upstreamFDs[MAX_MAPPINGS];
+    int mappingCount;
+
+    Link toServer;
+    Link toClient;
+
+} Relay;
+
+typedef struct {
+
+    int masterFD;           // -1 once the proxy has exited
+    int logFD;
+    int lineLength;
+    char line[256];
+
+} ProxyOutput;
+
+static Event events[MAX_EVENTS];
+static int eventCount = 0;
+static int currentEvent = -1; // the last event applied
+static double latencies[MAX_SAMPLES];
+static int latencyCount = 0;
+static Relay relay;
+
+/******************************************
+ * compareDoubles
+ *
+ * Arguments: const void* a, const void* b
+ * Returns: int
+ *
+ * Orders doubles for qsort
+ *****************************************/
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/******************************************
+ * patternByte
+ *
+ * Arguments: long index
+ * Returns: char
+ *
+ * The byte the session sends at index of its
+ * stream. 251 is prime, so a lost, repeated
+ * or reordered chunk of any length shows
+ *****************************************/
+static char patternByte(long index)
+{
+    return (char) (index % 251);
+}
+
+/******************************************
+ * readScript
+ *
+ * Arguments: const char* path
+ * Returns: int
+ *
+ * Reads the events of the script at path in
+ * to events, in order of time
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int readScript(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("impair unable to open the script");
+        return -1;
+    }
+
+    static const char* actionNames[] = { "delay", "jitter", "loss", "rate", "blackhole", "disconnect", "clear", "end" };
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char* time = strtok(line, " \t");
+        if (time == NULL)
+        {
+            continue;
+        }
+        if (eventCount >= MAX_EVENTS)
+        {
+            printf("A script can have at most %i events\n", MAX_EVENTS);
+            fclose(file);
+            return -1;
+        }
+
+        Event* event = &events[eventCount];
+        memset(event, 0, sizeof(*event));
+        char* name = strtok(NULL, " \t");
+        char* value = strtok(NULL, " \t");
+        char* word = strtok(NULL, " \t");
+        char* duration = strtok(NULL, " \t");
+        event->action = -1;
+        for (int i = 0; name != NULL && i < sizeof(actionNames) / sizeof(actionNames[0]); i++)
+        {
+            if (strcmp(name, actionNames[i]) == 0)
+            {
+                event->action = i;
+            }
+        }
+
+        // Only a blackhole has "for" straight after its name
+        if (event->action == ACTION_BLACKHOLE)
+        {
+            duration = word;
+            word = value;
+            value = NULL;
+        }
+        int takesValue = (event->action <= ACTION_RATE);
+        int takesDuration = (event->action <= ACTION_BLACKHOLE);
+        event->time = atof(time);
+        event->value = (value != NULL) ? atof(value) : 0;
+        event->duration = (duration != NULL) ? atof(duration) : 0;
+        if (event->action < 0 || (value != NULL) != takesValue
+            || (word != NULL && (takesDuration == 0 || strcmp(word, "for") != 0 || duration == NULL))
+            || (event->action == ACTION_BLACKHOLE && event->duration <= 0)
+            || (eventCount > 0 && event->time < events[eventCount - 1].time))
+        {
+            printf("Line %i of the script is not a valid event\n", lineNumber);
+            fclose(file);
+            return -1;
+        }
+
+        if (event->action == ACTION_BLACKHOLE)
+        {
+            snprintf(event->text, sizeof(event->text), "blackhole for %g", event->duration);
+        }
+        else if (takesValue != 0 && event->duration > 0)
+        {
+            snprintf(event->text, sizeof(event->text), "%s %g for %g", name, event->value, event->duration);
+        }
+        else if (takesValue != 0)
+        {
+            snprintf(event->text, sizeof(event->text), "%s %g", name, event->value);
+        }
+        else
+        {
+            snprintf(event->text, sizeof(event->text), "%s", name);
+        }
+        eventCount++;
+    }
+
+    fclose(file);
+    if (eventCount == 0)
+    {
+        printf("The script has no events\n");
+        return -1;
+    }
+    return 0;
+}
+
+/******************************************
+ * setting
+ *
+ * Arguments: Impairment* impairment,
+ *            int action
+ * Returns: double*
+ *
+ * The setting an event with action changes,
+ * or NULL if it is not a setting
+ *****************************************/
+static double* setting(Impairment* impairment, int action)
+{
+    switch (action)
+    {
+        case ACTION_DELAY:
+            return &impairment->delayMs;
+        case ACTION_JITTER:
+            return &impairment->jitterMs;
+        case ACTION_LOSS:
+            return &impairment->lossPercent;
+        case ACTION_RATE:
+            return &impairment->rateKBps;
+        default:
+            return NULL;
+    }
+}
+
+/******************************************
+ * clearLink
+ *
+ * Arguments: Link* link
+ * Returns: void
+ *
+ * Drops every chunk held on link
+ *****************************************/
+static void clearLink(Link* link)
+{
+    for (int i = 0; i < LINK_SLOTS; i++)
+    {
+        if (link->chunks[i].isUsed != 0)
+        {
+            link->droppedBytes += link->chunks[i].length - link->chunks[i].offset;
+            link->chunks[i].isUsed = 0;
+        }
+    }
+    link->count = 0;
+    link->queuedBytes = 0;
+    link->lastRelease = 0;
+    link->lineFreeTime = 0;
+}
+
+/******************************************
+ * hasRoom
+ *
+ * Arguments: Link* link
+ * Returns: int
+ *
+ * !0 if link can take another chunk. Over
+ * TCP the relay stops reading when it can't,
+ * so the sender backs up as behind a slow link
+ *****************************************/
+static int hasRoom(Link* link)
+{
+    return link->count < LINK_SLOTS && link->queuedBytes < MAX_QUEUED_BYTES;
+}
+
+/******************************************
+ * queueChunk
+ *
+ * Arguments: Link* link, int mapping,
+ *            void* data, int length,
+ *            double now
+ * Returns: void
+ *
+ * Puts data in line to cross the impaired
+ * link, or drops it as the link would
+ *****************************************/
+static void queueChunk(Link* link, int mapping, void* data, int length, double now)
+{
+    Impairment* impairment = &relay.impairment;
+    if (relay.isDatagram != 0 && (impairment->isBlackhole != 0 || rand() < impairment->lossPercent / 100 * RAND_MAX
+        || link->queuedBytes + length > MAX_QUEUED_BYTES || hasRoom(link) == 0))
+    {
+        link->droppedBytes += length;
+        return;
+    }
+
+    for (int i = 0; i < LINK_SLOTS; i++)
+    {
+        Chunk* chunk = &link->chunks[i];
+        if (chunk->isUsed == 0)
+        {
+            chunk->isUsed = 1;
+            chunk->hasLeftLine = 0;
+            chunk->arrivalTime = now;
+            chunk->order = link->order++;
+            chunk->mapping = mapping;
+            chunk->offset = 0;
+            chunk->length = length;
+            memcpy(chunk->data, data, length);
+            link->count++;
+            link->queuedBytes += length;
+            return;
+        }
+    }
+}
+
+/******************************************
+ * nextChunk
+ *
+ * Arguments: Link* link, int hasLeftLine
+ * Returns: Chunk*
+ *
+ * The first chunk still in line on link if
+ * hasLeftLine is 0, or else the first of the
+ * ones past it to release, or NULL if there
+ * are none
+ *****************************************/
+static Chunk* nextChunk(Link* link, int hasLeftLine)
+{
+    Chunk* next = NULL;
+    for (int i = 0; i < LINK_SLOTS && link->count > 0; i++)
+    {
+        Chunk* chunk = &link->chunks[i];
+        if (chunk->isUsed == 0 || chunk->hasLeftLine != hasLeftLine)
+        {
+            continue;
+        }
+        if (next == NULL || (hasLeftLine != 0 && chunk->releaseTime < next->releaseTime)
+            || ((hasLeftLine == 0 || chunk->releaseTime == next->releaseTime) && chunk->order < next->order))
+        {
+            next = chunk;
+        }
+    }
+
+    return next;
+}
+
+/******************************************
+ * advanceLine
+ *
+ * Arguments: Link* link, double now
+ * Returns: double
+ *
+ * Sends the chunks in line on link across it,
+ * one after another as fast as its rate cap
+ * allows, then each takes the delay to cross.
+ * The cap in force as a chunk reaches the
+ * front decides how long it takes, so lifting
+ * it drains the line at once
+ *
+ * Returns when the next chunk in line will be
+ * sent, or 0 if the line is empty
+ *****************************************/
+static double advanceLine(Link* link, double now)
+{
+    Impairment* impairment = &relay.impairment;
+    Chunk* chunk;
+    while ((chunk = nextChunk(link, 0)) != NULL)
+    {
+        double startTime = (link->lineFreeTime > chunk->arrivalTime) ? link->lineFreeTime : chunk->arrivalTime;
+        double sentTime = startTime + ((impairment->rateKBps > 0) ? chunk->length / (impairment->rateKBps * 1000) : 0);
+        if (sentTime > now)
+        {
+            return sentTime;
+        }
+
+        // Jitter is a queue that grows and shrinks on the way, so it holds chunks back but keeps them in order
+        double releaseTime = sentTime + (impairment->delayMs + impairment->jitterMs * rand() / RAND_MAX) / 1000;
+        if (releaseTime < link->lastRelease)
+        {
+            releaseTime = link->lastRelease;
+        }
+        chunk->hasLeftLine = 1;
+        chunk->releaseTime = releaseTime;
+        link->lastRelease = releaseTime;
+        link->lineFreeTime = sentTime;
+    }
+
+    return 0;
+}
+
+/******************************************
+ * closeConnection
+ *
+ * Arguments: int isReset
+ * Returns: void
+ *
+ * Closes the relay's TCP connections to
+ * cproxy and sproxy, resetting them rather
+ * than ending them if isReset, and drops
+ * what they held. A reset from either side
+ * is passed on as one, as a router would
+ *****************************************/
+static void closeConnection(int isReset)
+{
+    int fds[2] = { relay.clientFD, relay.serverFD };
+    for (int i = 0; i < 2; i++)
+    {
+        if (fds[i] < 0)
+        {
+            continue;
+        }
+
+        // Lingering for no time makes close send a reset, as a dropped mobile link ends up doing
+        if (isReset != 0)
+        {
+            struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+            setsockopt(fds[i], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+        close(fds[i]);
+    }
+    relay.clientFD = -1;
+    relay.serverFD = -1;
+    clearLink(&relay.toServer);
+    clearLink(&relay.toClient);
+}
+
+/******************************************
+ * disconnectRelay
+ *
+ * Arguments: none
+ * Returns: void
+ *
+ * Breaks the session's connection: over TCP
+ * resets it, over UDP forgets every cproxy
+ * address, so its next datagrams reach sproxy
+ * from a new port, as after a NAT rebinding
+ *****************************************/
+static void disconnectRelay()
+{
+    if (relay.isDatagram == 0)
+    {
+        closeConnection(1);
+        return;
+    }
+
+    for (int i = 0; i < relay.mappingCount; i++)
+    {
+        close(relay.upstreamFDs[i]);
+    }
+    relay.mappingCount = 0;
+    clearLink(&relay.toServer);
+    clearLink(&relay.toClient);
+}
+
+/******************************************
+ * acceptClient
+ *
+ * Arguments: none
+ * Returns: void
+ *
+ * Accepts cproxy's connection to the relay
+ * over TCP, in place of any it had, and
+ * connects it on to sproxy
+ *****************************************/
+static void acceptClient()
+{
+    int clientFD = accept(relay.listenFD, NULL, NULL);
+    if (clientFD < 0)
+    {
+        perror("impair unable to accept cproxy");
+        return;
+    }
+
+    // cproxy only connects again once it has given up on the old connection, which the relay
+    // may not have seen reset yet if it was too full to read it
+    closeConnection(1);
+
+    int serverFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverFD < 0 || connect(serverFD, (struct sockaddr*) &relay.serverAddress, sizeof(relay.serverAddress)) < 0)
+    {
+        perror("impair unable to connect to sproxy");
+        close(clientFD);
+        if (serverFD >= 0)
+        {
+            close(serverFD);
+        }
+        return;
+    }
+
+    // The proxies write whole frames, so the relay must not hold them back either
+    int noDelay = 1;
+    setsockopt(clientFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    setsockopt(serverFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    fcntl(clientFD, F_SETFL, O_NONBLOCK);
+    fcntl(serverFD, F_SETFL, O_NONBLOCK);
+    relay.clientFD = clientFD;
+    relay.serverFD = serverFD;
+}
+
+/******************************************
+ * findMapping
+ *
+ * Arguments: struct sockaddr_in* address
+ * Returns: int
+ *
+ * The mapping for datagrams from the cproxy
+ * address, opening a socket to sproxy for it
+ * if it is new
+ *
+ * Returns -1 if there is no room or on error
+ *****************************************/
+static int findMapping(struct sockaddr_in* address)
+{
+    for (int i = 0; i < relay.mappingCount; i++)
+    {
+        if (relay.clientAddresses[i].sin_addr.s_addr == address->sin_addr.s_addr
+            && relay.clientAddresses[i].sin_port == address->sin_port)
+        {
+            return i;
+        }
+    }
+    if (relay.mappingCount >= MAX_MAPPINGS)
+    {
+        return -1;
+    }
+
+    int upstreamFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (upstreamFD < 0 || connect(upstreamFD, (struct sockaddr*) &relay.serverAddress, sizeof(relay.serverAddress)) < 0)
+    {
+        perror("impair unable to open a socket to sproxy");
+        if (upstreamFD >= 0)
+        {
+            close(upstreamFD);
+        }
+        return -1;
+    }
+
+    relay.clientAddresses[relay.mappingCount] = *address;
+    relay.upstreamFDs[relay.mappingCount] = upstreamFD;
+    return relay.mappingCount++;
+}
+
+/******************************************
+ * flushLink
+ *
+ * Arguments: Link* link, int isToServer,
+ *            double now, double* wakeTime
+ * Returns: int
+ *
+ * Sends on every chunk of link that has
+ * crossed it by now. Over TCP a blackhole
+ * holds them, over UDP it drops them. Moves
+ * wakeTime earlier if the link has more to
+ * do before then
+ *
+ * Returns !0 if a TCP socket was full and
+ * chunks are waiting for it
+ *****************************************/
+static int flushLink(Link* link, int isToServer, double now, double* wakeTime)
+{
+    double lineTime = advanceLine(link, now);
+    if (lineTime > 0 && lineTime < *wakeTime)
+    {
+        *wakeTime = lineTime;
+    }
+
+    Chunk* chunk;
+    while ((chunk = nextChunk(link, 1)) != NULL)
+    {
+        if (chunk->releaseTime > now)
+        {
+            if (chunk->releaseTime < *wakeTime)
+            {
+                *wakeTime = chunk->releaseTime;
+            }
+            return 0;
+        }
+
+        if (relay.isDatagram == 0 && relay.impairment.isBlackhole != 0)
+        {
+            return 0;
+        }
+
+        ssize_t bytesSent = chunk->length;
+        if (relay.isDatagram == 0)
+        {
+            int socketFD = (isToServer != 0) ? relay.serverFD : relay.clientFD;
+            bytesSent = send(socketFD, chunk->data + chunk->offset, chunk->length - chunk->offset, MSG_NOSIGNAL);
+            if (bytesSent < 0 && errno == EAGAIN)
+            {
+                return 1;
+            }
+            if (bytesSent < 0)
+            {
+                closeConnection(1);
+                return 0;
+            }
+
+            chunk->offset += bytesSent;
+            link->relayedBytes += bytesSent;
+            if (chunk->offset < chunk->length)
+            {
+                return 1;
+            }
+        }
+        else if (relay.impairment.isBlackhole != 0)
+        {
+            link->droppedBytes += chunk->length;
+        }
+        else
+        {
+            // A mapping dropped by a disconnect has no socket any more, and its datagrams were cleared with it
+            if (isToServer != 0)
+            {
+                send(relay.upstreamFDs[chunk->mapping], chunk->data, chunk->length, 0);
+            }
+            else
+            {
+                sendto(relay.listenFD, chunk->data, chunk->length, 0, (struct sockaddr*) &relay.clientAddresses[chunk->mapping],
+                    sizeof(relay.clientAddresses[chunk->mapping]));
+            }
+            link->relayedBytes += chunk->length;
+        }
+
+        chunk->isUsed = 0;
+        link->count--;
+        link->queuedBytes -= chunk->length;
+    }
+
+    return 0;
+}
+
+/******************************************
+ * openRelay
+ *
+ * Arguments: int isDatagram
+ * Returns: int
+ *
+ * Starts the relay listening for cproxy on
+ * RELAY_PORT, relaying to sproxy on
+ * SPROXY_PORT
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int openRelay(int isDatagram)
+{
+    memset(&relay, 0, sizeof(relay));
+    relay.isDatagram = isDatagram;
+    relay.clientFD = -1;
+    relay.serverFD = -1;
+    relay.serverAddress.sin_family = AF_INET;
+    relay.serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    relay.serverAddress.sin_port = htons(SPROXY_PORT);
+
+    struct sockaddr_in relayAddress = relay.serverAddress;
+    relayAddress.sin_port = htons(RELAY_PORT);
+    relay.listenFD = socket(AF_INET, (isDatagram != 0) ? SOCK_DGRAM | SOCK_NONBLOCK : SOCK_STREAM, 0);
+    int reuseAddress = 1;
+    setsockopt(relay.listenFD, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+    if (relay.listenFD < 0 || bind(relay.listenFD, (struct sockaddr*) &relayAddress, sizeof(relayAddress)) < 0
+        || (isDatagram == 0 && listen(relay.listenFD, 4) < 0))
+    {
+        perror("impair unable to listen for cproxy");
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************
+ * startProxy
+ *
+ * Arguments: char** argv,
+ *            ProxyOutput* output,
+ *            const char* logPath
+ * Returns: pid_t
+ *
+ * Runs argv[0] with its output going to a
+ * pseudo terminal, read through output, and
+ * saved to logPath
+ *
+ * Returns the child's pid, or -1 on error
+ *****************************************/
+static pid_t startProxy(char** argv, ProxyOutput* output, const char* logPath)
+{
+    // On a terminal stdio flushes every line, so each can be timed as it arrives
+    output->lineLength = 0;
+    output->masterFD = posix_openpt(O_RDWR | O_NOCTTY);
+    int terminalFD = -1;
+    if (output->masterFD < 0 || grantpt(output->masterFD) < 0 || unlockpt(output->masterFD) < 0
+        || (terminalFD = open(ptsname(output->masterFD), O_RDWR | O_NOCTTY)) < 0)
+    {
+        perror("impair unable to open a pseudo terminal");
+        return -1;
+    }
+
+    // Pass lines through as they were written
+    struct termios settings;
+    tcgetattr(terminalFD, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(terminalFD, TCSANOW, &settings);
+    fcntl(output->masterFD, F_SETFL, O_NONBLOCK);
+
+    output->logFD = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output->logFD < 0)
+    {
+        perror("impair unable to create a log");
+        close(terminalFD);
+        return -1;
+    }
+
+    pid_t pid = startProcess(argv, terminalFD);
+    close(terminalFD);
+    return pid;
+}
+
+/******************************************
+ * noteLine
+ *
+ * Arguments: const char* line
+ * Returns: void
+ *
+ * Counts what a line a proxy printed says
+ * towards the current event
+ *****************************************/
+static void noteLine(const char* line)
+{
+    if (currentEvent < 0)
+    {
+        return;
+    }
+    Event* event = &events[currentEvent];
+
+    int packets, bytes;
+    if (sscanf(line, "Retransmitted %i data packets, %i bytes", &packets, &bytes) == 2)
+    {
+        event->retransmissions += packets;
+        event->retransmittedBytes += bytes;
+    }
+    // Over TCP cproxy connects again, over UDP it turns up at another address
+    else if (strcmp(line, "sproxy accepted new connection from client!") == 0
+        || strcmp(line, "cproxy is now at a new address") == 0)
+    {
+        event->rejoins++;
+    }
+}
+
+/******************************************
+ * readOutput
+ *
+ * Arguments: ProxyOutput* output
+ * Returns: int
+ *
+ * Reads what a proxy has printed, saving it
+ * and noting each whole line
+ *
+ * Returns 0 if nothing was ready, 1 otherwise
+ *****************************************/
+static int readOutput(ProxyOutput* output)
+{
+    char buffer[4096];
+    ssize_t bytesRead = read(output->masterFD, buffer, sizeof(buffer));
+    if (bytesRead < 0 && errno == EAGAIN)
+    {
+        return 0;
+    }
+    // Once the proxy has exited, reading its terminal fails
+    if (bytesRead <= 0)
+    {
+        close(output->masterFD);
+        output->masterFD = -1;
+        return 1;
+    }
+
+    if (write(output->logFD, buffer, bytesRead) < 0)
+    {
+        perror("impair unable to save a proxy's output");
+    }
+    for (ssize_t i = 0; i < bytesRead; i++)
+    {
+        if (buffer[i] == '\n' || buffer[i] == '\r')
+        {
+            output->line[output->lineLength] = '\0';
+            noteLine(output->line);
+            output->lineLength = 0;
+        }
+        else if (output->lineLength < sizeof(output->line) - 1)
+        {
+            output->line[output->lineLength++] = buffer[i];
+        }
+    }
+
+    return 1;
+}
+
+/******************************************
+ * endPhase
+ *
+ * Arguments: double now, double lastDelivery
+ * Returns: void
+ *
+ * Closes the measurements of the current
+ * event, as the next one starts or the run
+ * ends
+ *****************************************/
+static void endPhase(double now, double lastDelivery)
+{
+    if (currentEvent < 0)
+    {
+        return;
+    }
+
+    Event* event = &events[currentEvent];
+    double since = (lastDelivery > event->startTime) ? lastDelivery : event->startTime;
+    if (now - since > event->longestStall)
+    {
+        event->longestStall = now - since;
+    }
+    event->endTime = now;
+    event->sampleEnd = latencyCount;
+}
+
+/******************************************
+ * liftEvent
+ *
+ * Arguments: Event* event, double now,
+ *            long sentBytes, long receivedBytes
+ * Returns: void
+ *
+ * Records that event's impairment has lifted,
+ * so the session can be timed recovering
+ *****************************************/
+static void liftEvent(Event* event, double now, long sentBytes, long receivedBytes)
+{
+    event->isLifted = 1;
+    event->liftTime = now;
+    event->liftSentBytes = sentBytes;
+    event->wasIdle = (sentBytes == receivedBytes);
+}
+
+/******************************************
+ * applyEvent
+ *
+ * Arguments: Event* event, double now,
+ *            long sentBytes, long receivedBytes
+ * Returns: void
+ *
+ * Changes the relay's impairment as event
+ * says
+ *****************************************/
+static void applyEvent(Event* event, double now, long sentBytes, long receivedBytes)
+{
+    event->isApplied = 1;
+    event->startTime = now;
+    event->sampleStart = latencyCount;
+
+    double* value = setting(&relay.impairment, event->action);
+    if (value != NULL)
+    {
+        event->previous = *value;
+        *value = event->value;
+        if (event->action == ACTION_LOSS && relay.isDatagram == 0)
+        {
+            printf("A stream never loses bytes, loss only applies over UDP (-U)\n");
+        }
+    }
+    else if (event->action == ACTION_BLACKHOLE)
+    {
+        relay.impairment.isBlackhole = 1;
+    }
+    else if (event->action == ACTION_DISCONNECT)
+    {
+        disconnectRelay();
+        liftEvent(event, now, sentBytes, receivedBytes);
+    }
+    else if (event->action == ACTION_CLEAR)
+    {
+        memset(&relay.impairment, 0, sizeof(relay.impairment));
+    }
+}
+
+/******************************************
+ * revertEvent
+ *
+ * Arguments: Event* event, double now,
+ *            long sentBytes, long receivedBytes
+ * Returns: void
+ *
+ * Puts back what event changed, once its
+ * time is up
+ *****************************************/
+static void revertEvent(Event* event, double now, long sentBytes, long receivedBytes)
+{
+    double* value = setting(&relay.impairment, event->action);
+    if (value != NULL)
+    {
+        *value = event->previous;
+    }
+    else if (event->action == ACTION_BLACKHOLE)
+    {
+        relay.impairment.isBlackhole = 0;
+    }
+    liftEvent(event, now, sentBytes, receivedBytes);
+}
+
+/******************************************
+ * printReport
+ *
+ * Arguments: int isBulk
+ * Returns: void
+ *
+ * Prints what was measured for each event
+ *****************************************/
+static void printReport(int isBulk)
+{
+    printf("%6s  %-22s %10s %10s %19s %14s %7s\n", "at s", "event", "recover", "stall", isBulk ? "throughput" : "rtt p50 / p99",
+        "retransmitted", "rejoins");
+    for (int i = 0; i < eventCount; i++)
+    {
+        Event* event = &events[i];
+        if (event->isApplied == 0 || event->action == ACTION_END)
+        {
+            continue;
+        }
+
+        char recover[32] = "-";
+        if (event->isLifted != 0 && event->recoverTime == 0)
+        {
+            snprintf(recover, sizeof(recover), "never");
+        }
+        else if (event->isLifted != 0)
+        {
+            double start = (event->wasIdle != 0) ? event->firstSendTime : event->liftTime;
+            snprintf(recover, sizeof(recover), "%.0f ms", (event->recoverTime - start) * 1e3);
+        }
+
+        char delivery[32] = "-";
+        double seconds = event->endTime - event->startTime;
+        if (isBulk != 0 && seconds > 0)
+        {
+            snprintf(delivery, sizeof(delivery), "%.1f KB/s", event->deliveredBytes / seconds / 1e3);
+        }
+        else if (event->sampleEnd > event->sampleStart)
+        {
+            int count = event->sampleEnd - event->sampleStart;
+            double* samples = &latencies[event->sampleStart];
+            qsort(samples, count, sizeof(double), compareDoubles);
+            snprintf(delivery, sizeof(delivery), "%.1f / %.1f ms", samples[count / 2] * 1e3, samples[count * 99 / 100] * 1e3);
+        }
+
+        char retransmitted[32];
+        snprintf(retransmitted, sizeof(retransmitted), "%i, %li B", event->retransmissions, event->retransmittedBytes);
+        printf("%6.1f  %-22s %10s %7.0f ms %19s %14s %7i\n", event->time, event->text, recover, event->longestStall * 1e3,
+            delivery, retransmitted, event->rejoins);
+    }
+}
+
+/******************************************
+ * printUsage
+ *
+ * Arguments: none
+ * Returns: void
+ *
+ * Prints the command line options
+ *****************************************/
+static void printUsage()
+{
+    printf("Usage: ./impair [-U] [-b] [-a \"proxy options\"] [-c \"cproxy options\"] [-L] script\n");
+}
+
+int main(int argc, char** argv)
+{
+    int isDatagram = 0;
+    int isBulk = 0;
+    char* proxyOptions = "";
+    char* cproxyOptions = "";
+    int isKeepingLogs = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "Uba:c:L")) != -1)
+    {
+        switch (option)
+        {
+            case 'U':
+                isDatagram = 1;
+                break;
+            case 'b':
+                isBulk = 1;
+                break;
+            case 'a':
+                proxyOptions = optarg;
+                break;
+            case 'c':
+                cproxyOptions = optarg;
+                break;
+            case 'L':
+                isKeepingLogs = 1;
+                break;
+            default:
+                printUsage();
+                return -1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        printUsage();
+        return -1;
+    }
+    if (readScript(argv[optind]) < 0)
+    {
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(1); // the same script draws the same losses and jitter every run
+
+    // Split the proxy options in to words, -U goes to both
+    char* sproxyArgs[MAX_PROXY_ARGS + 1];
+    char* cproxyArgs[MAX_PROXY_ARGS + 1];
+    int sproxyArgCount = splitOptions(isDatagram ? "-U" : "", sproxyArgs, 0);
+    sproxyArgCount = splitOptions(proxyOptions, sproxyArgs, sproxyArgCount);
+    int cproxyArgCount = splitOptions(isDatagram ? "-U" : "", cproxyArgs, 0);
+    cproxyArgCount = splitOptions(proxyOptions, cproxyArgs, cproxyArgCount);
+    cproxyArgCount = splitOptions(cproxyOptions, cproxyArgs, cproxyArgCount);
+
+    pid_t backendPID = startBackend();
+    if (backendPID < 0 || openRelay(isDatagram) < 0)
+    {
+        return -1;
+    }
+
+    char logDirectory[] = "/tmp/impair.XXXXXX";
+    if (mkdtemp(logDirectory) == NULL)
+    {
+        perror("impair unable to create a log directory");
+        return -1;
+    }
+
+    char sproxyPort[16], relayPort[16], cproxyPort[16], logPath[64];
+    snprintf(sproxyPort, sizeof(sproxyPort), "%i", SPROXY_PORT);
+    snprintf(relayPort, sizeof(relayPort), "%i", RELAY_PORT);
+    snprintf(cproxyPort, sizeof(cproxyPort), "%i", CPROXY_PORT);
+
+    ProxyOutput outputs[2];
+    char* sproxyArgv[MAX_PROXY_ARGS + 3];
+    int argCount = 0;
+    sproxyArgv[argCount++] = "./sproxy";
+    for (int i = 0; i < sproxyArgCount; i++)
+    {
+        sproxyArgv[argCount++] = sproxyArgs[i];
+    }
+    sproxyArgv[argCount++] = sproxyPort;
+    sproxyArgv[argCount] = NULL;
+    snprintf(logPath, sizeof(logPath), "%s/sproxy.log", logDirectory);
+    pid_t sproxyPID = startProxy(sproxyArgv, &outputs[0], logPath);
+
+    char* cproxyArgv[MAX_PROXY_ARGS + 5];
+    argCount = 0;
+    cproxyArgv[argCount++] = "./cproxy";
+    for (int i = 0; i < cproxyArgCount; i++)
+    {
+        cproxyArgv[argCount++] = cproxyArgs[i];
+    }
+    cproxyArgv[argCount++] = cproxyPort;
+    cproxyArgv[argCount++] = "127.0.0.1";
+    cproxyArgv[argCount++] = relayPort;
+    cproxyArgv[argCount] = NULL;
+    snprintf(logPath, sizeof(logPath), "%s/cproxy.log", logDirectory);
+    pid_t cproxyPID = startProxy(cproxyArgv, &outputs[1], logPath);
+
+    int result = 0;
+    int sessionFD = -1;
+    if (sproxyPID < 0 || cproxyPID < 0 || (sessionFD = connectSession(CPROXY_PORT)) < 0)
+    {
+        result = -1;
+    }
+
+    static char payload[BULK_CHUNK_LEN];
+    static char scratch[65536];
+    long sentBytes = 0;
+    long receivedBytes = 0;
+    double nextKeyTime = 0;
+    double sentTime = 0;
+    double lastDelivery = 0;
+    double startTime = nowSeconds() + WARM_UP_SECONDS;
+    double endTime = startTime + events[eventCount - 1].time + TAIL_SECONDS;
+    for (int i = 0; i < eventCount; i++)
+    {
+        if (startTime + events[i].time + events[i].duration + TAIL_SECONDS > endTime)
+        {
+            endTime = startTime + events[i].time + events[i].duration + TAIL_SECONDS;
+        }
+    }
+
+    while (result == 0)
+    {
+        double now = nowSeconds();
+        if (now >= endTime)
+        {
+            break;
+        }
+
+        // Start the events that are due, and lift the ones that are up
+        double wakeTime = endTime;
+        for (int i = 0; i < eventCount; i++)
+        {
+            Event* event = &events[i];
+            double eventTime = startTime + event->time;
+            if (event->isApplied == 0 && now >= eventTime)
+            {
+                endPhase(now, lastDelivery);
+                currentEvent = i;
+                applyEvent(event, now, sentBytes, receivedBytes);
+                if (event->action == ACTION_END)
+                {
+                    endTime = now;
+                }
+            }
+            else if (event->isApplied == 0 && eventTime < wakeTime)
+            {
+                wakeTime = eventTime;
+            }
+
+            double liftTime = eventTime + event->duration;
+            if (event->isApplied != 0 && event->isLifted == 0 && event->duration > 0)
+            {
+                if (now >= liftTime)
+                {
+                    revertEvent(event, now, sentBytes, receivedBytes);
+                }
+                else if (liftTime < wakeTime)
+                {
+                    wakeTime = liftTime;
+                }
+            }
+        }
+        if (now >= endTime)
+        {
+            break;
+        }
+
+        // Type the next keystroke that is due
+        if (isBulk == 0 && sentBytes == receivedBytes && now >= nextKeyTime)
+        {
+            char key = patternByte(sentBytes);
+            if (send(sessionFD, &key, 1, 0) == 1)
+            {
+                sentTime = now;
+                sentBytes++;
+            }
+        }
+        else if (isBulk == 0 && sentBytes == receivedBytes && nextKeyTime < wakeTime)
+        {
+            wakeTime = nextKeyTime;
+        }
+
+        // Let through what has crossed the link
+        int isServerFull = flushLink(&relay.toServer, 1, now, &wakeTime);
+        int isClientFull = flushLink(&relay.toClient, 0, now, &wakeTime);
+
+        fd_set readSet, writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        int maxFD = sessionFD;
+        FD_SET(sessionFD, &readSet);
+        if (isBulk != 0 && sentBytes - receivedBytes < BULK_WINDOW_LEN)
+        {
+            FD_SET(sessionFD, &writeSet);
+        }
+        int relayFDs[MAX_MAPPINGS + 3];
+        int relayFDCount = 0;
+        relayFDs[relayFDCount++] = relay.listenFD;
+        if (relay.clientFD >= 0 && hasRoom(&relay.toServer))
+        {
+            relayFDs[relayFDCount++] = relay.clientFD;
+        }
+        if (relay.serverFD >= 0 && hasRoom(&relay.toClient))
+        {
+            relayFDs[relayFDCount++] = relay.serverFD;
+        }
+        for (int i = 0; i < relay.mappingCount; i++)
+        {
+            relayFDs[relayFDCount++] = relay.upstreamFDs[i];
+        }
+        for (int i = 0; i < relayFDCount; i++)
+        {
+            FD_SET(relayFDs[i], &readSet);
+            maxFD = (relayFDs[i] > maxFD) ? relayFDs[i] : maxFD;
+        }
+        if (isServerFull != 0 && relay.serverFD >= 0)
+        {
+            FD_SET(relay.serverFD, &writeSet);
+            maxFD = (relay.serverFD > maxFD) ? relay.serverFD : maxFD;
+        }
+        if (isClientFull != 0 && relay.clientFD >= 0)
+        {
+            FD_SET(relay.clientFD, &writeSet);
+            maxFD = (relay.clientFD > maxFD) ? relay.clientFD : maxFD;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (outputs[i].masterFD >= 0)
+            {
+                FD_SET(outputs[i].masterFD, &readSet);
+                maxFD = (outputs[i].masterFD > maxFD) ? outputs[i].masterFD : maxFD;
+            }
+        }
+
+        double waitSeconds = (wakeTime > now) ? wakeTime - now : 0;
+        struct timeval timeout = {
+            .tv_sec = (time_t) waitSeconds,
+            .tv_usec = (suseconds_t) ((waitSeconds - (time_t) waitSeconds) * 1e6)
+        };
+        if (select(maxFD + 1, &readSet, &writeSet, NULL, &timeout) < 0)
+        {
+            perror("impair unable to use select");
+            result = -1;
+            break;
+        }
+        now = nowSeconds();
+
+        for (int i = 0; i < 2; i++)
+        {
+            if (outputs[i].masterFD >= 0 && FD_ISSET(outputs[i].masterFD, &readSet))
+            {
+                readOutput(&outputs[i]);
+            }
+        }
+
+        // Relay what cproxy and sproxy sent, first checking for sockets a disconnect just closed
+        char chunk[CHUNK_LEN];
+        int clientFD = relay.clientFD, serverFD = relay.serverFD;
+        if (relay.isDatagram == 0 && FD_ISSET(relay.listenFD, &readSet))
+        {
+            acceptClient();
+        }
+        else if (relay.isDatagram != 0 && FD_ISSET(relay.listenFD, &readSet))
+        {
+            struct sockaddr_in fromAddress;
+            socklen_t fromAddressLength = sizeof(fromAddress);
+            ssize_t bytesRead = recvfrom(relay.listenFD, chunk, sizeof(chunk), 0, (struct sockaddr*) &fromAddress, &fromAddressLength);
+            int mapping = (bytesRead > 0) ? findMapping(&fromAddress) : -1;
+            if (mapping >= 0)
+            {
+                queueChunk(&relay.toServer, mapping, chunk, bytesRead, now);
+            }
+        }
+        for (int i = 0; i < relay.mappingCount; i++)
+        {
+            if (FD_ISSET(relay.upstreamFDs[i], &readSet))
+            {
+                ssize_t bytesRead = recv(relay.upstreamFDs[i], chunk, sizeof(chunk), 0);
+                if (bytesRead > 0)
+                {
+                    queueChunk(&relay.toClient, i, chunk, bytesRead, now);
+                }
+            }
+        }
+        if (clientFD >= 0 && clientFD == relay.clientFD && FD_ISSET(clientFD, &readSet))
+        {
+            ssize_t bytesRead = recv(clientFD, chunk, sizeof(chunk), 0);
+            if (bytesRead > 0)
+            {
+                queueChunk(&relay.toServer, 0, chunk, bytesRead, now);
+            }
+            else if (bytesRead == 0 || errno != EAGAIN)
+            {
+                closeConnection(bytesRead < 0);
+            }
+        }
+        if (serverFD >= 0 && serverFD == relay.serverFD && FD_ISSET(serverFD, &readSet))
+        {
+            ssize_t bytesRead = recv(serverFD, chunk, sizeof(chunk), 0);
+            if (bytesRead > 0)
+            {
+                queueChunk(&relay.toClient, 0, chunk, bytesRead, now);
+            }
+            else if (bytesRead == 0 || errno != EAGAIN)
+            {
+                closeConnection(bytesRead < 0);
+            }
+        }
+
+        if (isBulk != 0 && FD_ISSET(sessionFD, &writeSet))
+        {
+            for (int i = 0; i < BULK_CHUNK_LEN; i++)
+            {
+                payload[i] = patternByte(sentBytes + i);
+            }
+            ssize_t bytesSent = send(sessionFD, payload, BULK_CHUNK_LEN, 0);
+            if (bytesSent > 0)
+            {
+                sentBytes += bytesSent;
+            }
+        }
+        for (int i = 0; i < eventCount; i++)
+        {
+            if (events[i].isLifted != 0 && events[i].firstSendTime == 0 && sentBytes > events[i].liftSentBytes)
+            {
+                events[i].firstSendTime = (isBulk != 0) ? now : sentTime;
+            }
+        }
+
+        if (FD_ISSET(sessionFD, &readSet))
+        {
+            ssize_t bytesRead = recv(sessionFD, scratch, sizeof(scratch), 0);
+            if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN))
+            {
+                printf("The session was disconnected, see the logs in %s\n", logDirectory);
+                result = -1;
+                break;
+            }
+            if (bytesRead < 0)
+            {
+                continue;
+            }
+
+            for (ssize_t i = 0; i < bytesRead; i++)
+            {
+                if (scratch[i] != patternByte(receivedBytes + i))
+                {
+                    printf("Byte %li came back wrong, see the logs in %s\n", receivedBytes + i, logDirectory);
+                    result = -1;
+                    break;
+                }
+            }
+            receivedBytes += bytesRead;
+
+            if (currentEvent >= 0)
+            {
+                Event* event = &events[currentEvent];
+                double since = (lastDelivery > event->startTime) ? lastDelivery : event->startTime;
+                if (now - since > event->longestStall)
+                {
+                    event->longestStall = now - since;
+                }
+                event->deliveredBytes += bytesRead;
+            }
+            lastDelivery = now;
+            for (int i = 0; i < eventCount; i++)
+            {
+                if (events[i].isLifted != 0 && events[i].recoverTime == 0 && receivedBytes > events[i].liftSentBytes)
+                {
+                    events[i].recoverTime = now;
+                }
+            }
+
+            if (isBulk == 0 && sentBytes == receivedBytes)
+            {
+                if (currentEvent >= 0 && latencyCount < MAX_SAMPLES)
+                {
+                    latencies[latencyCount++] = now - sentTime;
+                }
+                nextKeyTime = now + KEY_INTERVAL_MS / 1e3;
+            }
+        }
+    }
+    endPhase(nowSeconds(), lastDelivery);
+
+    // Stop the proxies, then read the last of what they printed
+    if (cproxyPID > 0)
+    {
+        kill(cproxyPID, SIGTERM);
+        waitpid(cproxyPID, NULL, 0);
+    }
+    if (sproxyPID > 0)
+    {
+        kill(sproxyPID, SIGTERM);
+        waitpid(sproxyPID, NULL, 0);
+    }
+    kill(backendPID, SIGTERM);
+    waitpid(backendPID, NULL, 0);
+    for (int i = 0; i < 2; i++)
+    {
+        while (outputs[i].masterFD >= 0 && readOutput(&outputs[i]) != 0);
+        close(outputs[i].logFD);
+    }
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    printf("Session over %s, options \"%s\" \"%s\", %s, script %s\n", isDatagram ? "UDP" : "TCP", proxyOptions, cproxyOptions,
+        isBulk ? "bulk" : "interactive", argv[optind]);
+    printReport(isBulk);
+    printf("All %li bytes came back in order. The relay carried %li bytes to sproxy and %li back, and dropped %li\n",
+        receivedBytes, relay.toServer.relayedBytes, relay.toClient.relayedBytes, relay.toServer.droppedBytes + relay.toClient.droppedBytes);
+
+    // Keep the logs only if something went wrong, or they were asked for
+    if (isKeepingLogs != 0)
+    {
+        printf("Logs in %s\n", logDirectory);
+        return 0;
+    }
+    snprintf(logPath, sizeof(logPath), "%s/sproxy.log", logDirectory);
+    unlink(logPath);
+    snprintf(logPath, sizeof(logPath), "%s/cproxy.log", logDirectory);
+    unlink(logPath);
+    rmdir(logDirectory);
+
+    return 0;
+}
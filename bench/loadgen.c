@@ -0,0 +1,585 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       loadgen.c
+
+Note:       End to end benchmark of the proxy pair over loopback.
+
+            loadgen stands in for the telnet daemon on port 23, starts a
+            cproxy and sproxy pair for each session (each pair carries a
+            single session), and drives a simulated telnet client through
+            each pair. Interactive sessions type one keystroke every
+            KEY_INTERVAL_MS and time its echo. Bulk sessions either send
+            a stream of payloads and read back the echo, or, with -m
+            source, ask the daemon stand-in to stream output to them, as
+            a long listing would.
+
+            After a second of warm up, it measures for the given time and
+            prints the throughput carried by the bulk sessions, the data
+            frames per second the proxies sent (read from their stats
+            sockets, see stats.h),
+            the CPU time cproxy and sproxy used per GB carried, and the
+            p50, p99 and p999 keystroke round trip times.
+
+            Usage: ./loadgen [-n sessions] [-b bulkSessions] [-m echo|source]
+                             [-l payloadLength] [-t seconds] [-a "proxy options"]
+                             [-c "cproxy options"] [-L]
+
+            Options given with -a are passed to both cproxy and sproxy,
+            and ones given with -c to cproxy alone, -a -U -c -F say. Port
+            23 must be free (see harness.h). The proxies' logs and stats
+            sockets are deleted afterwards, unless something failed or -L was given.
+            "make bench" runs a few typical mixes.
+*/
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+#define CPROXY_BASE_PORT 15000      // cproxy of session i listens on CPROXY_BASE_PORT + i
+#define SPROXY_BASE_PORT 16000      // sproxy of session i listens on SPROXY_BASE_PORT + i
+#define MAX_SESSIONS 128
+#define MAX_PAYLOAD_LEN 65536
+#define KEY_INTERVAL_MS 20          // time between one keystroke's echo and the next keystroke
+#define BULK_WINDOW_LEN 262144      // most bytes a bulk session has sent but not had echoed
+#define MAX_SAMPLES 1048576
+#define WARM_UP_SECONDS 1.0
+
+typedef struct {
+
+    int socketFD;
+    int isBulk;
+    pid_t cproxyPID;
+    pid_t sproxyPID;
+
+    // Interactive sessions
+    int isWaiting;          // !0 while a keystroke's echo is outstanding
+    double sentTime;        // when the outstanding keystroke was sent
+    double nextKeyTime;     // when to send the next keystroke
+
+    // Bulk sessions
+    long sentBytes;
+    long receivedBytes;
+
+} Session;
+
+static double latencies[MAX_SAMPLES];
+static int latencyCount = 0;
+
+/******************************************
+ * compareDoubles
+ *
+ * Arguments: const void* a, const void* b
+ * Returns: int
+ *
+ * Orders doubles for qsort
+ *****************************************/
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/******************************************
+ * startLogged
+ *
+ * Arguments: char** argv, const char* logPath
+ * Returns: pid_t
+ *
+ * Runs argv[0] with its output going to
+ * logPath
+ *
+ * Returns the child's pid, or -1 on error
+ *****************************************/
+static pid_t startLogged(char** argv, const char* logPath)
+{
+    int logFD = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (logFD < 0)
+    {
+        perror("loadgen unable to create a log");
+        return -1;
+    }
+
+    pid_t pid = startProcess(argv, logFD);
+    close(logFD);
+    return pid;
+}
+
+/******************************************
+ * processCpuSeconds
+ *
+ * Arguments: pid_t pid
+ * Returns: double
+ *
+ * User and system CPU time pid has used so
+ * far, from /proc, or 0 if it is not known
+ *****************************************/
+static double processCpuSeconds(pid_t pid)
+{
+    char path[64];
+    char stat[1024];
+    snprintf(path, sizeof(path), "/proc/%i/stat", (int) pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[length] = '\0';
+
+    // utime and stime are the 12th and 13th fields after the command name, which may hold spaces
+    char* fields = strrchr(stat, ')');
+    unsigned long userTicks, systemTicks;
+    if (fields == NULL
+        || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &userTicks, &systemTicks) != 2)
+    {
+        return 0;
+    }
+
+    return (double) (userTicks + systemTicks) / sysconf(_SC_CLK_TCK);
+}
+
+/******************************************
+ * countFrames
+ *
+ * Arguments: const char* directory,
+ *            const char* program, int index
+ * Returns: long
+ *
+ * Reads the frames a proxy has sent to the
+ * other, heartbeats and retransmissions
+ * included, from its stats socket
+ *
+ * Returns 0 if it could not be read
+ *****************************************/
+static long countFrames(const char* directory, const char* program, int index)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s/%s%i.sock", directory, program, index);
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        if (socketFD >= 0)
+        {
+            close(socketFD);
+        }
+        return 0;
+    }
+
+    // The stats thread answers without a request after a moment, so ask for it right away
+    send(socketFD, "\n", 1, 0);
+    FILE* file = fdopen(socketFD, "r");
+    if (file == NULL)
+    {
+        close(socketFD);
+        return 0;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s_peer_frames_sent_total ", program);
+    long count = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, name, strlen(name)) == 0)
+        {
+            count = atol(line + strlen(name));
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+/******************************************
+ * printUsage
+ *
+ * Arguments: none
+ * Returns: void
+ *
+ * Prints the command line options
+ *****************************************/
+static void printUsage()
+{
+    printf("Usage: ./loadgen [-n sessions] [-b bulkSessions] [-m echo|source] [-l payloadLength] [-t seconds] [-a \"proxy options\"] [-c \"cproxy options\"] [-L]\n");
+}
+
+int main(int argc, char** argv)
+{
+    int sessionCount = 1;
+    int bulkCount = 0;
+    int isSource = 0;
+    int payloadLength = 1024;
+    double seconds = 5;
+    char* proxyOptions = "";
+    char* cproxyOptions = "";
+    int isKeepingLogs = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:b:m:l:t:a:c:L")) != -1)
+    {
+        switch (option)
+        {
+            case 'n':
+                sessionCount = atoi(optarg);
+                break;
+            case 'b':
+                bulkCount = atoi(optarg);
+                break;
+            case 'm':
+                isSource = (strcmp(optarg, "source") == 0);
+                break;
+            case 'l':
+                payloadLength = atoi(optarg);
+                break;
+            case 't':
+                seconds = atof(optarg);
+                break;
+            case 'a':
+                proxyOptions = optarg;
+                break;
+            case 'c':
+                cproxyOptions = optarg;
+                break;
+            case 'L':
+                isKeepingLogs = 1;
+                break;
+            default:
+                printUsage();
+                return -1;
+        }
+    }
+    if (sessionCount < 1 || sessionCount > MAX_SESSIONS || bulkCount < 0 || bulkCount > sessionCount
+        || payloadLength < 1 || payloadLength > MAX_PAYLOAD_LEN || seconds <= 0)
+    {
+        printUsage();
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Split the proxy options in to words
+    char* sproxyArgs[MAX_PROXY_ARGS];
+    char* cproxyArgs[MAX_PROXY_ARGS];
+    int sproxyArgCount = splitOptions(proxyOptions, sproxyArgs, 0);
+    int cproxyArgCount = splitOptions(proxyOptions, cproxyArgs, 0);
+    cproxyArgCount = splitOptions(cproxyOptions, cproxyArgs, cproxyArgCount);
+
+    // Stand in for the telnet daemon
+    pid_t backendPID = startBackend();
+    if (backendPID < 0)
+    {
+        return -1;
+    }
+
+    // Start a proxy pair for each session, logging to a scratch directory
+    char logDirectory[] = "/tmp/loadgen.XXXXXX";
+    if (mkdtemp(logDirectory) == NULL)
+    {
+        perror("loadgen unable to create a log directory");
+        return -1;
+    }
+
+    static Session sessions[MAX_SESSIONS];
+    int result = 0;
+    for (int i = 0; i < sessionCount && result == 0; i++)
+    {
+        Session* session = &sessions[i];
+        memset(session, 0, sizeof(*session));
+        session->isBulk = (i < bulkCount);
+
+        char cproxyPort[16], sproxyPort[16], logPath[64], sproxyStatsPath[64], cproxyStatsPath[64];
+        snprintf(cproxyPort, sizeof(cproxyPort), "%i", CPROXY_BASE_PORT + i);
+        snprintf(sproxyPort, sizeof(sproxyPort), "%i", SPROXY_BASE_PORT + i);
+
+        char* sproxyArgv[MAX_PROXY_ARGS + 5];
+        int argCount = 0;
+        sproxyArgv[argCount++] = "./sproxy";
+        for (int j = 0; j < sproxyArgCount; j++)
+        {
+            sproxyArgv[argCount++] = sproxyArgs[j];
+        }
+        snprintf(sproxyStatsPath, sizeof(sproxyStatsPath), "%s/sproxy%i.sock", logDirectory, i);
+        sproxyArgv[argCount++] = "-s";
+        sproxyArgv[argCount++] = sproxyStatsPath;
+        sproxyArgv[argCount++] = sproxyPort;
+        sproxyArgv[argCount] = NULL;
+        snprintf(logPath, sizeof(logPath), "%s/sproxy%i.log", logDirectory, i);
+        session->sproxyPID = startLogged(sproxyArgv, logPath);
+
+        char* cproxyArgv[MAX_PROXY_ARGS + 7];
+        argCount = 0;
+        cproxyArgv[argCount++] = "./cproxy";
+        for (int j = 0; j < cproxyArgCount; j++)
+        {
+            cproxyArgv[argCount++] = cproxyArgs[j];
+        }
+        snprintf(cproxyStatsPath, sizeof(cproxyStatsPath), "%s/cproxy%i.sock", logDirectory, i);
+        cproxyArgv[argCount++] = "-s";
+        cproxyArgv[argCount++] = cproxyStatsPath;
+        cproxyArgv[argCount++] = cproxyPort;
+        cproxyArgv[argCount++] = "127.0.0.1";
+        cproxyArgv[argCount++] = sproxyPort;
+        cproxyArgv[argCount] = NULL;
+        snprintf(logPath, sizeof(logPath), "%s/cproxy%i.log", logDirectory, i);
+        session->cproxyPID = startLogged(cproxyArgv, logPath);
+
+        if (session->sproxyPID < 0 || session->cproxyPID < 0)
+        {
+            result = -1;
+        }
+    }
+
+    for (int i = 0; i < sessionCount && result == 0; i++)
+    {
+        sessions[i].socketFD = connectSession(CPROXY_BASE_PORT + i);
+        if (sessions[i].socketFD < 0)
+        {
+            result = -1;
+        }
+        else if (sessions[i].isBulk != 0 && isSource != 0)
+        {
+            char request = SOURCE_REQUEST;
+            send(sessions[i].socketFD, &request, 1, 0);
+        }
+    }
+
+    static char payload[MAX_PAYLOAD_LEN];
+    static char scratch[MAX_PAYLOAD_LEN];
+    memset(payload, 'x', sizeof(payload));
+
+    double startTime = nowSeconds();
+    double measureTime = startTime + WARM_UP_SECONDS;
+    double endTime = measureTime + seconds;
+    int isMeasuring = 0;
+    long measuredBytes = 0;
+    long startFrames = 0;
+    double startCpu = 0;
+
+    while (result == 0)
+    {
+        double now = nowSeconds();
+        if (now >= endTime)
+        {
+            break;
+        }
+
+        // Start counting once every session has had time to connect through
+        if (isMeasuring == 0 && now >= measureTime)
+        {
+            isMeasuring = 1;
+            for (int i = 0; i < sessionCount; i++)
+            {
+                // A proxy that exited, on a bad option say, would leave its session idle
+                if (waitpid(sessions[i].cproxyPID, NULL, WNOHANG) != 0)
+                {
+                    sessions[i].cproxyPID = 0;
+                }
+                if (waitpid(sessions[i].sproxyPID, NULL, WNOHANG) != 0)
+                {
+                    sessions[i].sproxyPID = 0;
+                }
+                if (sessions[i].cproxyPID == 0 || sessions[i].sproxyPID == 0)
+                {
+                    printf("A proxy of session %i exited, see the logs in %s\n", i, logDirectory);
+                    result = -1;
+                }
+
+                startFrames += countFrames(logDirectory, "cproxy", i) + countFrames(logDirectory, "sproxy", i);
+                startCpu += processCpuSeconds(sessions[i].cproxyPID) + processCpuSeconds(sessions[i].sproxyPID);
+            }
+            if (result < 0)
+            {
+                break;
+            }
+            now = nowSeconds();
+            measureTime = now;
+            endTime = now + seconds;
+        }
+
+        // Type the next keystrokes that are due
+        double wakeTime = (isMeasuring != 0) ? endTime : measureTime;
+        for (int i = 0; i < sessionCount; i++)
+        {
+            Session* session = &sessions[i];
+            if (session->isBulk != 0 || session->isWaiting != 0)
+            {
+                continue;
+            }
+            if (now >= session->nextKeyTime)
+            {
+                char key = 'a' + i % 26;
+                if (send(session->socketFD, &key, 1, 0) == 1)
+                {
+                    session->isWaiting = 1;
+                    session->sentTime = now;
+                }
+            }
+            else if (session->nextKeyTime < wakeTime)
+            {
+                wakeTime = session->nextKeyTime;
+            }
+        }
+
+        fd_set readSet, writeSet;
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        int maxFD = 0;
+        for (int i = 0; i < sessionCount; i++)
+        {
+            Session* session = &sessions[i];
+            FD_SET(session->socketFD, &readSet);
+            if (session->isBulk != 0 && isSource == 0 && session->sentBytes - session->receivedBytes < BULK_WINDOW_LEN)
+            {
+                FD_SET(session->socketFD, &writeSet);
+            }
+            if (session->socketFD > maxFD)
+            {
+                maxFD = session->socketFD;
+            }
+        }
+
+        double waitSeconds = wakeTime - now;
+        struct timeval timeout = {
+            .tv_sec = (time_t) waitSeconds,
+            .tv_usec = (suseconds_t) ((waitSeconds - (time_t) waitSeconds) * 1e6)
+        };
+        if (select(maxFD + 1, &readSet, &writeSet, NULL, &timeout) < 0)
+        {
+            perror("loadgen unable to use select");
+            result = -1;
+            break;
+        }
+        now = nowSeconds();
+
+        for (int i = 0; i < sessionCount; i++)
+        {
+            Session* session = &sessions[i];
+            if (FD_ISSET(session->socketFD, &writeSet))
+            {
+                ssize_t bytesSent = send(session->socketFD, payload, payloadLength, 0);
+                if (bytesSent > 0)
+                {
+                    session->sentBytes += bytesSent;
+                }
+            }
+
+            if (FD_ISSET(session->socketFD, &readSet))
+            {
+                ssize_t bytesRead = recv(session->socketFD, scratch, sizeof(scratch), 0);
+                if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN))
+                {
+                    printf("Session %i was disconnected, see the logs in %s\n", i, logDirectory);
+                    result = -1;
+                    break;
+                }
+                if (bytesRead < 0)
+                {
+                    continue;
+                }
+
+                session->receivedBytes += bytesRead;
+                if (session->isBulk != 0 && isMeasuring != 0)
+                {
+                    measuredBytes += bytesRead;
+                }
+                if (session->isBulk == 0 && session->isWaiting != 0)
+                {
+                    if (isMeasuring != 0 && latencyCount < MAX_SAMPLES)
+                    {
+                        latencies[latencyCount++] = now - session->sentTime;
+                    }
+                    session->isWaiting = 0;
+                    session->nextKeyTime = now + KEY_INTERVAL_MS / 1e3;
+                }
+            }
+        }
+    }
+
+    // Measure before stopping anything, so shutting down is not counted
+    double measuredSeconds = nowSeconds() - measureTime;
+    double cpu = -startCpu;
+    long frames = -startFrames;
+    for (int i = 0; i < sessionCount; i++)
+    {
+        cpu += processCpuSeconds(sessions[i].cproxyPID) + processCpuSeconds(sessions[i].sproxyPID);
+        frames += countFrames(logDirectory, "cproxy", i) + countFrames(logDirectory, "sproxy", i);
+    }
+    for (int i = 0; i < sessionCount; i++)
+    {
+        // A pid of 0 was never started, and kill would signal this whole process group
+        if (sessions[i].cproxyPID > 0)
+        {
+            kill(sessions[i].cproxyPID, SIGTERM);
+            waitpid(sessions[i].cproxyPID, NULL, 0);
+        }
+        if (sessions[i].sproxyPID > 0)
+        {
+            kill(sessions[i].sproxyPID, SIGTERM);
+            waitpid(sessions[i].sproxyPID, NULL, 0);
+        }
+    }
+    kill(backendPID, SIGTERM);
+    waitpid(backendPID, NULL, 0);
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    printf("%i sessions (%i bulk %s, %i interactive), options \"%s\" \"%s\", %.1f s\n", sessionCount, bulkCount,
+        isSource ? "source" : "echo", sessionCount - bulkCount, proxyOptions, cproxyOptions, measuredSeconds);
+    if (bulkCount > 0)
+    {
+        double gigabytes = measuredBytes / 1e9;
+        printf("  throughput    %10.1f MB/s\n", gigabytes * 1e3 / measuredSeconds);
+        printf("  cpu           %10.2f s/GB (cproxy and sproxy)\n", gigabytes > 0 ? cpu / gigabytes : 0);
+    }
+    else
+    {
+        printf("  cpu           %10.1f %% (cproxy and sproxy)\n", cpu * 100 / measuredSeconds);
+    }
+    printf("  frames        %10.0f /s\n", frames / measuredSeconds);
+    if (latencyCount > 0)
+    {
+        qsort(latencies, latencyCount, sizeof(double), compareDoubles);
+        printf("  keystroke rtt p50 %.3f ms, p99 %.3f ms, p999 %.3f ms (%i keystrokes)\n", latencies[latencyCount / 2] * 1e3,
+            latencies[latencyCount * 99 / 100] * 1e3, latencies[latencyCount * 999 / 1000] * 1e3, latencyCount);
+    }
+
+    // Keep the logs only if something went wrong, or they were asked for
+    if (isKeepingLogs != 0)
+    {
+        printf("  logs in %s\n", logDirectory);
+        return 0;
+    }
+    for (int i = 0; i < sessionCount; i++)
+    {
+        char logPath[64];
+        snprintf(logPath, sizeof(logPath), "%s/cproxy%i.log", logDirectory, i);
+        unlink(logPath);
+        snprintf(logPath, sizeof(logPath), "%s/sproxy%i.log", logDirectory, i);
+        unlink(logPath);
+        snprintf(logPath, sizeof(logPath), "%s/cproxy%i.sock", logDirectory, i);
+        unlink(logPath);
+        snprintf(logPath, sizeof(logPath), "%s/sproxy%i.sock", logDirectory, i);
+        unlink(logPath);
+    }
+    rmdir(logDirectory);
+
+    return 0;
+}
@@ -0,0 +1,258 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       packetbench.c
+
+Note:       Measures the per packet hot path on its own (see packet.h
+            and frame.h), to catch a slower build or a change that
+            costs more per frame before it shows up end to end.
+
+            For each payload size it prints the time to encode a data
+            packet with compressPacket and with writeFrame in version 1
+            and version 2 frames, and to decode it again with readFrame.
+            For each count of packets already waiting for an ack it
+            prints the time to allocate and free a packet, to push one
+            on to the list of unacknowledged packets with pushTail, and
+            to trim one off again with clearAckdPackets, as packets go
+            out and acks come back in batches of ACK_BATCH. Times are
+            in ns per packet.
+
+            Build with "make packetbench" and run ./packetbench.
+*/
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../frame.h"
+#include "../packet.h"
+
+#define FRAME_COUNT 1000000
+#define PACKET_COUNT 1000000
+#define ACK_BATCH 8 // packets sent between acks, as in a burst of output
+
+/******************************************
+ * secondsSince
+ *
+ * Arguments: struct timespec* start
+ * Returns: double
+ *
+ * Seconds elapsed since start
+ *****************************************/
+static double secondsSince(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/******************************************
+ * encodePackets
+ *
+ * Arguments: int version, int payloadLength
+ * Returns: double
+ *
+ * Encodes FRAME_COUNT data packets with
+ * consecutive seqNs, with compressPacket
+ * for version 0, or as version 1 or 2 frames
+ *
+ * Returns ns per packet
+ *****************************************/
+static double encodePackets(int version, int payloadLength)
+{
+    static unsigned char payload[PACKET_PAYLOAD_LEN];
+    static unsigned char buffer[FRAME_MAX_OVERHEAD + PACKET_PAYLOAD_LEN];
+    struct packet pck = { .type = 1, .seqN = 0, .ackN = 7, .length = payloadLength, .payload = payload };
+    FrameWriter writer = { 0 }; // isDatagram is left to the caller by resetFrameWriter
+    long totalBytes = 0;
+
+    memset(payload, 'x', sizeof(payload));
+    resetFrameWriter(&writer);
+    writer.isCompact = (version == 2);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < FRAME_COUNT; i++)
+    {
+        pck.seqN = i;
+        totalBytes += (version == 0)
+            ? compressPacket(buffer, pck)
+            : writeFrame(&writer, NULL, buffer, pck.type, pck.seqN, pck.ackN, pck.length, pck.payload);
+    }
+
+    double seconds = secondsSince(&start);
+    if (totalBytes < (long) FRAME_COUNT * payloadLength)
+    {
+        return -1;
+    }
+
+    return seconds * 1e9 / FRAME_COUNT;
+}
+
+/******************************************
+ * decodeFrames
+ *
+ * Arguments: int version, int payloadLength
+ * Returns: double
+ *
+ * Fills a reader with as many version 1 or 2
+ * frames as fit, and decodes them over and
+ * over until FRAME_COUNT have been read
+ *
+ * Returns ns per packet, or -1 if a frame did
+ * not read back as it was written
+ *****************************************/
+static double decodeFrames(int version, int payloadLength)
+{
+    static FrameReader reader;
+    static unsigned char payload[PACKET_PAYLOAD_LEN];
+    FrameWriter writer = { 0 }; // isDatagram is left to the caller by resetFrameWriter
+    uint32_t type, seqN, ackN, length;
+
+    memset(payload, 'x', sizeof(payload));
+    resetFrameWriter(&writer);
+    resetFrameReader(&reader);
+    writer.isCompact = (version == 2);
+
+    // Write a batch of frames once, then read it again as if it had just arrived
+    int frameCount = 0;
+    while (reader.end + FRAME_MAX_OVERHEAD + payloadLength <= FRAME_READER_LEN)
+    {
+        reader.end += writeFrame(&writer, NULL, reader.buffer + reader.end, 1, frameCount, 7, payloadLength, payload);
+        frameCount++;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int framesRead = 0;
+    while (framesRead < FRAME_COUNT)
+    {
+        reader.start = 0;
+        reader.seqN = 0;
+        reader.ackN = 0;
+        for (int i = 0; i < frameCount; i++)
+        {
+            if (readFrame(&reader, NULL, &type, &seqN, &ackN, &length, payload, PACKET_PAYLOAD_LEN) != 1
+                || seqN != (uint32_t) i || length != (uint32_t) payloadLength)
+            {
+                return -1;
+            }
+        }
+        framesRead += frameCount;
+    }
+
+    return secondsSince(&start) * 1e9 / framesRead;
+}
+
+/******************************************
+ * allocatePackets
+ *
+ * Arguments: none
+ * Returns: double
+ *
+ * Allocates and frees PACKET_COUNT packets
+ *
+ * Returns ns per packet
+ *****************************************/
+static double allocatePackets()
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (uint32_t i = 0; i < PACKET_COUNT; i++)
+    {
+        deletePacket(newPacket(1, i, 0, 1));
+    }
+
+    return secondsSince(&start) * 1e9 / PACKET_COUNT;
+}
+
+/******************************************
+ * queuePackets
+ *
+ * Arguments: int depth, double* pushNs,
+ *            double* trimNs
+ * Returns: void
+ *
+ * Keeps depth packets waiting for an ack,
+ * while PACKET_COUNT more are allocated and
+ * pushed ACK_BATCH at a time, and each batch
+ * is trimmed by an ack. Stores the ns per
+ * packet of newPacket and pushTail in pushNs,
+ * and of clearAckdPackets in trimNs
+ *****************************************/
+static void queuePackets(int depth, double* pushNs, double* trimNs)
+{
+    LinkedList list = { .head = NULL };
+    uint32_t seqN = 0;
+    double pushSeconds = 0;
+    double trimSeconds = 0;
+
+    for (; seqN < (uint32_t) depth; seqN++)
+    {
+        pushTail(&list, newPacket(1, seqN, 0, 1));
+    }
+
+    for (int sent = 0; sent < PACKET_COUNT; sent += ACK_BATCH)
+    {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < ACK_BATCH; i++, seqN++)
+        {
+            pushTail(&list, newPacket(1, seqN, 0, 1));
+        }
+        pushSeconds += secondsSince(&start);
+
+        // The ack names the next packet expected, so it leaves depth packets waiting
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clearAckdPackets(&list, seqN - depth);
+        trimSeconds += secondsSince(&start);
+    }
+
+    clearList(&list);
+
+    *pushNs = pushSeconds * 1e9 / PACKET_COUNT;
+    *trimNs = trimSeconds * 1e9 / PACKET_COUNT;
+}
+
+int main()
+{
+    printf("%8s %14s %12s %12s %12s %12s\n", "payload", "compressPacket", "write v1", "write v2", "read v1", "read v2");
+
+    int sizes[] = { 1, 16, 64, 256, 1024 };
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        double results[5] = {
+            encodePackets(0, sizes[i]),
+            encodePackets(1, sizes[i]),
+            encodePackets(2, sizes[i]),
+            decodeFrames(1, sizes[i]),
+            decodeFrames(2, sizes[i])
+        };
+        for (int j = 0; j < 5; j++)
+        {
+            if (results[j] < 0)
+            {
+                printf("Packets of %i bytes did not read back\n", sizes[i]);
+                return -1;
+            }
+        }
+
+        printf("%8i %14.1f %12.1f %12.1f %12.1f %12.1f\n", sizes[i], results[0], results[1], results[2], results[3], results[4]);
+    }
+
+    printf("\n%8s %14s %12s %12s\n", "unacked", "new+delete", "enqueue", "ack trim");
+
+    int depths[] = { 0, 8, 64, 256, 1024 };
+    double allocateNs = allocatePackets();
+    for (unsigned int i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+    {
+        double pushNs, trimNs;
+        queuePackets(depths[i], &pushNs, &trimNs);
+        printf("%8i %14.1f %12.1f %12.1f\n", depths[i], allocateNs, pushNs, trimNs);
+    }
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       splicebench.c
+
+Note:       Measures what splice() saves over copying when relaying a
+            TCP stream (see passthrough.h). A writer process streams
+            BENCH_BYTES over loopback to this process, which relays them
+            to a reader process, once with recv() and send() through a
+            buffer as the Milestone 2 relay() did, at the proxies'
+            BUFFER_LEN and at a larger size, and once with spliceRelay().
+            It prints the throughput and the relay's CPU time per GB for
+            each.
+
+            Build with "make splicebench" and run ./splicebench.
+*/
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../passthrough.h"
+
+#define BENCH_BYTES (1024L * 1024 * 1024)
+#define BUFFER_LEN 1024 // what cproxy and sproxy read at a time
+#define LARGE_BUFFER_LEN 65536
+
+/******************************************
+ * secondsSince
+ *
+ * Arguments: struct timespec* start
+ * Returns: double
+ *
+ * Seconds elapsed since start
+ *****************************************/
+static double secondsSince(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/******************************************
+ * cpuSeconds
+ *
+ * Arguments: none
+ * Returns: double
+ *
+ * User and system CPU time this process has
+ * used so far
+ *****************************************/
+static double cpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/******************************************
+ * connectLoopback
+ *
+ * Arguments: int* sendFD, int* receiveFD
+ * Returns: int
+ *
+ * Opens a TCP connection over loopback, and
+ * returns its two ends
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int connectLoopback(int* sendFD, int* receiveFD)
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFD < 0 || bind(listenFD, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listenFD, 1) < 0
+        || getsockname(listenFD, (struct sockaddr*) &address, &addressLength) < 0)
+    {
+        perror("Unable to listen on loopback");
+        return -1;
+    }
+
+    *sendFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sendFD < 0 || connect(*sendFD, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        perror("Unable to connect over loopback");
+        return -1;
+    }
+    *receiveFD = accept(listenFD, NULL, NULL);
+    if (*receiveFD < 0)
+    {
+        perror("Unable to accept over loopback");
+        return -1;
+    }
+
+    close(listenFD);
+    return 0;
+}
+
+/******************************************
+ * copyRelay
+ *
+ * Arguments: int receiveFD, int sendFD,
+ *            void* buffer, int bufferSize
+ * Returns: int
+ *
+ * Reads up to bufferSize bytes from receiveFD
+ * and sends them all to sendFD
+ *
+ * Returns -1 if receiveFD closed or on error,
+ * 0 otherwise
+ *****************************************/
+static int copyRelay(int receiveFD, int sendFD, void* buffer, int bufferSize)
+{
+    ssize_t bytesRead = recv(receiveFD, buffer, bufferSize, 0);
+    if (bytesRead < 1) // Returns 0 on closed connection, -1 on error
+    {
+        return -1;
+    }
+
+    for (ssize_t offset = 0; offset < bytesRead; )
+    {
+        ssize_t bytesSent = send(sendFD, (char*) buffer + offset, bytesRead - offset, 0);
+        if (bytesSent < 1) // Returns -1 on error
+        {
+            return -1;
+        }
+        offset += bytesSent;
+    }
+
+    return 0;
+}
+
+/******************************************
+ * runRelay
+ *
+ * Arguments: int bufferSize
+ * Returns: int
+ *
+ * Streams BENCH_BYTES from a writer process
+ * through this one to a reader process, with
+ * copyRelay and a buffer of bufferSize, or
+ * with spliceRelay if bufferSize is 0, and
+ * prints the results
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int runRelay(int bufferSize)
+{
+    int writerFD, relayInFD, relayOutFD, readerFD;
+    if (connectLoopback(&writerFD, &relayInFD) < 0 || connectLoopback(&relayOutFD, &readerFD) < 0)
+    {
+        return -1;
+    }
+
+    static char buffer[LARGE_BUFFER_LEN];
+    memset(buffer, 'x', sizeof(buffer));
+
+    pid_t writer = fork();
+    if (writer == 0)
+    {
+        // Only keep this process's own end open, so the others see it close
+        close(relayInFD);
+        close(relayOutFD);
+        close(readerFD);
+        for (long sent = 0; sent < BENCH_BYTES; )
+        {
+            ssize_t bytesSent = send(writerFD, buffer, sizeof(buffer), 0);
+            if (bytesSent < 1)
+            {
+                _exit(1);
+            }
+            sent += bytesSent;
+        }
+        _exit(0);
+    }
+    close(writerFD);
+
+    pid_t reader = fork();
+    if (reader == 0)
+    {
+        close(relayInFD);
+        close(relayOutFD);
+        long received = 0;
+        ssize_t bytesRead;
+        while ((bytesRead = recv(readerFD, buffer, sizeof(buffer), 0)) > 0)
+        {
+            received += bytesRead;
+        }
+        _exit(received >= BENCH_BYTES ? 0 : 1);
+    }
+    close(readerFD);
+
+    int pipeFDs[2];
+    if (bufferSize == 0 && pipe(pipeFDs) < 0)
+    {
+        perror("Unable to create a pipe");
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double startCpu = cpuSeconds();
+
+    // The writer closing its end ends the relay
+    if (bufferSize == 0)
+    {
+        while (spliceRelay(relayInFD, relayOutFD, pipeFDs) == 0);
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+    }
+    else
+    {
+        while (copyRelay(relayInFD, relayOutFD, buffer, bufferSize) == 0);
+    }
+    close(relayInFD);
+    close(relayOutFD);
+
+    int writerStatus, readerStatus;
+    waitpid(writer, &writerStatus, 0);
+    waitpid(reader, &readerStatus, 0);
+    double seconds = secondsSince(&start);
+    double cpu = cpuSeconds() - startCpu;
+    if (!WIFEXITED(readerStatus) || WEXITSTATUS(readerStatus) != 0)
+    {
+        printf("The reader did not receive every byte\n");
+        return -1;
+    }
+
+    double gigabytes = BENCH_BYTES / 1e9;
+    char name[32];
+    snprintf(name, sizeof(name), bufferSize == 0 ? "splice" : "copy %i B", bufferSize);
+    printf("%-12s %10.1f %12.3f\n", name, gigabytes * 1e3 / seconds, cpu / gigabytes);
+    fflush(stdout);
+    return 0;
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-12s %10s %12s\n", "relay", "MB/s", "cpu s/GB");
+    fflush(stdout); // before forking, so the children do not print it again
+    if (runRelay(BUFFER_LEN) < 0 || runRelay(LARGE_BUFFER_LEN) < 0 || runRelay(0) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,395 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       cipher.c
+
+Note:       Implementation of frame encryption with OpenSSL. See cipher.h
+*/
+#include "cipher.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include "log.h"
+
+/******************************************
+ * deriveKey
+ *
+ * Arguments: FrameCipher* cipher,
+ *            unsigned char* salt,
+ *            const char* label,
+ *            unsigned char* out, int length
+ * Returns: int
+ *
+ * HKDF-SHA256 of the pre-shared key, with
+ * both nonces as salt and label as info
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int deriveKey(FrameCipher* cipher, unsigned char* salt, const char* label, unsigned char* out, int length)
+{
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    size_t outLength = length;
+    int result = -1;
+
+    if (context != NULL
+        && EVP_PKEY_derive_init(context) > 0
+        && EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) > 0
+        && EVP_PKEY_CTX_set1_hkdf_salt(context, salt, 2*CIPHER_NONCE_LEN) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(context, cipher->preSharedKey, CIPHER_KEY_LEN) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(context, (unsigned char*) label, strlen(label)) > 0
+        && EVP_PKEY_derive(context, out, &outLength) > 0)
+    {
+        result = 0;
+    }
+
+    EVP_PKEY_CTX_free(context);
+    return result;
+}
+
+/******************************************
+ * startDirection
+ *
+ * Arguments: CipherDirection* direction,
+ *            int isEncrypting
+ * Returns: int
+ *
+ * Creates the OpenSSL context of one
+ * direction and loads its key
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int startDirection(CipherDirection* direction, int isEncrypting)
+{
+    EVP_CIPHER_CTX* context = EVP_CIPHER_CTX_new();
+    if (context == NULL)
+    {
+        return -1;
+    }
+
+    if (EVP_CipherInit_ex(context, EVP_aes_256_gcm(), NULL, direction->key, NULL, isEncrypting) <= 0)
+    {
+        EVP_CIPHER_CTX_free(context);
+        return -1;
+    }
+
+    direction->context = context;
+    return 0;
+}
+
+/******************************************
+ * startCipher
+ *
+ * Arguments: FrameCipher* cipher
+ * Returns: int
+ *
+ * Creates the OpenSSL contexts of both
+ * directions from their keys
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int startCipher(FrameCipher* cipher)
+{
+    if (startDirection(&cipher->tx, 1) < 0 || startDirection(&cipher->rx, 0) < 0)
+    {
+        logMessage(LOG_ERROR, "Unable to set up AES-256-GCM\n");
+        return -1;
+    }
+    cipher->isKeyed = 1;
+
+    return 0;
+}
+
+/******************************************
+ * makeNonce
+ *
+ * Arguments: CipherDirection* direction,
+ *            uint64_t counter,
+ *            unsigned char* nonce
+ * Returns: void
+ *
+ * The nonce of a frame: the IV with the
+ * frame's count XORed in to its end
+ *****************************************/
+static void makeNonce(CipherDirection* direction, uint64_t counter, unsigned char* nonce)
+{
+    memcpy(nonce, direction->iv, CIPHER_IV_LEN);
+    for (int i = 0; i < 8; i++)
+    {
+        nonce[CIPHER_IV_LEN - 1 - i] ^= (unsigned char) (counter >> (8*i));
+    }
+}
+
+/******************************************
+ * isReplay
+ *
+ * Arguments: CipherDirection* direction,
+ *            uint64_t counter
+ * Returns: int
+ *
+ * !0 if the frame with this count was
+ * already opened, or is too old to tell
+ *****************************************/
+static int isReplay(CipherDirection* direction, uint64_t counter)
+{
+    if (counter >= direction->counter)
+    {
+        return 0;
+    }
+
+    uint64_t age = direction->counter - 1 - counter;
+    return age >= CIPHER_REPLAY_WINDOW || (direction->seen & ((uint64_t) 1 << age)) != 0;
+}
+
+/******************************************
+ * markSeen
+ *
+ * Arguments: CipherDirection* direction,
+ *            uint64_t counter
+ * Returns: void
+ *
+ * Records that the frame with this count
+ * was opened, sliding the window forward if
+ * it is the newest
+ *****************************************/
+static void markSeen(CipherDirection* direction, uint64_t counter)
+{
+    if (counter >= direction->counter)
+    {
+        uint64_t shift = counter + 1 - direction->counter;
+        direction->seen = (shift >= CIPHER_REPLAY_WINDOW) ? 0 : direction->seen << shift;
+        direction->seen |= 1;
+        direction->counter = counter + 1;
+    }
+    else
+    {
+        direction->seen |= (uint64_t) 1 << (direction->counter - 1 - counter);
+    }
+}
+
+void initCipher(FrameCipher* cipher, int isClient)
+{
+    memset(cipher, 0, sizeof(FrameCipher));
+    cipher->isClient = isClient;
+}
+
+int loadCipherKey(FrameCipher* cipher, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("Unable to open key file");
+        return -1;
+    }
+
+    char text[2*CIPHER_KEY_LEN + 1];
+    int length = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF && length < (int) sizeof(text))
+    {
+        if (isxdigit(c))
+        {
+            text[length++] = c;
+        }
+        else if (!isspace(c))
+        {
+            break;
+        }
+    }
+    fclose(file);
+
+    if (length != 2*CIPHER_KEY_LEN)
+    {
+        printf("Key file %s must hold %i hex digits\n", path, 2*CIPHER_KEY_LEN);
+        return -1;
+    }
+
+    for (int i = 0; i < CIPHER_KEY_LEN; i++)
+    {
+        unsigned int byte;
+        sscanf(text + 2*i, "%2x", &byte);
+        cipher->preSharedKey[i] = byte;
+    }
+    cipher->isRequired = 1;
+
+    return 0;
+}
+
+void resetCipher(FrameCipher* cipher)
+{
+    EVP_CIPHER_CTX_free(cipher->tx.context);
+    EVP_CIPHER_CTX_free(cipher->rx.context);
+    memset(&cipher->tx, 0, sizeof(CipherDirection));
+    memset(&cipher->rx, 0, sizeof(CipherDirection));
+    cipher->isKeyed = 0;
+    cipher->isNonceSent = 0;
+    cipher->hasPeerNonce = 0;
+
+    if (RAND_bytes(cipher->localNonce, CIPHER_NONCE_LEN) <= 0)
+    {
+        logMessage(LOG_ERROR, "Unable to generate a random nonce\n");
+    }
+}
+
+/******************************************
+ * deriveCipher
+ *
+ * Arguments: FrameCipher* cipher
+ * Returns: int
+ *
+ * Derives the keys of both directions from
+ * the pre-shared key and both nonces
+ *
+ * Returns -1 on error, 0 otherwise
+ *****************************************/
+static int deriveCipher(FrameCipher* cipher)
+{
+    // Salt is cproxy's nonce then sproxy's, so both sides build the same one
+    unsigned char salt[2*CIPHER_NONCE_LEN];
+    memcpy(salt + (cipher->isClient ? 0 : CIPHER_NONCE_LEN), cipher->localNonce, CIPHER_NONCE_LEN);
+    memcpy(salt + (cipher->isClient ? CIPHER_NONCE_LEN : 0), cipher->peerNonce, CIPHER_NONCE_LEN);
+
+    CipherDirection* toServer = cipher->isClient ? &cipher->tx : &cipher->rx;
+    CipherDirection* toClient = cipher->isClient ? &cipher->rx : &cipher->tx;
+    if (deriveKey(cipher, salt, "cproxy to sproxy key", toServer->key, CIPHER_KEY_LEN) < 0
+        || deriveKey(cipher, salt, "cproxy to sproxy iv", toServer->iv, CIPHER_IV_LEN) < 0
+        || deriveKey(cipher, salt, "sproxy to cproxy key", toClient->key, CIPHER_KEY_LEN) < 0
+        || deriveKey(cipher, salt, "sproxy to cproxy iv", toClient->iv, CIPHER_IV_LEN) < 0)
+    {
+        logMessage(LOG_ERROR, "Unable to derive the connection keys\n");
+        return -1;
+    }
+    cipher->tx.counter = 0;
+    cipher->rx.counter = 0;
+
+    return startCipher(cipher);
+}
+
+int keyCipher(FrameCipher* cipher, unsigned char* peerNonce)
+{
+    if (cipher->isKeyed != 0)
+    {
+        return 0;
+    }
+
+    memcpy(cipher->peerNonce, peerNonce, CIPHER_NONCE_LEN);
+    cipher->hasPeerNonce = 1;
+
+    return (cipher->isNonceSent != 0) ? deriveCipher(cipher) : 0;
+}
+
+int sentCipherNonce(FrameCipher* cipher)
+{
+    cipher->isNonceSent = 1;
+
+    return (cipher->hasPeerNonce != 0 && cipher->isKeyed == 0) ? deriveCipher(cipher) : 0;
+}
+
+int restoreCipher(FrameCipher* cipher)
+{
+    // The copied pointers belong to the other process
+    int wasKeyed = cipher->isKeyed;
+    cipher->tx.context = NULL;
+    cipher->rx.context = NULL;
+    cipher->isKeyed = 0;
+
+    return (wasKeyed != 0) ? startCipher(cipher) : 0;
+}
+
+int sealFrame(FrameCipher* cipher, void* frame, int headerLength, int payloadLength)
+{
+    EVP_CIPHER_CTX* context = cipher->tx.context;
+    unsigned char* header = frame;
+    unsigned char nonce[CIPHER_IV_LEN];
+    int outLength;
+
+    // A datagram cipher sends the count, big endian, as part of the header
+    if (cipher->isDatagram != 0)
+    {
+        for (int i = 0; i < CIPHER_SEQ_LEN; i++)
+        {
+            header[headerLength + i] = (unsigned char) (cipher->tx.counter >> (8*(CIPHER_SEQ_LEN - 1 - i)));
+        }
+        headerLength += CIPHER_SEQ_LEN;
+    }
+    unsigned char* payload = header + headerLength;
+
+    makeNonce(&cipher->tx, cipher->tx.counter, nonce);
+    if (EVP_EncryptInit_ex(context, NULL, NULL, NULL, nonce) <= 0
+        || EVP_EncryptUpdate(context, NULL, &outLength, header, headerLength) <= 0
+        || EVP_EncryptUpdate(context, payload, &outLength, payload, payloadLength) <= 0
+        || EVP_EncryptFinal_ex(context, payload + payloadLength, &outLength) <= 0
+        || EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_GET_TAG, CIPHER_TAG_LEN, payload + payloadLength) <= 0)
+    {
+        logMessage(LOG_ERROR, "Unable to encrypt frame\n");
+        return -1;
+    }
+    cipher->tx.counter++;
+
+    return headerLength + payloadLength + CIPHER_TAG_LEN; // headerLength counts the frame count
+}
+
+int openFrame(FrameCipher* cipher, void* frame, int headerLength, int sealedLength)
+{
+    EVP_CIPHER_CTX* context = cipher->rx.context;
+    unsigned char* header = frame;
+    uint64_t counter = cipher->rx.counter;
+    unsigned char nonce[CIPHER_IV_LEN];
+    int outLength;
+
+    // A datagram cipher reads the count from the header, and checks it is new
+    if (cipher->isDatagram != 0)
+    {
+        if (sealedLength < CIPHER_SEQ_LEN)
+        {
+            return -1;
+        }
+
+        counter = 0;
+        for (int i = 0; i < CIPHER_SEQ_LEN; i++)
+        {
+            counter = (counter << 8) | header[headerLength + i];
+        }
+        headerLength += CIPHER_SEQ_LEN;
+        sealedLength -= CIPHER_SEQ_LEN;
+
+        if (isReplay(&cipher->rx, counter))
+        {
+            logMessage(LOG_DEBUG, "Dropped a replayed frame\n");
+            return -1;
+        }
+    }
+    unsigned char* payload = header + headerLength;
+    int payloadLength = sealedLength - CIPHER_TAG_LEN;
+
+    if (payloadLength < 0)
+    {
+        return -1;
+    }
+
+    makeNonce(&cipher->rx, counter, nonce);
+    if (EVP_DecryptInit_ex(context, NULL, NULL, NULL, nonce) <= 0
+        || EVP_DecryptUpdate(context, NULL, &outLength, header, headerLength) <= 0
+        || EVP_DecryptUpdate(context, payload, &outLength, payload, payloadLength) <= 0
+        || EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_GCM_SET_TAG, CIPHER_TAG_LEN, payload + payloadLength) <= 0
+        || EVP_DecryptFinal_ex(context, payload + payloadLength, &outLength) <= 0)
+    {
+        logMessage(LOG_DEBUG, "Frame failed authentication\n");
+        return -1;
+    }
+
+    if (cipher->isDatagram != 0)
+    {
+        markSeen(&cipher->rx, counter);
+    }
+    else
+    {
+        cipher->rx.counter++;
+    }
+
+    return payloadLength;
+}
@@ -0,0 +1,193 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       cipher.h
+
+Note:       Authenticated encryption of frames with AES-256-GCM.
+
+            Both programs are given the same pre-shared key with -k
+            keyFile (64 hex digits, as made by "openssl rand -hex 32").
+            Every connection picks a fresh random nonce that is sent in
+            the Hello, and once a side has both nonces it derives a key
+            and IV for each direction with HKDF-SHA256 over the
+            pre-shared key, so no two connections ever share keys.
+
+            A frame is encrypted in place in the buffer it was written
+            to: the header stays readable and is authenticated as
+            additional data, the payload is encrypted, and a 16 byte tag
+            follows it. The nonce of each frame is the direction's IV
+            XOR a count of frames, which both sides keep since TCP
+            delivers frames in order, so no nonce is sent on the wire.
+            Over UDP (isDatagram set) frames can be lost or reordered, so
+            the count is sent as 8 bytes after the header, authenticated
+            with it, and the receiver drops any count it has seen or that
+            is more than 64 frames older than the newest, so a replayed
+            datagram is never accepted twice.
+            OpenSSL's EVP interface uses AES-NI and carry-less multiply
+            where the CPU has them.
+
+            With a key loaded, encryption is required: a peer whose Hello
+            does not offer it is disconnected, and the only plaintext
+            frames accepted are heartbeats sent before the peer's first
+            encrypted frame, which are used for nothing but their Hello.
+*/
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stdint.h>
+
+#define CIPHER_KEY_LEN 32
+#define CIPHER_IV_LEN 12
+#define CIPHER_TAG_LEN 16
+#define CIPHER_NONCE_LEN 16
+#define CIPHER_SEQ_LEN 8        // frame count sent in front of the payload by a datagram cipher
+#define CIPHER_REPLAY_WINDOW 64 // frames older than the newest a datagram cipher still accepts
+
+#define PACKET_TYPE_ENCRYPTED 0x8 // payload is encrypted and followed by a tag
+
+typedef struct {
+
+    unsigned char key[CIPHER_KEY_LEN];
+    unsigned char iv[CIPHER_IV_LEN];
+    uint64_t counter;   // frames sealed or opened so far, over UDP 1 more than the newest opened
+    uint64_t seen;      // over UDP, bit n is set if frame counter - 1 - n was opened
+    void* context;      // EVP_CIPHER_CTX*, not valid in another process
+
+} CipherDirection;
+
+typedef struct {
+
+    int32_t isRequired;     // !0 if a pre-shared key was loaded
+    int32_t isKeyed;        // !0 once the keys of this connection are derived
+    int32_t isClient;       // !0 in cproxy, which decides the order of the nonces
+    int32_t isDatagram;     // !0 if frames may be lost or reordered, so their count is sent
+    int32_t isNonceSent;    // !0 once a plaintext heartbeat carried localNonce to the peer
+    int32_t hasPeerNonce;   // !0 once peerNonce arrived in the peer's Hello
+    unsigned char preSharedKey[CIPHER_KEY_LEN];
+    unsigned char localNonce[CIPHER_NONCE_LEN]; // sent in this side's Hello
+    unsigned char peerNonce[CIPHER_NONCE_LEN];
+    CipherDirection tx;
+    CipherDirection rx;
+
+} FrameCipher;
+
+/**************************************************
+ * initCipher
+ *
+ * Arguments: FrameCipher* cipher, int isClient
+ * Returns: void
+ *
+ * Prepares a cipher with no key loaded
+ *************************************************/
+void initCipher(FrameCipher* cipher, int isClient);
+
+/**************************************************
+ * loadCipherKey
+ *
+ * Arguments: FrameCipher* cipher,
+ *            const char* path
+ * Returns: int
+ *
+ * Reads the pre-shared key from path, which makes
+ * encryption required
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int loadCipherKey(FrameCipher* cipher, const char* path);
+
+/**************************************************
+ * resetCipher
+ *
+ * Arguments: FrameCipher* cipher
+ * Returns: void
+ *
+ * Forgets the keys of the previous connection
+ * and picks a new localNonce for the next one
+ *************************************************/
+void resetCipher(FrameCipher* cipher);
+
+/**************************************************
+ * keyCipher
+ *
+ * Arguments: FrameCipher* cipher,
+ *            unsigned char* peerNonce
+ * Returns: int
+ *
+ * Records the nonce from the peer's Hello and
+ * derives the keys of the connection from the
+ * pre-shared key and both nonces, or, if this
+ * side's nonce has not been sent yet, leaves that
+ * to sentCipherNonce. Frames are encrypted once
+ * the keys are derived
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int keyCipher(FrameCipher* cipher, unsigned char* peerNonce);
+
+/**************************************************
+ * sentCipherNonce
+ *
+ * Arguments: FrameCipher* cipher
+ * Returns: int
+ *
+ * Called when a plaintext heartbeat carrying
+ * localNonce is written. Keys the connection if
+ * the peer's nonce is already known. Keying only
+ * after both nonces have been sent means the peer
+ * can always read the first encrypted frame
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int sentCipherNonce(FrameCipher* cipher);
+
+/**************************************************
+ * restoreCipher
+ *
+ * Arguments: FrameCipher* cipher
+ * Returns: int
+ *
+ * Rebuilds the OpenSSL state of a cipher that
+ * was copied from another process
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int restoreCipher(FrameCipher* cipher);
+
+/**************************************************
+ * sealFrame
+ *
+ * Arguments: FrameCipher* cipher, void* frame,
+ *            int headerLength, int payloadLength
+ * Returns: int
+ *
+ * Encrypts the payload that follows the header
+ * in frame in place, and appends the tag. The
+ * header must already count the tag in its length.
+ * A datagram cipher also writes the frame count
+ * after the header, so the payload must start
+ * CIPHER_SEQ_LEN bytes after it, and be counted
+ * in the header's length
+ *
+ * Returns the length of the whole frame, or -1 on
+ * error
+ *************************************************/
+int sealFrame(FrameCipher* cipher, void* frame, int headerLength, int payloadLength);
+
+/**************************************************
+ * openFrame
+ *
+ * Arguments: FrameCipher* cipher, void* frame,
+ *            int headerLength, int sealedLength
+ * Returns: int
+ *
+ * Checks the tag and decrypts, in place, the
+ * sealedLength bytes of payload and tag that
+ * follow the header in frame. The plaintext ends
+ * where the tag starts
+ *
+ * Returns the length of the plaintext payload, or
+ * -1 if the frame was not sealed with this
+ * connection's key or, over UDP, was a replay
+ *************************************************/
+int openFrame(FrameCipher* cipher, void* frame, int headerLength, int sealedLength);
+
+#endif
@@ -43,14 +43,105 @@ Note:       This is the client part of the program. The program takes 3
             3 seconds, it will automatically disconnect the server socket
             and attempt to reconnect once every second to try to recover 
             the session.
+
+            sip may be an IPv4 or IPv6 address or a name. Each connection
+            races sproxy's IPv6 and IPv4 addresses and takes whichever
+            answers first (see dial.h), so a reconnect after a network
+            change does not wait on a family that stopped working. A
+            name is looked up on a thread of its own, and again when its
+            DNS records expire (see resolve.h), so a reconnect never
+            waits for the DNS, and still follows sproxy to a new
+            address.
+
+            If started with -z, cproxy asks sproxy to compress data
+            packets. Once sproxy agrees in its heartbeats, both sides
+            compress the payload of every data packet they send with a
+            streaming LZ codec whose history lasts for the connection.
+
+            Every heartbeat also carries a Hello (see hello.h) listing
+            the protocol version and features cproxy supports. Packets
+            are sent in the compact version 2 frame format (see frame.h),
+            and compressed, only once sproxy's Hello says it supports
+            them. Until then, and with older versions of sproxy, they
+            are sent in the original format.
+
+            If started with -k keyFile, every frame to and from sproxy
+            is encrypted and authenticated with keys derived from the
+            pre-shared key in keyFile (see cipher.h), and a sproxy
+            without the same key is refused.
+
+            If started with -U, cproxy talks to sproxy over UDP instead
+            of TCP, with the same packets and the same retransmission,
+            one frame per datagram, so a lost packet is only recovered
+            once, by the heartbeat, and never holds up the ones behind
+            it. sproxy replies to whatever address cproxy's heartbeats
+            come from, so a new address or port does not need a new
+            connection. Compression needs every packet in order, so it
+            is not used over UDP.
+
+            If also started with -F, cproxy asks for forward error
+            correction (see fec.h): both sides follow data packets with
+            parity packets, as many as the loss the other side reports
+            calls for, so most lost packets are rebuilt on arrival of the
+            parity instead of a heartbeat later.
+
+            Over UDP, -b localAddress may be given more than once, to reach
+            sproxy over several paths at once (see multipath.h), say over
+            both Wi-Fi and cellular. cproxy probes every path, sends on
+            the fastest one that still answers, and moves to another as
+            soon as it goes quiet.
+
+            If started with -P, cproxy is a plain TCP relay for trusted
+            networks (see passthrough.h): no heartbeats, packets or
+            retransmission, just bytes moved between the client and
+            sproxy, also started with -P, with splice(). None of the
+            other options apply then.
+
+            If started with -s statsSocket, cproxy serves counters and
+            histograms of its traffic on that Unix socket (see stats.h),
+            including how long data packets take at each stage of
+            forwarding (see trace.h). It prints those on SIGUSR1 too,
+            with or without -s.
+
+            Input from the client only fills three quarters of the
+            window of unacknowledged packets while more than a few
+            keystrokes are waiting, such as a paste, and the rest is
+            kept for keystrokes, so typing is not stuck behind it (see
+            priority.h).
+
+            If started with -e, cproxy guesses the echo of printable
+            keys while the daemon echoes what is typed, and shows it
+            to the client straight away instead of a round trip later
+            (see predict.h). The real echo is then dropped, or a wrong
+            guess taken back, as the daemon's output arrives.
+
+            If started with -m mapFile, cproxy also listens on the port
+            of every service in mapFile, and forwards each connection
+            it takes there over the session as a stream of its own (see
+            stream.h), to the host and port sproxy, given the same map
+            file, has for that service. Connections wait until sproxy
+            agrees to forward streams, and end with the session.
+
+            If started with -D socksPort, cproxy also takes SOCKS5
+            clients on that port of the loopback address, and forwards
+            each connection a client asks for as a stream of its own,
+            which sproxy, started with -D too, connects to whatever
+            address or name and port the client named.
+
+            cproxy logs through a thread of its own (see log.h), so that
+            printing never holds up a packet. Every packet sent, received
+            and retransmitted is only logged if started with -v.
             
 */
 #define _DEFAULT_SOURCE // Needed to use timersub on Windows Subsystem for Linux
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,87 +152,21 @@ Note:       This is the client part of the program. The program takes 3
 #include <sys/types.h>
 #include <unistd.h>
 
-#define BUFFER_LEN 1024
-
-typedef enum {
+#include "proxy.h"
 
-    PACKET_TYPE,
-    SEQ,
-    ACK,
-    LENGTH,
-    PAYLOAD,
+#define BUFFER_LEN PACKET_PAYLOAD_LEN // Most bytes read in to one data packet
+#define WINDOW_LEN 64 // Most data packets sent to sproxy but not yet acknowledged
 
-} segmentType;
+#define HEARTBEAT_CAN_RESUME 0x1 // a disconnect without HEARTBEAT_CLOSING is not the end of the session: from sproxy it
+                                 // crashed, so reconnect, from cproxy the network failed, so wait for it to reconnect
+#define HEARTBEAT_CLOSING 0x2 // the telnet session ended, the connection is about to close
 
-struct packet {
-    // header
-    uint32_t type;      // 0 = heartbeat, !0 = data
-    uint32_t seqN;      // Sequence number
-    uint32_t ackN;      // Ack number (the seqN of the next expected packet)
-    uint32_t length;    // length of payload
-    // payload
-    void* payload;      // either int sessionID or buffer
+struct heartbeatPayload {
+    int32_t sessionID;  // ID of the current session
+    uint32_t flags;     // HEARTBEAT_* flags (not sent by older versions)
+    Hello hello;        // What the sender supports (not sent by older versions)
 };
 
-typedef struct LLNode_struct {
-
-    struct LLNode_struct* next;
-    struct packet* pck;
-
-} LLNode;
-
-typedef struct {
-
-    LLNode* head;
-
-} LinkedList;
-
-/**************************************************
- * pushTail
- * 
- * Arguments: LinkedList* list, struct packet* pck
- * Returns: void
- * 
- * Creates a new LLNode that points to the
- * given pck, and pushes it on to the end of the
- * given list
- *************************************************/
-void pushTail(LinkedList* list, struct packet* pck);
-
-/**************************************************
- * pop
- * 
- * Arguments: LinkedList* list
- * Returns: packet*
- * 
- * Pop's off the head of the linked list and
- * returns the packet contained in it
- * 
- * Returns NULL if the list was empty
- *************************************************/
-struct packet* pop(LinkedList* list);
-
-/**************************************************
- * clearAckdPackets
- * 
- * Arguments: LinkedList* list, uint32_t ackN
- * Returns: void
- * 
- * Deletes all packets in the linked list that
- * have a seqN less than ackN
- *************************************************/
-void clearAckdPackets(LinkedList* list, uint32_t ackN);
-
-/**************************************************
- * clearList
- * 
- * Arguments: LinkedList* list
- * Returns: void
- * 
- * Deletes everything in the linked list
- *************************************************/
-void clearList(LinkedList* list);
-
 /*************************************
  * max
  * 
@@ -165,89 +190,63 @@ int max(int a, int b);
 int generateID(int oldID);
 
 /******************************************
- * newPacket
- * 
- * Arguments: uint32_t type, seqN, ackN,
- *                     length
- * Returns: struct packet*
+ * sendToServer
  * 
- * Allocates space for a new packet and
- * packet payload, and sets the given
- * attributes
- *****************************************/
-struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length);
-
-/******************************************
- * deletePacket
+ * Arguments: ProxyStats* stats, int socketFD,
+ *            void* buffer, int length
+ * Returns: int
  * 
- * Arguments: struct packet* pck
- * Returns: void
+ * Sends length bytes of frames to sproxy, on
+ * the connection or the path socketFD, and
+ * counts them in stats. Over TCP a short
+ * write is finished, so frames go out whole
  * 
- * Frees the memory allocated for the
- * given packet and packet payload
+ * Returns length, or -1 on error
  *****************************************/
-void deletePacket(struct packet* pck);
+int sendToServer(ProxyStats* stats, int socketFD, void* buffer, int length);
 
 /******************************************
- * compressPacket
+ * sendToClient
  * 
- * Arguments: char* buffer, struct packet
+ * Arguments: EchoPredictor* predictor,
+ *            int socketFD, void* buffer,
+ *            int length
  * Returns: int
  * 
- * Takes the given packet and compresses all
- * the data into a single buffer, which can
- * then be sent later using send()
+ * Sends length bytes of the daemon's output
+ * to the client, through predictor, which
+ * drops the echoes it already showed, unless
+ * that is NULL
  * 
- * Returns the number of bytes now stored
- * in buffer
+ * Returns the result of send()
  *****************************************/
-int compressPacket(void* buffer, struct packet);
+int sendToClient(EchoPredictor* predictor, int socketFD, void* buffer, int length);
 
-/**********************************************************
- * addToPacket
- * 
- * Arguments: void* buffer, struct packet* pck, int n,
- *            segmentType* currentSegment, int remaining
- * 
- * buffer: Buffer containing data to be added to the
- * packet
- * 
- * This function places data from buffer into the pck packet
- * in the following way: It first reads n bytes from buffer,
- * and copies them in to the memory pointed to by pck->payload
- * + index
- * 
- * index is calulated as the length of the
- * currentSegment - remaining
- * 
- * If the end of a segment is reached during the runtime
- * of this function, it copies the data from pck->payload into
- * the proper segment, and updates currentSegment to be
- * the next expected segment, unless the last segment read
- * was actually the packet payload. The function returns the
- * number of bytes remaining to be read for any segment it
- * does not finish.
- * 
- * If the function returns 0, with currentSegment being set
- * to PACKET_TYPE, this indicates the end of an entire
- * packet was read.
- * 
- * Otherwise, the data added in pck is unreliable, and should
- * be passed to subsequent calls to addToPacket to continue
- * building it out
- *********************************************************/
-int addToPacket(void* buffer, struct packet* pck, int n, segmentType* currentSegment, int remaining);
 
 int main(int argc, char** argv)
 {
     int sessionID = 0;
     uint32_t seqN = 0;
     uint32_t ackN = 0;
+    uint32_t sentAckN = 0; // ackN last sent to sproxy, in a heartbeat or data packet
 
     int ignoreFirstHeartbeat = 1;
+    int serverCanResume = 0; // Is true if sproxy announced it closes sessions with HEARTBEAT_CLOSING
+    int serverIsClosing = 0; // Is true if sproxy announced the telnet session ended
+    int isCompressionRequested = 0; // Is true if packets should be compressed when sproxy agrees
+    const char* keyPath = NULL; // Pre-shared key file given with -k, if any
+    int isDatagram = 0; // Is true if sproxy is reached over UDP
+    int isFecRequested = 0; // Is true if parity packets should be sent when sproxy agrees
+    PathSet paths; // Local addresses given with -b, one path to sproxy from each
+    int isPassthrough = 0; // Is true if bytes are relayed to sproxy as they are, without packets
+    const char* statsSocketPath = NULL; // Unix socket to serve stats on, given with -s
+    int isVerbose = 0; // Is true if every packet is logged
+    int isResuming = 0; // Is true if the next connection to sproxy resumes the session
+    int isEchoPredicted = 0; // Is true if the echo of printable keys is shown before it arrives, given with -e
+    const char* mapPath = NULL; // Map file of the services to forward, given with -m
+    in_port_t socksPort = 0; // Port to take SOCKS clients on, given with -D, 0 for none
+    initPathSet(&paths);
 
-    segmentType segmentExpected = PACKET_TYPE;
-    int bytesExpected = sizeof(uint32_t); // Size of packet.type
     int bytesRead = 0;
 
     LinkedList unAckdPackets = {
@@ -262,15 +261,93 @@ int main(int argc, char** argv)
     // Timevals that keep track of next select() timeout, and last message received
     struct timeval timeLastMessageReceived;
     struct timeval nextTimeout;
+    struct timeval nextProbeTime;
 
-    int listenSocketFD, clientSocketFD, serverSocketFD; // Socket file descriptor
+    int listenSocketFD, clientSocketFD; // Socket file descriptor
+    int serverSocketFD = -1; // -1 until cproxy first connects to sproxy
     fd_set socketSet;
+    fd_set writeSet; // local ends of streams with bytes kept for them
     in_port_t listenPort, serverPort;
-    struct sockaddr_in listenAddress, serverAddress;
-    struct sockaddr clientAddress;
+    struct sockaddr_storage clientAddress;
     socklen_t clientAddressLength;
     void* toServerBuffer = NULL;
-    void* fromServerBuffer = NULL;
+
+    // Get options from command line
+    int option;
+    while ((option = getopt(argc, argv, "zk:UFb:Ps:em:D:v")) != -1)
+    {
+        switch (option)
+        {
+            case 'z':
+                isCompressionRequested = 1;
+                break;
+            case 'k':
+                keyPath = optarg;
+                break;
+            case 'U':
+                isDatagram = 1;
+                break;
+            case 'F':
+                isFecRequested = 1;
+                break;
+            case 'b':
+                if (addPath(&paths, optarg) < 0)
+                {
+                    return -1;
+                }
+                break;
+            case 'P':
+                isPassthrough = 1;
+                break;
+            case 's':
+                statsSocketPath = optarg;
+                break;
+            case 'e':
+                isEchoPredicted = 1;
+                break;
+            case 'm':
+                mapPath = optarg;
+                break;
+            case 'D':
+                socksPort = atoi(optarg);
+                break;
+            case 'v':
+                isVerbose = 1;
+                break;
+            default:
+                printf("Usage: ./cproxy [-P] [-z] [-k keyFile] [-U [-F] [-b localAddress]...] [-s statsSocket] [-e] [-m mapFile] [-D socksPort] [-v] lport sip sport\n");
+                return -1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (isPassthrough != 0 && (isCompressionRequested != 0 || keyPath != NULL || isDatagram != 0 || statsSocketPath != NULL
+        || isEchoPredicted != 0 || mapPath != NULL || socksPort != 0))
+    {
+        printf("Passthrough relays plain TCP, ignoring -z, -k, -U, -s, -e, -m and -D\n");
+        isCompressionRequested = 0;
+        keyPath = NULL;
+        isDatagram = 0;
+        statsSocketPath = NULL;
+        isEchoPredicted = 0;
+        mapPath = NULL;
+        socksPort = 0;
+    }
+    if (isDatagram != 0 && isCompressionRequested != 0)
+    {
+        printf("Compression is not used over UDP, ignoring -z\n");
+        isCompressionRequested = 0;
+    }
+    if (isDatagram == 0 && isFecRequested != 0)
+    {
+        printf("FEC is only used over UDP, ignoring -F\n");
+        isFecRequested = 0;
+    }
+    if (isDatagram == 0 && paths.pathCount != 0)
+    {
+        printf("Several paths are only used over UDP, ignoring -b\n");
+        initPathSet(&paths);
+    }
 
     // Get listenPort and serverPort from command line
     if (argc < 4)
@@ -278,86 +355,136 @@ int main(int argc, char** argv)
         printf(
             "ERROR: You must enter the port to listen for new connections on,\n"
             "       as well as the address and port number to forward data to\n"
-            "Usage: ./cproxy lport sip sport\n"
+            "Usage: ./cproxy [-P] [-z] [-k keyFile] [-U [-F] [-b localAddress]...] [-s statsSocket] [-e] [-m mapFile] [-D socksPort] [-v] lport sip sport\n"
         );
         return -1;
     }
     listenPort = atoi(argv[1]);
     serverPort = atoi(argv[3]);
+    startLog(isVerbose ? LOG_DEBUG : LOG_INFO);
     
     // defining the heartbeat packet with session ID
+    struct heartbeatPayload heartbeatData;
     struct packet heartbeatPacket;
     heartbeatPacket.type = (uint32_t) 0;
-    heartbeatPacket.length = (uint32_t) sizeof(int);
-    heartbeatPacket.payload = (void*) &sessionID;
+    heartbeatPacket.length = (uint32_t) sizeof(struct heartbeatPayload);
+    heartbeatPacket.payload = (void*) &heartbeatData;
+
+    // Encryption of the connection to sproxy, required once a key is loaded
+    FrameCipher cipher;
+    initCipher(&cipher, 1);
+    cipher.isDatagram = isDatagram;
+    if (keyPath != NULL && loadCipherKey(&cipher, keyPath) < 0)
+    {
+        return -1;
+    }
+
+    // Services to forward, from the map file, and SOCKS clients
+    StreamTable streams;
+    initStreamTable(&streams, 1);
+    if (mapPath != NULL && loadStreamMap(&streams, mapPath) < 0)
+    {
+        return -1;
+    }
+    streams.socksPort = socksPort;
+
+    // Features cproxy offers, what an older sproxy supports, and what was agreed with sproxy
+    Hello localHello, oldPeerHello, agreedHello;
+    initHello(&localHello, HELLO_COMPACT_FRAMES | HELLO_EXTENDED_TYPES | (isCompressionRequested ? HELLO_COMPRESSION : 0)
+        | (cipher.isRequired ? HELLO_ENCRYPTION : 0) | (isFecRequested ? HELLO_FEC : 0)
+        | (paths.pathCount > 1 ? HELLO_MULTIPATH : 0) | (streams.serviceCount > 0 ? HELLO_STREAMS : 0)
+        | (socksPort != 0 ? HELLO_SOCKS : 0),
+        isFecRequested ? BUFFER_LEN - FEC_PARITY_HEADER_LEN : BUFFER_LEN, WINDOW_LEN);
+    readHello(&oldPeerHello, NULL, 0);
+    heartbeatData.hello = localHello;
+
+    // Compression and framing state for the connection to sproxy
+    LZSession* compression = newLZSession();
+    FecSession* fec = newFecSession();
+    ProxyStats* stats = newProxyStats("cproxy");
+    if (startTraceSignal(&stats->trace, "cproxy") < 0)
+    {
+        logMessage(LOG_WARNING, "cproxy will not print its latency by stage on SIGUSR1\n");
+    }
+    EchoPredictor* predictor = isEchoPredicted ? newEchoPredictor() : NULL; // Of the client's screen, with -e
+    FrameWriter toServerFrames;
+    FrameReader fromServerFrames;
+    toServerFrames.isDatagram = isDatagram;
+    fromServerFrames.isDatagram = isDatagram;
 
     // Create the receivedPacket
     struct packet* receivedPacket = newPacket(0, 0, 0, 0);
 
     // Attempt to allocate space for toServerBuffer
-    toServerBuffer = malloc(4*sizeof(uint32_t) + BUFFER_LEN);
+    toServerBuffer = malloc(FRAME_MAX_OVERHEAD + BUFFER_LEN);
     if (toServerBuffer == NULL)
     {
         perror("Unable to allocate space for the toServerBuffer");
         return -1;
     }
 
-    // Attempt to allocate space for fromServerBuffer
-    fromServerBuffer = malloc(BUFFER_LEN);
-    if (fromServerBuffer == NULL)
-    {
-        perror("Unable to allocate space for the fromServerBuffer");
-        return -1;
-    }
-
     // Seed RNG to help ensure that two different cproxy sessions don't start with the same sessionID
     struct timeval currentTime;
     gettimeofday(&currentTime, NULL);
     srand(currentTime.tv_usec);
 
-    // Create listen socket
-    listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenSocketFD < 0) // socket returns -1 on error
+    // Create listen socket, for telnet clients over IPv6 as well as IPv4
+    listenSocketFD = bindDualStack(SOCK_STREAM, listenPort);
+    if (listenSocketFD < 0) // bindDualStack returns -1 on error
     {
-        perror("cproxy unable to create listen socket");
         return -1;
     }
 
-    // Bind listen socket to port
-    listenAddress.sin_family = AF_INET;
-    listenAddress.sin_addr.s_addr = INADDR_ANY;
-    listenAddress.sin_port = htons(listenPort);
-
-    // bind returns -1 on error
-    if (bind(listenSocketFD, (struct sockaddr*) &listenAddress, sizeof(listenAddress)) < 0)
+    // set to listen to incoming connections
+    if (listen(listenSocketFD, 5) < 0) // listen returns -1 on error
     {
-        perror("cproxy unable to bind listen socket to port");
+        perror("cproxy unable to listen to port");
         return -1;
     }
 
-    // set to listen to incoming connections
-    if (listen(listenSocketFD, 5) < 0) // listen returns -1 on error
+    // Find every address sproxy has, only IPv4 ones for paths bound to local IPv4 addresses, a name on its own thread
+    Dialer dialer;
+    initDialer(&dialer);
+    Resolver* resolver = newResolver(argv[2], serverPort, (paths.pathCount != 0) ? AF_INET : AF_UNSPEC);
+    if (resolver == NULL)
     {
-        perror("cproxy unable to listen to port");
         return -1;
     }
 
-    // populate address info for connection to server
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = inet_addr(argv[2]);
-    serverAddress.sin_port = htons(serverPort);
+    // In passthrough mode, relay each client to sproxy's first address until it disconnects, and nothing else
+    if (isPassthrough != 0)
+    {
+        while (takeResolvedAddresses(resolver, &dialer) == 0)
+        {
+            struct timeval waitTime = {
+                .tv_sec = 0,
+                .tv_usec = 100000
+            };
+            select(0, NULL, NULL, NULL, &waitTime);
+        }
+        return servePassthrough(listenSocketFD, (struct sockaddr*) &dialer.addresses[0].address, dialer.addresses[0].length);
+    }
+
+    if (statsSocketPath != NULL && openStatsSocket(stats, statsSocketPath) < 0)
+    {
+        logMessage(LOG_WARNING, "cproxy will run without a stats socket\n");
+    }
+    if (listenForStreams(&streams) < 0)
+    {
+        return -1;
+    }
 
     // Infinite loop, continue to listen for new connections
     while (1)
     {
         if (clientConnected == 0)
         {
-            printf("client is not connected. Connecting...\n");
+            logMessage(LOG_INFO, "client is not connected. Connecting...\n");
             
             // accept a new client
-            printf("cproxy waiting for new connection...\n");
-            clientAddressLength = sizeof(struct sockaddr); // Should solve INVALID ARGUMENT error
-            clientSocketFD = accept(listenSocketFD, &clientAddress, &clientAddressLength);
+            logMessage(LOG_INFO, "cproxy waiting for new connection...\n");
+            clientAddressLength = sizeof(clientAddress); // Should solve INVALID ARGUMENT error
+            clientSocketFD = accept(listenSocketFD, (struct sockaddr*) &clientAddress, &clientAddressLength);
             if (clientSocketFD < 0) // accept returns -1 on error
             {
                 perror("cproxy unable to receive connection from client");
@@ -365,26 +492,78 @@ int main(int argc, char** argv)
             }
             else
             {
-                printf("cproxy accepted new connection from client!\n");
+                logMessage(LOG_INFO, "cproxy accepted new connection from client!\n");
                 clientConnected = 1;
                 ignoreFirstHeartbeat = 1;
                 clearList(&unAckdPackets);
                 sessionID = generateID(sessionID);
                 seqN = 0;
                 ackN = 0;
+                isResuming = 0;
+                startStatsSession(stats, sessionID);
+                if (predictor != NULL)
+                {
+                    resetEchoPredictor(predictor);
+                }
             }
         }
 
         if (serverConnected == 0)
         {
             // Attempt to re-establish connection
-            printf("server is not connected. Connecting...\n");
+            logMessage(LOG_INFO, "server is not connected. Connecting...\n");
             
-            // Create new server socket
-            serverSocketFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-            if (serverSocketFD < 0) // socket returns -1 on error
+            // Over TCP race a connect to each of sproxy's addresses, over UDP connect to the one picked, or with
+            // local addresses given, a socket for each path, starting on the first (see dial.h). The addresses
+            // are the latest answer for sproxy's name, which is never waited for (see resolve.h)
+            logMessage(LOG_INFO, "cproxy attempting to connect to %s %i\n", argv[2], serverPort);
+            takeResolvedAddresses(resolver, &dialer);
+            if (dialer.addressCount == 0)
+            {
+                logMessage(LOG_WARNING, "cproxy has no address for %s yet\n", argv[2]);
+                serverSocketFD = -1;
+            }
+            else if (isDatagram == 0)
             {
-                perror("cproxy unable to create server socket. Trying again in one second");
+                serverSocketFD = dialServer(&dialer);
+
+                // Compression's history and the cipher's frame count both assume every frame reaches sproxy
+                // whole, so block on a full send buffer, as sproxy's accepted socket does, instead of dropping
+                // or cutting a frame short
+                if (serverSocketFD >= 0 && fcntl(serverSocketFD, F_SETFL, 0) < 0)
+                {
+                    perror("cproxy unable to make the server socket blocking");
+                    close(serverSocketFD);
+                    serverSocketFD = -1;
+                }
+
+                // Every frame is written whole, so send each at once instead of letting Nagle's algorithm
+                // hold a keystroke until sproxy acknowledges the last frame
+                int noDelay = 1;
+                if (serverSocketFD >= 0 && setsockopt(serverSocketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) < 0)
+                {
+                    perror("cproxy unable to set TCP_NODELAY on server socket");
+                }
+            }
+            else if (paths.pathCount != 0)
+            {
+                closePaths(&paths, serverSocketFD); // the primary was closed on disconnect
+                serverSocketFD = openPaths(&paths, (struct sockaddr_in*) &pickServerAddress(&dialer)->address);
+            }
+            else
+            {
+                const DialAddress* serverAddress = pickServerAddress(&dialer);
+                serverSocketFD = socket(serverAddress->address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+                if (serverSocketFD >= 0 && connect(serverSocketFD, (struct sockaddr*) &serverAddress->address, serverAddress->length) < 0)
+                {
+                    perror("cproxy unable to connect its socket to sproxy");
+                    close(serverSocketFD);
+                    serverSocketFD = -1;
+                }
+            }
+            if (serverSocketFD < 0) // -1 on error
+            {
+                logMessage(LOG_WARNING, "cproxy unable to connect to server. Trying again in one second\n");
 
                 struct timeval oneSec = {
                     .tv_sec = 1,
@@ -395,110 +574,132 @@ int main(int argc, char** argv)
                 continue; // Repeat loop to attempt a new connection
             }
 
-            // Attempt to connect to server
-            printf("cproxy attempting to connect to %s %i\n", argv[2], htons(serverAddress.sin_port));
-            if (connect(serverSocketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
-            {
-                struct timeval timeout;
-                
-                // If connection is still in progress
-                if (errno == EINPROGRESS)
-                {
-                    // Wait 10 seconds for server socket to be writable
-                    FD_ZERO(&socketSet); // zero out socketSet
-                    FD_SET(serverSocketFD, &socketSet); // add server socket
-                    
-                    timeout.tv_sec = 10;
-                    timeout.tv_usec = 0;
+            // Server connected successfully
+            serverConnected = 1;
+            serverCanResume = 0;
+            serverIsClosing = 0;
+            resetLZSession(compression);
+            resetFecSession(fec);
+            resetFrameWriter(&toServerFrames);
+            resetFrameReader(&fromServerFrames);
+            resetCipher(&cipher);
+            memcpy(heartbeatData.hello.nonce, cipher.localNonce, CIPHER_NONCE_LEN);
+            negotiateHello(&agreedHello, &localHello, &oldPeerHello); // Until sproxy's Hello arrives
+            gettimeofday(&timeLastMessageReceived, NULL);
+            countConnection(stats, isResuming);
+            isResuming = 1;
+            logMessage(LOG_INFO, "cproxy successfully connected to server!\n");
+        }
 
-                    int resultOfSelect = select(
+        if ((serverConnected != 0) && (clientConnected != 0))
+        {
+            logMessage(LOG_INFO, "Client and Server are both connected\n");
 
-                        serverSocketFD + 1,
-                        NULL,
-                        &socketSet,
-                        NULL,
-                        &timeout
-                    );
-                    if (resultOfSelect < 0)
-                    {
-                        perror("FATAL: cproxy unable to use select to check for connection");
+            // Set nextTimeout to currentTime to ensure the first message sent is a heartbeat
+            gettimeofday(&nextTimeout, NULL);
+            nextProbeTime = nextTimeout;
 
-                        // Close client socket, so it doesn't stay open
-                        if (close(clientSocketFD)) // close returns -1 on error
-                        {
-                            perror("cproxy unable to properly close client socket");
-                        }
-                        else
-                        {
-                            printf("cproxy closed connection to client\n");
-                        }
+            // Use select for data to be ready on both serverSocket and clientSocket
+            while (1)
+            {   
+                setStatGauge(stats, STAT_PEER_CONNECTED, 1);
+                setStatGauge(stats, STAT_UNACKED_PACKETS, (unAckdPackets.head == NULL) ? 0 : seqN - unAckdPackets.head->pck->seqN);
+
+                // With several paths, probe them all, and send on the fastest one still answering
+                int isMultipath = paths.pathCount > 1 && (agreedHello.features & HELLO_MULTIPATH) != 0
+                    && (cipher.isRequired == 0 || cipher.isKeyed != 0);
+                gettimeofday(&currentTime, NULL);
+                if (isMultipath && !timercmp(&currentTime, &nextProbeTime, <))
+                {
+                    int primaryFD = choosePath(&paths);
+                    if (primaryFD != serverSocketFD)
+                    {
+                        logMessage(LOG_INFO, "cproxy moved to the path from %s\n", inet_ntoa(paths.paths[paths.primary].localAddress.sin_addr));
+                        serverSocketFD = primaryFD;
 
-                        return -1;
+                        // A heartbeat moves sproxy's replies to the new path, send it and any retransmissions now
+                        nextTimeout = currentTime;
                     }
-                    // If select is not 0, the server may have connected
-                    if (resultOfSelect != 0)
+
+                    PathProbe probe;
+                    makePathProbe(&probe);
+                    for (int i = 0; i < paths.pathCount; i++)
                     {
-                        // Check value of SO_ERROR
-                        int result;
-                        socklen_t resultSize = sizeof(int);
-                        getsockopt(serverSocketFD, SOL_SOCKET, SO_ERROR, &result, &resultSize);
-                        if (result == 0) // Server connected successfully
+                        if (paths.paths[i].socketFD < 0)
                         {
-                            serverConnected = 1;
-                            gettimeofday(&timeLastMessageReceived, NULL);
-                            printf("cproxy successfully connected to server!\n");
                             continue;
                         }
+
+                        int bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, PACKET_TYPE_PROBE, seqN, ackN,
+                            sizeof(PathProbe), &probe);
+                        if (bytesToSend < 0 || sendToServer(stats, paths.paths[i].socketFD, toServerBuffer, bytesToSend) < 0)
+                        {
+                            perror("Unable to send a probe to sproxy");
+                        }
                     }
-                }
-                
-                perror("cproxy unable to connect to server. Trying again in one second");
 
-                // close server socket to avoid TOO MANY OPEN FILES error
-                if (close(serverSocketFD) < 0)
-                {
-                    perror("cproxy unable to properly close server socket");
+                    struct timeval probeInterval = {
+                        .tv_sec = 0,
+                        .tv_usec = PATH_PROBE_INTERVAL_MS * 1000
+                    };
+                    timeradd(&currentTime, &probeInterval, &nextProbeTime);
                 }
 
-                timeout.tv_sec = 1;
-                timeout.tv_usec = 0;
-                select(0, NULL, NULL, NULL, &timeout);
-
-                continue; // Repeat loop to attempt a new connection
-            }
-            else // Server connected successfully
-            {
-                serverConnected = 1;
-                gettimeofday(&timeLastMessageReceived, NULL);
-                printf("cproxy successfully connected to server!\n");
-            }
-        }
-
-        if ((serverConnected != 0) && (clientConnected != 0))
-        {
-            printf("Client and Server are both connected\n");
-            
-            // Reset segmentExpected to PACKET_TYPE and bytesExpected to sizeof(uint32_t)
-            segmentExpected = PACKET_TYPE;
-            bytesExpected = sizeof(uint32_t);
-
-            // Set nextTimeout to currentTime to ensure the first message sent is a heartbeat
-            gettimeofday(&nextTimeout, NULL);
-
-            // Use select for data to be ready on both serverSocket and clientSocket
-            while (1)
-            {   
                 // Reset socketSet
                 FD_ZERO(&socketSet); // zero out socketSet
+                FD_ZERO(&writeSet);
                 FD_SET(serverSocketFD, &socketSet); // add server socket
-                FD_SET(clientSocketFD, &socketSet); // add client socket
+                int maxFD = addPathsToSet(&paths, &socketSet, max(serverSocketFD, clientSocketFD));
+
+                // Only read more from the client while the agreed window of unacknowledged packets has room,
+                // and, if encryption is required, once the connection is keyed. Pastes and other bulk input only
+                // get their share of the window, and the rest is kept for keystrokes (see priority.h)
+                uint32_t inFlight = (unAckdPackets.head == NULL) ? 0 : seqN - unAckdPackets.head->pck->seqN;
+                int readLength = (cipher.isRequired == 0 || cipher.isKeyed != 0) ? priorityReadLength(clientSocketFD,
+                    inFlight, agreedHello.windowLength, agreedHello.maxPayloadLength) : 0;
+                if (readLength > 0)
+                {
+                    FD_SET(clientSocketFD, &socketSet); // add client socket
+                }
+
+                // Forwarded streams share the window the same way, and new ones, from the map file or SOCKS
+                // clients, are only taken once sproxy agreed to forward them (see stream.h)
+                int isSending = cipher.isRequired == 0 || cipher.isKeyed != 0;
+                maxFD = addStreamsToSet(&streams, &socketSet, &writeSet, maxFD, isSending ? agreedHello.features : 0, isSending,
+                    inFlight, agreedHello.windowLength, agreedHello.maxPayloadLength);
+
+                // sproxy's window only opens as its packets are acknowledged, and while the client is quiet that is
+                // only by heartbeats, so acknowledge every half of the share of the agreed window that bulk output may
+                // fill (see priority.h) straight away, instead of leaving sproxy's window full until the next one
+                if (agreedHello.windowLength != 0 && isSending != 0
+                    && (int32_t) (ackN - sentAckN) >= (int32_t) (agreedHello.windowLength * PRIORITY_BULK_PERCENT / 200))
+                {
+                    heartbeatPacket.seqN = seqN;
+                    heartbeatPacket.ackN = ackN;
+                    heartbeatData.sessionID = sessionID;
+                    heartbeatData.flags = HEARTBEAT_CAN_RESUME;
+                    heartbeatData.hello.lossPermille = (fec->isEnabled != 0) ? fec->lossPermille : 0;
+                    stampHello(stats, &heartbeatData.hello);
+                    int bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                        heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                    if (bytesToSend < 0 || sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend) < 0)
+                    {
+                        perror("Unable to send an acknowledgement to sproxy");
+                    }
+                    sentAckN = ackN;
+                }
 
-                // Calculate new timeout value (passing a returned timeout value from a previous select call does not work on all OSs)
-                struct timeval currentTime;
+                // Calculate new timeout value (passing a returned timeout value from a previous select call does not work on all OSs),
+                // waking up for the next probe too
+                struct timeval wakeTime = nextTimeout;
+                if (isMultipath && timercmp(&nextProbeTime, &wakeTime, <))
+                {
+                    wakeTime = nextProbeTime;
+                }
                 gettimeofday(&currentTime, NULL);
                 struct timeval timeout;
-                timersub(&nextTimeout, &currentTime, &timeout);
-                if (timeout.tv_sec < 0) // If it came back negative, set to zero
+                timersub(&wakeTime, &currentTime, &timeout);
+                if (timeout.tv_sec < 0 || hasStreamControl(&streams)) // If it came back negative, set to zero
                 {
                     timeout.tv_sec = 0;
                     timeout.tv_usec = 0;
@@ -506,14 +707,32 @@ int main(int argc, char** argv)
 
                 // Wait at most one second for input to be available using select
                 int resultOfSelect = select(
-                    max(serverSocketFD, clientSocketFD) + 1,
+                    maxFD + 1,
                     &socketSet,
-                    NULL,
+                    &writeSet,
                     NULL,
                     &timeout
                 );
-                // If select timed out, check for a heartbeat from sproxy, and also send one
-                if (resultOfSelect == 0)
+                if (resultOfSelect > 0)
+                {
+                    acceptStreams(&streams, &socketSet);
+                    writeStreams(&streams, &writeSet);
+                }
+
+                // Take back guessed echoes that never came
+                if (predictor != NULL)
+                {
+                    int withdrawalLength;
+                    const char* withdrawal = expireEcho(predictor, statsMicros(), &withdrawalLength);
+                    if (withdrawal != NULL && send(clientSocketFD, withdrawal, withdrawalLength, 0) < 0)
+                    {
+                        perror("Unable to take back the predicted echo");
+                    }
+                }
+
+                // If select timed out, check for a heartbeat from sproxy, and also send one, unless it only woke up to probe
+                gettimeofday(&currentTime, NULL);
+                if (resultOfSelect == 0 && !timercmp(&currentTime, &nextTimeout, <))
                 {
                     struct timeval newTime;
                     gettimeofday(&newTime, NULL);
@@ -521,6 +740,14 @@ int main(int argc, char** argv)
                     timersub(&newTime, &timeLastMessageReceived, &timeDif); // getting the time difference
                     if(timeDif.tv_sec >= 3) // if the time difference is 3 or greater
                     {
+                        // Reset the connection rather than end it, or an sproxy that has not timed out yet
+                        // would take it for the end of the session
+                        if (isDatagram == 0)
+                        {
+                            struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+                            setsockopt(serverSocketFD, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+                        }
+
                         //TODO: close the sockets between cproxy and sproxy
                         if (close(serverSocketFD)) // close returns -1 on error
                         {
@@ -528,7 +755,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("cproxy closed connection to server\n");
+                            logMessage(LOG_INFO, "cproxy closed connection to server\n");
                         }
                         serverConnected = 0;
 
@@ -541,8 +768,33 @@ int main(int argc, char** argv)
                     // Compress and send heartbeat packet
                     heartbeatPacket.seqN = seqN;
                     heartbeatPacket.ackN = ackN;
-                    int bytesToSend = compressPacket(toServerBuffer, heartbeatPacket);
-                    int bytesSent = send(serverSocketFD, toServerBuffer, bytesToSend, 0);
+                    sentAckN = ackN;
+                    heartbeatData.sessionID = sessionID;
+                    heartbeatData.flags = HEARTBEAT_CAN_RESUME;
+                    heartbeatData.hello.lossPermille = (fec->isEnabled != 0) ? measureFecLoss(fec) : 0;
+                    stampHello(stats, &heartbeatData.hello);
+
+                    // Over UDP the heartbeat that carried the nonce may have been lost, so repeat it in
+                    // plaintext until sproxy's first encrypted packet shows it has the keys too
+                    if (isDatagram != 0 && cipher.isKeyed != 0 && cipher.rx.counter == 0)
+                    {
+                        int bytesToSend = writeFrame(&toServerFrames, NULL, toServerBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                            heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                        if (sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend) < 0)
+                        {
+                            perror("Unable to send heartbeat message to sproxy");
+                        }
+                    }
+
+                    int bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                        heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                    int bytesSent = (bytesToSend < 0) ? -1 : sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend);
+
+                    // A plaintext heartbeat carried this connection's nonce, keys may follow now
+                    if (cipher.isRequired != 0 && cipher.isKeyed == 0 && bytesSent >= 0 && sentCipherNonce(&cipher) < 0)
+                    {
+                        bytesSent = -1;
+                    }
 
                     // Report if there was an error (just for debugging, no need to exit)
                     if (bytesSent < 0)
@@ -551,17 +803,22 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("Sent heartbeat with seqN %i ackN %i\n", heartbeatPacket.seqN, heartbeatPacket.ackN);
+                        logMessage(LOG_DEBUG, "Sent heartbeat with seqN %i ackN %i\n", heartbeatPacket.seqN, heartbeatPacket.ackN);
                     }
 
                     // Retransmit unackd packets
-                    if (unAckdPackets.head != NULL)
+                    if (unAckdPackets.head != NULL && (cipher.isRequired == 0 || cipher.isKeyed != 0))
                     {
                         LLNode* node = unAckdPackets.head;
+                        int retransmittedCount = 0;
+                        int retransmittedBytes = 0;
                         while (node != NULL)
                         {
-                            bytesToSend = compressPacket(toServerBuffer, *node->pck);
-                            bytesSent = send(serverSocketFD, toServerBuffer, bytesToSend, 0);
+                            struct packet wirePacket = *node->pck;
+                            wirePacket.payload = compressPayload(compression, &wirePacket.type, wirePacket.payload, &wirePacket.length);
+                            bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, wirePacket.type, wirePacket.seqN,
+                                wirePacket.ackN, wirePacket.length, wirePacket.payload);
+                            bytesSent = (bytesToSend < 0) ? -1 : sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend);
 
                             // Report if there was an error (just for debugging, no need to exit)
                             if (bytesSent < 0)
@@ -570,11 +827,19 @@ int main(int argc, char** argv)
                             }
                             else
                             {
-                                printf("Retransmitted data with seqN %i ackN %i\n", node->pck->seqN, node->pck->ackN);
+                                logMessage(LOG_DEBUG, "Retransmitted data with seqN %i ackN %i, %i bytes\n", node->pck->seqN, node->pck->ackN, bytesSent);
+                                addStat(stats, STAT_RETRANSMITTED_FRAMES, 1);
+                                addStat(stats, STAT_RETRANSMITTED_BYTES, bytesSent);
+                                retransmittedCount++;
+                                retransmittedBytes += bytesSent;
                             }
                             
                             node = node->next;
                         }
+                        if (retransmittedCount > 0)
+                        {
+                            logMessage(LOG_INFO, "Retransmitted %i data packets, %i bytes\n", retransmittedCount, retransmittedBytes);
+                        }
                     }
                 }
                 // If there was an error with select, this is non recoverable
@@ -589,7 +854,7 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("cproxy closed connection to server\n");
+                        logMessage(LOG_INFO, "cproxy closed connection to server\n");
                     }
 
                     // Close client socket, so it doesn't stay open
@@ -599,26 +864,51 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("cproxy closed connection to client\n");
+                        logMessage(LOG_INFO, "cproxy closed connection to client\n");
                     }
 
                     return -1;
                 }
 
-                // If input is ready on serverSocket, place data into receivedPacket
-                if (FD_ISSET(serverSocketFD, &socketSet))
+                // If input is ready on serverSocket, or any other path, place data into receivedPacket
+                int readyFD = findReadyPath(&paths, &socketSet, serverSocketFD);
+                if (readyFD >= 0)
                 {   
-                    // Update timeLastMessageReceived
-                    gettimeofday(&timeLastMessageReceived, NULL);
-                    
-                    // Read bytesExpected into fromServerBuffer
-                    bytesRead = recv(serverSocketFD, fromServerBuffer, bytesExpected, 0);
+                    // Read whatever has arrived in to the frame reader
+                    bytesRead = receiveFrames(&fromServerFrames, readyFD);
+                    uint32_t receivedMicros = statsMicros();
+                    if (bytesRead > 0)
+                    {
+                        addStat(stats, STAT_PEER_BYTES_RECEIVED, bytesRead);
+                    }
 
+                    // Over UDP an error (sproxy's port unreachable, say) is not a disconnect, the heartbeat timeout decides
+                    if (bytesRead < 0 && isDatagram != 0)
+                    {
+                        perror("cproxy unable to receive from sproxy");
+                    }
                     // If bytesRead is 0 or -1, controlled disconnect, disconnect both sockets and
                     // break into outer while loop
-                    if (bytesRead <= 0)
+                    else if (bytesRead <= 0 && isDatagram == 0)
                     {
-                        printf("recv() returned with %i on serverSocketFD\n", bytesRead);
+                        logMessage(LOG_INFO, "recv() returned with %i on serverSocketFD\n", bytesRead);
+
+                        // If sproxy went away without ending the session, it crashed or restarted,
+                        // so keep the client and reconnect to recover the session
+                        if (serverCanResume != 0 && serverIsClosing == 0)
+                        {
+                            if (close(serverSocketFD)) // close returns -1 on error
+                            {
+                                perror("cproxy unable to properly close server socket");
+                            }
+                            else
+                            {
+                                logMessage(LOG_INFO, "cproxy lost connection to server, reconnecting\n");
+                            }
+                            serverConnected = 0;
+
+                            break;
+                        }
 
                         // Close server socket
                         if (close(serverSocketFD)) // close returns -1 on error
@@ -627,7 +917,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("cproxy closed connection to server\n");
+                            logMessage(LOG_INFO, "cproxy closed connection to server\n");
                         }
                         serverConnected = 0;
 
@@ -638,30 +928,82 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("cproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "cproxy closed connection to client\n");
                         }
                         clientConnected = 0;
+                        closeStreams(&streams); // Forwarded streams end with the session
 
                         break;
                     }
 
-                    // Add data to packet
-                    bytesExpected = addToPacket(fromServerBuffer, receivedPacket, bytesRead, &segmentExpected, bytesExpected);
-
-                    // If bytesExpected is 0, we just finished reading a whole packet
-                    if (bytesExpected == 0)
+                    // Handle every whole packet that has arrived
+                    int frameResult = 0;
+                    while (serverConnected != 0
+                        && (frameResult = readFrame(&fromServerFrames, &cipher, &receivedPacket->type, &receivedPacket->seqN,
+                            &receivedPacket->ackN, &receivedPacket->length, receivedPacket->payload, BUFFER_LEN)) > 0)
                     {
-                        // Update bytesExpected to sizeof(uint32_t)
-                        bytesExpected = sizeof(uint32_t);
+                        // Update timeLastMessageReceived, and the path's liveness and round trip time
+                        gettimeofday(&timeLastMessageReceived, NULL);
+                        addStat(stats, STAT_PEER_FRAMES_RECEIVED, 1);
+                        notePathFrame(&paths, readyFD, receivedPacket->type, receivedPacket->payload, receivedPacket->length);
+
+                        // A probe reply was only needed for its path's round trip time
+                        if ((receivedPacket->type & PACKET_TYPE_PROBE) != 0)
+                        {
+                            continue;
+                        }
+
+                        // If the packet is a parity packet, it may rebuild a lost data packet
+                        if ((receivedPacket->type & PACKET_TYPE_PARITY) != 0)
+                        {
+                            logMessage(LOG_DEBUG, "Parity packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+
+                            if (fec->isEnabled != 0
+                                && rebuildFecPacket(fec, receivedPacket->seqN, receivedPacket->type, receivedPacket->payload,
+                                    receivedPacket->length, ackN) > 0)
+                            {
+                                logMessage(LOG_DEBUG, "Rebuilt a lost data packet from parity\n");
+                            }
 
+                            countAcks(stats, &unAckdPackets, receivedPacket->ackN);
+                            clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
+                        }
                         // If the packet is a data packet
-                        if (receivedPacket->type != 0)
+                        else if (receivedPacket->type != 0)
                         {
-                            printf("Data packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+                            logMessage(LOG_DEBUG, "Data packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+
+                            // Every data packet goes through the compression history, even duplicates.
+                            // If that fails the history is lost, so start over on a new connection
+                            if (decompressPayload(compression, &receivedPacket->type, receivedPacket->payload, &receivedPacket->length, BUFFER_LEN) < 0)
+                            {
+                                if (close(serverSocketFD)) // close returns -1 on error
+                                {
+                                    perror("cproxy unable to properly close server socket");
+                                }
+                                else
+                                {
+                                    logMessage(LOG_INFO, "cproxy closed connection to server\n");
+                                }
+                                serverConnected = 0;
+
+                                break;
+                            }
                             
-                            if (receivedPacket->seqN == ackN)
+                            // With FEC, packets that arrive ahead of ackN are kept until the gap is filled
+                            if (fec->isEnabled != 0)
+                            {
+                                storeFecPacket(fec, receivedPacket->seqN, receivedPacket->type, receivedPacket->payload, receivedPacket->length, ackN);
+                                if (receivedPacket->seqN > ackN)
+                                {
+                                    traceGap(&stats->trace);
+                                }
+                            }
+                            else if (receivedPacket->seqN == ackN)
                             {
-                                int bytesSent = send(clientSocketFD, receivedPacket->payload, receivedPacket->length, 0);
+                                int bytesSent = ((receivedPacket->type & PACKET_TYPE_STREAM) != 0)
+                                    ? deliverStreamPacket(&streams, receivedPacket->payload, receivedPacket->length)
+                                    : sendToClient(predictor, clientSocketFD, receivedPacket->payload, receivedPacket->length);
 
                                 // Report if there was an error (just for debugging, no need to exit)
                                 if (bytesSent < 0)
@@ -671,46 +1013,197 @@ int main(int argc, char** argv)
                                 }
                                 else
                                 {
+                                    traceDeliveredPacket(&stats->trace, ackN, receivedMicros);
                                     ackN++;
+                                    addStat(stats, STAT_LOCAL_BYTES_WRITTEN, bytesSent);
                                 }
                             }
                             else
                             {
-                                printf("Data's seqN %i does not match ackN %i. Discarding\n", receivedPacket->seqN, ackN);
+                                logMessage(LOG_DEBUG, "Data's seqN %i does not match ackN %i. Discarding\n", receivedPacket->seqN, ackN);
+                                addStat(stats, STAT_DISCARDED_PACKETS, 1);
+                                if (receivedPacket->seqN > ackN)
+                                {
+                                    traceGap(&stats->trace);
+                                }
                             }
                                 
+                            countAcks(stats, &unAckdPackets, receivedPacket->ackN);
                             clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
                         }
                         else
                         {
-                            printf("Heartbeat received with seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+                            logMessage(LOG_DEBUG, "Heartbeat received with seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+
+                            // Before sproxy's first encrypted frame, a heartbeat is only trusted for its Hello
+                            int isTrusted = (cipher.isRequired == 0 || cipher.rx.counter > 0);
+
+                            // Newer versions of sproxy send flags after the session ID
+                            if (isTrusted && receivedPacket->length >= offsetof(struct heartbeatPayload, hello))
+                            {
+                                uint32_t flags = ((struct heartbeatPayload*) receivedPacket->payload)->flags;
+                                serverCanResume = flags & HEARTBEAT_CAN_RESUME;
+                                serverIsClosing = flags & HEARTBEAT_CLOSING;
+                            }
+
+                            // Over UDP no disconnect follows HEARTBEAT_CLOSING, so end the session now
+                            if (isDatagram != 0 && serverIsClosing != 0)
+                            {
+                                logMessage(LOG_INFO, "sproxy ended the session\n");
+                                if (close(serverSocketFD)) // close returns -1 on error
+                                {
+                                    perror("cproxy unable to properly close server socket");
+                                }
+                                serverConnected = 0;
+                                if (close(clientSocketFD)) // close returns -1 on error
+                                {
+                                    perror("cproxy unable to properly close client socket");
+                                }
+                                else
+                                {
+                                    logMessage(LOG_INFO, "cproxy closed connection to client\n");
+                                }
+                                clientConnected = 0;
+                                closeStreams(&streams); // Forwarded streams end with the session
+
+                                break;
+                            }
+
+                            // Agree with sproxy on the features to use, older versions send no Hello. The Hello that
+                            // keys the connection is taken as it is, and after that only authenticated ones
+                            Hello peerHello;
+                            readHello(&peerHello, (char*) receivedPacket->payload + offsetof(struct heartbeatPayload, hello),
+                                (int) receivedPacket->length - (int) offsetof(struct heartbeatPayload, hello));
+                            if (isTrusted != 0 || cipher.isKeyed == 0)
+                            {
+                                negotiateHello(&agreedHello, &localHello, &peerHello);
+                                compression->isEnabled = (agreedHello.features & HELLO_COMPRESSION) != 0;
+                                fec->isEnabled = (agreedHello.features & HELLO_FEC) != 0;
+                                toServerFrames.isCompact = (agreedHello.features & HELLO_COMPACT_FRAMES) != 0;
+                                toServerFrames.isExtended = (agreedHello.features & HELLO_EXTENDED_TYPES) != 0;
+                            }
+                            confirmServerAddress(&dialer); // Over UDP, the next connection is tried here first
+
+                            // With a key loaded, only talk to a sproxy that has one too
+                            if (cipher.isRequired != 0 && cipher.isKeyed == 0)
+                            {
+                                if ((agreedHello.features & HELLO_ENCRYPTION) == 0 || keyCipher(&cipher, peerHello.nonce) < 0)
+                                {
+                                    logMessage(LOG_WARNING, "sproxy does not support encryption, disconnecting\n");
+                                    if (close(serverSocketFD)) // close returns -1 on error
+                                    {
+                                        perror("cproxy unable to properly close server socket");
+                                    }
+                                    serverConnected = 0;
+
+                                    break;
+                                }
+
+                                // Send a heartbeat now, to carry the nonce or to start the encrypted stream
+                                gettimeofday(&nextTimeout, NULL);
+                            }
+                            if (isTrusted == 0)
+                            {
+                                continue;
+                            }
+                            noteHello(stats, &peerHello);
+
+                            // Cover more packets with parity the more sproxy sees lost, and measure what it loses
+                            setFecLoss(fec, peerHello.lossPermille);
+                            countFecHeartbeat(fec, receivedPacket->seqN);
+
                             if (ignoreFirstHeartbeat != 0)
                             {
                                 ignoreFirstHeartbeat = 0;
                             }
                             else
                             {
+                                countAcks(stats, &unAckdPackets, receivedPacket->ackN);
                                 clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
                             }
                         }
+
+                        // Hand on the packets FEC has kept, in order, up to the next gap
+                        FecSlot* slot;
+                        while (fec->isEnabled != 0 && (slot = nextFecPacket(fec, ackN)) != NULL)
+                        {
+                            int bytesSent = ((slot->type & PACKET_TYPE_STREAM) != 0)
+                                ? deliverStreamPacket(&streams, slot->payload, slot->length)
+                                : sendToClient(predictor, clientSocketFD, slot->payload, slot->length);
+                            if (bytesSent < 0)
+                            {
+                                perror("Unable to send data to telnet");
+                                break; // Don't update ackN, so that it will be retransmitted
+                            }
+                            traceDeliveredPacket(&stats->trace, ackN, receivedMicros);
+                            ackN++;
+                            addStat(stats, STAT_LOCAL_BYTES_WRITTEN, bytesSent);
+                        }
+                    }
+
+                    // If the bytes are not a valid packet the stream is lost, so start over on a new connection.
+                    // Over UDP only that datagram is lost, and the next one is read on its own
+                    if (serverConnected != 0 && frameResult < 0 && isDatagram == 0)
+                    {
+                        if (close(serverSocketFD)) // close returns -1 on error
+                        {
+                            perror("cproxy unable to properly close server socket");
+                        }
+                        else
+                        {
+                            logMessage(LOG_INFO, "cproxy closed connection to server\n");
+                        }
+                        serverConnected = 0;
+                    }
+
+                    // Break in to outer while loop if server was disconnected
+                    if (serverConnected == 0)
+                    {
+                        break;
                     }
                 }
 
-                // If input is ready on clientSocket, construct packet and send to serverSocket
-                if (FD_ISSET(clientSocketFD, &socketSet))
+                // If input is ready on clientSocket, or a forwarded stream has something to send, the two taking turns,
+                // construct packet and send to serverSocket
+                Stream* stream = nextStreamToSend(&streams, &socketSet, FD_ISSET(clientSocketFD, &socketSet));
+                if (stream != NULL || FD_ISSET(clientSocketFD, &socketSet))
                 {   
                     // Create new packet
-                    struct packet* dataPacket = newPacket(1, seqN, ackN, 0);
+                    struct packet* dataPacket = newPacket((stream != NULL) ? 1 | PACKET_TYPE_STREAM : 1, seqN, ackN, 0);
+                    sentAckN = ackN;
                     
-                    int clientBytesRead = recv(clientSocketFD, dataPacket->payload, BUFFER_LEN, 0);
+                    // A stream's packet may be its OPEN or CLOSE, with nothing read
+                    int clientBytesRead, localBytesRead;
+                    if (stream != NULL)
+                    {
+                        clientBytesRead = readStreamPacket(&streams, stream, dataPacket->payload, &localBytesRead);
+                    }
+                    else
+                    {
+                        clientBytesRead = recv(clientSocketFD, dataPacket->payload, readLength, 0);
+                        localBytesRead = clientBytesRead;
+                    }
                     // If bytesRead is 0 or -1, controlled disconnect, disconnect both sockets and
                     // break into outer while loop
                     if (clientBytesRead <= 0)
                     {
-                        printf("recv() returned with %i on clientSocketFD\n", clientBytesRead);
+                        logMessage(LOG_INFO, "recv() returned with %i on clientSocketFD\n", clientBytesRead);
 
                         // Delete packet
                         deletePacket(dataPacket);
+
+                        // Tell sproxy the session is over, so it does not wait for a reconnect
+                        heartbeatPacket.seqN = seqN;
+                        heartbeatPacket.ackN = ackN;
+                        heartbeatData.sessionID = sessionID;
+                        heartbeatData.flags = HEARTBEAT_CAN_RESUME | HEARTBEAT_CLOSING;
+                        stampHello(stats, &heartbeatData.hello);
+                        int bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                            heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                        if (bytesToSend < 0 || sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend) < 0)
+                        {
+                            perror("Unable to send closing heartbeat to sproxy");
+                        }
                         
                         // Close server socket
                         if (close(serverSocketFD)) // close returns -1 on error
@@ -719,7 +1212,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("cproxy closed connection to server\n");
+                            logMessage(LOG_INFO, "cproxy closed connection to server\n");
                         }
                         serverConnected = 0;
 
@@ -730,17 +1223,29 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("cproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "cproxy closed connection to client\n");
                         }
                         clientConnected = 0;
+                        closeStreams(&streams); // Forwarded streams end with the session
 
                         break;
                     }
                     dataPacket->length = clientBytesRead;
+                    dataPacket->sentMicros = statsMicros();
+                    addStat(stats, STAT_LOCAL_BYTES_READ, localBytesRead);
+                    if (localBytesRead > 0 && ((stream != NULL) ? stream->readLength + (int) STREAM_HEADER_LEN : readLength) < agreedHello.maxPayloadLength)
+                    {
+                        addStat(stats, STAT_PRIORITY_FRAMES, 1);
+                    }
 
                     // send to serverSocketFD
-                    int bytesToSend = compressPacket(toServerBuffer, *dataPacket);
-                    int bytesSent = send(serverSocketFD, toServerBuffer, bytesToSend, 0);
+                    struct packet wirePacket = *dataPacket;
+                    wirePacket.payload = compressPayload(compression, &wirePacket.type, wirePacket.payload, &wirePacket.length);
+                    int bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, wirePacket.type, wirePacket.seqN,
+                        wirePacket.ackN, wirePacket.length, wirePacket.payload);
+                    uint32_t framedMicros = statsMicros();
+                    int bytesSent = (bytesToSend < 0) ? -1 : sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend);
+                    uint32_t sentMicros = statsMicros();
                     // Report if there was an error (just for debugging, no need to exit)
                     if (bytesSent < 0)
                     {
@@ -748,13 +1253,47 @@ int main(int argc, char** argv)
                     }
                     seqN++;
                     pushTail(&unAckdPackets, dataPacket);
-                    printf("Data packet sent with seqN %i ackN %i\n", dataPacket->seqN, dataPacket->ackN);
+                    traceSentPacket(&stats->trace, dataPacket->seqN, dataPacket->sentMicros, framedMicros, sentMicros);
+                    logMessage(LOG_DEBUG, "Data packet sent with seqN %i ackN %i\n", dataPacket->seqN, dataPacket->ackN);
+
+                    // Show the client the echo of what it typed, where it can be guessed
+                    if (predictor != NULL && stream == NULL)
+                    {
+                        char echo[BUFFER_LEN];
+                        int echoLength = predictEcho(predictor, dataPacket->payload, dataPacket->length, sentMicros, echo);
+                        if (echoLength > 0 && send(clientSocketFD, echo, echoLength, 0) < 0)
+                        {
+                            perror("Unable to send the predicted echo to telnet");
+                        }
+                    }
+
+                    // Follow with parity once the group is full, or the client has nothing more to send for now
+                    int parityCount = addFecPacket(fec, dataPacket->seqN, dataPacket->type, dataPacket->payload,
+                        dataPacket->length, dataPacket->length < agreedHello.maxPayloadLength);
+                    if (parityCount != 0)
+                    {
+                        uint32_t paritySeqN, parityType, parityLength;
+                        void* parity = takeFecParity(fec, &paritySeqN, &parityType, &parityLength);
+                        for (int i = 0; i < parityCount; i++)
+                        {
+                            // Framed again each time, so each copy is sealed with a frame count of its own
+                            bytesToSend = writeFrame(&toServerFrames, &cipher, toServerBuffer, parityType, paritySeqN,
+                                ackN, parityLength, parity);
+                            if (bytesToSend < 0 || sendToServer(stats, serverSocketFD, toServerBuffer, bytesToSend) < 0)
+                            {
+                                perror("Unable to send parity to sproxy");
+                                break;
+                            }
+                        }
+                    }
                 }
             }
+
+            setStatGauge(stats, STAT_PEER_CONNECTED, serverConnected);
         }
     }
 
-    printf("Error! Outer while loop was broken!!!!\n");
+    logMessage(LOG_ERROR, "Error! Outer while loop was broken!!!!\n");
 
     // Close listen socket
     if (close(listenSocketFD)) // close returns -1 on error
@@ -765,80 +1304,14 @@ int main(int argc, char** argv)
     // free buffers
     deletePacket(receivedPacket);
     free(toServerBuffer);
-    free(fromServerBuffer);
+    deleteLZSession(compression);
+    deleteFecSession(fec);
+    deleteEchoPredictor(predictor);
+    closeStreams(&streams);
 
     return 0;
 }
 
-void pushTail(LinkedList* list, struct packet* pck)
-{
-    LLNode* newNode = malloc(sizeof(LLNode));
-    if (newNode == NULL)
-    {
-        perror("Unable to allocate space for new linked list node");
-        exit(-1);
-    }
-
-    // Populate node
-    newNode->pck = pck;
-    newNode->next = NULL;
-
-    // If the list is empty, insert at the head
-    if (list->head == NULL)
-    {
-        list->head = newNode;
-        return;
-    }
-
-    // Insert at the end of the list
-    LLNode* lastNode = list->head;
-    while (lastNode->next != NULL)
-    {
-        lastNode = lastNode->next;
-    }
-
-    lastNode->next = newNode;
-}
-
-struct packet* pop(LinkedList* list)
-{
-    if (list->head == NULL)
-    {
-        return NULL;
-    }
-
-    LLNode* poppedNode = list->head;
-    list->head = poppedNode->next;
-
-    struct packet* pck = poppedNode->pck;
-    free(poppedNode);
-
-    return pck;
-}
-
-void clearAckdPackets(LinkedList* list, uint32_t ackN)
-{
-    while (list->head != NULL)
-    {
-        if (list->head->pck->seqN >= ackN)
-        {
-            return;
-        }
-
-        struct packet* poppedPacket = pop(list);
-        deletePacket(poppedPacket);
-    }
-}
-
-void clearList(LinkedList* list)
-{
-    while (list->head != NULL)
-    {
-        struct packet* poppedPacket = pop(list);
-        deletePacket(poppedPacket);
-    }
-}
-
 int max(int a, int b)
 {
     if (a > b)
@@ -862,163 +1335,43 @@ int generateID(int oldID)
     return newID;
 }
 
-struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length)
+int sendToServer(ProxyStats* stats, int socketFD, void* buffer, int length)
 {
-    struct packet* newPacket = malloc(sizeof(struct packet));
-    if (newPacket == NULL)
-    {
-        perror("Unable to allocate space for new packet");
-        exit(-1);
-    }
-
-    newPacket->payload = malloc(BUFFER_LEN);
-    if (newPacket->payload == NULL)
+    // The socket blocks over TCP, so send() only returns short when a signal interrupts it
+    int bytesSent = 0;
+    while (bytesSent < length)
     {
-        perror("Unable to allocate space for packet payload");
-        exit(-1);
-    }
-
-    newPacket->type = type;
-    newPacket->seqN = seqN;
-    newPacket->ackN = ackN;
-    newPacket->length = length;
-
-    return newPacket;
-}
-
-void deletePacket(struct packet* pck)
-{
-    free(pck->payload);
-    free(pck);
-}
-
-int compressPacket(void* buffer, struct packet pck)
-{
-    int index = 0;
-
-    // Write in packet type
-    *(uint32_t*) (buffer+index) = pck.type;
-    index += sizeof(uint32_t);
-
-    // Write in seqN
-    *(uint32_t*) (buffer+index) = pck.seqN;
-    index += sizeof(uint32_t);
-
-    // Write in ackN
-    *(uint32_t*) (buffer+index) = pck.ackN;
-    index += sizeof(uint32_t);
-
-    // Write in payload length
-    *(uint32_t*) (buffer+index) = pck.length;
-    index += sizeof(uint32_t);
-
-    // Write in the payload
-    memcpy(buffer+index, pck.payload, pck.length);
-    index += pck.length;
-
-    return index; // This should now equal the size of the data in buffer
-}
-
-int addToPacket(void* buffer, struct packet* pck, int n, segmentType* currentSegment, int remaining)
-{
-    int bufferIndex = 0;
-    
-    // As long as there are still bytes to read
-    while (n > 0)
-    {
-        // Calculate payloadIndex
-        int payloadIndex;
-        if (*currentSegment != PAYLOAD)
-        {
-            payloadIndex = sizeof(uint32_t) - remaining;
-        }
-        else
-        {
-            payloadIndex = pck->length - remaining;
-        }
-
-        // Check that payloadIndex is not negative
-        if (payloadIndex < 0)
+        int result = send(socketFD, (char*) buffer + bytesSent, length - bytesSent, 0);
+        if (result < 0 && errno == EINTR)
         {
-            printf("Error in addToPacket: the given \"remaining\" argument is too high: %i\n", remaining);
-            return remaining;
+            continue;
         }
-        
-        // If there are more bytes remaining than n, copy n bytes and return
-        if (remaining > n)
+        if (result < 0)
         {
-            memcpy(pck->payload + payloadIndex, buffer + bufferIndex, n);
-            return remaining - n;
+            return -1;
         }
-        else
-        {
-            // Copy remaining bytes
-            memcpy(pck->payload + payloadIndex, buffer + bufferIndex, remaining);
-            bufferIndex += remaining;
-            n -= remaining;
-
-            // Update segment type
-            switch (*currentSegment)
-            {
-                case PACKET_TYPE:
-
-                    // Copy packet type data into pck->type
-                    pck->type = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to SEQ
-                    *currentSegment = SEQ;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;
-                case SEQ:
-
-                    // Copy packet seqN data into pck->seqN
-                    pck->seqN = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to ACK
-                    *currentSegment = ACK;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;
-                case ACK:
-
-                    // Copy packet ackN data into pck->ackN
-                    pck->ackN = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to LENGTH
-                    *currentSegment = LENGTH;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;   
-                case LENGTH:
-
-                    // Copy packet length data into pck->length
-                    pck->length = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to PAYLOAD
-                    *currentSegment = PAYLOAD;
-
-                    // Update remaining to pck->length
-                    remaining = pck->length;
+        bytesSent += result;
+    }
 
-                    break;
-                case PAYLOAD:
-                    
-                    // pck->payload should contain the correct payload now
+    addStat(stats, STAT_PEER_BYTES_SENT, bytesSent);
+    addStat(stats, STAT_PEER_FRAMES_SENT, 1);
+    return bytesSent;
+}
 
-                    // Change currentSegment to PACKET_TYPE
-                    *currentSegment = PACKET_TYPE;
+int sendToClient(EchoPredictor* predictor, int socketFD, void* buffer, int length)
+{
+    if (predictor == NULL)
+    {
+        return send(socketFD, buffer, length, 0);
+    }
 
-                    return 0;
-            }
-        }
+    // If the echo could not be reconciled, the output is still sent as it is
+    int sentLength;
+    const char* output = reconcileEcho(predictor, buffer, length, &sentLength);
+    if (output == NULL)
+    {
+        return send(socketFD, buffer, length, 0);
     }
 
-    return remaining;
+    return (sentLength == 0) ? 0 : send(socketFD, output, sentLength, 0);
 }
\ No newline at end of file
@@ -0,0 +1,373 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       dial.c
+
+Note:       Implementation of reaching sproxy over IPv6 or IPv4. See
+            dial.h
+*/
+#define _DEFAULT_SOURCE // Needed to use timeradd
+
+#include "dial.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/******************************************
+ * orderAddresses
+ *
+ * Arguments: Dialer* dialer, int* order
+ * Returns: void
+ *
+ * Writes the indexes of dialer's addresses
+ * in to order, in the order to try them:
+ * alternating between the families,
+ * starting with the one that last reached
+ * sproxy, or else the resolver's first
+ *****************************************/
+static void orderAddresses(Dialer* dialer, int* order)
+{
+    int firstFamily = dialer->addresses[0].address.ss_family;
+    for (int i = 0; i < dialer->addressCount; i++)
+    {
+        if (dialer->addresses[i].address.ss_family == dialer->lastFamily)
+        {
+            firstFamily = dialer->lastFamily;
+        }
+    }
+
+    // Each family's addresses keep the resolver's order, and one that runs out leaves the rest to the other
+    int next[2] = { 0, 0 }; // next of the first family, and of the other, to look at
+    int isFirstTurn = 1;
+    for (int count = 0; count < dialer->addressCount; isFirstTurn = !isFirstTurn)
+    {
+        int* position = &next[isFirstTurn ? 0 : 1];
+        while (*position < dialer->addressCount
+            && (dialer->addresses[*position].address.ss_family == firstFamily) != isFirstTurn)
+        {
+            (*position)++;
+        }
+        if (*position < dialer->addressCount)
+        {
+            order[count++] = (*position)++;
+        }
+    }
+}
+
+/******************************************
+ * startAttempt
+ *
+ * Arguments: const DialAddress* address,
+ *            int* isConnected
+ * Returns: int
+ *
+ * Starts a non-blocking connect to address,
+ * and sets isConnected to whether it
+ * completed at once
+ *
+ * Returns the socket, or -1 if it failed
+ *****************************************/
+static int startAttempt(const DialAddress* address, int* isConnected)
+{
+    char text[DIAL_TEXT_LEN];
+    describeAddress(&address->address, text);
+    logMessage(LOG_INFO, "Trying sproxy at %s\n", text);
+
+    *isConnected = 0;
+    int socketFD = socket(address->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socketFD < 0)
+    {
+        perror("Unable to create a socket to sproxy");
+        return -1;
+    }
+
+    if (connect(socketFD, (struct sockaddr*) &address->address, address->length) == 0)
+    {
+        *isConnected = 1;
+    }
+    else if (errno != EINPROGRESS)
+    {
+        logMessage(LOG_INFO, "Unable to connect to sproxy at %s\n", text);
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
+
+void initDialer(Dialer* dialer)
+{
+    dialer->addressCount = 0;
+    dialer->lastFamily = AF_UNSPEC;
+    dialer->current = -1;
+    dialer->isConfirmed = 0;
+}
+
+void setServerAddresses(Dialer* dialer, const DialAddress* addresses, int addressCount)
+{
+    // Over UDP the address in use keeps its place, confirmed or not, if sproxy still has it
+    int current = -1;
+    for (int i = 0; i < addressCount && dialer->current >= 0; i++)
+    {
+        const DialAddress* address = &dialer->addresses[dialer->current];
+        if (addresses[i].length == address->length && memcmp(&addresses[i].address, &address->address, address->length) == 0)
+        {
+            current = i;
+        }
+    }
+
+    memcpy(dialer->addresses, addresses, addressCount * sizeof(DialAddress));
+    dialer->addressCount = addressCount;
+    dialer->current = current;
+    dialer->isConfirmed = (current >= 0) ? dialer->isConfirmed : 0;
+}
+
+int dialServer(Dialer* dialer)
+{
+    int order[DIAL_ADDRESS_LEN];
+    int socketFDs[DIAL_ADDRESS_LEN];
+    orderAddresses(dialer, order);
+
+    struct timeval now, nextAttemptTime, deadline;
+    struct timeval attemptDelay = {
+        .tv_sec = 0,
+        .tv_usec = DIAL_ATTEMPT_DELAY_MS * 1000
+    };
+    struct timeval timeLimit = {
+        .tv_sec = DIAL_TIMEOUT_MS / 1000,
+        .tv_usec = (DIAL_TIMEOUT_MS % 1000) * 1000
+    };
+    gettimeofday(&now, NULL);
+    nextAttemptTime = now;
+    timeradd(&now, &timeLimit, &deadline);
+
+    int started = 0; // attempts started, in order
+    int pending = 0; // of those, still connecting
+    int winner = -1;
+    while (winner < 0 && timercmp(&now, &deadline, <))
+    {
+        // Start the next attempt once the last had its time alone, or failed
+        if (started < dialer->addressCount && !timercmp(&now, &nextAttemptTime, <))
+        {
+            int isConnected;
+            int attempt = started++;
+            socketFDs[attempt] = startAttempt(&dialer->addresses[order[attempt]], &isConnected);
+            if (isConnected != 0)
+            {
+                winner = attempt;
+                break;
+            }
+            if (socketFDs[attempt] >= 0)
+            {
+                pending++;
+                timeradd(&now, &attemptDelay, &nextAttemptTime);
+            }
+            continue;
+        }
+        if (pending == 0)
+        {
+            break;
+        }
+
+        // Wait for a connect to complete, the next attempt, or the deadline
+        fd_set socketSet;
+        FD_ZERO(&socketSet);
+        int maxFD = -1;
+        for (int i = 0; i < started; i++)
+        {
+            if (socketFDs[i] >= 0)
+            {
+                FD_SET(socketFDs[i], &socketSet);
+                maxFD = (socketFDs[i] > maxFD) ? socketFDs[i] : maxFD;
+            }
+        }
+        struct timeval wakeTime = deadline;
+        if (started < dialer->addressCount && timercmp(&nextAttemptTime, &wakeTime, <))
+        {
+            wakeTime = nextAttemptTime;
+        }
+        struct timeval timeout;
+        timersub(&wakeTime, &now, &timeout);
+        if (timeout.tv_sec < 0)
+        {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+        }
+
+        int resultOfSelect = select(maxFD + 1, NULL, &socketSet, NULL, &timeout);
+        if (resultOfSelect < 0 && errno != EINTR)
+        {
+            perror("Unable to wait for a connection to sproxy");
+            break;
+        }
+        gettimeofday(&now, NULL);
+
+        // A completed connect either won, or failed and lets the next attempt start now
+        for (int i = 0; resultOfSelect > 0 && i < started && winner < 0; i++)
+        {
+            if (socketFDs[i] < 0 || FD_ISSET(socketFDs[i], &socketSet) == 0)
+            {
+                continue;
+            }
+
+            int result;
+            socklen_t resultSize = sizeof(result);
+            if (getsockopt(socketFDs[i], SOL_SOCKET, SO_ERROR, &result, &resultSize) == 0 && result == 0)
+            {
+                winner = i;
+                continue;
+            }
+
+            char text[DIAL_TEXT_LEN];
+            describeAddress(&dialer->addresses[order[i]].address, text);
+            logMessage(LOG_INFO, "Unable to connect to sproxy at %s\n", text);
+            close(socketFDs[i]);
+            socketFDs[i] = -1;
+            pending--;
+            nextAttemptTime = now;
+        }
+    }
+
+    // Only the winner is kept
+    for (int i = 0; i < started; i++)
+    {
+        if (i != winner && socketFDs[i] >= 0)
+        {
+            close(socketFDs[i]);
+        }
+    }
+    if (winner < 0)
+    {
+        logMessage(LOG_WARNING, "Unable to reach sproxy at any of its %i addresses\n", dialer->addressCount);
+        return -1;
+    }
+
+    DialAddress* address = &dialer->addresses[order[winner]];
+    dialer->lastFamily = address->address.ss_family;
+    dialer->current = order[winner];
+    dialer->isConfirmed = 1;
+
+    char text[DIAL_TEXT_LEN];
+    describeAddress(&address->address, text);
+    logMessage(LOG_INFO, "Connected to sproxy at %s\n", text);
+    return socketFDs[winner];
+}
+
+const DialAddress* pickServerAddress(Dialer* dialer)
+{
+    int order[DIAL_ADDRESS_LEN];
+    orderAddresses(dialer, order);
+
+    // The next address in the order the race would take, after one sproxy never answered at
+    int position = 0;
+    if (dialer->current >= 0)
+    {
+        while (position < dialer->addressCount - 1 && order[position] != dialer->current)
+        {
+            position++;
+        }
+        position = (dialer->isConfirmed != 0) ? position : (position + 1) % dialer->addressCount;
+    }
+    dialer->current = order[position];
+    dialer->isConfirmed = 0;
+
+    char text[DIAL_TEXT_LEN];
+    describeAddress(&dialer->addresses[dialer->current].address, text);
+    logMessage(LOG_INFO, "Trying sproxy at %s\n", text);
+    return &dialer->addresses[dialer->current];
+}
+
+void confirmServerAddress(Dialer* dialer)
+{
+    if (dialer->current < 0 || dialer->isConfirmed != 0)
+    {
+        return;
+    }
+    dialer->isConfirmed = 1;
+    dialer->lastFamily = dialer->addresses[dialer->current].address.ss_family;
+
+    char text[DIAL_TEXT_LEN];
+    describeAddress(&dialer->addresses[dialer->current].address, text);
+    logMessage(LOG_INFO, "sproxy answered at %s\n", text);
+}
+
+void describeAddress(const struct sockaddr_storage* address, char* text)
+{
+    char host[INET6_ADDRSTRLEN] = "?";
+    if (address->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6* address6 = (const struct sockaddr_in6*) address;
+        inet_ntop(AF_INET6, &address6->sin6_addr, host, sizeof(host));
+        snprintf(text, DIAL_TEXT_LEN, "[%s]:%u", host, ntohs(address6->sin6_port));
+    }
+    else
+    {
+        const struct sockaddr_in* address4 = (const struct sockaddr_in*) address;
+        inet_ntop(AF_INET, &address4->sin_addr, host, sizeof(host));
+        snprintf(text, DIAL_TEXT_LEN, "%s:%u", host, ntohs(address4->sin_port));
+    }
+}
+
+int bindDualStack(int socketType, in_port_t port)
+{
+    // A host without IPv6 can still take IPv4
+    int isIPv6 = 1;
+    int socketFD = socket(AF_INET6, socketType, 0);
+    if (socketFD < 0 && errno == EAFNOSUPPORT)
+    {
+        isIPv6 = 0;
+        socketFD = socket(AF_INET, socketType, 0);
+    }
+    if (socketFD < 0)
+    {
+        perror("Unable to create a listen socket");
+        return -1;
+    }
+
+    // Allow a restarted proxy to bind the port again while old connections are in TIME_WAIT
+    int reuseAddress = 1;
+    if (setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)) < 0)
+    {
+        perror("Unable to set SO_REUSEADDR on a listen socket");
+    }
+
+    // IPv4 arrives on the IPv6 socket as mapped addresses, whatever the system's default is
+    int result;
+    if (isIPv6 != 0)
+    {
+        int isIPv6Only = 0;
+        if (setsockopt(socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &isIPv6Only, sizeof(isIPv6Only)) < 0)
+        {
+            perror("Unable to take IPv4 on a listen socket");
+        }
+        struct sockaddr_in6 address = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = in6addr_any,
+            .sin6_port = htons(port)
+        };
+        result = bind(socketFD, (struct sockaddr*) &address, sizeof(address));
+    }
+    else
+    {
+        struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = INADDR_ANY,
+            .sin_port = htons(port)
+        };
+        result = bind(socketFD, (struct sockaddr*) &address, sizeof(address));
+    }
+    if (result < 0)
+    {
+        perror("Unable to bind a listen socket to its port");
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
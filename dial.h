@@ -0,0 +1,155 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       dial.h
+
+Note:       Reaching sproxy over IPv6 or IPv4, whichever answers.
+
+            cproxy's sip may be an IPv4 or IPv6 address or a name, and
+            is resolved to every address it has, of either family, up to
+            DIAL_ADDRESS_LEN of them, a name on a thread of its own that
+            looks it up again once its answer expires (see resolve.h).
+            Many carriers are IPv6 first, some through NAT64 paths that
+            are slow or broken, and a network change can take either
+            family away, so no family is trusted to work: every
+            connection races them, the Happy Eyeballs way (RFC 8305).
+
+            The addresses are tried in turn, alternating between the
+            families, and starting with the family that last connected
+            (or the one the resolver put first). Each connect has
+            DIAL_ATTEMPT_DELAY_MS on its own before the next one starts
+            alongside it, or none once it fails, and the first to
+            complete wins and closes the others. So a working IPv6 path
+            is used as before, and a dead one costs a quarter of a
+            second rather than a connect timeout. DIAL_TIMEOUT_MS bounds
+            the whole race.
+
+            Over UDP nothing answers a connect, so the race is run by
+            the session instead: each connection goes to one address,
+            and once sproxy's Hello came back on it the address is kept
+            for the next connection. A connection that never heard from
+            sproxy moves the next one on to the next address.
+
+            Several paths (see multipath.h) are bound to IPv4 local
+            addresses, so with them only sproxy's IPv4 addresses are
+            used. The listen sockets of both proxies take IPv4 and IPv6
+            alike (see bindDualStack).
+*/
+#ifndef DIAL_H
+#define DIAL_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define DIAL_ADDRESS_LEN 8          // most of sproxy's addresses that are tried
+#define DIAL_ATTEMPT_DELAY_MS 250   // how long a connect waits alone before the next address is tried too
+#define DIAL_TIMEOUT_MS 10000       // how long a whole race may take
+#define DIAL_TEXT_LEN 64            // an address and port as text, with its terminating 0
+
+typedef struct {
+
+    struct sockaddr_storage address;
+    socklen_t length;
+
+} DialAddress;
+
+typedef struct {
+
+    DialAddress addresses[DIAL_ADDRESS_LEN];    // in the resolver's order
+    int addressCount;
+    int lastFamily;                             // family of the address that last reached sproxy, AF_UNSPEC for none
+    int current;                                // over UDP, the address in use, -1 for none yet
+    int isConfirmed;                            // over UDP, is true once sproxy answered on it
+
+} Dialer;
+
+/**************************************************
+ * initDialer
+ *
+ * Arguments: Dialer* dialer
+ * Returns: void
+ *
+ * Empties dialer, with no addresses
+ *************************************************/
+void initDialer(Dialer* dialer);
+
+/**************************************************
+ * setServerAddresses
+ *
+ * Arguments: Dialer* dialer,
+ *            const DialAddress* addresses,
+ *            int addressCount
+ * Returns: void
+ *
+ * Sets dialer's addresses to the first
+ * addressCount of addresses, keeping the one in
+ * use over UDP if it is still among them
+ *************************************************/
+void setServerAddresses(Dialer* dialer, const DialAddress* addresses, int addressCount);
+
+/**************************************************
+ * dialServer
+ *
+ * Arguments: Dialer* dialer
+ * Returns: int
+ *
+ * Races TCP connects to dialer's addresses, and
+ * waits for the first to complete
+ *
+ * Returns its non-blocking socket, or -1 if none
+ * did within DIAL_TIMEOUT_MS
+ *************************************************/
+int dialServer(Dialer* dialer);
+
+/**************************************************
+ * pickServerAddress
+ *
+ * Arguments: Dialer* dialer
+ * Returns: const DialAddress*
+ *
+ * Picks the address for the next connection over
+ * UDP: the last one, if sproxy answered there, or
+ * else the one after it
+ *
+ * Returns the address
+ *************************************************/
+const DialAddress* pickServerAddress(Dialer* dialer);
+
+/**************************************************
+ * confirmServerAddress
+ *
+ * Arguments: Dialer* dialer
+ * Returns: void
+ *
+ * Notes that sproxy answered at the address
+ * picked last, so it is kept
+ *************************************************/
+void confirmServerAddress(Dialer* dialer);
+
+/**************************************************
+ * describeAddress
+ *
+ * Arguments: const struct sockaddr_storage* address,
+ *            char* text
+ * Returns: void
+ *
+ * Writes address and its port as text in to text,
+ * which has room for DIAL_TEXT_LEN bytes
+ *************************************************/
+void describeAddress(const struct sockaddr_storage* address, char* text);
+
+/**************************************************
+ * bindDualStack
+ *
+ * Arguments: int socketType, in_port_t port
+ * Returns: int
+ *
+ * Opens a socket of socketType bound to port on
+ * every IPv6 and IPv4 address of this host, or
+ * only IPv4 ones if it has no IPv6, that a
+ * restarted proxy can bind again at once
+ *
+ * Returns the socket, or -1 on error
+ *************************************************/
+int bindDualStack(int socketType, in_port_t port);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       fec.c
+
+Note:       Implementation of forward error correction. See fec.h
+*/
+#include "fec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************
+ * xorBytes
+ *
+ * Arguments: unsigned char* target,
+ *            unsigned char* source, uint32_t length
+ * Returns: void
+ *
+ * XORs length bytes of source in to target
+ *****************************************/
+static void xorBytes(unsigned char* target, unsigned char* source, uint32_t length)
+{
+    for (uint32_t i = 0; i < length; i++)
+    {
+        target[i] ^= source[i];
+    }
+}
+
+/******************************************
+ * findSlot
+ *
+ * Arguments: FecSession* session, uint32_t seqN
+ * Returns: FecSlot*
+ *
+ * Returns the slot holding seqN, or NULL if
+ * it is not kept
+ *****************************************/
+static FecSlot* findSlot(FecSession* session, uint32_t seqN)
+{
+    FecSlot* slot = &session->slots[seqN & (FEC_WINDOW_LEN - 1)];
+    return (slot->isValid != 0 && slot->seqN == seqN) ? slot : NULL;
+}
+
+/******************************************
+ * keepSlot
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t seqN, uint32_t type,
+ *            void* payload, uint32_t length,
+ *            uint32_t ackN
+ * Returns: void
+ *
+ * Copies a packet in to its slot, unless it is
+ * further than half the window from ackN
+ *****************************************/
+static void keepSlot(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, uint32_t ackN)
+{
+    // Packets just behind ackN were handed on already, but may still be needed to rebuild others
+    if ((int32_t) (seqN - ackN) >= FEC_WINDOW_LEN / 2 || (int32_t) (ackN - seqN) > FEC_WINDOW_LEN / 2
+        || length > FEC_MAX_PAYLOAD_LEN)
+    {
+        return;
+    }
+
+    FecSlot* slot = &session->slots[seqN & (FEC_WINDOW_LEN - 1)];
+    slot->seqN = seqN;
+    slot->type = type;
+    slot->length = length;
+    slot->isValid = 1;
+    memcpy(slot->payload, payload, length);
+}
+
+FecSession* newFecSession()
+{
+    FecSession* session = malloc(sizeof(FecSession));
+    if (session == NULL)
+    {
+        perror("Unable to allocate space for FEC session");
+        exit(-1);
+    }
+
+    resetFecSession(session);
+
+    return session;
+}
+
+void deleteFecSession(FecSession* session)
+{
+    free(session);
+}
+
+void resetFecSession(FecSession* session)
+{
+    session->isEnabled = 0;
+
+    session->count = 0;
+    session->maxLength = 0;
+    setFecLoss(session, FEC_INITIAL_LOSS);
+
+    session->hasNewestSeqN = 0;
+    session->receivedCount = 0;
+    session->lostCount = 0;
+    session->lossPermille = FEC_INITIAL_LOSS;
+    for (int i = 0; i < FEC_WINDOW_LEN; i++)
+    {
+        session->slots[i].isValid = 0;
+    }
+}
+
+void setFecLoss(FecSession* session, uint32_t lossPermille)
+{
+    // A lost keystroke is only rebuilt if one of its parity copies arrives, so these keep it under
+    // 0.5% each way, or one round trip in 100 waiting for a heartbeat, up to 25% loss
+    if (lossPermille < 30)
+    {
+        session->parityCount = 1;
+    }
+    else if (lossPermille < 150)
+    {
+        session->parityCount = 2;
+    }
+    else
+    {
+        session->parityCount = FEC_MAX_PARITY_COUNT;
+    }
+
+    // A lost packet is only rebuilt if no other packet of its group is lost too
+    if (lossPermille < 5)
+    {
+        session->groupLength = 0;
+    }
+    else if (lossPermille < 20)
+    {
+        session->groupLength = FEC_MAX_GROUP_LEN;
+    }
+    else if (lossPermille < 50)
+    {
+        session->groupLength = 8;
+    }
+    else if (lossPermille < 100)
+    {
+        session->groupLength = 4;
+    }
+    else
+    {
+        session->groupLength = 2;
+    }
+}
+
+int addFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, int isShort)
+{
+    // The parity packet must fit in a payload too, so longer packets are left uncovered
+    if (session->isEnabled == 0 || session->groupLength == 0 || length > FEC_MAX_PAYLOAD_LEN - FEC_PARITY_HEADER_LEN)
+    {
+        session->count = 0;
+        return 0;
+    }
+
+    // Groups only cover consecutive seqNs of one type
+    if (session->count != 0 && (seqN != session->firstSeqN + session->count || type != session->type))
+    {
+        session->count = 0;
+    }
+
+    if (session->count == 0)
+    {
+        session->firstSeqN = seqN;
+        session->type = type;
+        session->maxLength = 0;
+        session->header.lengthXor = 0;
+    }
+
+    // Shorter payloads are padded with zeros, so only the parity up to the longest is kept
+    if (length > session->maxLength)
+    {
+        memset(session->parity + session->maxLength, 0, length - session->maxLength);
+        session->maxLength = length;
+    }
+
+    xorBytes(session->parity, payload, length);
+    session->header.lengthXor ^= (uint16_t) length;
+    session->count++;
+
+    // A lone short packet, a keystroke or its echo, means the sender caught up, so there is room for its
+    // parity more than once
+    if (isShort != 0)
+    {
+        return (session->count == 1) ? session->parityCount : 1;
+    }
+    return (session->count >= session->groupLength || session->count >= FEC_MAX_GROUP_LEN) ? 1 : 0;
+}
+
+void* takeFecParity(FecSession* session, uint32_t* seqN, uint32_t* type, uint32_t* length)
+{
+    session->header.count = (uint16_t) session->count;
+    memcpy(session->scratch, &session->header, FEC_PARITY_HEADER_LEN);
+    memcpy(session->scratch + FEC_PARITY_HEADER_LEN, session->parity, session->maxLength);
+
+    *seqN = session->firstSeqN;
+    *type = PACKET_TYPE_PARITY | session->type;
+    *length = FEC_PARITY_HEADER_LEN + session->maxLength;
+
+    session->count = 0;
+    return session->scratch;
+}
+
+void storeFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, uint32_t ackN)
+{
+    // Only seqNs past the newest received count towards the loss, and any skipped over are lost
+    if (session->hasNewestSeqN == 0)
+    {
+        session->hasNewestSeqN = 1;
+        session->newestSeqN = seqN;
+        session->receivedCount++;
+    }
+    else if ((int32_t) (seqN - session->newestSeqN) > 0)
+    {
+        session->lostCount += seqN - session->newestSeqN - 1;
+        session->newestSeqN = seqN;
+        session->receivedCount++;
+    }
+
+    if (findSlot(session, seqN) == NULL)
+    {
+        keepSlot(session, seqN, type, payload, length, ackN);
+    }
+}
+
+void countFecHeartbeat(FecSession* session, uint32_t seqN)
+{
+    // Every seqN before the heartbeat's was sent, so any past the newest received were lost
+    if (session->hasNewestSeqN != 0 && (int32_t) (seqN - 1 - session->newestSeqN) > 0)
+    {
+        session->lostCount += seqN - 1 - session->newestSeqN;
+        session->newestSeqN = seqN - 1;
+    }
+}
+
+int rebuildFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, uint32_t ackN)
+{
+    FecParityHeader header;
+    if (length < FEC_PARITY_HEADER_LEN)
+    {
+        return -1;
+    }
+    memcpy(&header, payload, FEC_PARITY_HEADER_LEN);
+
+    uint32_t parityLength = length - FEC_PARITY_HEADER_LEN;
+    if (header.count == 0 || header.count > FEC_MAX_GROUP_LEN || parityLength > FEC_MAX_PAYLOAD_LEN)
+    {
+        return -1;
+    }
+
+    // Find the one missing packet, if there is only one
+    uint32_t missingSeqN = 0;
+    int missingCount = 0;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        if (findSlot(session, seqN + i) == NULL)
+        {
+            missingSeqN = seqN + i;
+            missingCount++;
+        }
+    }
+    if (missingCount != 1 || (int32_t) (missingSeqN - ackN) < 0)
+    {
+        return 0;
+    }
+
+    // XOR out every packet that did arrive, leaving the missing one
+    unsigned char* rebuilt = (unsigned char*) payload + FEC_PARITY_HEADER_LEN;
+    uint16_t rebuiltLength = header.lengthXor;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        FecSlot* slot = findSlot(session, seqN + i);
+        if (slot == NULL)
+        {
+            continue;
+        }
+        if (slot->length > parityLength)
+        {
+            return -1;
+        }
+        xorBytes(rebuilt, slot->payload, slot->length);
+        rebuiltLength ^= (uint16_t) slot->length;
+    }
+    if (rebuiltLength > parityLength)
+    {
+        return -1;
+    }
+
+    // Older versions send parity without its group's type, as their groups only held plain data packets
+    uint32_t rebuiltType = (type != PACKET_TYPE_PARITY) ? type & ~PACKET_TYPE_PARITY : 1;
+    keepSlot(session, missingSeqN, rebuiltType, rebuilt, rebuiltLength, ackN);
+    return (findSlot(session, missingSeqN) != NULL) ? 1 : 0;
+}
+
+FecSlot* nextFecPacket(FecSession* session, uint32_t ackN)
+{
+    return findSlot(session, ackN);
+}
+
+uint32_t measureFecLoss(FecSession* session)
+{
+    uint32_t total = session->receivedCount + session->lostCount;
+    if (total != 0)
+    {
+        // Rise quickly, so parity catches up with a link that turned bad, and fall slowly, so one
+        // clean heartbeat between losses does not take it away again
+        uint32_t sample = session->lostCount * 1000 / total;
+        if (sample > session->lossPermille)
+        {
+            session->lossPermille = (session->lossPermille + sample + 1) / 2;
+        }
+        else
+        {
+            session->lossPermille = (session->lossPermille * 3 + sample) / 4;
+        }
+    }
+
+    session->receivedCount = 0;
+    session->lostCount = 0;
+    return session->lossPermille;
+}
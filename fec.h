@@ -0,0 +1,270 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       fec.h
+
+Note:       Forward error correction for data packets sent over UDP.
+
+            The sender XORs together the payloads of a group of data
+            packets with consecutive seqNs, and sends the result as a
+            parity packet whose seqN is the first of the group. If one
+            packet of a group is lost, the receiver rebuilds it from the
+            parity and the others, without waiting a heartbeat for the
+            retransmission. A group closes when it holds groupLength
+            packets, or as soon as a packet shorter than the largest
+            payload is sent, since that means the sender has caught up:
+            a lone keystroke gets a parity packet of its own straight
+            away, and is only lost if both are. As the sender has caught
+            up then, the link has room to spare, so on a lossier link
+            the parity of a group of one short packet is sent
+            parityCount times, and a keystroke is only lost if all of
+            its copies are.
+
+            The receiver counts the seqNs it never saw arrive, before any
+            rebuilding, whether a later data packet or a heartbeat skips
+            over them, and reports that loss in its Hello. The sender
+            picks groupLength and parityCount from the report: no parity
+            on a clean link, and more parity the more is lost. The loss
+            reported rises halfway to a higher measurement at each
+            heartbeat but falls only a quarter of the way to a lower
+            one, so parity catches up with a link that turns bad within
+            a few heartbeats. Until the first reports arrive,
+            FEC_INITIAL_LOSS is assumed, so the start of a connection
+            over a lossy link is covered too.
+
+            To rebuild packets, the receiver keeps the last
+            FEC_WINDOW_LEN data packets, including ones that arrive
+            ahead of ackN, which are then handed on in order once the
+            gap before them is filled, instead of being discarded.
+
+            A group only holds packets of one type, and its parity packet
+            is sent with that type as well as PACKET_TYPE_PARITY, so a
+            rebuilt packet gets its type back, and a forwarded stream's
+            packet (see stream.h) is never rebuilt as the client's data.
+            Older versions send PACKET_TYPE_PARITY alone, for groups of
+            plain data packets.
+
+            A parity payload is a FecParityHeader followed by the XOR of
+            the group's payloads, each padded with zeros to the longest.
+            Only payloads of up to FEC_MAX_PAYLOAD_LEN -
+            FEC_PARITY_HEADER_LEN bytes are covered, so the parity fits in
+            a payload too, and a side that wants FEC offers that as the
+            largest payload it can read.
+*/
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+
+#define FEC_WINDOW_LEN 64         // data packets the receiver keeps, must be a power of 2
+#define FEC_MAX_PAYLOAD_LEN 1024  // largest data packet payload, at least BUFFER_LEN
+#define FEC_MAX_GROUP_LEN 16      // most data packets covered by one parity packet
+#define FEC_MAX_PARITY_COUNT 3    // most times the parity of a group of one short packet is sent
+#define FEC_INITIAL_LOSS 50       // loss assumed, in 1/1000ths, until it is measured
+
+#define PACKET_TYPE_PARITY 0x10   // payload is the parity of a group of data packets
+
+typedef struct {
+
+    uint16_t count;         // data packets in the group
+    uint16_t lengthXor;     // XOR of their payload lengths
+
+} FecParityHeader;
+
+#define FEC_PARITY_HEADER_LEN sizeof(FecParityHeader)
+
+typedef struct {
+
+    uint32_t seqN;
+    uint32_t type;
+    uint32_t length;
+    int32_t isValid;
+    unsigned char payload[FEC_MAX_PAYLOAD_LEN];
+
+} FecSlot;
+
+typedef struct {
+
+    int32_t isEnabled;      // !0 if both sides agreed to FEC
+
+    // Sending
+    uint32_t groupLength;   // data packets per parity packet, 0 to send no parity
+    uint32_t parityCount;   // times the parity of a group of one short packet is sent
+    uint32_t firstSeqN;     // seqN of the first packet of the open group
+    uint32_t type;          // type of the packets in the open group
+    uint32_t count;         // packets in the open group
+    uint32_t maxLength;     // longest payload in the open group
+    FecParityHeader header;
+    unsigned char parity[FEC_MAX_PAYLOAD_LEN];
+    unsigned char scratch[FEC_PARITY_HEADER_LEN + FEC_MAX_PAYLOAD_LEN];
+
+    // Receiving
+    int32_t hasNewestSeqN;  // !0 once a data packet was received
+    uint32_t newestSeqN;    // highest seqN received
+    uint32_t receivedCount; // new seqNs received since the last report
+    uint32_t lostCount;     // seqNs skipped over since the last report
+    uint32_t lossPermille;  // smoothed loss, in 1/1000ths
+    FecSlot slots[FEC_WINDOW_LEN];
+
+} FecSession;
+
+/******************************************
+ * newFecSession
+ *
+ * Arguments: none
+ * Returns: FecSession*
+ *
+ * Allocates a new, disabled FecSession
+ *****************************************/
+FecSession* newFecSession();
+
+/******************************************
+ * deleteFecSession
+ *
+ * Arguments: FecSession* session
+ * Returns: void
+ *
+ * Frees the memory allocated for the session
+ *****************************************/
+void deleteFecSession(FecSession* session);
+
+/******************************************
+ * resetFecSession
+ *
+ * Arguments: FecSession* session
+ * Returns: void
+ *
+ * Disables FEC and forgets every packet and
+ * measurement, for the start of a new
+ * connection
+ *****************************************/
+void resetFecSession(FecSession* session);
+
+/******************************************
+ * setFecLoss
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t lossPermille
+ * Returns: void
+ *
+ * Picks how many data packets each parity
+ * packet covers, and how many times a lone
+ * short packet's parity is sent, from the
+ * loss the peer reported
+ *****************************************/
+void setFecLoss(FecSession* session, uint32_t lossPermille);
+
+/******************************************
+ * addFecPacket
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t seqN, uint32_t type,
+ *            void* payload, uint32_t length,
+ *            int isShort
+ * Returns: int
+ *
+ * Adds a data packet that was just sent for
+ * the first time to the open group, or to a
+ * new one if it is of another type. isShort
+ * should be !0 if the packet did not fill the
+ * largest payload
+ *
+ * Returns how many times the parity of the
+ * group should be sent now, taken with
+ * takeFecParity, if it is closed, or 0 if not
+ *****************************************/
+int addFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, int isShort);
+
+/******************************************
+ * takeFecParity
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t* seqN, uint32_t* type,
+ *            uint32_t* length
+ * Returns: void*
+ *
+ * Builds the parity packet of the closed
+ * group, and starts a new group. The payload
+ * stays as it is until the next call, so it
+ * can be sent more than once
+ *
+ * Returns the payload, in the session's
+ * scratch buffer, and sets seqN, type and
+ * length for the packet
+ *****************************************/
+void* takeFecParity(FecSession* session, uint32_t* seqN, uint32_t* type, uint32_t* length);
+
+/******************************************
+ * storeFecPacket
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t seqN, uint32_t type,
+ *            void* payload, uint32_t length,
+ *            uint32_t ackN
+ * Returns: void
+ *
+ * Keeps a data packet that was just read, and
+ * counts any seqNs it skipped over as lost.
+ * Packets too far from ackN are not kept
+ *****************************************/
+void storeFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, uint32_t ackN);
+
+/******************************************
+ * countFecHeartbeat
+ *
+ * Arguments: FecSession* session, uint32_t seqN
+ * Returns: void
+ *
+ * Counts the data packets a heartbeat with
+ * seqN says were sent, but that have not
+ * arrived, as lost. A lone keystroke is
+ * retransmitted before anything follows it,
+ * so this is the only way its loss is seen
+ *****************************************/
+void countFecHeartbeat(FecSession* session, uint32_t seqN);
+
+/******************************************
+ * rebuildFecPacket
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t seqN, uint32_t type,
+ *            void* payload, uint32_t length,
+ *            uint32_t ackN
+ * Returns: int
+ *
+ * Reads a parity packet of the given type, and if exactly one
+ * packet of its group at or after ackN is
+ * missing, rebuilds and keeps it
+ *
+ * Returns 1 if a packet was rebuilt, 0 if not,
+ * or -1 if the parity packet is not valid
+ *****************************************/
+int rebuildFecPacket(FecSession* session, uint32_t seqN, uint32_t type, void* payload, uint32_t length, uint32_t ackN);
+
+/******************************************
+ * nextFecPacket
+ *
+ * Arguments: FecSession* session,
+ *            uint32_t ackN
+ * Returns: FecSlot*
+ *
+ * Returns the kept packet with seqN ackN, so
+ * it can be handed on, or NULL if it has not
+ * arrived
+ *****************************************/
+FecSlot* nextFecPacket(FecSession* session, uint32_t ackN);
+
+/******************************************
+ * measureFecLoss
+ *
+ * Arguments: FecSession* session
+ * Returns: uint32_t
+ *
+ * Folds the packets counted since the last
+ * call in to the smoothed loss, once per
+ * heartbeat
+ *
+ * Returns the loss to report, in 1/1000ths
+ *****************************************/
+uint32_t measureFecLoss(FecSession* session);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       frame.c
+
+Note:       Implementation of the wire frame formats. See frame.h
+*/
+#include "frame.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "log.h"
+
+#define FRAME_V1_HEADER_LEN (4*sizeof(uint32_t))
+
+/******************************************
+ * zigzag / unzigzag
+ *
+ * Arguments: uint32_t value
+ * Returns: uint32_t
+ *
+ * Maps the difference between two sequence
+ * numbers to an unsigned value that is small
+ * when the difference is small either way:
+ * 0, -1, 1, -2, 2 become 0, 1, 2, 3, 4
+ *****************************************/
+static inline uint32_t zigzag(uint32_t value)
+{
+    return (value << 1) ^ (uint32_t) ((int32_t) value >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ -(value & 1);
+}
+
+/******************************************
+ * writeVarint
+ *
+ * Arguments: unsigned char* out,
+ *            uint32_t value
+ * Returns: int
+ *
+ * Writes value as a prefix varint
+ *
+ * Returns the number of bytes written
+ *****************************************/
+static inline int writeVarint(unsigned char* out, uint32_t value)
+{
+    if (value < (1u << 7))
+    {
+        out[0] = value;
+        return 1;
+    }
+    if (value < (1u << 14))
+    {
+        out[0] = 0x80 | (value >> 8);
+        out[1] = value;
+        return 2;
+    }
+    if (value < (1u << 21))
+    {
+        out[0] = 0xc0 | (value >> 16);
+        out[1] = value >> 8;
+        out[2] = value;
+        return 3;
+    }
+    if (value < (1u << 28))
+    {
+        out[0] = 0xe0 | (value >> 24);
+        out[1] = value >> 16;
+        out[2] = value >> 8;
+        out[3] = value;
+        return 4;
+    }
+
+    out[0] = 0xf0;
+    out[1] = value >> 24;
+    out[2] = value >> 16;
+    out[3] = value >> 8;
+    out[4] = value;
+    return 5;
+}
+
+/******************************************
+ * readVarint
+ *
+ * Arguments: unsigned char* in,
+ *            unsigned char* end,
+ *            uint32_t* value
+ * Returns: int
+ *
+ * Reads a prefix varint that starts at in
+ *
+ * Returns the number of bytes read, 0 if the
+ * varint continues past end, or -1 if it is
+ * longer than 5 bytes
+ *****************************************/
+static inline int readVarint(unsigned char* in, unsigned char* end, uint32_t* value)
+{
+    if (in >= end)
+    {
+        return 0;
+    }
+
+    // The leading 1 bits count the bytes that follow
+    int extra = __builtin_clz(~((uint32_t) in[0] << 24));
+    if (extra > 4)
+    {
+        return -1;
+    }
+    if (end - in <= extra)
+    {
+        return 0;
+    }
+
+    uint32_t result = in[0] & (0x7f >> extra);
+    for (int i = 1; i <= extra; i++)
+    {
+        result = (result << 8) | in[i];
+    }
+
+    *value = result;
+    return extra + 1;
+}
+
+void resetFrameWriter(FrameWriter* writer)
+{
+    writer->isCompact = 0;
+    writer->isExtended = 0;
+    writer->seqN = 0;
+    writer->ackN = 0;
+}
+
+int writeFrame(FrameWriter* writer, FrameCipher* cipher, void* buffer, uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length, void* payload)
+{
+    unsigned char* out = buffer;
+
+    // An encrypted frame's length counts the tag, and the frame count if it is sent
+    int isEncrypted = (cipher != NULL && cipher->isKeyed != 0);
+    int seqLength = (isEncrypted && cipher->isDatagram != 0) ? CIPHER_SEQ_LEN : 0;
+    uint32_t sealedLength = length;
+    if (isEncrypted)
+    {
+        type |= PACKET_TYPE_ENCRYPTED;
+        sealedLength += seqLength + CIPHER_TAG_LEN;
+    }
+
+    // Nothing before this frame is sure to arrive with it
+    if (writer->isDatagram != 0)
+    {
+        writer->seqN = 0;
+        writer->ackN = 0;
+    }
+
+    int isExtended = (type & ~FRAME_TYPE_MASK) != 0;
+    if (writer->isCompact != 0 && (isExtended == 0 || writer->isExtended != 0))
+    {
+        unsigned char* flags = out++;
+        *flags = FRAME_FLAG_COMPACT | (type & FRAME_TYPE_MASK);
+        if (isExtended != 0)
+        {
+            *flags |= FRAME_FLAG_EXTENDED_TYPE;
+            out += writeVarint(out, type >> FRAME_TYPE_SHIFT);
+        }
+
+        out += writeVarint(out, zigzag(seqN - writer->seqN));
+        if (ackN == writer->ackN)
+        {
+            *flags |= FRAME_FLAG_SAME_ACK;
+        }
+        else
+        {
+            out += writeVarint(out, zigzag(ackN - writer->ackN));
+        }
+        out += writeVarint(out, sealedLength);
+    }
+
+    // Otherwise write version 1, as also when the version 2 header came out longer (the buffer's tag room holds it)
+    if (out == buffer || out - (unsigned char*) buffer > FRAME_MAX_HEADER_LEN)
+    {
+        out = buffer;
+        uint32_t fields[4] = { type, seqN, ackN, sealedLength };
+        memcpy(out, fields, FRAME_V1_HEADER_LEN);
+        out += FRAME_V1_HEADER_LEN;
+    }
+
+    int headerLength = out - (unsigned char*) buffer;
+    memcpy(out + seqLength, payload, length);
+
+    // Version 1 frames move the reference point too, so both ends always agree on it
+    writer->seqN = seqN;
+    writer->ackN = ackN;
+
+    if (isEncrypted)
+    {
+        return sealFrame(cipher, buffer, headerLength, length);
+    }
+
+    return headerLength + length;
+}
+
+void resetFrameReader(FrameReader* reader)
+{
+    reader->seqN = 0;
+    reader->ackN = 0;
+    reader->start = 0;
+    reader->end = 0;
+    reader->fromAddressLength = 0;
+}
+
+int receiveFrames(FrameReader* reader, int socketFD)
+{
+    // A datagram stands alone, so drop what is left of the last one
+    if (reader->isDatagram != 0)
+    {
+        reader->seqN = 0;
+        reader->ackN = 0;
+        reader->start = 0;
+        reader->end = 0;
+    }
+
+    // Move a partly read frame to the front, to make room after it
+    if (reader->start > 0)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    reader->fromAddressLength = sizeof(reader->fromAddress);
+    int bytesRead = recvfrom(socketFD, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end, 0,
+        (struct sockaddr*) &reader->fromAddress, &reader->fromAddressLength);
+    if (bytesRead > 0)
+    {
+        reader->end += bytesRead;
+    }
+
+    return bytesRead;
+}
+
+int readFrame(FrameReader* reader, FrameCipher* cipher, uint32_t* type, uint32_t* seqN, uint32_t* ackN, uint32_t* length, void* payload, int capacity)
+{
+    unsigned char* frame = reader->buffer + reader->start;
+    unsigned char* in = frame;
+    unsigned char* end = reader->buffer + reader->end;
+    uint32_t frameType, frameSeqN, frameAckN, frameLength;
+
+    if (in >= end)
+    {
+        return 0;
+    }
+
+    if ((in[0] & FRAME_FLAG_COMPACT) == 0)
+    {
+        if (end - in < (int) FRAME_V1_HEADER_LEN)
+        {
+            return 0;
+        }
+
+        uint32_t fields[4];
+        memcpy(fields, in, FRAME_V1_HEADER_LEN);
+        in += FRAME_V1_HEADER_LEN;
+
+        frameType = fields[0];
+        frameSeqN = fields[1];
+        frameAckN = fields[2];
+        frameLength = fields[3];
+    }
+    else
+    {
+        int flags = *in++;
+        frameType = flags & FRAME_TYPE_MASK;
+
+        int n;
+        if ((flags & FRAME_FLAG_EXTENDED_TYPE) != 0)
+        {
+            uint32_t highType;
+            n = readVarint(in, end, &highType);
+            if (n <= 0)
+            {
+                return n;
+            }
+            if (highType == 0 || highType >= (1u << (32 - FRAME_TYPE_SHIFT)))
+            {
+                logMessage(LOG_DEBUG, "Frame has an invalid extended type: 0x%x\n", highType);
+                return -1;
+            }
+            in += n;
+            frameType |= highType << FRAME_TYPE_SHIFT;
+        }
+
+        uint32_t delta;
+        n = readVarint(in, end, &delta);
+        if (n <= 0)
+        {
+            return n;
+        }
+        in += n;
+        frameSeqN = reader->seqN + unzigzag(delta);
+
+        frameAckN = reader->ackN;
+        if ((flags & FRAME_FLAG_SAME_ACK) == 0)
+        {
+            n = readVarint(in, end, &delta);
+            if (n <= 0)
+            {
+                return n;
+            }
+            in += n;
+            frameAckN += unzigzag(delta);
+        }
+
+        n = readVarint(in, end, &frameLength);
+        if (n <= 0)
+        {
+            return n;
+        }
+        in += n;
+    }
+
+    int isEncrypted = (frameType & PACKET_TYPE_ENCRYPTED) != 0;
+    if (frameLength > (uint32_t) capacity + (isEncrypted ? CIPHER_SEQ_LEN + CIPHER_TAG_LEN : 0))
+    {
+        logMessage(LOG_DEBUG, "Frame payload of %u bytes is too long\n", frameLength);
+        return -1;
+    }
+    if ((uint32_t) (end - in) < frameLength)
+    {
+        return 0;
+    }
+    reader->start = in + frameLength - reader->buffer;
+
+    if (isEncrypted)
+    {
+        if (cipher == NULL || cipher->isKeyed == 0)
+        {
+            logMessage(LOG_DEBUG, "Encrypted frame received without a key\n");
+            return -1;
+        }
+
+        // Decrypt in place in the reader's buffer, the payload follows the frame count if one was sent
+        int plainLength = openFrame(cipher, frame, in - frame, frameLength);
+        if (plainLength < 0 || plainLength > capacity)
+        {
+            return -1;
+        }
+        in += frameLength - plainLength - CIPHER_TAG_LEN;
+        frameLength = plainLength;
+        frameType &= ~PACKET_TYPE_ENCRYPTED;
+    }
+    else if (cipher != NULL && cipher->isRequired != 0 && (frameType != 0 || cipher->rx.counter != 0))
+    {
+        logMessage(LOG_DEBUG, "Plaintext frame received when encryption is required\n");
+        return -1;
+    }
+
+    memcpy(payload, in, frameLength);
+    reader->seqN = frameSeqN;
+    reader->ackN = frameAckN;
+
+    *type = frameType;
+    *seqN = frameSeqN;
+    *ackN = frameAckN;
+    *length = frameLength;
+    return 1;
+}
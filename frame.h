@@ -0,0 +1,192 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       frame.h
+
+Note:       Encoding and decoding of packets on the wire.
+
+            Version 1 frames are the original format: type, seqN, ackN
+            and length as four host order uint32_t, then the payload.
+            That is 16 bytes of header on packets that often carry a
+            single keystroke.
+
+            Version 2 frames start with a flags byte:
+
+                0x80    always set, marks a version 2 frame
+                0x40    ackN is the same as in the previous frame, and
+                        is left out
+                0x20    the packet type has bits above 0x1f, which
+                        follow as a varint of type >> 5
+                0x1f    low bits of the packet type (data,
+                        compressed, compress reset, encrypted, parity)
+
+            followed by the rest of the type if 0x20 is set (a stream or
+            probe packet, see stream.h and multipath.h), then seqN and
+            ackN as the difference from the previous frame read from (or
+            written to) the same connection, zigzag encoded so small
+            steps back stay small, then the
+            payload length, then the payload. A keystroke costs 3 or 4
+            bytes of header instead of 16.
+
+            The numbers are prefix varints in network byte order: the
+            count of leading 1 bits in the first byte is the count of
+            bytes that follow (0 to 4), and the rest of the bits are the
+            value, most significant first. The length of every field is
+            known from its first byte, so decoding never tests a
+            continuation bit per byte. A header is at most as long as a
+            version 1 header, and in the rare case the rest of the type
+            would make it longer, the frame is written in version 1.
+
+            The first byte of a version 1 frame is a byte of a small
+            type value, so it never has 0x80 set. Every frame therefore
+            says which version it is, and a reader accepts both. A writer
+            only uses version 2 once the peer has said it can read it,
+            and only sets 0x20, which older readers reject, once the peer
+            has said it can read that too (see hello.h).
+
+            Once a connection's FrameCipher is keyed, writeFrame encrypts
+            every frame in place and readFrame decrypts it (see cipher.h).
+
+            Over UDP (isDatagram set) every datagram holds whole frames
+            and is decoded on its own, since the one before it may have
+            been lost: the seqN and ackN differences start from 0 in each
+            datagram, and a partial frame at the end of one is dropped.
+            A frame of FRAME_MAX_OVERHEAD + BUFFER_LEN bytes fits in
+            FRAME_DATAGRAM_LEN, which stays under the path MTU of any
+            IPv4 or IPv6 link without fragmenting.
+*/
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "cipher.h"
+
+#define FRAME_MAX_HEADER_LEN 16 // Longest header of either version
+#define FRAME_MAX_OVERHEAD (FRAME_MAX_HEADER_LEN + CIPHER_SEQ_LEN + CIPHER_TAG_LEN) // Bytes a frame adds to its payload
+#define FRAME_READER_LEN 4096   // Must hold a whole frame, header and payload
+#define FRAME_DATAGRAM_LEN 1200 // Largest datagram sent over UDP
+
+#define FRAME_FLAG_COMPACT 0x80  // version 2 frame
+#define FRAME_FLAG_SAME_ACK 0x40 // ackN is not sent, it did not change
+#define FRAME_FLAG_EXTENDED_TYPE 0x20 // the rest of the type follows the flags
+#define FRAME_TYPE_MASK 0x1f     // low bits of the type, in the flags
+#define FRAME_TYPE_SHIFT 5       // the rest of the type is sent shifted right by this
+
+typedef struct {
+
+    int32_t isCompact;  // !0 if version 2 frames may be written
+    int32_t isExtended; // !0 if version 2 frames may carry types above FRAME_TYPE_MASK
+    int32_t isDatagram; // !0 if every frame is sent in a datagram of its own
+    uint32_t seqN;      // seqN of the previous frame written
+    uint32_t ackN;      // ackN of the previous frame written
+
+} FrameWriter;
+
+typedef struct {
+
+    int32_t isDatagram; // !0 if each receiveFrames reads one datagram of whole frames
+    uint32_t seqN;      // seqN of the previous frame read
+    uint32_t ackN;      // ackN of the previous frame read
+    int32_t start;      // first byte in buffer not yet decoded
+    int32_t end;        // first free byte in buffer
+    struct sockaddr_storage fromAddress; // where the last datagram came from
+    socklen_t fromAddressLength;         // 0 on a stream socket
+    unsigned char buffer[FRAME_READER_LEN];
+
+} FrameReader;
+
+/**************************************************
+ * resetFrameWriter
+ *
+ * Arguments: FrameWriter* writer
+ * Returns: void
+ *
+ * Prepares writer for a new connection, which
+ * starts out with version 1 frames. isDatagram
+ * is left as it was
+ *************************************************/
+void resetFrameWriter(FrameWriter* writer);
+
+/**************************************************
+ * writeFrame
+ *
+ * Arguments: FrameWriter* writer,
+ *            FrameCipher* cipher, void* buffer,
+ *            uint32_t type, uint32_t seqN,
+ *            uint32_t ackN, uint32_t length,
+ *            void* payload
+ * Returns: int
+ *
+ * Encodes a packet in to buffer, which must have
+ * room for FRAME_MAX_OVERHEAD + length bytes, and
+ * encrypts it if cipher is keyed. cipher may be
+ * NULL. Types that do not fit in FRAME_TYPE_MASK
+ * are written as version 1 frames unless
+ * isExtended is set
+ *
+ * Returns the number of bytes now stored in
+ * buffer, or -1 if it could not be encrypted
+ *************************************************/
+int writeFrame(FrameWriter* writer, FrameCipher* cipher, void* buffer, uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length, void* payload);
+
+/**************************************************
+ * resetFrameReader
+ *
+ * Arguments: FrameReader* reader
+ * Returns: void
+ *
+ * Prepares reader for a new connection, dropping
+ * any bytes still buffered. isDatagram is left as
+ * it was
+ *************************************************/
+void resetFrameReader(FrameReader* reader);
+
+/**************************************************
+ * receiveFrames
+ *
+ * Arguments: FrameReader* reader, int socketFD
+ * Returns: int
+ *
+ * Reads as many bytes as are available from
+ * socketFD in to the reader's buffer, after any
+ * partly read frame. On a datagram reader, reads
+ * the next datagram in place of whatever is left,
+ * and records its source in fromAddress
+ *
+ * Returns the result of recvfrom()
+ *************************************************/
+int receiveFrames(FrameReader* reader, int socketFD);
+
+/**************************************************
+ * readFrame
+ *
+ * Arguments: FrameReader* reader,
+ *            FrameCipher* cipher, uint32_t* type,
+ *            uint32_t* seqN, uint32_t* ackN,
+ *            uint32_t* length, void* payload,
+ *            int capacity
+ * Returns: int
+ *
+ * Decodes the next whole frame in the reader's
+ * buffer, copying its payload in to payload,
+ * which must have room for capacity bytes.
+ * capacity must not be more than
+ * FRAME_READER_LEN - FRAME_MAX_OVERHEAD
+ *
+ * Encrypted frames are decrypted with cipher,
+ * which may be NULL if no key is loaded, and
+ * PACKET_TYPE_ENCRYPTED is cleared from type.
+ * When cipher requires encryption, a plaintext
+ * frame is an error unless it is a heartbeat
+ * that came before the peer's first encrypted
+ * frame
+ *
+ * Returns 1 if a frame was read, 0 if the rest of
+ * the frame has not arrived yet, or -1 if the
+ * bytes are not a valid frame, after which the
+ * connection can not be read any further
+ *************************************************/
+int readFrame(FrameReader* reader, FrameCipher* cipher, uint32_t* type, uint32_t* seqN, uint32_t* ackN, uint32_t* length, void* payload, int capacity);
+
+#endif
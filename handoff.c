@@ -0,0 +1,387 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       handoff.c
+
+Note:       Implementation of the socket handoff used for hot restarts.
+            See handoff.h
+*/
+#define _GNU_SOURCE // Needed to use struct ucred
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**************************************************
+ * fillAddress
+ *
+ * Arguments: struct sockaddr_un* address,
+ *            const char* path
+ * Returns: int
+ *
+ * Fills in a Unix socket address for path
+ *
+ * Returns -1 if path is too long, 0 otherwise
+ *************************************************/
+static int fillAddress(struct sockaddr_un* address, const char* path)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        printf("Upgrade socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+
+    return 0;
+}
+
+/**************************************************
+ * sendAll / receiveAll
+ *
+ * Arguments: int socketFD, void* buffer,
+ *            size_t length
+ * Returns: int
+ *
+ * Loops over send()/recv() until all length bytes
+ * are transferred
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+static int sendAll(int socketFD, void* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t bytesSent = send(socketFD, buffer, length, MSG_NOSIGNAL); // a new process that died is an error, not SIGPIPE
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer = (char*) buffer + bytesSent;
+        length -= bytesSent;
+    }
+
+    return 0;
+}
+
+static int receiveAll(int socketFD, void* buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t bytesRead = recv(socketFD, buffer, length, 0);
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead <= 0)
+        {
+            return -1;
+        }
+        buffer = (char*) buffer + bytesRead;
+        length -= bytesRead;
+    }
+
+    return 0;
+}
+
+/**************************************************
+ * isSameUser
+ *
+ * Arguments: int socketFD
+ * Returns: int
+ *
+ * Returns !0 if the process at the other end of
+ * the Unix socket runs as this process's user
+ *************************************************/
+static int isSameUser(int socketFD)
+{
+    struct ucred credentials;
+    socklen_t credentialsLength = sizeof(credentials);
+    if (getsockopt(socketFD, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLength) < 0)
+    {
+        perror("Unable to get the credentials of the process on the upgrade socket");
+        return 0;
+    }
+
+    return credentials.uid == geteuid();
+}
+
+/**************************************************
+ * receiveByte
+ *
+ * Arguments: int socketFD, int timeoutMs
+ * Returns: int
+ *
+ * Waits up to timeoutMs for one byte
+ *
+ * Returns the byte, or -1 on error, end of file or
+ * timeout
+ *************************************************/
+static int receiveByte(int socketFD, int timeoutMs)
+{
+    struct timeval timeout = {
+        .tv_sec = timeoutMs / 1000,
+        .tv_usec = (timeoutMs % 1000) * 1000
+    };
+    fd_set socketSet;
+    FD_ZERO(&socketSet);
+    FD_SET(socketFD, &socketSet);
+    if (select(socketFD + 1, &socketSet, NULL, NULL, &timeout) <= 0)
+    {
+        return -1;
+    }
+
+    unsigned char byte;
+    if (recv(socketFD, &byte, 1, 0) != 1)
+    {
+        return -1;
+    }
+
+    return byte;
+}
+
+int openUpgradeSocket(const char* path)
+{
+    struct sockaddr_un address;
+    if (fillAddress(&address, path) < 0)
+    {
+        return -1;
+    }
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0) // socket returns -1 on error
+    {
+        perror("Unable to create upgrade socket");
+        return -1;
+    }
+
+    // A previous process may have left its socket file behind
+    unlink(path);
+
+    if (bind(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        perror("Unable to bind upgrade socket");
+        close(socketFD);
+        return -1;
+    }
+
+    // Before listen(), so no other user connects in between
+    if (chmod(path, S_IRUSR | S_IWUSR) < 0)
+    {
+        perror("Unable to restrict the upgrade socket to its owner");
+        close(socketFD);
+        unlink(path);
+        return -1;
+    }
+
+    if (listen(socketFD, 1) < 0)
+    {
+        perror("Unable to listen on upgrade socket");
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
+
+int connectUpgradeSocket(const char* path)
+{
+    struct sockaddr_un address;
+    if (fillAddress(&address, path) < 0)
+    {
+        return -1;
+    }
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0) // socket returns -1 on error
+    {
+        perror("Unable to create upgrade socket");
+        return -1;
+    }
+
+    // Failing to connect just means there is no old process to take over from
+    if (connect(socketFD, (struct sockaddr*) &address, sizeof(address)) < 0)
+    {
+        close(socketFD);
+        return -1;
+    }
+
+    if (isSameUser(socketFD) == 0)
+    {
+        printf("Upgrade socket %s belongs to a process of another user\n", path);
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
+
+int acceptUpgradeSocket(int listenFD)
+{
+    int socketFD = accept(listenFD, NULL, NULL);
+    if (socketFD < 0) // accept returns -1 on error
+    {
+        perror("Unable to accept a new process on the upgrade socket");
+        return -1;
+    }
+
+    if (isSameUser(socketFD) == 0)
+    {
+        logMessage(LOG_WARNING, "Refused a process of another user on the upgrade socket\n");
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
+
+int sendHandoff(int socketFD, int* fds, int fdCount, void* data, size_t length)
+{
+    if (fdCount > HANDOFF_MAX_FDS)
+    {
+        printf("Too many file descriptors to hand off: %i\n", fdCount);
+        return -1;
+    }
+
+    // The length prefix carries the descriptors, so they arrive with the first byte
+    uint64_t dataLength = length;
+    struct iovec iov = {
+        .iov_base = &dataLength,
+        .iov_len = sizeof(dataLength)
+    };
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    if (fdCount > 0)
+    {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+    }
+
+    if (sendmsg(socketFD, &message, MSG_NOSIGNAL) != sizeof(dataLength))
+    {
+        perror("Unable to send handoff header");
+        return -1;
+    }
+
+    if (sendAll(socketFD, data, length) < 0)
+    {
+        perror("Unable to send handoff state");
+        return -1;
+    }
+
+    return 0;
+}
+
+int receiveHandoff(int socketFD, int* fds, int* fdCount, void** data, size_t* length)
+{
+    uint64_t dataLength;
+    struct iovec iov = {
+        .iov_base = &dataLength,
+        .iov_len = sizeof(dataLength)
+    };
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    if (recvmsg(socketFD, &message, MSG_WAITALL) != sizeof(dataLength))
+    {
+        perror("Unable to receive handoff header");
+        return -1;
+    }
+
+    // Collect the descriptors
+    *fdCount = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *fdCount * sizeof(int));
+        }
+    }
+
+    *data = malloc(dataLength > 0 ? dataLength : 1);
+    if (*data == NULL)
+    {
+        perror("Unable to allocate space for handoff state");
+        return -1;
+    }
+
+    if (receiveAll(socketFD, *data, dataLength) < 0)
+    {
+        perror("Unable to receive handoff state");
+        free(*data);
+        return -1;
+    }
+    *length = dataLength;
+
+    return 0;
+}
+
+int confirmHandoff(int socketFD)
+{
+    unsigned char ack = HANDOFF_ACK;
+    if (sendAll(socketFD, &ack, 1) < 0)
+    {
+        perror("Unable to acknowledge the handoff");
+        return -1;
+    }
+
+    // The old process waits HANDOFF_ACK_TIMEOUT_MS at most, so its answer comes well within twice that
+    return (receiveByte(socketFD, 2 * HANDOFF_ACK_TIMEOUT_MS) == HANDOFF_RELEASED) ? 0 : -1;
+}
+
+int releaseHandoff(int socketFD)
+{
+    if (receiveByte(socketFD, HANDOFF_ACK_TIMEOUT_MS) != HANDOFF_ACK)
+    {
+        return -1;
+    }
+
+    // Once this is sent the session is the new process's, so a failure means it already gave up
+    unsigned char released = HANDOFF_RELEASED;
+    return sendAll(socketFD, &released, 1);
+}
@@ -0,0 +1,139 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       handoff.h
+
+Note:       Passing open sockets and serialized state from a running
+            process to its replacement over a Unix domain socket.
+
+            The running process listens on a Unix socket at a known
+            path. A new process connects to that path, and the old one
+            sends it a single message: the file descriptors travel as
+            SCM_RIGHTS ancillary data, followed by a length prefixed
+            blob of state. The new process then owns the same kernel
+            sockets, so the TCP connections never notice the upgrade.
+
+            The old process only lets go once the new one has taken the
+            state: the new process sends HANDOFF_ACK, and the old one
+            answers HANDOFF_RELEASED and exits. If no HANDOFF_ACK comes
+            within HANDOFF_ACK_TIMEOUT_MS, the old process closes the
+            connection and keeps serving, and a new process that is not
+            released gives up, so exactly one of the two ever serves the
+            session.
+
+            As the socket hands out live connections and their keys, it
+            is only open to its owner (mode 0600), and both ends check
+            that the process at the other end runs as the same user.
+*/
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+#define HANDOFF_MAX_FDS 8
+#define HANDOFF_ACK_TIMEOUT_MS 5000 // longest the old process waits for the new one to take the state
+
+#define HANDOFF_ACK 'A'             // from the new process: the state was taken
+#define HANDOFF_RELEASED 'R'        // from the old process: the session is the new process's
+
+/**************************************************
+ * openUpgradeSocket
+ *
+ * Arguments: const char* path
+ * Returns: int
+ *
+ * Creates a listening Unix socket at path,
+ * replacing any stale socket file left there,
+ * that only its owner may connect to
+ *
+ * Returns the socket, or -1 on error
+ *************************************************/
+int openUpgradeSocket(const char* path);
+
+/**************************************************
+ * connectUpgradeSocket
+ *
+ * Arguments: const char* path
+ * Returns: int
+ *
+ * Connects to the Unix socket of a running
+ * process at path
+ *
+ * Returns the socket, or -1 if no process is
+ * listening there, or one of another user is
+ *************************************************/
+int connectUpgradeSocket(const char* path);
+
+/**************************************************
+ * acceptUpgradeSocket
+ *
+ * Arguments: int listenFD
+ * Returns: int
+ *
+ * Accepts a new process on the upgrade socket
+ * listenFD, if it runs as the same user
+ *
+ * Returns the socket, or -1 on error
+ *************************************************/
+int acceptUpgradeSocket(int listenFD);
+
+/**************************************************
+ * sendHandoff
+ *
+ * Arguments: int socketFD, int* fds, int fdCount,
+ *            void* data, size_t length
+ * Returns: int
+ *
+ * Sends fdCount file descriptors and length bytes
+ * of data over the connected Unix socket
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int sendHandoff(int socketFD, int* fds, int fdCount, void* data, size_t length);
+
+/**************************************************
+ * receiveHandoff
+ *
+ * Arguments: int socketFD, int* fds, int* fdCount,
+ *            void** data, size_t* length
+ * Returns: int
+ *
+ * Receives a message sent by sendHandoff. At most
+ * HANDOFF_MAX_FDS descriptors are stored in fds,
+ * and data is set to a malloc()ed buffer the
+ * caller must free
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int receiveHandoff(int socketFD, int* fds, int* fdCount, void** data, size_t* length);
+
+/**************************************************
+ * confirmHandoff
+ *
+ * Arguments: int socketFD
+ * Returns: int
+ *
+ * In the new process, once the state received is
+ * taken: sends HANDOFF_ACK and waits for the old
+ * process to answer HANDOFF_RELEASED
+ *
+ * Returns 0 if the session is now this process's,
+ * or -1 if the old process keeps it
+ *************************************************/
+int confirmHandoff(int socketFD);
+
+/**************************************************
+ * releaseHandoff
+ *
+ * Arguments: int socketFD
+ * Returns: int
+ *
+ * In the old process, after sendHandoff: waits up
+ * to HANDOFF_ACK_TIMEOUT_MS for HANDOFF_ACK, and
+ * answers it with HANDOFF_RELEASED
+ *
+ * Returns 0 if the new process took the session,
+ * or -1 if this process must keep serving it
+ *************************************************/
+int releaseHandoff(int socketFD);
+
+#endif
@@ -0,0 +1,96 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       hello.c
+
+Note:       Implementation of the capability negotiation. See hello.h
+*/
+#include "hello.h"
+
+#include <string.h>
+
+void initHello(Hello* hello, uint32_t features, uint32_t maxPayloadLength, uint32_t windowLength)
+{
+    hello->version = HELLO_VERSION;
+    hello->length = sizeof(Hello);
+    hello->features = features;
+    hello->maxPayloadLength = maxPayloadLength;
+    hello->windowLength = windowLength;
+    memset(hello->nonce, 0, CIPHER_NONCE_LEN);
+    hello->lossPermille = 0;
+    hello->timestampMicros = 0;
+    hello->echoMicros = 0;
+    hello->echoDelayMicros = 0;
+    hello->traceSeqN = 0;
+    hello->traceReceivedMicros = 0;
+    hello->traceDeliveredMicros = 0;
+}
+
+int readHello(Hello* hello, void* data, int length)
+{
+    // Defaults of a peer that predates the Hello
+    hello->version = 1;
+    hello->length = 0;
+    hello->features = 0;
+    hello->maxPayloadLength = HELLO_DEFAULT_PAYLOAD_LEN;
+    hello->windowLength = 0;
+    memset(hello->nonce, 0, CIPHER_NONCE_LEN);
+    hello->lossPermille = 0;
+    hello->timestampMicros = 0;
+    hello->echoMicros = 0;
+    hello->echoDelayMicros = 0;
+    hello->traceSeqN = 0;
+    hello->traceReceivedMicros = 0;
+    hello->traceDeliveredMicros = 0;
+
+    if (length < (int) (2*sizeof(uint16_t)))
+    {
+        return 0;
+    }
+
+    // Take only the fields both versions know about
+    Hello received;
+    memcpy(&received, data, 2*sizeof(uint16_t));
+    int helloLength = received.length;
+    if (helloLength < (int) (2*sizeof(uint16_t)))
+    {
+        return 0;
+    }
+    if (helloLength > length)
+    {
+        helloLength = length;
+    }
+    if (helloLength > (int) sizeof(Hello))
+    {
+        helloLength = sizeof(Hello);
+    }
+    memcpy(hello, data, helloLength);
+    hello->length = helloLength;
+
+    // A peer may not claim it can read less than any version could
+    if (hello->maxPayloadLength == 0)
+    {
+        hello->maxPayloadLength = HELLO_DEFAULT_PAYLOAD_LEN;
+    }
+
+    return 1;
+}
+
+void negotiateHello(Hello* agreed, Hello* local, Hello* peer)
+{
+    agreed->version = (local->version < peer->version) ? local->version : peer->version;
+    agreed->length = sizeof(Hello);
+    agreed->features = local->features & peer->features;
+    agreed->maxPayloadLength = (local->maxPayloadLength < peer->maxPayloadLength) ? local->maxPayloadLength : peer->maxPayloadLength;
+
+    // A window of 0 sets no limit, so the other side's window wins
+    if (local->windowLength == 0 || (peer->windowLength != 0 && peer->windowLength < local->windowLength))
+    {
+        agreed->windowLength = peer->windowLength;
+    }
+    else
+    {
+        agreed->windowLength = local->windowLength;
+    }
+    memset(agreed->nonce, 0, CIPHER_NONCE_LEN);
+    agreed->lossPermille = 0;
+}
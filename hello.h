@@ -0,0 +1,107 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       hello.h
+
+Note:       Protocol version and capability negotiation.
+
+            Every heartbeat carries a Hello after the session ID and
+            flags, saying which protocol version the sender speaks, which
+            optional features it supports, the largest payload it can
+            read, and how many data packets it is willing to have in
+            flight. The first heartbeat goes out as soon as a connection
+            is made, so the Hello is exchanged on connect, and repeating
+            it in later heartbeats keeps every connection self-contained.
+
+            Each side combines its own Hello with the peer's: the lower
+            version, the features both support, the smaller payload and
+            the smaller window. Older versions only read the session ID
+            from a heartbeat and ignore the rest, and a heartbeat without
+            a Hello means the peer only knows version 1 frames, no
+            optional features and BUFFER_LEN byte payloads. Until the
+            peer's Hello arrives a connection uses those same defaults,
+            so mixed versions always fall back to the original format.
+
+            length lets later versions append fields: fields the peer
+            did not send get their defaults, and fields a newer peer
+            sent that this version does not know are ignored.
+*/
+#ifndef HELLO_H
+#define HELLO_H
+
+#include <stdint.h>
+
+#include "cipher.h"
+
+#define HELLO_VERSION 2
+
+#define HELLO_DEFAULT_PAYLOAD_LEN 1024 // What a peer without a Hello can read
+
+// Optional features
+#define HELLO_COMPACT_FRAMES 0x1 // can read version 2 frames (see frame.h)
+#define HELLO_COMPRESSION 0x2    // cproxy: wants compression, sproxy: supports it (see lz.h)
+#define HELLO_SACK 0x4           // reserved for selective acknowledgements, not sent yet
+#define HELLO_ENCRYPTION 0x8     // has a pre-shared key and encrypts frames (see cipher.h)
+#define HELLO_FEC 0x10           // cproxy: wants parity packets over UDP, sproxy: supports them (see fec.h)
+#define HELLO_MULTIPATH 0x20     // cproxy: has several paths over UDP, sproxy: answers their probes (see multipath.h)
+#define HELLO_STREAMS 0x40       // was given a map file, and forwards its services (see stream.h)
+#define HELLO_SOCKS 0x80         // cproxy: takes SOCKS clients, sproxy: connects streams to their targets (see stream.h)
+#define HELLO_EXTENDED_TYPES 0x100 // can read version 2 frames with types above FRAME_TYPE_MASK (see frame.h)
+
+typedef struct {
+
+    uint16_t version;           // HELLO_VERSION of the sender
+    uint16_t length;            // sizeof(Hello) of the sender
+    uint32_t features;          // HELLO_* features the sender supports
+    uint32_t maxPayloadLength;  // largest data packet payload the sender can read
+    uint32_t windowLength;      // most unacknowledged data packets the sender keeps, 0 for no limit
+    unsigned char nonce[CIPHER_NONCE_LEN]; // sender's random nonce for this connection's keys
+    uint32_t lossPermille;      // data packets the sender lately saw lost, in 1/1000ths, a report rather than negotiated
+    uint32_t timestampMicros;   // sender's clock when the heartbeat was sent, 0 if not sent (see stats.h)
+    uint32_t echoMicros;        // latest timestampMicros received from the peer, 0 if none yet
+    uint32_t echoDelayMicros;   // how long the sender held echoMicros before sending it back
+    uint32_t traceSeqN;         // latest data packet the sender delivered (see trace.h)
+    uint32_t traceReceivedMicros; // sender's clock when that packet arrived
+    uint32_t traceDeliveredMicros; // sender's clock when it was delivered, 0 if none since the last Hello
+
+} Hello;
+
+/**************************************************
+ * initHello
+ *
+ * Arguments: Hello* hello, uint32_t features,
+ *            uint32_t maxPayloadLength,
+ *            uint32_t windowLength
+ * Returns: void
+ *
+ * Fills in the Hello this version sends
+ *************************************************/
+void initHello(Hello* hello, uint32_t features, uint32_t maxPayloadLength, uint32_t windowLength);
+
+/**************************************************
+ * readHello
+ *
+ * Arguments: Hello* hello, void* data, int length
+ * Returns: int
+ *
+ * Reads the peer's Hello from the length bytes
+ * of a heartbeat that follow the flags. A
+ * length of 0 or less means the peer sent no
+ * Hello. Anything missing gets the defaults of a
+ * peer that predates the Hello
+ *
+ * Returns !0 if the peer sent a Hello
+ *************************************************/
+int readHello(Hello* hello, void* data, int length);
+
+/**************************************************
+ * negotiateHello
+ *
+ * Arguments: Hello* agreed, Hello* local,
+ *            Hello* peer
+ * Returns: void
+ *
+ * Sets agreed to what both sides support
+ *************************************************/
+void negotiateHello(Hello* agreed, Hello* local, Hello* peer);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       log.c
+
+Note:       Implementation of the log ring and its thread. See log.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_IDLE_MS 10              // how long the log thread sleeps when the ring is empty
+#define LOG_FLUSH_TIMEOUT_MS 1000   // how long flushLog waits for the log thread
+#define LOG_SPEC_LEN 16             // longest conversion, flags and width included
+
+typedef struct {
+
+    const char* format;
+    int32_t arguments[LOG_ARG_COUNT];
+    char text[LOG_TEXT_LEN];
+
+} LogRecord;
+
+int logLevel = LOG_INFO;
+
+static LogRecord ring[LOG_RING_LEN];
+static uint32_t head = 0;           // next record to write, only written by the proxy's thread
+static uint32_t tail = 0;           // next record to print, only written by whoever drains the ring
+static uint32_t droppedCount = 0;   // messages that found the ring full
+static uint32_t suppressedCount = 0; // debug messages over LOG_DEBUG_PER_SECOND
+static void (*reportPrinter)(void*) = NULL; // the report waiting to be printed, taken by the log thread
+static void* reportArgument = NULL;
+static int isThreadRunning = 0;
+static int isSynchronous = 0;       // is true if the log thread could not start
+static pthread_t logThread;
+
+// Debug messages logged in the current second, for the rate limit
+static time_t debugSecond = 0;
+static uint32_t debugCount = 0;
+
+/******************************************
+ * sleepMillis
+ *
+ * Arguments: int millis
+ * Returns: void
+ *
+ * Sleeps for the given milliseconds
+ *****************************************/
+static void sleepMillis(int millis)
+{
+    struct timespec duration = { .tv_sec = millis / 1000, .tv_nsec = (millis % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+}
+
+/******************************************
+ * getExitSignals
+ *
+ * Arguments: sigset_t* signals
+ * Returns: void
+ *
+ * Fills in the signals that end the proxy
+ * by way of the log thread
+ *****************************************/
+static void getExitSignals(sigset_t* signals)
+{
+    sigemptyset(signals);
+    sigaddset(signals, SIGTERM);
+    sigaddset(signals, SIGINT);
+}
+
+/******************************************
+ * printRecord
+ *
+ * Arguments: LogRecord* record
+ * Returns: void
+ *
+ * Formats a record's message on to stdout
+ *****************************************/
+static void printRecord(LogRecord* record)
+{
+    const char* format = record->format;
+    int argumentIndex = 0;
+
+    while (*format != '\0')
+    {
+        if (*format != '%')
+        {
+            putchar(*format++);
+            continue;
+        }
+
+        // Copy one conversion, flags and width included, to hand to printf()
+        char spec[LOG_SPEC_LEN];
+        int specLength = 0;
+        spec[specLength++] = *format++;
+        while (*format != '\0' && strchr("-+ #0123456789.", *format) != NULL && specLength < LOG_SPEC_LEN - 2)
+        {
+            spec[specLength++] = *format++;
+        }
+        if (*format == '\0')
+        {
+            break;
+        }
+        char conversion = *format++;
+        spec[specLength++] = conversion;
+        spec[specLength] = '\0';
+
+        if (conversion == '%')
+        {
+            putchar('%');
+        }
+        else if (conversion == 's')
+        {
+            printf(spec, record->text);
+        }
+        else if (argumentIndex < LOG_ARG_COUNT)
+        {
+            printf(spec, record->arguments[argumentIndex++]);
+        }
+    }
+}
+
+/******************************************
+ * drainLog
+ *
+ * Arguments: none
+ * Returns: int
+ *
+ * Prints every record in the ring, how many
+ * messages were dropped or suppressed since
+ * the last time, and the report waiting if
+ * there is one, then flushes stdout
+ *
+ * Returns 0 if there was nothing to print
+ *****************************************/
+static int drainLog()
+{
+    static uint32_t reportedDropped = 0;
+    static uint32_t reportedSuppressed = 0;
+
+    uint32_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    uint32_t start = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    uint32_t dropped = __atomic_load_n(&droppedCount, __ATOMIC_RELAXED);
+    uint32_t suppressed = __atomic_load_n(&suppressedCount, __ATOMIC_RELAXED);
+    void (*printReport)(void*) = __atomic_exchange_n(&reportPrinter, NULL, __ATOMIC_ACQUIRE);
+    if (start == end && dropped == reportedDropped && suppressed == reportedSuppressed && printReport == NULL)
+    {
+        return 0;
+    }
+
+    for (uint32_t i = start; i != end; i++)
+    {
+        printRecord(&ring[i % LOG_RING_LEN]);
+    }
+
+    if (dropped != reportedDropped)
+    {
+        printf("Logging fell behind, dropped %u messages\n", dropped - reportedDropped);
+        reportedDropped = dropped;
+    }
+    if (suppressed != reportedSuppressed)
+    {
+        printf("Over %i debug messages a second, suppressed %u\n", LOG_DEBUG_PER_SECOND, suppressed - reportedSuppressed);
+        reportedSuppressed = suppressed;
+    }
+    if (printReport != NULL)
+    {
+        printReport(__atomic_load_n(&reportArgument, __ATOMIC_RELAXED));
+    }
+
+    // The records are only handed back once they are out, so flushLog knows they were printed
+    fflush(stdout);
+    __atomic_store_n(&tail, end, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/******************************************
+ * runLog
+ *
+ * Arguments: void* argument (unused)
+ * Returns: void*
+ *
+ * Body of the log thread: prints records as
+ * they arrive, for the life of the process,
+ * and exits it on SIGTERM or SIGINT
+ *****************************************/
+static void* runLog(void* argument)
+{
+    sigset_t exitSignals;
+    getExitSignals(&exitSignals);
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = LOG_IDLE_MS * 1000000L };
+
+    while (1)
+    {
+        if (drainLog() != 0)
+        {
+            continue;
+        }
+
+        // Waiting for a signal doubles as the sleep while the ring is empty
+        int received = sigtimedwait(&exitSignals, NULL, &idle);
+        if (received > 0)
+        {
+            // exit() rather than dying to the signal, so flushLog and the rest of atexit() run
+            exit(128 + received);
+        }
+    }
+
+    return NULL;
+}
+
+int startLog(int level)
+{
+    logLevel = level;
+    atexit(flushLog);
+
+    // Started with every signal blocked, so that signals go to the proxy's own thread
+    sigset_t signals, oldSignals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    int result = pthread_create(&logThread, NULL, runLog, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (result != 0)
+    {
+        printf("Unable to start the log thread, logging as it happens: %s\n", strerror(result));
+        isSynchronous = 1;
+        drainLog();
+        return -1;
+    }
+    pthread_detach(logThread);
+
+    // Except the ones that end the proxy, which the log thread waits for
+    getExitSignals(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    __atomic_store_n(&isThreadRunning, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void writeLogRecord(int level, const char* format, ...)
+{
+    if (level == LOG_DEBUG)
+    {
+        time_t now = time(NULL);
+        if (now != debugSecond)
+        {
+            debugSecond = now;
+            debugCount = 0;
+        }
+        if (++debugCount > LOG_DEBUG_PER_SECOND)
+        {
+            __atomic_store_n(&suppressedCount, suppressedCount + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint32_t position = head;
+    if (position - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOG_RING_LEN)
+    {
+        __atomic_store_n(&droppedCount, droppedCount + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Copy the arguments the format names, as printRecord will read them
+    LogRecord* record = &ring[position % LOG_RING_LEN];
+    record->format = format;
+    record->text[0] = '\0';
+    int argumentIndex = 0;
+    va_list arguments;
+    va_start(arguments, format);
+    for (const char* next = strchr(format, '%'); next != NULL; next = strchr(next, '%'))
+    {
+        next += strspn(next + 1, "-+ #0123456789.") + 1;
+        if (*next == '\0')
+        {
+            break;
+        }
+        if (*next == 's')
+        {
+            strncpy(record->text, va_arg(arguments, const char*), LOG_TEXT_LEN - 1);
+            record->text[LOG_TEXT_LEN - 1] = '\0';
+        }
+        else if (*next != '%' && argumentIndex < LOG_ARG_COUNT)
+        {
+            record->arguments[argumentIndex++] = va_arg(arguments, int32_t);
+        }
+        next++;
+    }
+    va_end(arguments);
+
+    __atomic_store_n(&head, position + 1, __ATOMIC_RELEASE);
+
+    if (isSynchronous != 0)
+    {
+        drainLog();
+    }
+}
+
+void logReport(void (*printReport)(void*), void* argument)
+{
+    if (__atomic_load_n(&isThreadRunning, __ATOMIC_ACQUIRE) == 0)
+    {
+        flockfile(stdout);
+        printReport(argument);
+        fflush(stdout);
+        funlockfile(stdout);
+        return;
+    }
+
+    // The argument is in place before the printer that the log thread takes with it
+    __atomic_store_n(&reportArgument, argument, __ATOMIC_RELAXED);
+    __atomic_store_n(&reportPrinter, printReport, __ATOMIC_RELEASE);
+}
+
+void flushLog()
+{
+    if (__atomic_load_n(&isThreadRunning, __ATOMIC_ACQUIRE) == 0 || pthread_equal(pthread_self(), logThread))
+    {
+        drainLog();
+        return;
+    }
+
+    for (int waited = 0; waited < LOG_FLUSH_TIMEOUT_MS; waited++)
+    {
+        if (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == head)
+        {
+            return;
+        }
+        sleepMillis(1);
+    }
+}
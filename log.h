@@ -0,0 +1,132 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       log.h
+
+Note:       Leveled logging for cproxy and sproxy that keeps printing off
+            the proxy's own thread.
+
+            logMessage takes a level and a printf() style format. A
+            message above the level given to startLog costs one compare:
+            its arguments are not even evaluated. Per packet messages
+            (data packets and heartbeats sent and received, each packet
+            retransmitted) are LOG_DEBUG, which the proxies only log with
+            -v.
+
+            A message that is logged is not formatted either. Its format
+            and arguments are copied as a binary record into a ring of
+            LOG_RING_LEN records, and a thread started by startLog
+            formats and prints them to stdout, flushing after each batch.
+            The proxy's thread is the only one that writes records and
+            the log thread the only one that reads them, so the ring
+            needs no lock, only an acquire and release on each end.
+
+            Logging never blocks the proxy. If the ring is full the
+            message is dropped, and at most LOG_DEBUG_PER_SECOND debug
+            messages are logged each second, so that -v on a bulk
+            transfer cannot swamp the terminal. The log thread prints how
+            many messages were dropped or suppressed either way.
+
+            A format can take at most LOG_ARG_COUNT int arguments (%i,
+            %d, %u, %x, with any flags and width) and one string (%s),
+            which is copied, truncated to LOG_TEXT_LEN - 1 characters.
+
+            Only the proxy's main thread may call logMessage. What is
+            still in the ring when the process exits is printed by
+            flushLog, which startLog registers with atexit(). SIGTERM and
+            SIGINT are handled by the log thread too, which exits the
+            process with 128 plus the signal number, so that atexit()
+            runs for them as well; only a process killed by another
+            signal can lose its last messages.
+
+            A report too long for a record, like the latency table
+            printed on SIGUSR1, is printed by the log thread as well,
+            between two batches of records, so that stdout only has the
+            one writer. logReport is the one call any thread may make.
+*/
+#ifndef LOG_H
+#define LOG_H
+
+// Levels
+#define LOG_ERROR 0
+#define LOG_WARNING 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RING_LEN 1024           // records waiting to be printed, a power of 2
+#define LOG_ARG_COUNT 4             // int arguments a record holds
+#define LOG_TEXT_LEN 48             // room for the one string argument
+#define LOG_DEBUG_PER_SECOND 1000   // debug messages logged each second at most
+
+// The most verbose level logged, only changed by startLog
+extern int logLevel;
+
+/**************************************************
+ * logMessage
+ *
+ * Arguments: int level, const char* format, ...
+ * Returns: void
+ *
+ * Logs a message with the given level, if it is
+ * logged at all, without evaluating the arguments
+ * otherwise
+ *************************************************/
+#define logMessage(level, ...) \
+    do { if ((level) <= logLevel) writeLogRecord((level), __VA_ARGS__); } while (0)
+
+/**************************************************
+ * startLog
+ *
+ * Arguments: int level
+ * Returns: int
+ *
+ * Logs messages up to level from now on, and
+ * starts the thread that prints them. Until then
+ * messages wait in the ring. Blocks SIGTERM and
+ * SIGINT in the calling thread, for the log
+ * thread to exit on
+ *
+ * Returns 0 on success, or -1 if the thread could
+ * not start, in which case messages are printed
+ * as they are logged
+ *************************************************/
+int startLog(int level);
+
+/**************************************************
+ * writeLogRecord
+ *
+ * Arguments: int level, const char* format, ...
+ * Returns: void
+ *
+ * Copies a message in to the ring. Use logMessage,
+ * which skips this if level is not logged
+ *************************************************/
+void writeLogRecord(int level, const char* format, ...);
+
+/**************************************************
+ * logReport
+ *
+ * Arguments: void (*printReport)(void*),
+ *            void* argument
+ * Returns: void
+ *
+ * Has the log thread call printReport with
+ * argument to print a report to stdout, after the
+ * messages already logged. A report asked for
+ * again before it was printed is printed once.
+ * Without a log thread it is printed at once.
+ * May be called from any thread
+ *************************************************/
+void logReport(void (*printReport)(void*), void* argument);
+
+/**************************************************
+ * flushLog
+ *
+ * Arguments: none
+ * Returns: void
+ *
+ * Waits until every message logged so far has
+ * been printed and flushed
+ *************************************************/
+void flushLog();
+
+#endif
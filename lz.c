@@ -0,0 +1,432 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       lz.c
+
+Note:       Implementation of the streaming LZ codec. See lz.h
+*/
+#include "lz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/******************************************
+ * hash4
+ *
+ * Arguments: unsigned char* p
+ * Returns: uint32_t
+ *
+ * Hashes the 4 bytes at p in to an index
+ * of the hash table
+ *****************************************/
+static inline uint32_t hash4(unsigned char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/******************************************
+ * makeRoom
+ *
+ * Arguments: LZStream* stream, int length
+ * Returns: void
+ *
+ * Slides the window so that length (at most
+ * LZ_MAX_PACKET_LEN) more bytes fit after the
+ * history, keeping the last LZ_WINDOW_LEN bytes
+ *****************************************/
+static void makeRoom(LZStream* stream, int length)
+{
+    if (stream->windowLength + length <= (int) sizeof(stream->window))
+    {
+        return;
+    }
+
+    int shift = stream->windowLength - LZ_WINDOW_LEN;
+
+    memmove(stream->window, stream->window + shift, stream->windowLength - shift);
+    stream->windowLength -= shift;
+
+    // Positions in the hash table move with the window, and are dropped if they fall off the front
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+    {
+        stream->hashTable[i] = (stream->hashTable[i] > shift) ? stream->hashTable[i] - shift : 0;
+    }
+}
+
+/******************************************
+ * writeLength
+ *
+ * Arguments: unsigned char** out,
+ *            unsigned char* outEnd, int length
+ * Returns: int
+ *
+ * Writes the extra bytes of a length that did
+ * not fit in its 4 bits of the token
+ *
+ * Returns -1 if out would pass outEnd
+ *****************************************/
+static int writeLength(unsigned char** out, unsigned char* outEnd, int length)
+{
+    for (length -= 15; length >= 0; length -= 255)
+    {
+        if (*out >= outEnd)
+        {
+            return -1;
+        }
+        *(*out)++ = (length >= 255) ? 255 : length;
+        if (length < 255)
+        {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************
+ * readLength
+ *
+ * Arguments: unsigned char** in,
+ *            unsigned char* inEnd, int length
+ * Returns: int
+ *
+ * Reads the extra bytes of a length whose
+ * token bits were 15
+ *
+ * Returns the full length, or -1 if in would
+ * pass inEnd
+ *****************************************/
+static int readLength(unsigned char** in, unsigned char* inEnd, int length)
+{
+    unsigned char byte;
+    do
+    {
+        if (*in >= inEnd)
+        {
+            return -1;
+        }
+        byte = *(*in)++;
+        length += byte;
+
+    } while (byte == 255);
+
+    return length;
+}
+
+/******************************************
+ * writeSequence
+ *
+ * Arguments: unsigned char** out,
+ *            unsigned char* outEnd,
+ *            unsigned char* literals,
+ *            int literalLength, int offset,
+ *            int matchLength
+ * Returns: int
+ *
+ * Writes one sequence. A matchLength of 0
+ * writes the final, literals only, sequence
+ *
+ * Returns -1 if out would pass outEnd
+ *****************************************/
+static int writeSequence(unsigned char** out, unsigned char* outEnd, unsigned char* literals, int literalLength, int offset, int matchLength)
+{
+    if (*out >= outEnd)
+    {
+        return -1;
+    }
+
+    int matchCode = (matchLength > 0) ? matchLength - LZ_MIN_MATCH : 0;
+    unsigned char* token = (*out)++;
+    *token = ((literalLength >= 15 ? 15 : literalLength) << 4) | (matchCode >= 15 ? 15 : matchCode);
+
+    if (literalLength >= 15 && writeLength(out, outEnd, literalLength) < 0)
+    {
+        return -1;
+    }
+
+    if (*out + literalLength > outEnd)
+    {
+        return -1;
+    }
+    memcpy(*out, literals, literalLength);
+    *out += literalLength;
+
+    if (matchLength == 0)
+    {
+        return 0;
+    }
+
+    if (*out + 2 > outEnd)
+    {
+        return -1;
+    }
+    *(*out)++ = offset & 0xff;
+    *(*out)++ = offset >> 8;
+
+    if (matchCode >= 15 && writeLength(out, outEnd, matchCode) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void resetLZStream(LZStream* stream)
+{
+    stream->windowLength = 0;
+    memset(stream->hashTable, 0, sizeof(stream->hashTable));
+}
+
+int lzCompress(LZStream* stream, void* input, int inputLength, void* output, int outputCapacity)
+{
+    if (inputLength > LZ_MAX_PACKET_LEN)
+    {
+        return -1;
+    }
+
+    // Place the input right after the history, so matches can reach back in to it
+    makeRoom(stream, inputLength);
+    unsigned char* base = stream->window;
+    int start = stream->windowLength;
+    int end = start + inputLength;
+    memcpy(base + start, input, inputLength);
+    stream->windowLength = end;
+
+    unsigned char* out = output;
+    unsigned char* outEnd = out + outputCapacity;
+    int anchor = start; // First byte not yet written out
+    int position = start;
+
+    while (position + LZ_MIN_MATCH <= end)
+    {
+        uint32_t h = hash4(base + position);
+        int candidate = stream->hashTable[h] - 1;
+        stream->hashTable[h] = position + 1;
+
+        if (candidate < 0 || position - candidate > LZ_MAX_OFFSET || memcmp(base + candidate, base + position, LZ_MIN_MATCH) != 0)
+        {
+            position++;
+            continue;
+        }
+
+        // Extend the match as far as the input goes
+        int matchLength = LZ_MIN_MATCH;
+        while (position + matchLength < end && base[candidate + matchLength] == base[position + matchLength])
+        {
+            matchLength++;
+        }
+
+        if (writeSequence(&out, outEnd, base + anchor, position - anchor, position - candidate, matchLength) < 0)
+        {
+            return -1;
+        }
+
+        // Remember the strings inside the match too, so later packets can refer to them
+        for (int i = position + 1; i < position + matchLength && i + LZ_MIN_MATCH <= end; i++)
+        {
+            stream->hashTable[hash4(base + i)] = i + 1;
+        }
+
+        position += matchLength;
+        anchor = position;
+    }
+
+    // Remember the tail, then write the remaining literals
+    for (; position + LZ_MIN_MATCH <= end; position++)
+    {
+        stream->hashTable[hash4(base + position)] = position + 1;
+    }
+    if (writeSequence(&out, outEnd, base + anchor, end - anchor, 0, 0) < 0)
+    {
+        return -1;
+    }
+
+    return out - (unsigned char*) output;
+}
+
+int lzDecompress(LZStream* stream, void* input, int inputLength, void* output, int outputCapacity)
+{
+    if (outputCapacity > LZ_MAX_PACKET_LEN)
+    {
+        outputCapacity = LZ_MAX_PACKET_LEN;
+    }
+
+    // Decode straight in to the window, after the history
+    makeRoom(stream, outputCapacity);
+    unsigned char* base = stream->window;
+    unsigned char* out = base + stream->windowLength;
+    unsigned char* outStart = out;
+    unsigned char* outEnd = out + outputCapacity;
+    unsigned char* in = input;
+    unsigned char* inEnd = in + inputLength;
+
+    while (in < inEnd)
+    {
+        int token = *in++;
+
+        // Literals
+        int literalLength = token >> 4;
+        if (literalLength == 15 && (literalLength = readLength(&in, inEnd, literalLength)) < 0)
+        {
+            return -1;
+        }
+        if (in + literalLength > inEnd || out + literalLength > outEnd)
+        {
+            return -1;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // The last sequence has no match
+        if (in == inEnd)
+        {
+            break;
+        }
+
+        // Match
+        if (in + 2 > inEnd)
+        {
+            return -1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && (matchLength = readLength(&in, inEnd, matchLength)) < 0)
+        {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out - base || out + matchLength > outEnd)
+        {
+            return -1;
+        }
+
+        // Copy byte by byte, since a match may overlap the bytes it produces
+        unsigned char* match = out - offset;
+        for (int i = 0; i < matchLength; i++)
+        {
+            out[i] = match[i];
+        }
+        out += matchLength;
+    }
+
+    int length = out - outStart;
+    stream->windowLength += length;
+    memcpy(output, outStart, length);
+
+    return length;
+}
+
+void lzAppend(LZStream* stream, void* data, int length)
+{
+    if (length > LZ_MAX_PACKET_LEN)
+    {
+        return;
+    }
+
+    makeRoom(stream, length);
+    memcpy(stream->window + stream->windowLength, data, length);
+    stream->windowLength += length;
+}
+
+LZSession* newLZSession()
+{
+    LZSession* session = malloc(sizeof(LZSession));
+    if (session == NULL)
+    {
+        perror("Unable to allocate space for compression session");
+        exit(-1);
+    }
+
+    resetLZSession(session);
+
+    return session;
+}
+
+void deleteLZSession(LZSession* session)
+{
+    free(session);
+}
+
+void resetLZSession(LZSession* session)
+{
+    resetLZStream(&session->tx);
+    resetLZStream(&session->rx);
+    session->isEnabled = 0;
+    session->isTxStarted = 0;
+    session->isRxStarted = 0;
+}
+
+void* compressPayload(LZSession* session, uint32_t* type, void* payload, uint32_t* length)
+{
+    if (session->isEnabled == 0)
+    {
+        return payload;
+    }
+
+    // The first packet after compression is enabled starts the history on both sides
+    if (session->isTxStarted == 0)
+    {
+        resetLZStream(&session->tx);
+        session->isTxStarted = 1;
+        *type |= PACKET_TYPE_COMPRESS_RESET;
+    }
+
+    // Only send the compressed version if it is actually smaller
+    int compressedLength = lzCompress(&session->tx, payload, *length, session->scratch, *length - 1);
+    if (compressedLength <= 0)
+    {
+        return payload;
+    }
+
+    *length = compressedLength;
+    *type |= PACKET_TYPE_COMPRESSED;
+    return session->scratch;
+}
+
+int decompressPayload(LZSession* session, uint32_t* type, void* payload, uint32_t* length, int capacity)
+{
+    if (*type & PACKET_TYPE_COMPRESS_RESET)
+    {
+        resetLZStream(&session->rx);
+        session->isRxStarted = 1;
+    }
+
+    if ((*type & PACKET_TYPE_COMPRESSED) == 0)
+    {
+        // Uncompressed packets still count as history once the stream has started
+        if (session->isRxStarted != 0)
+        {
+            lzAppend(&session->rx, payload, *length);
+        }
+        *type &= ~PACKET_TYPE_COMPRESS_RESET;
+        return 0;
+    }
+
+    if (session->isRxStarted == 0)
+    {
+        logMessage(LOG_DEBUG, "Compressed packet received before the compression stream started\n");
+        return -1;
+    }
+
+    int uncompressedLength = lzDecompress(&session->rx, payload, *length, session->scratch, capacity);
+    if (uncompressedLength < 0)
+    {
+        logMessage(LOG_DEBUG, "Unable to decompress packet payload\n");
+        return -1;
+    }
+
+    memcpy(payload, session->scratch, uncompressedLength);
+    *length = uncompressedLength;
+    *type &= ~(PACKET_TYPE_COMPRESSED | PACKET_TYPE_COMPRESS_RESET);
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       lz.h
+
+Note:       A small, fast LZ77 codec for packet payloads, with no
+            outside dependencies.
+
+            The codec is streaming: each direction of a connection keeps
+            the last 64KB of data it sent or received as history, and
+            matches may point back in to that history. This lets short
+            keystroke and echo packets compress well, since the text
+            they repeat was usually seen in an earlier packet.
+
+            The encoded format is a series of sequences, each made of a
+            token byte (high 4 bits: literal count, low 4 bits: match
+            length - 4, 15 meaning more length bytes follow), the
+            literals, then a 2 byte little endian match offset. The last
+            sequence holds literals only.
+
+            Both sides must feed every packet in to their streams in the
+            same order. To make that hold without any extra bookkeeping,
+            the history belongs to one TCP connection: every data packet
+            is compressed as it is sent (retransmissions included), and
+            every data packet is decompressed as it is read, before it
+            is checked against ackN. Both histories then follow the TCP
+            byte stream, and a new connection starts new histories. This
+            needs every compressed packet to be written whole, so both
+            proxies send on a blocking socket.
+*/
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+#define LZ_WINDOW_LEN 65536
+#define LZ_HASH_BITS 12
+#define LZ_MAX_PACKET_LEN 16384
+
+// Packet type flags used with compression (the low bit is the data flag)
+#define PACKET_TYPE_COMPRESSED 0x2     // payload is compressed
+#define PACKET_TYPE_COMPRESS_RESET 0x4 // the sender's history starts with this packet
+
+typedef struct {
+
+    unsigned char window[2 * LZ_WINDOW_LEN];  // slid back once full, so it moves once every 64KB
+    int32_t windowLength;                   // bytes of history in window
+    int32_t hashTable[1 << LZ_HASH_BITS];   // encoder only: position + 1 of recent 4 byte strings
+
+} LZStream;
+
+typedef struct {
+
+    LZStream tx;            // history of packets sent
+    LZStream rx;            // history of packets received
+    int32_t isEnabled;      // !0 if outgoing packets should be compressed
+    int32_t isTxStarted;    // !0 once a packet with PACKET_TYPE_COMPRESS_RESET was sent
+    int32_t isRxStarted;    // !0 once a packet with PACKET_TYPE_COMPRESS_RESET was read
+    unsigned char scratch[LZ_MAX_PACKET_LEN];
+
+} LZSession;
+
+/******************************************
+ * resetLZStream
+ *
+ * Arguments: LZStream* stream
+ * Returns: void
+ *
+ * Forgets all history of the stream
+ *****************************************/
+void resetLZStream(LZStream* stream);
+
+/******************************************
+ * lzCompress
+ *
+ * Arguments: LZStream* stream, void* input,
+ *            int inputLength, void* output,
+ *            int outputCapacity
+ * Returns: int
+ *
+ * Compresses inputLength bytes of input in to
+ * output, and adds input to the history
+ *
+ * Returns the compressed length, or -1 if it
+ * would not fit in outputCapacity bytes. The
+ * input is added to the history either way
+ *****************************************/
+int lzCompress(LZStream* stream, void* input, int inputLength, void* output, int outputCapacity);
+
+/******************************************
+ * lzDecompress
+ *
+ * Arguments: LZStream* stream, void* input,
+ *            int inputLength, void* output,
+ *            int outputCapacity
+ * Returns: int
+ *
+ * Decompresses input in to output, and adds
+ * the result to the history
+ *
+ * Returns the decompressed length, or -1 if
+ * the input is corrupt or too long
+ *****************************************/
+int lzDecompress(LZStream* stream, void* input, int inputLength, void* output, int outputCapacity);
+
+/******************************************
+ * lzAppend
+ *
+ * Arguments: LZStream* stream, void* data,
+ *            int length
+ * Returns: void
+ *
+ * Adds uncompressed data to the history
+ *****************************************/
+void lzAppend(LZStream* stream, void* data, int length);
+
+/******************************************
+ * newLZSession
+ *
+ * Arguments: none
+ * Returns: LZSession*
+ *
+ * Allocates a new, disabled LZSession
+ *****************************************/
+LZSession* newLZSession();
+
+/******************************************
+ * deleteLZSession
+ *
+ * Arguments: LZSession* session
+ * Returns: void
+ *
+ * Frees the memory allocated for the session
+ *****************************************/
+void deleteLZSession(LZSession* session);
+
+/******************************************
+ * resetLZSession
+ *
+ * Arguments: LZSession* session
+ * Returns: void
+ *
+ * Disables compression and forgets all
+ * history, for the start of a new connection
+ *****************************************/
+void resetLZSession(LZSession* session);
+
+/******************************************
+ * compressPayload
+ *
+ * Arguments: LZSession* session,
+ *            uint32_t* type, void* payload,
+ *            uint32_t* length
+ * Returns: void*
+ *
+ * Compresses the payload of a data packet that
+ * is about to be sent, if compression is
+ * enabled. type and length are updated for the
+ * packet on the wire, and should be copies, as
+ * the packet itself keeps its original payload
+ * for retransmission
+ *
+ * Returns the bytes to send: the session's
+ * scratch buffer, or payload itself if it did
+ * not get smaller (it is still added to the
+ * history)
+ *****************************************/
+void* compressPayload(LZSession* session, uint32_t* type, void* payload, uint32_t* length);
+
+/******************************************
+ * decompressPayload
+ *
+ * Arguments: LZSession* session,
+ *            uint32_t* type, void* payload,
+ *            uint32_t* length, int capacity
+ * Returns: int
+ *
+ * Undoes compressPayload in place, for a data
+ * packet that was just read. Clears the
+ * compression flags from type, and sets length
+ * to the uncompressed length. payload must
+ * have room for capacity bytes
+ *
+ * Returns -1 if the payload could not be
+ * decompressed, 0 otherwise
+ *****************************************/
+int decompressPayload(LZSession* session, uint32_t* type, void* payload, uint32_t* length, int capacity);
+
+#endif
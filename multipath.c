@@ -0,0 +1,228 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       multipath.c
+
+Note:       Implementation of multiple paths to sproxy. See multipath.h
+*/
+#define _DEFAULT_SOURCE // Needed to use timersub on Windows Subsystem for Linux
+
+#include "multipath.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/******************************************
+ * microsNow
+ *
+ * Arguments: none
+ * Returns: uint32_t
+ *
+ * The time of day in microseconds, wrapping
+ * about every 71 minutes
+ *****************************************/
+static uint32_t microsNow()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t) now.tv_sec * 1000000u + (uint32_t) now.tv_usec;
+}
+
+void initPathSet(PathSet* set)
+{
+    set->pathCount = 0;
+    set->primary = 0;
+}
+
+int addPath(PathSet* set, const char* localAddress)
+{
+    if (set->pathCount >= MULTIPATH_MAX_PATHS)
+    {
+        printf("At most %i paths can be used\n", MULTIPATH_MAX_PATHS);
+        return -1;
+    }
+
+    Path* path = &set->paths[set->pathCount];
+    memset(&path->localAddress, 0, sizeof(path->localAddress));
+    path->localAddress.sin_family = AF_INET;
+    path->localAddress.sin_port = 0;
+    if (inet_pton(AF_INET, localAddress, &path->localAddress.sin_addr) != 1)
+    {
+        printf("%s is not a valid local address\n", localAddress);
+        return -1;
+    }
+    path->socketFD = -1;
+    path->isAlive = 0;
+    path->rttMicros = 0;
+
+    set->pathCount++;
+    return 0;
+}
+
+int openPaths(PathSet* set, struct sockaddr_in* serverAddress)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    set->primary = -1;
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        Path* path = &set->paths[i];
+        path->socketFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (path->socketFD < 0) // socket returns -1 on error
+        {
+            perror("cproxy unable to create a path socket");
+            continue;
+        }
+
+        if (bind(path->socketFD, (struct sockaddr*) &path->localAddress, sizeof(path->localAddress)) < 0
+            || connect(path->socketFD, (struct sockaddr*) serverAddress, sizeof(*serverAddress)) < 0)
+        {
+            perror("cproxy unable to open a path to sproxy");
+            close(path->socketFD);
+            path->socketFD = -1;
+            continue;
+        }
+
+        // Every path starts out alive, until it fails to answer
+        path->isAlive = 1;
+        path->rttMicros = 0;
+        path->lastReceiveTime = now;
+        if (set->primary < 0)
+        {
+            set->primary = i;
+        }
+    }
+
+    if (set->primary < 0)
+    {
+        set->primary = 0;
+        return -1;
+    }
+    return set->paths[set->primary].socketFD;
+}
+
+void closePaths(PathSet* set, int closedFD)
+{
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        Path* path = &set->paths[i];
+        if (path->socketFD >= 0 && path->socketFD != closedFD && close(path->socketFD) < 0)
+        {
+            perror("cproxy unable to properly close a path socket");
+        }
+        path->socketFD = -1;
+        path->isAlive = 0;
+    }
+}
+
+int addPathsToSet(PathSet* set, fd_set* socketSet, int maxFD)
+{
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        if (set->paths[i].socketFD >= 0)
+        {
+            FD_SET(set->paths[i].socketFD, socketSet);
+            if (set->paths[i].socketFD > maxFD)
+            {
+                maxFD = set->paths[i].socketFD;
+            }
+        }
+    }
+
+    return maxFD;
+}
+
+int findReadyPath(PathSet* set, fd_set* socketSet, int primaryFD)
+{
+    if (FD_ISSET(primaryFD, socketSet))
+    {
+        return primaryFD;
+    }
+
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        if (set->paths[i].socketFD >= 0 && FD_ISSET(set->paths[i].socketFD, socketSet))
+        {
+            return set->paths[i].socketFD;
+        }
+    }
+
+    return -1;
+}
+
+void notePathFrame(PathSet* set, int socketFD, uint32_t type, void* payload, uint32_t length)
+{
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        Path* path = &set->paths[i];
+        if (path->socketFD != socketFD)
+        {
+            continue;
+        }
+
+        gettimeofday(&path->lastReceiveTime, NULL);
+        path->isAlive = 1;
+
+        PathProbe probe;
+        if ((type & PACKET_TYPE_PROBE) == 0 || length < sizeof(PathProbe))
+        {
+            return;
+        }
+        memcpy(&probe, payload, sizeof(PathProbe));
+        if (probe.isReply == 0)
+        {
+            return;
+        }
+
+        // Smooth the round trip time over the last few probes, as TCP does
+        uint32_t sample = microsNow() - probe.sentMicros;
+        path->rttMicros = (path->rttMicros == 0) ? sample : (path->rttMicros * 7 + sample) / 8;
+        return;
+    }
+}
+
+void makePathProbe(PathProbe* probe)
+{
+    probe->sentMicros = microsNow();
+    probe->isReply = 0;
+}
+
+int choosePath(PathSet* set)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        Path* path = &set->paths[i];
+        struct timeval silence;
+        timersub(&now, &path->lastReceiveTime, &silence);
+        long silenceMicros = silence.tv_sec * 1000000L + silence.tv_usec;
+        path->isAlive = path->socketFD >= 0 && silenceMicros < PATH_MIN_TIMEOUT_MS * 1000L + 2L * path->rttMicros;
+    }
+
+    // Keep the primary unless another path is a quarter faster, so two close paths don't flap
+    int best = (set->paths[set->primary].isAlive != 0) ? set->primary : -1;
+    for (int i = 0; i < set->pathCount; i++)
+    {
+        Path* path = &set->paths[i];
+        if (i == set->primary || path->isAlive == 0)
+        {
+            continue;
+        }
+
+        if (best < 0 || (path->rttMicros != 0 && path->rttMicros * 4 < set->paths[best].rttMicros * 3))
+        {
+            best = i;
+        }
+    }
+
+    if (best >= 0)
+    {
+        set->primary = best;
+    }
+    return set->paths[set->primary].socketFD;
+}
@@ -0,0 +1,189 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       multipath.h
+
+Note:       Several UDP paths from cproxy to sproxy for one session.
+
+            A phone often has Wi-Fi and cellular up at once. cproxy can
+            be given a local address for each (-b), and then opens a UDP
+            socket bound to each of them, all sending to the same sproxy
+            port. The paths share the session, the seqNs and the keys:
+            they only differ in the route their datagrams take.
+
+            Data and heartbeats go out on one path at a time, the
+            primary. Every PATH_PROBE_INTERVAL_MS, cproxy sends a probe
+            packet on every path, and sproxy sends it straight back on
+            the path it came in on, which gives each path a smoothed
+            round trip time. A path that has not had a frame back in
+            PATH_MIN_TIMEOUT_MS plus twice its round trip time is dead.
+            The primary moves as soon as it dies, or when another path
+            is a quarter faster, so a dead path costs a fraction of a
+            second instead of the 3 second heartbeat timeout. sproxy
+            replies to wherever the latest heartbeat came from, so a
+            heartbeat sent on the new primary moves its data there too.
+
+            A probe's payload is a PathProbe. Probes and their replies
+            are only sent once both sides agreed to HELLO_MULTIPATH.
+            PACKET_TYPE_PROBE is above the type bits of a version 2
+            frame's flags, so its frames carry the rest of the type after
+            them (see frame.h).
+*/
+#ifndef MULTIPATH_H
+#define MULTIPATH_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#define MULTIPATH_MAX_PATHS 4
+#define PATH_PROBE_INTERVAL_MS 200  // how often every path is probed
+#define PATH_MIN_TIMEOUT_MS 600     // silence after which a path is dead, plus twice its round trip time
+
+#define PACKET_TYPE_PROBE 0x20      // payload is a PathProbe
+
+typedef struct {
+
+    uint32_t sentMicros;    // cproxy's clock when the probe was sent, in microseconds
+    uint32_t isReply;       // !0 if sproxy is sending the probe back
+
+} PathProbe;
+
+typedef struct {
+
+    int socketFD;                   // -1 while closed
+    struct sockaddr_in localAddress; // address the socket is bound to
+    int isAlive;                    // !0 while frames keep arriving on the path
+    uint32_t rttMicros;             // smoothed round trip time, 0 until measured
+    struct timeval lastReceiveTime; // when a frame last arrived on the path
+
+} Path;
+
+typedef struct {
+
+    int pathCount;
+    int primary;            // index of the path data and heartbeats go out on
+    Path paths[MULTIPATH_MAX_PATHS];
+
+} PathSet;
+
+/******************************************
+ * initPathSet
+ *
+ * Arguments: PathSet* set
+ * Returns: void
+ *
+ * Empties set
+ *****************************************/
+void initPathSet(PathSet* set);
+
+/******************************************
+ * addPath
+ *
+ * Arguments: PathSet* set,
+ *            const char* localAddress
+ * Returns: int
+ *
+ * Adds a path whose socket will be bound to
+ * the dotted IPv4 localAddress
+ *
+ * Returns -1 if the address is not valid or
+ * set is full, 0 otherwise
+ *****************************************/
+int addPath(PathSet* set, const char* localAddress);
+
+/******************************************
+ * openPaths
+ *
+ * Arguments: PathSet* set,
+ *            struct sockaddr_in* serverAddress
+ * Returns: int
+ *
+ * Opens a non-blocking UDP socket for each
+ * path, bound to its local address and
+ * connected to serverAddress. Paths that fail
+ * to open stay closed
+ *
+ * Returns the socket of the new primary, or -1
+ * if no path could be opened
+ *****************************************/
+int openPaths(PathSet* set, struct sockaddr_in* serverAddress);
+
+/******************************************
+ * closePaths
+ *
+ * Arguments: PathSet* set, int closedFD
+ * Returns: void
+ *
+ * Closes the socket of every path, except
+ * closedFD, which the caller already closed
+ *****************************************/
+void closePaths(PathSet* set, int closedFD);
+
+/******************************************
+ * addPathsToSet
+ *
+ * Arguments: PathSet* set, fd_set* socketSet,
+ *            int maxFD
+ * Returns: int
+ *
+ * Adds the socket of every open path to
+ * socketSet
+ *
+ * Returns the larger of maxFD and the highest
+ * socket added
+ *****************************************/
+int addPathsToSet(PathSet* set, fd_set* socketSet, int maxFD);
+
+/******************************************
+ * findReadyPath
+ *
+ * Arguments: PathSet* set, fd_set* socketSet,
+ *            int primaryFD
+ * Returns: int
+ *
+ * Returns primaryFD if it is in socketSet,
+ * else the socket of another path that is, or
+ * -1 if none is
+ *****************************************/
+int findReadyPath(PathSet* set, fd_set* socketSet, int primaryFD);
+
+/******************************************
+ * notePathFrame
+ *
+ * Arguments: PathSet* set, int socketFD,
+ *            uint32_t type, void* payload,
+ *            uint32_t length
+ * Returns: void
+ *
+ * Records that a frame arrived on the path of
+ * socketFD, and if it is a probe reply, the
+ * path's round trip time
+ *****************************************/
+void notePathFrame(PathSet* set, int socketFD, uint32_t type, void* payload, uint32_t length);
+
+/******************************************
+ * makePathProbe
+ *
+ * Arguments: PathProbe* probe
+ * Returns: void
+ *
+ * Fills in a probe to send now
+ *****************************************/
+void makePathProbe(PathProbe* probe);
+
+/******************************************
+ * choosePath
+ *
+ * Arguments: PathSet* set
+ * Returns: int
+ *
+ * Marks paths that went quiet as dead, and
+ * moves the primary to the fastest live path
+ *
+ * Returns the socket of the primary, which is
+ * left as it was if no path is alive
+ *****************************************/
+int choosePath(PathSet* set);
+
+#endif
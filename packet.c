@@ -0,0 +1,139 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       packet.c
+
+Note:       Implementation of packets and the list of unacknowledged
+            packets. See packet.h
+*/
+#include "packet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void pushTail(LinkedList* list, struct packet* pck)
+{
+    LLNode* newNode = malloc(sizeof(LLNode));
+    if (newNode == NULL)
+    {
+        perror("Unable to allocate space for new linked list node");
+        exit(-1);
+    }
+
+    // Populate node
+    newNode->pck = pck;
+    newNode->next = NULL;
+
+    // If the list is empty, insert at the head
+    if (list->head == NULL)
+    {
+        list->head = newNode;
+        return;
+    }
+
+    // Insert at the end of the list
+    LLNode* lastNode = list->head;
+    while (lastNode->next != NULL)
+    {
+        lastNode = lastNode->next;
+    }
+
+    lastNode->next = newNode;
+}
+
+struct packet* pop(LinkedList* list)
+{
+    if (list->head == NULL)
+    {
+        return NULL;
+    }
+
+    LLNode* poppedNode = list->head;
+    list->head = poppedNode->next;
+
+    struct packet* pck = poppedNode->pck;
+    free(poppedNode);
+
+    return pck;
+}
+
+void clearAckdPackets(LinkedList* list, uint32_t ackN)
+{
+    while (list->head != NULL)
+    {
+        if (list->head->pck->seqN >= ackN)
+        {
+            return;
+        }
+
+        struct packet* poppedPacket = pop(list);
+        deletePacket(poppedPacket);
+    }
+}
+
+void clearList(LinkedList* list)
+{
+    while (list->head != NULL)
+    {
+        struct packet* poppedPacket = pop(list);
+        deletePacket(poppedPacket);
+    }
+}
+
+struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length)
+{
+    struct packet* newPacket = malloc(sizeof(struct packet));
+    if (newPacket == NULL)
+    {
+        perror("Unable to allocate space for new packet");
+        exit(-1);
+    }
+
+    newPacket->payload = malloc(PACKET_PAYLOAD_LEN);
+    if (newPacket->payload == NULL)
+    {
+        perror("Unable to allocate space for packet payload");
+        exit(-1);
+    }
+
+    newPacket->type = type;
+    newPacket->seqN = seqN;
+    newPacket->ackN = ackN;
+    newPacket->length = length;
+    newPacket->sentMicros = 0;
+
+    return newPacket;
+}
+
+void deletePacket(struct packet* pck)
+{
+    free(pck->payload);
+    free(pck);
+}
+
+int compressPacket(void* buffer, struct packet pck)
+{
+    int index = 0;
+
+    // Write in packet type
+    *(uint32_t*) (buffer+index) = pck.type;
+    index += sizeof(uint32_t);
+
+    // Write in seqN
+    *(uint32_t*) (buffer+index) = pck.seqN;
+    index += sizeof(uint32_t);
+
+    // Write in ackN
+    *(uint32_t*) (buffer+index) = pck.ackN;
+    index += sizeof(uint32_t);
+
+    // Write in payload length
+    *(uint32_t*) (buffer+index) = pck.length;
+    index += sizeof(uint32_t);
+
+    // Write in the payload
+    memcpy(buffer+index, pck.payload, pck.length);
+    index += pck.length;
+
+    return index; // This should now equal the size of the data in buffer
+}
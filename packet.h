@@ -0,0 +1,135 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       packet.h
+
+Note:       Packets as cproxy and sproxy hold them in memory, and the
+            list of data packets each keeps until the other side
+            acknowledges them.
+
+            A packet is the header fields, the time it was first sent,
+            for the stats, and a payload buffer of PACKET_PAYLOAD_LEN
+            bytes. The list is kept in seqN order: packets are pushed on
+            to the tail as they are sent, and trimmed from the head as
+            ackNs arrive, so every heartbeat can retransmit it from the
+            head.
+
+            These run for every packet sent and acknowledged, and
+            bench/packetbench.c measures them on their own.
+*/
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+#define PACKET_PAYLOAD_LEN 1024 // Room newPacket allocates for a payload
+
+struct packet {
+    // header
+    uint32_t type;      // 0 = heartbeat, !0 = data
+    uint32_t seqN;      // Sequence number
+    uint32_t ackN;      // Ack number (the seqN of the next expected packet)
+    uint32_t length;    // length of payload
+    uint32_t sentMicros; // statsMicros() when first sent, 0 if not known (see stats.h)
+    // payload
+    void* payload;      // either struct heartbeatPayload or buffer
+};
+
+typedef struct LLNode_struct {
+
+    struct LLNode_struct* next;
+    struct packet* pck;
+
+} LLNode;
+
+typedef struct {
+
+    LLNode* head;
+
+} LinkedList;
+
+/**************************************************
+ * pushTail
+ *
+ * Arguments: LinkedList* list, struct packet* pck
+ * Returns: void
+ *
+ * Creates a new LLNode that points to the
+ * given pck, and pushes it on to the end of the
+ * given list
+ *************************************************/
+void pushTail(LinkedList* list, struct packet* pck);
+
+/**************************************************
+ * pop
+ *
+ * Arguments: LinkedList* list
+ * Returns: packet*
+ *
+ * Pop's off the head of the linked list and
+ * returns the packet contained in it
+ *
+ * Returns NULL if the list was empty
+ *************************************************/
+struct packet* pop(LinkedList* list);
+
+/**************************************************
+ * clearAckdPackets
+ *
+ * Arguments: LinkedList* list, uint32_t ackN
+ * Returns: void
+ *
+ * Deletes all packets in the linked list that
+ * have a seqN less than ackN
+ *************************************************/
+void clearAckdPackets(LinkedList* list, uint32_t ackN);
+
+/**************************************************
+ * clearList
+ *
+ * Arguments: LinkedList* list
+ * Returns: void
+ *
+ * Deletes everything in the linked list
+ *************************************************/
+void clearList(LinkedList* list);
+
+/******************************************
+ * newPacket
+ *
+ * Arguments: uint32_t type, seqN, ackN,
+ *                     length
+ * Returns: struct packet*
+ *
+ * Allocates space for a new packet and
+ * packet payload, and sets the given
+ * attributes
+ *****************************************/
+struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length);
+
+/******************************************
+ * deletePacket
+ *
+ * Arguments: struct packet* pck
+ * Returns: void
+ *
+ * Frees the memory allocated for the
+ * given packet and packet payload
+ *****************************************/
+void deletePacket(struct packet* pck);
+
+/******************************************
+ * compressPacket
+ *
+ * Arguments: char* buffer, struct packet
+ * Returns: int
+ *
+ * Takes the given packet and compresses all
+ * the data into a single buffer, which can
+ * then be sent later using send()
+ *
+ * Returns the number of bytes now stored
+ * in buffer
+ *****************************************/
+int compressPacket(void* buffer, struct packet);
+
+#endif
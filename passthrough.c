@@ -0,0 +1,143 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       passthrough.c
+
+Note:       Implementation of plain TCP passthrough. See passthrough.h
+*/
+#define _GNU_SOURCE // Needed to use splice
+
+#include "passthrough.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+
+int spliceRelay(int receiveFD, int sendFD, int pipeFDs[2])
+{
+    // Move what has arrived in to the pipe, select said receiveFD is ready so this does not block
+    ssize_t bytesQueued = splice(receiveFD, NULL, pipeFDs[1], NULL, PASSTHROUGH_CHUNK_LEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytesQueued < 0 && errno == EAGAIN)
+    {
+        return 0;
+    }
+    if (bytesQueued < 1) // Returns 0 on closed connection, -1 on error
+    {
+        return -1;
+    }
+
+    // Empty the pipe in to sendFD, waiting for room as send() would
+    while (bytesQueued > 0)
+    {
+        ssize_t bytesSent = splice(pipeFDs[0], NULL, sendFD, NULL, bytesQueued, SPLICE_F_MOVE);
+        if (bytesSent < 1) // Returns -1 on error
+        {
+            return -1;
+        }
+        bytesQueued -= bytesSent;
+    }
+
+    return 0;
+}
+
+int runPassthrough(int clientSocketFD, int serverSocketFD)
+{
+    // One pipe for each direction, so bytes left in one never mix with the other
+    int toServerPipe[2], toClientPipe[2];
+    if (pipe(toServerPipe) < 0)
+    {
+        perror("Unable to create a passthrough pipe");
+        return -1;
+    }
+    if (pipe(toClientPipe) < 0)
+    {
+        perror("Unable to create a passthrough pipe");
+        close(toServerPipe[0]);
+        close(toServerPipe[1]);
+        return -1;
+    }
+
+    int result = 0;
+    while (1)
+    {
+        fd_set socketSet;
+        FD_ZERO(&socketSet);
+        FD_SET(clientSocketFD, &socketSet);
+        FD_SET(serverSocketFD, &socketSet);
+
+        if (select((clientSocketFD > serverSocketFD ? clientSocketFD : serverSocketFD) + 1, &socketSet, NULL, NULL, NULL) < 0)
+        {
+            perror("Unable to use select to wait for passthrough input");
+            result = -1;
+            break;
+        }
+
+        if (FD_ISSET(serverSocketFD, &socketSet) && spliceRelay(serverSocketFD, clientSocketFD, toClientPipe) < 0)
+        {
+            logMessage(LOG_INFO, "Passthrough connection closed by either server or client\n");
+            break;
+        }
+
+        if (FD_ISSET(clientSocketFD, &socketSet) && spliceRelay(clientSocketFD, serverSocketFD, toServerPipe) < 0)
+        {
+            logMessage(LOG_INFO, "Passthrough connection closed by either server or client\n");
+            break;
+        }
+    }
+
+    close(toServerPipe[0]);
+    close(toServerPipe[1]);
+    close(toClientPipe[0]);
+    close(toClientPipe[1]);
+    return result;
+}
+
+int servePassthrough(int listenSocketFD, struct sockaddr* forwardAddress, socklen_t forwardAddressLength)
+{
+    while (1)
+    {
+        logMessage(LOG_INFO, "Waiting for a new passthrough connection...\n");
+        int clientSocketFD = accept(listenSocketFD, NULL, NULL);
+        if (clientSocketFD < 0) // accept returns -1 on error
+        {
+            perror("Unable to accept a passthrough connection");
+            continue; // Repeat loop to receive another connection
+        }
+
+        int serverSocketFD = socket(forwardAddress->sa_family, SOCK_STREAM, 0);
+        if (serverSocketFD < 0) // socket returns -1 on error
+        {
+            perror("Unable to create a passthrough socket");
+            close(clientSocketFD);
+            continue;
+        }
+
+        if (connect(serverSocketFD, forwardAddress, forwardAddressLength) < 0)
+        {
+            perror("Unable to connect a passthrough connection");
+            close(serverSocketFD);
+            close(clientSocketFD);
+            continue;
+        }
+        logMessage(LOG_INFO, "Relaying a new passthrough connection\n");
+
+        int result = runPassthrough(clientSocketFD, serverSocketFD);
+
+        if (close(serverSocketFD) < 0) // close returns -1 on error
+        {
+            perror("Unable to properly close a passthrough server socket");
+        }
+        if (close(clientSocketFD) < 0)
+        {
+            perror("Unable to properly close a passthrough client socket");
+        }
+        if (result < 0)
+        {
+            return -1;
+        }
+    }
+}
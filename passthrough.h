@@ -0,0 +1,73 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       passthrough.h
+
+Note:       Plain TCP passthrough, for trusted LAN deployments where the
+            session layer is not wanted, or the traffic is already framed.
+
+            Started with -P, cproxy and sproxy drop heartbeats, packets
+            and retransmission, and relay bytes between their two sockets
+            as the Milestone 2 proxies did. Instead of copying them
+            through a buffer with recv() and send(), they are moved with
+            splice() in to a pipe and from the pipe to the other socket,
+            so the kernel hands pages from one socket to the other and
+            the data never reaches user memory. A session does not
+            survive a disconnect in this mode.
+
+            "make splicebench" compares the throughput and CPU cost of
+            the two (see bench/splicebench.c).
+*/
+#ifndef PASSTHROUGH_H
+#define PASSTHROUGH_H
+
+#include <sys/socket.h>
+
+#define PASSTHROUGH_CHUNK_LEN 65536 // most bytes moved per splice() call, the default pipe capacity
+
+/******************************************
+ * spliceRelay
+ *
+ * Arguments: int receiveFD, int sendFD,
+ *            int pipeFDs[2]
+ * Returns: int
+ *
+ * Moves whatever is ready on receiveFD to
+ * sendFD through the empty pipe pipeFDs,
+ * without copying it in to user memory
+ *
+ * Returns -1 if receiveFD closed or on error,
+ * 0 otherwise
+ *****************************************/
+int spliceRelay(int receiveFD, int sendFD, int pipeFDs[2]);
+
+/******************************************
+ * runPassthrough
+ *
+ * Arguments: int clientSocketFD,
+ *            int serverSocketFD
+ * Returns: int
+ *
+ * Relays bytes both ways between the two
+ * sockets until either one closes
+ *
+ * Returns -1 on error, 0 once a socket closed
+ *****************************************/
+int runPassthrough(int clientSocketFD, int serverSocketFD);
+
+/******************************************
+ * servePassthrough
+ *
+ * Arguments: int listenSocketFD,
+ *            struct sockaddr* forwardAddress,
+ *            socklen_t forwardAddressLength
+ * Returns: int
+ *
+ * Accepts connections on listenSocketFD one
+ * at a time, connects each to forwardAddress
+ * and relays between them with runPassthrough
+ *
+ * Only returns, with -1, if select fails
+ *****************************************/
+int servePassthrough(int listenSocketFD, struct sockaddr* forwardAddress, socklen_t forwardAddressLength);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       predict.c
+
+Note:       Implementation of the local echo cproxy guesses. See
+            predict.h
+*/
+#include "predict.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IAC 255
+
+/******************************************
+ * putOutput
+ *
+ * Arguments: EchoPredictor* predictor,
+ *            int* used, const void* data,
+ *            int length
+ * Returns: int
+ *
+ * Appends data to what the client gets
+ * instead of the output, used bytes of which
+ * are taken, growing it as needed
+ *
+ * Returns 0 on success, or -1 on error
+ *****************************************/
+static int putOutput(EchoPredictor* predictor, int* used, const void* data, int length)
+{
+    if (*used + length > predictor->outputCapacity)
+    {
+        int capacity = predictor->outputCapacity * 2 + length;
+        char* output = realloc(predictor->output, capacity);
+        if (output == NULL)
+        {
+            perror("Unable to allocate space for the predicted echo");
+            return -1;
+        }
+        predictor->output = output;
+        predictor->outputCapacity = capacity;
+    }
+    memcpy(predictor->output + *used, data, length);
+    *used += length;
+
+    return 0;
+}
+
+/******************************************
+ * withdrawPredictions
+ *
+ * Arguments: EchoPredictor* predictor,
+ *            int* used
+ * Returns: int
+ *
+ * Forgets every guess, and appends what
+ * redraws the cells under the shown ones
+ * and puts the cursor and pen back
+ *
+ * Returns 0 on success, or -1 on error
+ *****************************************/
+static int withdrawPredictions(EchoPredictor* predictor, int* used)
+{
+    // The shown ones follow each other along a row
+    int fromX = -1;
+    int toX = 0;
+    int y = 0;
+    for (int i = 0; i < predictor->count; i++)
+    {
+        Prediction* prediction = &predictor->predictions[predictor->first + i];
+        if (prediction->isShown != 0)
+        {
+            fromX = (fromX < 0) ? prediction->x : fromX;
+            toX = prediction->x;
+            y = prediction->y;
+        }
+    }
+    predictor->first = 0;
+    predictor->count = 0;
+    predictor->isBlocked = 0;
+    if (fromX < 0)
+    {
+        return 0;
+    }
+    predictor->isConfident = 0;
+
+    int length;
+    char* cells = writeTerminalCells(predictor->terminal, fromX, y, toX - fromX + 1, &length);
+    if (cells == NULL)
+    {
+        return -1;
+    }
+    int result = putOutput(predictor, used, cells, length);
+    free(cells);
+
+    return result;
+}
+
+/******************************************
+ * isEchoOf
+ *
+ * Arguments: TerminalModel* terminal,
+ *            Prediction* prediction,
+ *            unsigned char byte
+ * Returns: int
+ *
+ * Is true if byte, as the next output, draws
+ * the character guessed where and how it was
+ * shown
+ *****************************************/
+static int isEchoOf(TerminalModel* terminal, Prediction* prediction, unsigned char byte)
+{
+    return byte == prediction->character && isTerminalAtRest(terminal) && terminal->isAlternate == 0
+        && terminal->isWrapPending == 0 && terminal->cursorX == prediction->x && terminal->cursorY == prediction->y
+        && terminal->pen.foreground == prediction->pen.foreground && terminal->pen.background == prediction->pen.background
+        && terminal->pen.attributes == prediction->pen.attributes && terminal->charsets[terminal->shift] == prediction->charset;
+}
+
+EchoPredictor* newEchoPredictor()
+{
+    EchoPredictor* predictor = malloc(sizeof(EchoPredictor));
+    if (predictor == NULL)
+    {
+        perror("Unable to allocate space for the echo predictor");
+        exit(-1);
+    }
+
+    predictor->terminal = newTerminalModel();
+    predictor->output = NULL;
+    predictor->outputCapacity = 0;
+    resetEchoPredictor(predictor);
+
+    return predictor;
+}
+
+void deleteEchoPredictor(EchoPredictor* predictor)
+{
+    if (predictor == NULL)
+    {
+        return;
+    }
+    deleteTerminalModel(predictor->terminal);
+    free(predictor->output);
+    free(predictor);
+}
+
+void resetEchoPredictor(EchoPredictor* predictor)
+{
+    resetTerminalModel(predictor->terminal, 1);
+    predictor->first = 0;
+    predictor->count = 0;
+    predictor->isConfident = 0;
+    predictor->isBlocked = 0;
+}
+
+int predictEcho(EchoPredictor* predictor, const void* input, int length, uint32_t nowMicros, char* echo)
+{
+    TerminalModel* terminal = predictor->terminal;
+    const unsigned char* bytes = input;
+    int echoLength = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char byte = bytes[i];
+        int isKey = isTerminalInputData(terminal) && byte != IAC;
+        feedTerminalInput(terminal, &byte, 1);
+        if (isKey == 0)
+        {
+            continue;
+        }
+
+        // Enter, backspace, arrows and the like do things no guess follows, so the next keys are only watched
+        if (byte < 0x20 || byte > 0x7e)
+        {
+            predictor->isConfident = 0;
+            predictor->isBlocked = (predictor->count > 0);
+            continue;
+        }
+
+        // The guess goes after the ones still waiting, in the same row
+        if (predictor->first + predictor->count == PREDICT_LEN && predictor->first > 0)
+        {
+            memmove(predictor->predictions, predictor->predictions + predictor->first, predictor->count * sizeof(Prediction));
+            predictor->first = 0;
+        }
+        int x = (predictor->count > 0) ? predictor->predictions[predictor->first + predictor->count - 1].x + 1 : terminal->cursorX;
+        if (terminal->isRemoteEcho == 0 || terminal->isSynced == 0 || terminal->isAlternate != 0
+            || isTerminalAtRest(terminal) == 0 || terminal->isWrapPending != 0 || predictor->isBlocked != 0
+            || x >= terminal->columns - 1 || predictor->first + predictor->count == PREDICT_LEN)
+        {
+            predictor->isBlocked = (predictor->count > 0);
+            continue;
+        }
+
+        Prediction* prediction = &predictor->predictions[predictor->first + predictor->count++];
+        prediction->character = byte;
+        prediction->x = x;
+        prediction->y = terminal->cursorY;
+        prediction->pen = terminal->pen;
+        prediction->charset = terminal->charsets[terminal->shift];
+        prediction->isShown = predictor->isConfident;
+        prediction->typedMicros = nowMicros;
+        if (prediction->isShown != 0)
+        {
+            echo[echoLength++] = byte;
+        }
+    }
+
+    return echoLength;
+}
+
+const char* reconcileEcho(EchoPredictor* predictor, const void* output, int length, int* sentLength)
+{
+    TerminalModel* terminal = predictor->terminal;
+    const unsigned char* bytes = output;
+
+    if (predictor->count == 0)
+    {
+        feedTerminalOutput(terminal, output, length, 0);
+        *sentLength = length;
+        return output;
+    }
+
+    // One byte at a time while guesses wait, as each is checked against the model as it was just before it
+    int used = 0;
+    int i = 0;
+    while (i < length && predictor->count > 0)
+    {
+        Prediction* prediction = &predictor->predictions[predictor->first];
+        if (isEchoOf(terminal, prediction, bytes[i]) == 0)
+        {
+            if (withdrawPredictions(predictor, &used) < 0)
+            {
+                feedTerminalOutput(terminal, bytes + i, length - i, 0);
+                return NULL;
+            }
+            break;
+        }
+
+        // A shown echo is dropped, and the first that was only watched for makes the next guesses shown
+        feedTerminalOutput(terminal, bytes + i, 1, 0);
+        if (prediction->isShown == 0)
+        {
+            predictor->isConfident = 1;
+            if (putOutput(predictor, &used, bytes + i, 1) < 0)
+            {
+                feedTerminalOutput(terminal, bytes + i + 1, length - i - 1, 0);
+                return NULL;
+            }
+        }
+        predictor->first++;
+        predictor->count--;
+        predictor->isBlocked = predictor->isBlocked != 0 && predictor->count > 0;
+        i++;
+    }
+
+    feedTerminalOutput(terminal, bytes + i, length - i, 0);
+    if (putOutput(predictor, &used, bytes + i, length - i) < 0)
+    {
+        return NULL;
+    }
+
+    *sentLength = used;
+    return predictor->output;
+}
+
+const char* expireEcho(EchoPredictor* predictor, uint32_t nowMicros, int* length)
+{
+    if (predictor->count == 0
+        || nowMicros - predictor->predictions[predictor->first].typedMicros < PREDICT_TIMEOUT_MS * 1000)
+    {
+        return NULL;
+    }
+
+    int used = 0;
+    if (withdrawPredictions(predictor, &used) < 0 || used == 0)
+    {
+        return NULL;
+    }
+
+    *length = used;
+    return predictor->output;
+}
@@ -0,0 +1,155 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       predict.h
+
+Note:       Local echo that cproxy guesses, with -e, so that over a slow
+            link typing shows up at once instead of a round trip later.
+
+            cproxy keeps a terminal model (see terminal.h) of what its
+            client's screen shows, from the daemon's output it passes
+            on. When the daemon echoes what is typed (telnet WILL ECHO),
+            a printable keystroke is guessed to come back as itself, at
+            the cursor, in the pen in use. While cproxy is confident of
+            that, it shows the character to the client straight away and
+            remembers where it put it. When the daemon's output then
+            writes that character at that place in that pen, the output
+            byte is dropped, since the client already shows what it
+            would draw. Any other output first takes every shown guess
+            back: the cells under them are redrawn from the model, and
+            the cursor and pen put back, before the output is passed on.
+            Guesses still shown after PREDICT_TIMEOUT_MS are taken back
+            too, since the daemon may have read the keys without echoing
+            them.
+
+            cproxy is only confident after it has seen the echo of a
+            keystroke it did not show arrive where it guessed, and it
+            stops being confident after any keystroke that is not
+            printable, such as Enter, and after a wrong guess. So after
+            a command or at a password prompt the first key typed is
+            only shown once the daemon has echoed it. Nothing is
+            guessed on the alternate screen, where full screen programs
+            read keys as commands, at the end of a row, or past
+            PREDICT_LEN keystrokes waiting for their echo.
+*/
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "terminal.h"
+
+#define PREDICT_LEN 64              // most keystrokes waiting for their echo
+#define PREDICT_TIMEOUT_MS 2000     // how long a shown keystroke may wait for its echo
+
+typedef struct {
+
+    uint8_t character;
+    int x;                  // where the echo is due
+    int y;
+    TerminalCell pen;       // the pen and charset it is due in
+    int charset;
+    int isShown;            // is true if it was shown to the client, rather than only watched for
+    uint32_t typedMicros;
+
+} Prediction;
+
+typedef struct {
+
+    TerminalModel* terminal;            // of the client's screen
+    Prediction predictions[PREDICT_LEN];
+    int first;                          // the oldest waiting for its echo
+    int count;
+    int isConfident;                    // is true once a keystroke's echo arrived where it was due
+    int isBlocked;                      // is true once a key was typed that no guess was made for, until the rest are echoed
+
+    // What the client gets instead of the output, when that is changed
+    char* output;
+    int outputCapacity;
+
+} EchoPredictor;
+
+/**************************************************
+ * newEchoPredictor
+ *
+ * Arguments: none
+ * Returns: EchoPredictor*
+ *
+ * Allocates a predictor for a blank 80x24 screen,
+ * exits the process if it can't
+ *************************************************/
+EchoPredictor* newEchoPredictor();
+
+/**************************************************
+ * deleteEchoPredictor
+ *
+ * Arguments: EchoPredictor* predictor
+ * Returns: void
+ *
+ * Frees a predictor and its model
+ *************************************************/
+void deleteEchoPredictor(EchoPredictor* predictor);
+
+/**************************************************
+ * resetEchoPredictor
+ *
+ * Arguments: EchoPredictor* predictor
+ * Returns: void
+ *
+ * Forgets every guess and blanks the model, for a
+ * new client
+ *************************************************/
+void resetEchoPredictor(EchoPredictor* predictor);
+
+/**************************************************
+ * predictEcho
+ *
+ * Arguments: EchoPredictor* predictor,
+ *            const void* input, int length,
+ *            uint32_t nowMicros, char* echo
+ * Returns: int
+ *
+ * Guesses the echo of input from the client, on
+ * its way to sproxy, and writes what to show the
+ * client now in echo, which has room for length
+ * bytes
+ *
+ * Returns the bytes written in to echo
+ *************************************************/
+int predictEcho(EchoPredictor* predictor, const void* input, int length, uint32_t nowMicros, char* echo);
+
+/**************************************************
+ * reconcileEcho
+ *
+ * Arguments: EchoPredictor* predictor,
+ *            const void* output, int length,
+ *            int* sentLength
+ * Returns: const char*
+ *
+ * Follows output from sproxy on its way to the
+ * client, dropping the echoes already shown and
+ * taking back wrong guesses
+ *
+ * Returns what to send the client instead, with
+ * its length in sentLength, which is output itself
+ * while no guess is waiting, or stays valid until
+ * the next call. Returns NULL if memory ran out
+ *************************************************/
+const char* reconcileEcho(EchoPredictor* predictor, const void* output, int length, int* sentLength);
+
+/**************************************************
+ * expireEcho
+ *
+ * Arguments: EchoPredictor* predictor,
+ *            uint32_t nowMicros, int* length
+ * Returns: const char*
+ *
+ * Takes back the guesses shown if the oldest has
+ * waited PREDICT_TIMEOUT_MS for its echo
+ *
+ * Returns what to send the client to do so, with
+ * its length in length, valid until the next call,
+ * or NULL if there is nothing to take back
+ *************************************************/
+const char* expireEcho(EchoPredictor* predictor, uint32_t nowMicros, int* length);
+
+#endif
@@ -0,0 +1,45 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       priority.c
+
+Note:       Implementation of the two classes of local data. See
+            priority.h
+*/
+#include "priority.h"
+
+#include <stdio.h>
+#include <sys/ioctl.h>
+
+int priorityReadLength(int socketFD, uint32_t inFlight, uint32_t windowLength, int maxLength)
+{
+    if (windowLength == 0)
+    {
+        return maxLength;
+    }
+    if (inFlight >= windowLength)
+    {
+        return 0;
+    }
+
+    // Bulk gets its share, at least one packet of it
+    uint32_t bulkLength = windowLength * PRIORITY_BULK_PERCENT / 100;
+    if (inFlight < bulkLength || inFlight == 0)
+    {
+        return maxLength;
+    }
+
+    // The reserve only takes what is small enough to be interactive. A closed socket shows nothing waiting,
+    // and is read so its close is seen
+    int waiting;
+    if (ioctl(socketFD, FIONREAD, &waiting) < 0)
+    {
+        perror("Unable to see how much is waiting on the local socket");
+        return maxLength;
+    }
+    if (waiting > PRIORITY_INTERACTIVE_LEN)
+    {
+        return 0;
+    }
+
+    return (maxLength < PRIORITY_INTERACTIVE_LEN) ? maxLength : PRIORITY_INTERACTIVE_LEN;
+}
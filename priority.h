@@ -0,0 +1,66 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       priority.h
+
+Note:       Two classes of local data, so a keystroke, or its echo, is
+            not stuck behind a window full of bulk output, such as a
+            large cat.
+
+            Each direction of a session is one ordered byte stream, so
+            no frame can overtake the ones sent before it, and the other
+            proxy only takes data packets in order: sending or
+            retransmitting a small frame ahead of earlier bulk frames
+            would only have it dropped, or held, until they arrive. What
+            a proxy can bound is how much bulk is ahead of a keystroke
+            when it is read. Data read while at most
+            PRIORITY_INTERACTIVE_LEN bytes were waiting on the local
+            socket is interactive, and anything more is bulk. Bulk may
+            only fill PRIORITY_BULK_PERCENT of the agreed window of
+            unacknowledged packets, and the rest is kept for interactive
+            data, which is then read PRIORITY_INTERACTIVE_LEN bytes at a
+            time. So a keystroke waits behind a quarter less bulk, is
+            sent as soon as it is read rather than once an
+            acknowledgement makes room, and each heartbeat retransmits
+            less bulk ahead of it. The receiving proxy acknowledges
+            every half of the bulk share, so the bulk keeps flowing.
+
+            The local socket is only watched for the reserve while what
+            waits on it is small enough to be interactive, so a proxy
+            with bulk waiting and only the reserve free does not spin.
+
+            The rest of the queue ahead of an echo is in the kernel, in
+            sproxy's receive buffer for the daemon's socket, which Linux
+            would otherwise grow to hundreds of KB, so sproxy keeps it
+            at PRIORITY_LOCAL_BUFFER_LEN. What the daemon itself has
+            written but not yet sent is out of reach.
+*/
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include <stdint.h>
+
+#define PRIORITY_INTERACTIVE_LEN 64     // most bytes waiting for a read to be interactive
+#define PRIORITY_BULK_PERCENT 75        // of the agreed window that bulk data may fill
+#define PRIORITY_LOCAL_BUFFER_LEN 8192  // receive buffer sproxy asks for on its daemon socket, which Linux doubles
+
+/**************************************************
+ * priorityReadLength
+ *
+ * Arguments: int socketFD, uint32_t inFlight,
+ *            uint32_t windowLength, int maxLength
+ * Returns: int
+ *
+ * Decides how much to read from the local socket
+ * socketFD, with inFlight data packets sent but
+ * not yet acknowledged, out of a window of
+ * windowLength (0 for no limit)
+ *
+ * Returns maxLength while bulk may be sent,
+ * PRIORITY_INTERACTIVE_LEN (at most maxLength)
+ * while only interactive data may and no more
+ * than that is waiting, or 0 if socketFD should
+ * not be read now
+ *************************************************/
+int priorityReadLength(int socketFD, uint32_t inFlight, uint32_t windowLength, int maxLength);
+
+#endif
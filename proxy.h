@@ -0,0 +1,46 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       proxy.h
+
+Note:       The protocol library both proxies are built on, libproxy.a
+            (see the Makefile): packets and their list, framing,
+            compression, encryption, parity, the Hello, multipath,
+            passthrough, looking up and reaching sproxy over IPv6 or
+            IPv4, session handoff and saved state, the spool of daemon
+            output, the two classes of local data, the terminal model
+            and guessed echo, forwarded services and SOCKS, stats,
+            latency tracing and logging.
+            Each module keeps its own header, which this one includes,
+            so a proxy only has to include this.
+
+            The archive is compiled once and linked in to both proxies,
+            with the same flags as the proxies themselves, so a release
+            build (make release, release-o3, release-lto or release-pgo)
+            optimizes the library and the proxies together.
+*/
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "cipher.h"
+#include "dial.h"
+#include "fec.h"
+#include "frame.h"
+#include "handoff.h"
+#include "hello.h"
+#include "log.h"
+#include "lz.h"
+#include "multipath.h"
+#include "packet.h"
+#include "passthrough.h"
+#include "predict.h"
+#include "priority.h"
+#include "resolve.h"
+#include "sessionstate.h"
+#include "socks.h"
+#include "spool.h"
+#include "stats.h"
+#include "stream.h"
+#include "terminal.h"
+#include "trace.h"
+
+#endif
@@ -0,0 +1,282 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       resolve.c
+
+Note:       Implementation of looking up sproxy's name on a thread. See
+            resolve.h
+*/
+#define _DEFAULT_SOURCE // Needed to use getaddrinfo and res_nsearch
+
+#include "resolve.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define RESOLVE_ANSWER_LEN 4096     // largest DNS answer read for its TTLs
+
+/******************************************
+ * lookUpAddresses
+ *
+ * Arguments: Resolver* resolver, int flags,
+ *            DialAddress* addresses
+ * Returns: int
+ *
+ * Looks up resolver's host with getaddrinfo
+ * and flags, and writes up to
+ * DIAL_ADDRESS_LEN of its addresses in to
+ * addresses
+ *
+ * Returns how many it wrote, or -1 on error
+ *****************************************/
+static int lookUpAddresses(Resolver* resolver, int flags, DialAddress* addresses)
+{
+    char service[8];
+    snprintf(service, sizeof(service), "%u", resolver->port);
+    struct addrinfo hints = {
+        .ai_family = resolver->family,
+        .ai_socktype = SOCK_STREAM, // the addresses are the same for UDP, and are only wanted once
+        .ai_flags = AI_NUMERICSERV | flags
+    };
+    struct addrinfo* results;
+    if (getaddrinfo(resolver->host, service, &hints, &results) != 0)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    for (struct addrinfo* result = results; result != NULL && count < DIAL_ADDRESS_LEN; result = result->ai_next)
+    {
+        memset(&addresses[count], 0, sizeof(DialAddress)); // padding too, so answers compare whole
+        memcpy(&addresses[count].address, result->ai_addr, result->ai_addrlen);
+        addresses[count].length = result->ai_addrlen;
+        count++;
+    }
+    freeaddrinfo(results);
+
+    return count;
+}
+
+/******************************************
+ * queryTTL
+ *
+ * Arguments: res_state state,
+ *            const char* host, int type
+ * Returns: int
+ *
+ * Asks the DNS for host's records of type
+ *
+ * Returns the smallest TTL of the answer,
+ * CNAMEs on the way included, or -1 if
+ * there was none
+ *****************************************/
+static int queryTTL(res_state state, const char* host, int type)
+{
+    unsigned char answer[RESOLVE_ANSWER_LEN];
+    int length = res_nsearch(state, host, ns_c_in, type, answer, sizeof(answer));
+    if (length < 0)
+    {
+        return -1;
+    }
+
+    // A truncated answer fails to parse rather than being read past its end
+    ns_msg message;
+    if (ns_initparse(answer, (length < (int) sizeof(answer)) ? length : (int) sizeof(answer), &message) < 0)
+    {
+        return -1;
+    }
+
+    int ttl = -1;
+    for (int i = 0; i < ns_msg_count(message, ns_s_an); i++)
+    {
+        ns_rr record;
+        if (ns_parserr(&message, ns_s_an, i, &record) == 0 && (ttl < 0 || (int) ns_rr_ttl(record) < ttl))
+        {
+            ttl = (int) ns_rr_ttl(record);
+        }
+    }
+
+    return ttl;
+}
+
+/******************************************
+ * lookUpTTL
+ *
+ * Arguments: Resolver* resolver
+ * Returns: int
+ *
+ * Works out how long an answer for
+ * resolver's host is kept: the smallest TTL
+ * of its records, of resolver's family,
+ * clamped, or RESOLVE_DEFAULT_TTL_S without
+ * any
+ *
+ * Returns the time in seconds
+ *****************************************/
+static int lookUpTTL(Resolver* resolver)
+{
+    // A state of its own each time, so the thread needs no lock, and a changed resolv.conf is read again
+    struct __res_state state;
+    memset(&state, 0, sizeof(state));
+    if (res_ninit(&state) < 0)
+    {
+        return RESOLVE_DEFAULT_TTL_S;
+    }
+
+    int ttl = -1;
+    int types[2] = { ns_t_a, ns_t_aaaa };
+    for (int i = 0; i < 2; i++)
+    {
+        if ((types[i] == ns_t_a && resolver->family == AF_INET6) || (types[i] == ns_t_aaaa && resolver->family == AF_INET))
+        {
+            continue;
+        }
+
+        int typeTTL = queryTTL(&state, resolver->host, types[i]);
+        if (typeTTL >= 0 && (ttl < 0 || typeTTL < ttl))
+        {
+            ttl = typeTTL;
+        }
+    }
+    res_nclose(&state);
+
+    if (ttl < 0)
+    {
+        return RESOLVE_DEFAULT_TTL_S;
+    }
+    if (ttl < RESOLVE_MIN_TTL_S)
+    {
+        return RESOLVE_MIN_TTL_S;
+    }
+    return (ttl > RESOLVE_MAX_TTL_S) ? RESOLVE_MAX_TTL_S : ttl;
+}
+
+/******************************************
+ * runResolver
+ *
+ * Arguments: void* argument, the Resolver
+ * Returns: void*
+ *
+ * Thread: looks up the resolver's host, and
+ * again each time its answer expires or a
+ * lookup fails, for as long as the proxy
+ * runs. Never logs, as only the proxy's
+ * thread may
+ *****************************************/
+static void* runResolver(void* argument)
+{
+    Resolver* resolver = argument;
+    while (1)
+    {
+        DialAddress addresses[DIAL_ADDRESS_LEN];
+        int count = lookUpAddresses(resolver, 0, addresses);
+
+        // Handed over before the TTLs are asked for, which may take as long again
+        pthread_mutex_lock(&resolver->lock);
+        if (count <= 0)
+        {
+            resolver->failures++;
+        }
+        else if (count != resolver->addressCount || memcmp(addresses, resolver->addresses, count * sizeof(DialAddress)) != 0)
+        {
+            // Only a changed answer is new, so the proxy keeps its place in the same addresses
+            memcpy(resolver->addresses, addresses, count * sizeof(DialAddress));
+            resolver->addressCount = count;
+            resolver->isNew = 1;
+        }
+        pthread_mutex_unlock(&resolver->lock);
+
+        int ttl = (count > 0) ? lookUpTTL(resolver) : RESOLVE_RETRY_S;
+        sleep(ttl);
+    }
+
+    return NULL;
+}
+
+Resolver* newResolver(const char* host, in_port_t port, int family)
+{
+    if (strlen(host) >= RESOLVE_HOST_LEN)
+    {
+        printf("sproxy's name %s is too long\n", host);
+        return NULL;
+    }
+
+    Resolver* resolver = calloc(1, sizeof(Resolver));
+    if (resolver == NULL)
+    {
+        perror("Unable to allocate space for a resolver");
+        exit(-1);
+    }
+    strcpy(resolver->host, host);
+    resolver->port = port;
+    resolver->family = family;
+    pthread_mutex_init(&resolver->lock, NULL);
+
+    // An address is parsed at once, and one of the wrong family is an error rather than a name
+    struct in6_addr parsed;
+    if (inet_pton(AF_INET, host, &parsed) == 1 || inet_pton(AF_INET6, host, &parsed) == 1)
+    {
+        resolver->addressCount = lookUpAddresses(resolver, AI_NUMERICHOST, resolver->addresses);
+        if (resolver->addressCount <= 0)
+        {
+            printf("sproxy's address %s is not one cproxy can use\n", host);
+            pthread_mutex_destroy(&resolver->lock);
+            free(resolver);
+            return NULL;
+        }
+        resolver->isNew = 1;
+        return resolver;
+    }
+
+    // Started with every signal blocked, so that signals go to the proxy's own thread
+    resolver->isName = 1;
+    sigset_t signals, oldSignals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    int result = pthread_create(&resolver->thread, NULL, runResolver, resolver);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (result != 0)
+    {
+        printf("Unable to start the resolver thread: %s\n", strerror(result));
+        pthread_mutex_destroy(&resolver->lock);
+        free(resolver);
+        return NULL;
+    }
+    pthread_detach(resolver->thread);
+
+    return resolver;
+}
+
+int takeResolvedAddresses(Resolver* resolver, Dialer* dialer)
+{
+    pthread_mutex_lock(&resolver->lock);
+    int isNew = resolver->isNew;
+    int failures = resolver->failures;
+    int addressCount = resolver->addressCount;
+    if (isNew != 0)
+    {
+        setServerAddresses(dialer, resolver->addresses, resolver->addressCount);
+    }
+    resolver->isNew = 0;
+    resolver->failures = 0;
+    pthread_mutex_unlock(&resolver->lock);
+
+    if (failures != 0)
+    {
+        logMessage(LOG_WARNING, "Unable to resolve sproxy's name %s (%i lookups failed)\n", resolver->host, failures);
+    }
+    if (isNew != 0 && resolver->isName != 0)
+    {
+        logMessage(LOG_INFO, "Resolved sproxy's name %s to %i addresses\n", resolver->host, addressCount);
+    }
+
+    return isNew;
+}
@@ -0,0 +1,99 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       resolve.h
+
+Note:       Looking up sproxy's name without holding up cproxy.
+
+            A lookup can take seconds, or until its timeout when the
+            network has just changed, and cproxy's loop, which would
+            wait for it, is also the one forwarding keystrokes and
+            reconnecting. So a name is looked up on a thread of its own,
+            and the loop only ever takes the latest answer, which is a
+            copy under a lock the thread holds only to write it.
+
+            The answer is kept for as long as its DNS records say,
+            their smallest TTL, clamped between RESOLVE_MIN_TTL_S and
+            RESOLVE_MAX_TTL_S, and then looked up again, so a sproxy
+            that moves to a new address is reached there on the next
+            reconnect after the old records expire. The addresses come
+            from getaddrinfo, so they are the ones /etc/hosts and the
+            system's address ordering give, while the TTL comes from
+            asking the DNS for the same name, which a name only in
+            /etc/hosts does not have, so it is kept for
+            RESOLVE_DEFAULT_TTL_S.
+
+            A lookup that fails leaves the last answer in use, expired
+            or not, as an old address is more likely to work than none,
+            and is tried again after RESOLVE_RETRY_S. Until a name was
+            first resolved cproxy has no address to try, and keeps
+            retrying its connection each second as it does when sproxy
+            does not answer, so cproxy can start before the network is
+            up.
+
+            An IPv4 or IPv6 address is not a name, has no TTL, and
+            needs no thread.
+*/
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "dial.h"
+
+#define RESOLVE_HOST_LEN 256        // longest name, with its terminating 0
+#define RESOLVE_MIN_TTL_S 5         // least time an answer is kept, however short its TTL
+#define RESOLVE_MAX_TTL_S 3600      // most time an answer is kept, however long its TTL
+#define RESOLVE_DEFAULT_TTL_S 60    // time an answer is kept when the DNS gave no TTL for it
+#define RESOLVE_RETRY_S 5           // time after a failed lookup until the next
+
+typedef struct {
+
+    char host[RESOLVE_HOST_LEN];
+    in_port_t port;
+    int family;                                 // of the addresses wanted, AF_UNSPEC for either
+    int isName;                                 // is false for an address, which is not looked up
+
+    pthread_t thread;
+    pthread_mutex_t lock;                       // held by the thread only to write what follows
+
+    DialAddress addresses[DIAL_ADDRESS_LEN];    // the latest answer, in the resolver's order
+    int addressCount;
+    int isNew;                                  // is true until the proxy takes the latest answer
+    int failures;                               // lookups that failed since the proxy last took a result
+
+} Resolver;
+
+/**************************************************
+ * newResolver
+ *
+ * Arguments: const char* host, in_port_t port,
+ *            int family
+ * Returns: Resolver*
+ *
+ * Allocates a resolver for host, an address or a
+ * name, at port, of family, or of either for
+ * AF_UNSPEC. An address is parsed at once, and a
+ * name starts being looked up on a new thread
+ *
+ * Returns the resolver, or NULL on error
+ *************************************************/
+Resolver* newResolver(const char* host, in_port_t port, int family);
+
+/**************************************************
+ * takeResolvedAddresses
+ *
+ * Arguments: Resolver* resolver, Dialer* dialer
+ * Returns: int
+ *
+ * Gives dialer the latest addresses of resolver,
+ * if there is an answer it has not taken yet,
+ * without waiting for a lookup, and logs the
+ * lookups that failed since it last took one
+ *
+ * Returns 1 if dialer took new addresses, 0
+ * otherwise
+ *************************************************/
+int takeResolvedAddresses(Resolver* resolver, Dialer* dialer);
+
+#endif
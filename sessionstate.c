@@ -0,0 +1,175 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       sessionstate.c
+
+Note:       Implementation of the memory-mapped session state used by
+            sproxy. See sessionstate.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "sessionstate.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+SessionState* openSessionState(const char* path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) // open returns -1 on error
+    {
+        perror("Unable to open session state file");
+        return NULL;
+    }
+
+    // Make sure the file is large enough to hold a whole SessionState
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) < 0)
+    {
+        perror("Unable to stat session state file");
+        close(fd);
+        return NULL;
+    }
+    int isNewFile = (fileInfo.st_size != sizeof(SessionState));
+    if (isNewFile && ftruncate(fd, sizeof(SessionState)) < 0)
+    {
+        perror("Unable to resize session state file");
+        close(fd);
+        return NULL;
+    }
+
+    SessionState* state = mmap(NULL, sizeof(SessionState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid after the file is closed
+    if (state == MAP_FAILED)
+    {
+        perror("Unable to map session state file");
+        return NULL;
+    }
+
+    // Reinitialize a file that does not hold a state we understand
+    if (isNewFile || state->magic != SESSION_STATE_MAGIC || state->version != SESSION_STATE_VERSION)
+    {
+        memset(state, 0, sizeof(SessionState));
+        state->magic = SESSION_STATE_MAGIC;
+        state->version = SESSION_STATE_VERSION;
+    }
+
+    return state;
+}
+
+void closeSessionState(SessionState* state)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    munmap(state, sizeof(SessionState));
+}
+
+int canRestoreSession(SessionState* state)
+{
+    if (state == NULL || __atomic_load_n(&state->valid, __ATOMIC_ACQUIRE) == 0)
+    {
+        return 0;
+    }
+
+    // If more packets are unacknowledged than the ring holds, some are lost
+    uint32_t unAckdCount = state->seqN - state->unAckdN;
+    if (unAckdCount > SESSION_STATE_SLOTS)
+    {
+        return 0;
+    }
+
+    // Every slot in the window must hold the packet it is supposed to
+    for (uint32_t seqN = state->unAckdN; seqN != state->seqN; seqN++)
+    {
+        if (getSessionSlot(state, seqN)->seqN != seqN)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+SessionSlot* getSessionSlot(SessionState* state, uint32_t seqN)
+{
+    return &state->slots[seqN & (SESSION_STATE_SLOTS - 1)];
+}
+
+void saveSession(SessionState* state, int sessionID, uint32_t seqN, uint32_t ackN)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    // Invalidate the state while it is being rewritten, so a crash in between is not restored
+    __atomic_store_n(&state->valid, 0, __ATOMIC_RELEASE);
+
+    state->sessionID = sessionID;
+    state->seqN = seqN;
+    state->ackN = ackN;
+    state->unAckdN = seqN;
+
+    __atomic_store_n(&state->valid, 1, __ATOMIC_RELEASE);
+}
+
+void clearSession(SessionState* state)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&state->valid, 0, __ATOMIC_RELEASE);
+}
+
+void saveSentPacket(SessionState* state, uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length, void* payload)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    // Fill in the slot first, so the saved seqN never covers a half written packet
+    SessionSlot* slot = getSessionSlot(state, seqN);
+    slot->type = type;
+    slot->ackN = ackN;
+    slot->length = length;
+    memcpy(slot->payload, payload, length);
+    __atomic_store_n(&slot->seqN, seqN, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&state->seqN, seqN + 1, __ATOMIC_RELEASE);
+}
+
+void saveAckN(SessionState* state, uint32_t ackN)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&state->ackN, ackN, __ATOMIC_RELEASE);
+}
+
+void savePeerAckN(SessionState* state, uint32_t ackN)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+
+    // Only move forward, and never past the packets that were actually sent
+    if ((int32_t) (ackN - state->unAckdN) <= 0 || (int32_t) (ackN - state->seqN) > 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&state->unAckdN, ackN, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,161 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       sessionstate.h
+
+Note:       Crash-safe storage of sproxy's per-session protocol state.
+
+            The state (sessionID, seqN, ackN, and a ring of the data
+            packets cproxy has not acknowledged yet) lives in a file
+            that is mapped in to memory with mmap(). Every update is a
+            plain store into the mapping, so the hot path never makes a
+            system call, and the kernel keeps the pages even if sproxy
+            crashes. Updates are ordered with release stores, so the
+            counters in the header are never ahead of the data they
+            describe.
+
+            When sproxy is restarted with the same state file, it can
+            reload the session and resume it when cproxy reconnects with
+            the same sessionID, instead of forcing a new telnet session.
+*/
+#ifndef SESSIONSTATE_H
+#define SESSIONSTATE_H
+
+#include <stdint.h>
+
+#define SESSION_STATE_MAGIC 0x53505853 // "SPXS"
+#define SESSION_STATE_VERSION 1
+#define SESSION_STATE_SLOTS 64 // Must be a power of two
+#define SESSION_STATE_PAYLOAD_LEN 1024
+
+typedef struct {
+
+    uint32_t type;
+    uint32_t seqN;
+    uint32_t ackN;
+    uint32_t length;
+    unsigned char payload[SESSION_STATE_PAYLOAD_LEN];
+
+} SessionSlot;
+
+typedef struct {
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t valid;     // 0 while a new session is being written
+    int32_t sessionID;
+    uint32_t seqN;      // seqN of the next packet sproxy will send
+    uint32_t ackN;      // seqN of the next packet sproxy expects
+    uint32_t unAckdN;   // lowest seqN cproxy has not acknowledged yet
+    uint32_t reserved;
+    SessionSlot slots[SESSION_STATE_SLOTS];
+
+} SessionState;
+
+/**************************************************
+ * openSessionState
+ *
+ * Arguments: const char* path
+ * Returns: SessionState*
+ *
+ * Opens (or creates) the state file at path and
+ * maps it in to memory. A file that does not hold
+ * a valid state is reinitialized
+ *
+ * Returns NULL on error
+ *************************************************/
+SessionState* openSessionState(const char* path);
+
+/**************************************************
+ * closeSessionState
+ *
+ * Arguments: SessionState* state
+ * Returns: void
+ *
+ * Unmaps the given state. Does nothing if state
+ * is NULL
+ *************************************************/
+void closeSessionState(SessionState* state);
+
+/**************************************************
+ * canRestoreSession
+ *
+ * Arguments: SessionState* state
+ * Returns: int
+ *
+ * Returns !0 if the state holds a complete session
+ * that can be resumed: it is valid, and every
+ * unacknowledged packet is still in the ring
+ *************************************************/
+int canRestoreSession(SessionState* state);
+
+/**************************************************
+ * getSessionSlot
+ *
+ * Arguments: SessionState* state, uint32_t seqN
+ * Returns: SessionSlot*
+ *
+ * Returns the ring slot that holds (or will hold)
+ * the packet with the given seqN
+ *************************************************/
+SessionSlot* getSessionSlot(SessionState* state, uint32_t seqN);
+
+/**************************************************
+ * saveSession
+ *
+ * Arguments: SessionState* state, int sessionID,
+ *            uint32_t seqN, uint32_t ackN
+ * Returns: void
+ *
+ * Records the start of a new session. All packets
+ * before seqN are considered acknowledged
+ *
+ * All save functions do nothing if state is NULL
+ *************************************************/
+void saveSession(SessionState* state, int sessionID, uint32_t seqN, uint32_t ackN);
+
+/**************************************************
+ * clearSession
+ *
+ * Arguments: SessionState* state
+ * Returns: void
+ *
+ * Marks the saved session as ended, so it is not
+ * restored
+ *************************************************/
+void clearSession(SessionState* state);
+
+/**************************************************
+ * saveSentPacket
+ *
+ * Arguments: SessionState* state, uint32_t type,
+ *            seqN, ackN, length, void* payload
+ * Returns: void
+ *
+ * Copies a newly sent data packet in to its ring
+ * slot, then advances the saved seqN past it
+ *************************************************/
+void saveSentPacket(SessionState* state, uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length, void* payload);
+
+/**************************************************
+ * saveAckN
+ *
+ * Arguments: SessionState* state, uint32_t ackN
+ * Returns: void
+ *
+ * Records the seqN of the next packet expected
+ * from cproxy
+ *************************************************/
+void saveAckN(SessionState* state, uint32_t ackN);
+
+/**************************************************
+ * savePeerAckN
+ *
+ * Arguments: SessionState* state, uint32_t ackN
+ * Returns: void
+ *
+ * Records the ackN received from cproxy, freeing
+ * every ring slot before it
+ *************************************************/
+void savePeerAckN(SessionState* state, uint32_t ackN);
+
+#endif
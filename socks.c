@@ -0,0 +1,357 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       socks.c
+
+Note:       Implementation of the SOCKS5 messages. See socks.h
+*/
+#define _DEFAULT_SOURCE // Needed to use getaddrinfo
+
+#include "socks.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/******************************************
+ * parseSocksTarget
+ *
+ * Arguments: const void* target, int length,
+ *            char* host, uint16_t* port,
+ *            int* isName
+ * Returns: int
+ *
+ * Writes the address of a target in to
+ * host, which has room for SOCKS_NAME_LEN
+ * bytes, as text, its port in to port, and
+ * sets isName to whether it is a name
+ *
+ * Returns -1 if the target is not whole or
+ * not valid, 0 otherwise
+ *****************************************/
+static int parseSocksTarget(const void* target, int length, char* host, uint16_t* port, int* isName)
+{
+    const uint8_t* bytes = target;
+    if (length < 1)
+    {
+        return -1;
+    }
+
+    int addressLength;
+    const uint8_t* address = bytes + 1;
+    *isName = (bytes[0] == SOCKS_ADDRESS_NAME);
+    if (bytes[0] == SOCKS_ADDRESS_IPV4 && length == 1 + 4 + 2)
+    {
+        addressLength = 4;
+        inet_ntop(AF_INET, address, host, SOCKS_NAME_LEN);
+    }
+    else if (bytes[0] == SOCKS_ADDRESS_IPV6 && length == 1 + 16 + 2)
+    {
+        addressLength = 16;
+        inet_ntop(AF_INET6, address, host, SOCKS_NAME_LEN);
+    }
+    else if (bytes[0] == SOCKS_ADDRESS_NAME && length >= 2 && bytes[1] > 0 && length == 2 + bytes[1] + 2
+        && memchr(bytes + 2, '\0', bytes[1]) == NULL)
+    {
+        // A name is its length and then its characters, without a terminating 0
+        addressLength = 1 + bytes[1];
+        memcpy(host, bytes + 2, bytes[1]);
+        host[bytes[1]] = '\0';
+    }
+    else
+    {
+        return -1;
+    }
+
+    *port = (address[addressLength] << 8) | address[addressLength + 1];
+    return 0;
+}
+
+/******************************************
+ * lookUpTarget
+ *
+ * Arguments: const char* host, uint16_t port,
+ *            int flags,
+ *            struct sockaddr_storage* address,
+ *            socklen_t* addressLength
+ * Returns: int
+ *
+ * Looks host up with getaddrinfo and flags,
+ * and writes the first answer, at port, in
+ * to address
+ *
+ * Returns the error of getaddrinfo, 0 for
+ * none
+ *****************************************/
+static int lookUpTarget(const char* host, uint16_t port, int flags, struct sockaddr_storage* address,
+    socklen_t* addressLength)
+{
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_NUMERICSERV | flags
+    };
+    struct addrinfo* results;
+    int error = getaddrinfo(host, service, &hints, &results);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    memcpy(address, results->ai_addr, results->ai_addrlen);
+    *addressLength = results->ai_addrlen;
+    freeaddrinfo(results);
+
+    return 0;
+}
+
+/******************************************
+ * deleteSocksLookup
+ *
+ * Arguments: SocksLookup* lookup
+ * Returns: void
+ *
+ * Frees a lookup, and closes its pipe
+ *****************************************/
+static void deleteSocksLookup(SocksLookup* lookup)
+{
+    close(lookup->wakeFDs[0]);
+    close(lookup->wakeFDs[1]);
+    pthread_mutex_destroy(&lookup->lock);
+    free(lookup);
+}
+
+/******************************************
+ * runSocksLookup
+ *
+ * Arguments: void* argument, the SocksLookup
+ * Returns: void*
+ *
+ * Thread: looks the name up, and wakes the
+ * proxy, or frees the lookup if it was
+ * abandoned meanwhile. Never logs, as only
+ * the proxy's thread may
+ *****************************************/
+static void* runSocksLookup(void* argument)
+{
+    SocksLookup* lookup = argument;
+    struct sockaddr_storage address;
+    memset(&address, 0, sizeof(address));
+    socklen_t addressLength = 0;
+    int error = lookUpTarget(lookup->host, lookup->port, 0, &address, &addressLength);
+
+    // The byte is written under the lock, so a proxy that takes the answer frees it only after
+    pthread_mutex_lock(&lookup->lock);
+    lookup->isDone = 1;
+    lookup->error = error;
+    lookup->address = address;
+    lookup->addressLength = addressLength;
+    int isAbandoned = lookup->isAbandoned;
+    if (isAbandoned == 0 && write(lookup->wakeFDs[1], "", 1) < 0)
+    {
+        lookup->error = EAI_SYSTEM;
+    }
+    pthread_mutex_unlock(&lookup->lock);
+
+    if (isAbandoned != 0)
+    {
+        deleteSocksLookup(lookup);
+    }
+    return NULL;
+}
+
+int socksMissingLength(const uint8_t* message, int length, int isRequest)
+{
+    // A greeting is the version, a count of methods and the methods
+    if (isRequest == 0)
+    {
+        if (length < 2)
+        {
+            return 2 - length;
+        }
+        return (message[0] == SOCKS_VERSION) ? 2 + message[1] - length : -1;
+    }
+
+    // A request is the version, a command, a reserved byte and the target
+    if (length < SOCKS_TARGET_OFFSET + 1)
+    {
+        return SOCKS_TARGET_OFFSET + 1 - length;
+    }
+    if (message[0] != SOCKS_VERSION)
+    {
+        return -1;
+    }
+    switch (message[SOCKS_TARGET_OFFSET])
+    {
+        case SOCKS_ADDRESS_IPV4:
+            return SOCKS_TARGET_OFFSET + 1 + 4 + 2 - length;
+        case SOCKS_ADDRESS_IPV6:
+            return SOCKS_TARGET_OFFSET + 1 + 16 + 2 - length;
+        case SOCKS_ADDRESS_NAME:
+            if (length < SOCKS_TARGET_OFFSET + 2)
+            {
+                return SOCKS_TARGET_OFFSET + 2 - length;
+            }
+            return SOCKS_TARGET_OFFSET + 2 + message[SOCKS_TARGET_OFFSET + 1] + 2 - length;
+        default:
+            return 0; // Not read any further, as it is refused
+    }
+}
+
+int acceptSocksGreeting(const uint8_t* greeting, uint8_t* reply)
+{
+    reply[0] = SOCKS_VERSION;
+    reply[1] = SOCKS_METHOD_REFUSED;
+    for (int i = 0; i < greeting[1]; i++)
+    {
+        if (greeting[2 + i] == SOCKS_METHOD_NONE)
+        {
+            reply[1] = SOCKS_METHOD_NONE;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int socksRequestStatus(const uint8_t* request)
+{
+    if (request[1] != SOCKS_CONNECT)
+    {
+        return SOCKS_COMMAND_UNSUPPORTED;
+    }
+
+    uint8_t type = request[SOCKS_TARGET_OFFSET];
+    if ((type != SOCKS_ADDRESS_IPV4 && type != SOCKS_ADDRESS_IPV6 && type != SOCKS_ADDRESS_NAME)
+        || (type == SOCKS_ADDRESS_NAME && request[SOCKS_TARGET_OFFSET + 1] == 0))
+    {
+        return SOCKS_ADDRESS_UNSUPPORTED;
+    }
+
+    return SOCKS_SUCCEEDED;
+}
+
+int writeSocksReply(uint8_t* reply, int status)
+{
+    // The bound address, 0.0.0.0 port 0, is sproxy's to know
+    memset(reply, 0, SOCKS_REPLY_LEN);
+    reply[0] = SOCKS_VERSION;
+    reply[1] = status;
+    reply[SOCKS_TARGET_OFFSET] = SOCKS_ADDRESS_IPV4;
+
+    return SOCKS_REPLY_LEN;
+}
+
+int describeSocksTarget(const void* target, int length, char* text, int textLength)
+{
+    char host[SOCKS_NAME_LEN];
+    uint16_t port;
+    int isName;
+    if (parseSocksTarget(target, length, host, &port, &isName) < 0)
+    {
+        return -1;
+    }
+
+    // An IPv6 address is bracketed, so its colons are not taken for the port's
+    const char* format = (isName == 0 && strchr(host, ':') != NULL) ? "[%s]:%u" : "%s:%u";
+    snprintf(text, textLength, format, host, port);
+    return 0;
+}
+
+int resolveSocksTarget(const void* target, int length, struct sockaddr_storage* address, socklen_t* addressLength,
+    SocksLookup** lookup)
+{
+    char host[SOCKS_NAME_LEN];
+    uint16_t port;
+    int isName;
+    if (parseSocksTarget(target, length, host, &port, &isName) < 0)
+    {
+        logMessage(LOG_WARNING, "Refusing a stream to a target that is not valid\n");
+        return -1;
+    }
+
+    // An address is parsed at once
+    if (isName == 0)
+    {
+        if (lookUpTarget(host, port, AI_NUMERICHOST, address, addressLength) != 0)
+        {
+            logMessage(LOG_WARNING, "Unable to resolve %s for a stream\n", host);
+            return -1;
+        }
+        return 0;
+    }
+
+    SocksLookup* newLookup = calloc(1, sizeof(SocksLookup));
+    if (newLookup == NULL)
+    {
+        perror("Unable to allocate space for a lookup");
+        return -1;
+    }
+    if (pipe(newLookup->wakeFDs) < 0)
+    {
+        perror("Unable to create the pipe of a lookup");
+        free(newLookup);
+        return -1;
+    }
+    strcpy(newLookup->host, host);
+    newLookup->port = port;
+    pthread_mutex_init(&newLookup->lock, NULL);
+
+    // Started with every signal blocked, so that signals go to the proxy's own thread
+    pthread_t thread;
+    sigset_t signals, oldSignals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    int result = pthread_create(&thread, NULL, runSocksLookup, newLookup);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (result != 0)
+    {
+        logMessage(LOG_WARNING, "Unable to start a lookup of %s for a stream\n", host);
+        deleteSocksLookup(newLookup);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    *lookup = newLookup;
+    return 1;
+}
+
+int finishSocksLookup(SocksLookup* lookup, struct sockaddr_storage* address, socklen_t* addressLength, char* text,
+    int textLength)
+{
+    pthread_mutex_lock(&lookup->lock);
+    int error = lookup->error;
+    *address = lookup->address;
+    *addressLength = lookup->addressLength;
+    pthread_mutex_unlock(&lookup->lock);
+
+    snprintf(text, textLength, "%s:%u", lookup->host, lookup->port);
+    if (error != 0)
+    {
+        logMessage(LOG_WARNING, "Unable to resolve %s for a stream\n", lookup->host);
+    }
+    deleteSocksLookup(lookup);
+
+    return (error == 0) ? 0 : -1;
+}
+
+void abandonSocksLookup(SocksLookup* lookup)
+{
+    pthread_mutex_lock(&lookup->lock);
+    int isDone = lookup->isDone;
+    lookup->isAbandoned = 1;
+    pthread_mutex_unlock(&lookup->lock);
+
+    // Otherwise the thread frees it once it is done
+    if (isDone != 0)
+    {
+        deleteSocksLookup(lookup);
+    }
+}
@@ -0,0 +1,200 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       socks.h
+
+Note:       The parts of SOCKS5 (RFC 1928) that cproxy's SOCKS port and
+            sproxy's dynamic streams need.
+
+            A client opens with a greeting listing the authentication
+            methods it supports, and cproxy only accepts "none", as it
+            only listens on the loopback address. The client then asks
+            to CONNECT to an IPv4 address, an IPv6 address or a domain
+            name, and a port. The address type, address and port of the
+            request are the target, which cproxy sends sproxy as they
+            are, so that sproxy, rather than cproxy, looks a name up,
+            in the network it connects from.
+
+            Each message is read whole, and no further: socksMissingLength
+            says how many more bytes one needs from what was read of it
+            so far, so data the client sends after its request is left
+            on the socket for the stream.
+
+            A lookup can take as long as the resolver's timeout, longer
+            than cproxy waits for a heartbeat, so sproxy looks a name up
+            on a thread of its own, one per lookup, and its loop carries
+            on. The thread writes a byte to the lookup's pipe once it is
+            done, so select wakes for it. A lookup that is no longer
+            wanted, as its stream or session ended, is abandoned, and
+            the thread frees it once it is done.
+*/
+#ifndef SOCKS_H
+#define SOCKS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define SOCKS_VERSION 5
+#define SOCKS_MESSAGE_LEN 262       // longest greeting or request, a CONNECT to a 255 byte name
+#define SOCKS_REPLY_LEN 10          // a reply with an IPv4 address
+#define SOCKS_TARGET_OFFSET 3       // where the target starts in a request
+#define SOCKS_NAME_LEN 256          // longest name in a target, with its terminating 0
+
+// Address types
+#define SOCKS_ADDRESS_IPV4 1
+#define SOCKS_ADDRESS_NAME 3
+#define SOCKS_ADDRESS_IPV6 4
+
+// Commands
+#define SOCKS_CONNECT 1
+
+// Authentication methods
+#define SOCKS_METHOD_NONE 0
+#define SOCKS_METHOD_REFUSED 0xff
+
+// Reply statuses
+#define SOCKS_SUCCEEDED 0
+#define SOCKS_FAILED 1
+#define SOCKS_COMMAND_UNSUPPORTED 7
+#define SOCKS_ADDRESS_UNSUPPORTED 8
+
+typedef struct {
+
+    char host[SOCKS_NAME_LEN];
+    uint16_t port;
+    int wakeFDs[2];                     // a pipe the thread writes a byte to once it is done
+
+    pthread_mutex_t lock;               // held to write what follows
+    int isDone;
+    int isAbandoned;                    // is true once the proxy no longer wants the answer
+    int error;                          // of getaddrinfo, 0 for none
+    struct sockaddr_storage address;    // the first answer, once done without an error
+    socklen_t addressLength;
+
+} SocksLookup;
+
+/**************************************************
+ * socksMissingLength
+ *
+ * Arguments: const uint8_t* message, int length,
+ *            int isRequest
+ * Returns: int
+ *
+ * Works out how many more bytes the greeting, or
+ * the request if isRequest is true, needs after
+ * the first length bytes of it, in message
+ *
+ * Returns that count, 0 once it is whole, or -1
+ * if it is not one cproxy can read
+ *************************************************/
+int socksMissingLength(const uint8_t* message, int length, int isRequest);
+
+/**************************************************
+ * acceptSocksGreeting
+ *
+ * Arguments: const uint8_t* greeting,
+ *            uint8_t* reply
+ * Returns: int
+ *
+ * Writes the 2 byte answer to a whole greeting in
+ * to reply
+ *
+ * Returns 0 if it offered no authentication, or -1
+ * if it is refused
+ *************************************************/
+int acceptSocksGreeting(const uint8_t* greeting, uint8_t* reply);
+
+/**************************************************
+ * socksRequestStatus
+ *
+ * Arguments: const uint8_t* request
+ * Returns: int
+ *
+ * Checks a whole request
+ *
+ * Returns SOCKS_SUCCEEDED for a CONNECT cproxy can
+ * forward, or the status to refuse it with
+ *************************************************/
+int socksRequestStatus(const uint8_t* request);
+
+/**************************************************
+ * writeSocksReply
+ *
+ * Arguments: uint8_t* reply, int status
+ * Returns: int
+ *
+ * Writes a reply with status, and no bound
+ * address, in to reply, which has room for
+ * SOCKS_REPLY_LEN bytes
+ *
+ * Returns the length of the reply
+ *************************************************/
+int writeSocksReply(uint8_t* reply, int status);
+
+/**************************************************
+ * describeSocksTarget
+ *
+ * Arguments: const void* target, int length,
+ *            char* text, int textLength
+ * Returns: int
+ *
+ * Writes the target of a request, length bytes
+ * from its address type on, as host:port in to
+ * text, for logging
+ *
+ * Returns -1 if the target is not whole, 0
+ * otherwise
+ *************************************************/
+int describeSocksTarget(const void* target, int length, char* text, int textLength);
+
+/**************************************************
+ * resolveSocksTarget
+ *
+ * Arguments: const void* target, int length,
+ *            struct sockaddr_storage* address,
+ *            socklen_t* addressLength,
+ *            SocksLookup** lookup
+ * Returns: int
+ *
+ * Turns the target of a request, length bytes
+ * from its address type on, in to an address to
+ * connect to, or for a name starts looking it up
+ * on a new thread, and sets lookup to it
+ *
+ * Returns -1 on error, 0 if address was written,
+ * or 1 if a lookup was started
+ *************************************************/
+int resolveSocksTarget(const void* target, int length, struct sockaddr_storage* address, socklen_t* addressLength,
+    SocksLookup** lookup);
+
+/**************************************************
+ * finishSocksLookup
+ *
+ * Arguments: SocksLookup* lookup,
+ *            struct sockaddr_storage* address,
+ *            socklen_t* addressLength, char* text,
+ *            int textLength
+ * Returns: int
+ *
+ * Takes the answer of a lookup whose pipe is
+ * ready to read: writes it in to address, and the
+ * name and port looked up, for logging, in to
+ * text. Frees lookup
+ *
+ * Returns -1 if it failed, 0 otherwise
+ *************************************************/
+int finishSocksLookup(SocksLookup* lookup, struct sockaddr_storage* address, socklen_t* addressLength, char* text,
+    int textLength);
+
+/**************************************************
+ * abandonSocksLookup
+ *
+ * Arguments: SocksLookup* lookup
+ * Returns: void
+ *
+ * Gives up on a lookup that may still be running,
+ * which is freed once it is done
+ *************************************************/
+void abandonSocksLookup(SocksLookup* lookup);
+
+#endif
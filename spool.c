@@ -0,0 +1,212 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       spool.c
+
+Note:       Implementation of the spool of daemon output. See spool.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "spool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "terminal.h"
+
+OutputSpool* newOutputSpool()
+{
+    OutputSpool* spool = malloc(sizeof(OutputSpool));
+    if (spool == NULL)
+    {
+        perror("Unable to allocate space for the output spool");
+        exit(-1);
+    }
+
+    spool->memory = NULL;
+    spool->file = NULL;
+    clearSpool(spool);
+
+    return spool;
+}
+
+void deleteOutputSpool(OutputSpool* spool)
+{
+    clearSpool(spool);
+    if (spool->file != NULL)
+    {
+        fclose(spool->file);
+    }
+    free(spool);
+}
+
+void clearSpool(OutputSpool* spool)
+{
+    free(spool->memory);
+    spool->memory = NULL;
+    spool->memoryStart = 0;
+    spool->memoryEnd = 0;
+
+    if (spool->file != NULL && spool->fileEnd != 0 && ftruncate(fileno(spool->file), 0) < 0)
+    {
+        perror("Unable to empty the spill file");
+    }
+    spool->fileStart = 0;
+    spool->fileEnd = 0;
+
+    spool->length = 0;
+    spool->isDaemonEnded = 0;
+}
+
+uint32_t spoolRoom(OutputSpool* spool)
+{
+    return SPOOL_MEMORY_LEN + SPOOL_FILE_LEN - spool->length;
+}
+
+int appendToSpool(OutputSpool* spool, void* data, uint32_t length)
+{
+    // Memory while nothing has spilled, moving what is left to the front once the end is reached
+    if (spool->fileStart == spool->fileEnd)
+    {
+        if (spool->memory == NULL && (spool->memory = malloc(SPOOL_MEMORY_LEN)) == NULL)
+        {
+            perror("Unable to allocate space for the output spool");
+            return -1;
+        }
+        if (spool->memoryEnd + length > SPOOL_MEMORY_LEN && spool->memoryStart > 0)
+        {
+            memmove(spool->memory, spool->memory + spool->memoryStart, spool->memoryEnd - spool->memoryStart);
+            spool->memoryEnd -= spool->memoryStart;
+            spool->memoryStart = 0;
+        }
+
+        uint32_t copied = SPOOL_MEMORY_LEN - spool->memoryEnd;
+        if (copied > length)
+        {
+            copied = length;
+        }
+        memcpy(spool->memory + spool->memoryEnd, data, copied);
+        spool->memoryEnd += copied;
+        spool->length += copied;
+        data = (char*) data + copied;
+        length -= copied;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    // The rest spills to the file
+    if (spool->file == NULL)
+    {
+        spool->file = tmpfile();
+        if (spool->file == NULL)
+        {
+            perror("Unable to create the spill file");
+            return -1;
+        }
+        logMessage(LOG_INFO, "Spilling the daemon's output to a file\n");
+    }
+    while (length > 0)
+    {
+        ssize_t written = pwrite(fileno(spool->file), data, length, spool->fileEnd);
+        if (written < 0)
+        {
+            perror("Unable to write to the spill file");
+            return -1;
+        }
+        spool->fileEnd += written;
+        spool->length += written;
+        data = (char*) data + written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+int readInToSpool(OutputSpool* spool, int socketFD, TerminalModel* terminal)
+{
+    char chunk[SPOOL_READ_LEN];
+    uint32_t room = spoolRoom(spool);
+    int bytesRead = recv(socketFD, chunk, room < SPOOL_READ_LEN ? room : SPOOL_READ_LEN, 0);
+    if (bytesRead < 0)
+    {
+        perror("Unable to read the daemon's output in to the spool");
+    }
+    if (bytesRead <= 0 || appendToSpool(spool, chunk, bytesRead) < 0)
+    {
+        spool->isDaemonEnded = 1;
+        return (bytesRead == 0) ? 0 : -1;
+    }
+    if (terminal != NULL)
+    {
+        feedTerminalOutput(terminal, chunk, bytesRead, 1);
+    }
+
+    return bytesRead;
+}
+
+int replaceSpool(OutputSpool* spool, void* data, uint32_t length)
+{
+    int isDaemonEnded = spool->isDaemonEnded;
+    clearSpool(spool);
+    spool->isDaemonEnded = isDaemonEnded;
+
+    return appendToSpool(spool, data, length);
+}
+
+int takeFromSpool(OutputSpool* spool, void* buffer, uint32_t length)
+{
+    // Memory holds the oldest bytes, the file the ones after them
+    if (spool->memoryStart != spool->memoryEnd)
+    {
+        uint32_t taken = spool->memoryEnd - spool->memoryStart;
+        if (taken > length)
+        {
+            taken = length;
+        }
+        memcpy(buffer, spool->memory + spool->memoryStart, taken);
+        spool->memoryStart += taken;
+        spool->length -= taken;
+        if (spool->memoryStart == spool->memoryEnd)
+        {
+            spool->memoryStart = 0;
+            spool->memoryEnd = 0;
+        }
+
+        return taken;
+    }
+
+    if (spool->fileStart == spool->fileEnd)
+    {
+        return 0;
+    }
+    uint32_t wanted = spool->fileEnd - spool->fileStart;
+    if (wanted > length)
+    {
+        wanted = length;
+    }
+    ssize_t taken = pread(fileno(spool->file), buffer, wanted, spool->fileStart);
+    if (taken <= 0)
+    {
+        perror("Unable to read the spill file");
+        return -1;
+    }
+    spool->fileStart += taken;
+    spool->length -= taken;
+
+    // Once the file is empty, the memory takes the next output again
+    if (spool->fileStart == spool->fileEnd)
+    {
+        if (ftruncate(fileno(spool->file), 0) < 0)
+        {
+            perror("Unable to empty the spill file");
+        }
+        spool->fileStart = 0;
+        spool->fileEnd = 0;
+    }
+
+    return taken;
+}
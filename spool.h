@@ -0,0 +1,158 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       spool.h
+
+Note:       The daemon's output that sproxy keeps while it can not send
+            it to cproxy: while cproxy is disconnected, and after it
+            reconnects until its heartbeat names the session.
+
+            Without it the output would wait in the kernel's socket
+            buffers, which fill in a few hundred KB, and then the daemon
+            blocks, and whatever it runs with it. Instead sproxy keeps
+            reading, first in to SPOOL_MEMORY_LEN bytes of memory, and
+            then in to a spill file, an unlinked temporary file, of up
+            to SPOOL_FILE_LEN bytes. Only once both are full does the
+            daemon block as before.
+
+            The output is kept in order: once any is in the file, new
+            output goes to the file too, until what is in memory and then
+            the file has been taken. The memory is allocated with the
+            first byte kept, and freed, and the file emptied, when the
+            spool is cleared.
+*/
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "terminal.h"
+
+#define SPOOL_MEMORY_LEN (1 << 20)  // bytes kept in memory before spilling to the file
+#define SPOOL_FILE_LEN (32 << 20)   // most bytes the spill file holds
+#define SPOOL_READ_LEN 16384        // most bytes read from the daemon at once
+
+typedef struct {
+
+    // Kept in memory, from memoryStart up to memoryEnd
+    char* memory;
+    uint32_t memoryStart;
+    uint32_t memoryEnd;
+
+    // Spilled to the file, from fileStart up to fileEnd
+    FILE* file;             // NULL until the memory first fills
+    off_t fileStart;
+    off_t fileEnd;
+
+    uint32_t length;        // bytes kept in all
+    int isDaemonEnded;      // is true once the daemon closed its side, after what was kept
+
+} OutputSpool;
+
+/**************************************************
+ * newOutputSpool
+ *
+ * Arguments: none
+ * Returns: OutputSpool*
+ *
+ * Allocates an empty spool, exits the process if
+ * it can't
+ *************************************************/
+OutputSpool* newOutputSpool();
+
+/**************************************************
+ * deleteOutputSpool
+ *
+ * Arguments: OutputSpool* spool
+ * Returns: void
+ *
+ * Frees a spool and closes its spill file
+ *************************************************/
+void deleteOutputSpool(OutputSpool* spool);
+
+/**************************************************
+ * clearSpool
+ *
+ * Arguments: OutputSpool* spool
+ * Returns: void
+ *
+ * Drops everything kept, for a new connection to
+ * the daemon
+ *************************************************/
+void clearSpool(OutputSpool* spool);
+
+/**************************************************
+ * spoolRoom
+ *
+ * Arguments: OutputSpool* spool
+ * Returns: uint32_t
+ *
+ * How many more bytes the spool can keep
+ *************************************************/
+uint32_t spoolRoom(OutputSpool* spool);
+
+/**************************************************
+ * appendToSpool
+ *
+ * Arguments: OutputSpool* spool, void* data,
+ *            uint32_t length
+ * Returns: int
+ *
+ * Keeps length bytes after the rest, which must
+ * fit in spoolRoom
+ *
+ * Returns 0 on success, or -1 on error
+ *************************************************/
+int appendToSpool(OutputSpool* spool, void* data, uint32_t length);
+
+/**************************************************
+ * readInToSpool
+ *
+ * Arguments: OutputSpool* spool, int socketFD,
+ *            TerminalModel* terminal
+ * Returns: int
+ *
+ * Reads what the daemon has sent on socketFD, as
+ * much as there is room for, and keeps it, and
+ * feeds it to terminal unless that is NULL. Once
+ * the daemon has closed its side, isDaemonEnded
+ * is set and nothing more should be read
+ *
+ * Returns the bytes kept, 0 if the daemon closed,
+ * or -1 on error, which ends the daemon's output
+ * too
+ *************************************************/
+int readInToSpool(OutputSpool* spool, int socketFD, TerminalModel* terminal);
+
+/**************************************************
+ * replaceSpool
+ *
+ * Arguments: OutputSpool* spool, void* data,
+ *            uint32_t length
+ * Returns: int
+ *
+ * Drops everything kept and keeps length bytes
+ * instead, such as a terminal snapshot. Whether
+ * the daemon has ended is kept
+ *
+ * Returns 0 on success, or -1 on error
+ *************************************************/
+int replaceSpool(OutputSpool* spool, void* data, uint32_t length);
+
+/**************************************************
+ * takeFromSpool
+ *
+ * Arguments: OutputSpool* spool, void* buffer,
+ *            uint32_t length
+ * Returns: int
+ *
+ * Moves the oldest bytes kept, up to length of
+ * them, in to buffer
+ *
+ * Returns the bytes taken, or -1 if the spill file
+ * could not be read
+ *************************************************/
+int takeFromSpool(OutputSpool* spool, void* buffer, uint32_t length);
+
+#endif
@@ -46,13 +46,107 @@ Note:       This is the server part of the program. The program takes 1
             and begin accepting new connections, which will either recover
             the original session or start a new session based on the
             incoming session ID from the new client.
+
+            While cproxy is disconnected, and until the heartbeat of a
+            reconnected cproxy names the session, sproxy keeps reading
+            the daemon's output in to a spool (see spool.h), so the
+            daemon does not block on a full socket. Once the session
+            resumes, what was spooled is sent first, in full packets and
+            as fast as the window allows, before anything new is read.
+
+            If started with -t, sproxy keeps a model of the daemon's
+            terminal (see terminal.h). When a session resumes with at
+            least TERMINAL_SNAPSHOT_MIN_LEN bytes spooled, the spool is
+            replaced by a snapshot that redraws the screen, so cproxy
+            gets what the screen shows instead of every byte the daemon
+            wrote meanwhile.
+
+            If started with -f stateFile, sproxy keeps the session ID,
+            seqN, ackN and the unacknowledged data packets in a memory
+            mapped state file. If sproxy crashes or is restarted with the
+            same state file, it reloads the session, and a cproxy that
+            reconnects with the same session ID keeps its telnet session
+            and sequence numbers (sproxy opens a new connection to the
+            telnet daemon, since the old one died with the process).
+
+            If started with -u upgradeSocket, sproxy listens on that Unix
+            socket for its replacement. Starting a new sproxy binary with
+            the same -u path makes it connect to the running one, which
+            hands over its listening socket, client socket and daemon
+            socket (with SCM_RIGHTS) along with the session state and
+            unacknowledged packets, and then exits. The new process
+            carries on with the same connections, so an upgrade costs a
+            brief pause instead of a reconnect.
+
+            If cproxy asks for compression in its Hello, sproxy agrees
+            in its own Hello, and both sides compress the
+            payload of every data packet they send with a streaming LZ
+            codec whose history lasts for the connection.
+
+            Every heartbeat also carries a Hello (see hello.h) listing
+            the protocol version and features sproxy supports. Packets
+            are sent in the compact version 2 frame format (see frame.h)
+            only once cproxy's Hello says it can read it. Until then, and
+            with older versions of cproxy, they are sent in the original
+            format.
+
+            If started with -k keyFile, every frame to and from cproxy
+            is encrypted and authenticated with keys derived from the
+            pre-shared key in keyFile (see cipher.h), and a cproxy
+            without the same key is refused. A handoff carries the keys
+            of the current connection to the new process.
+
+            If started with -U, sproxy takes cproxy's packets as UDP
+            datagrams on portNumber instead of TCP connections (see
+            cproxy.c). The first datagram starts a connection, replies go
+            to the address the latest heartbeat came from, so cproxy can
+            move to a new address without reconnecting, and 3 seconds
+            without a valid packet ends the connection as it would over
+            TCP. Over UDP sproxy also supports forward error correction
+            (see fec.h), used when cproxy asks for it, and answers the
+            probes of a cproxy with several paths (see multipath.h) on
+            the path each came in on.
+
+            If started with -P, sproxy is a plain TCP relay to the
+            telnet daemon for trusted networks (see passthrough.h), for
+            a cproxy also started with -P. None of the other options
+            apply then.
+
+            If started with -s statsSocket, sproxy serves counters and
+            histograms of its traffic on that Unix socket (see stats.h),
+            including how long data packets take at each stage of
+            forwarding (see trace.h). It prints those on SIGUSR1 too,
+            with or without -s.
+
+            The daemon's output only fills three quarters of the window
+            of unacknowledged packets while there is more of it waiting
+            than a keystroke's echo, and the rest is kept for small
+            output, so an echo is not stuck behind a window of a large
+            cat (see priority.h).
+
+            If started with -m mapFile, sproxy forwards the services in
+            mapFile (see stream.h): each stream cproxy opens over the
+            session names a service, and sproxy connects it to the host
+            and port mapFile gives for it. Streams end with the session,
+            and are closed by an upgrade.
+
+            If started with -D, sproxy also connects the streams of
+            cproxy's SOCKS clients, each to the address or name and port
+            its client asked for. That lets whoever joins the session
+            reach anything sproxy can, so it is best combined with -k.
+
+            sproxy logs through a thread of its own (see log.h), so that
+            printing never holds up a packet. Every packet sent, received
+            and retransmitted is only logged if started with -v.
 */
 #define _DEFAULT_SOURCE // Needed to use timersub on Windows Subsystem for Linux
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -62,88 +156,54 @@ Note:       This is the server part of the program. The program takes 1
 #include <sys/types.h>
 #include <unistd.h>
 
-#define BUFFER_LEN 1024
+#include "proxy.h"
+
+#define BUFFER_LEN PACKET_PAYLOAD_LEN // Most bytes read in to one data packet
 #define LOCALHOST "127.0.0.1"
 #define TELNET_PORT 23
-
-typedef enum {
-
-    PACKET_TYPE,
-    SEQ,
-    ACK,
-    LENGTH,
-    PAYLOAD,
-
-} segmentType;
-
-struct packet {
-    // header
-    uint32_t type;      // 0 = heartbeat, !0 = data
-    uint32_t seqN;      // Sequence number
-    uint32_t ackN;      // Ack number (the seqN of the next expected packet)
-    uint32_t length;    // length of payload
-    // payload
-    void* payload;      // either int sessionID or buffer
+#define WINDOW_LEN SESSION_STATE_SLOTS // Most data packets sent to cproxy but not yet acknowledged,
+                                       // so the state file always holds all of them
+
+#define HANDOFF_MAGIC 0x53505855 // "SPXU"
+#define HANDOFF_VERSION 2 // of the handoff format, which before it had a version counts as 1
+
+// Connection state that follows the header, packets and spool in a handoff, each the size given in the header
+#define HANDOFF_COMPRESSION 0
+#define HANDOFF_FEC 1
+#define HANDOFF_WRITER 2
+#define HANDOFF_READER 3
+#define HANDOFF_CIPHER 4
+#define HANDOFF_SECTION_COUNT 5
+
+#define HEARTBEAT_CAN_RESUME 0x1 // a disconnect without HEARTBEAT_CLOSING is not the end of the session: from sproxy it
+                                 // crashed, so reconnect, from cproxy the network failed, so wait for it to reconnect
+#define HEARTBEAT_CLOSING 0x2 // the telnet session ended, the connection is about to close
+
+struct heartbeatPayload {
+    int32_t sessionID;  // ID of the current session
+    uint32_t flags;     // HEARTBEAT_* flags (not sent by older versions)
+    Hello hello;        // What the sender supports (not sent by older versions)
 };
 
-typedef struct LLNode_struct {
-
-    struct LLNode_struct* next;
-    struct packet* pck;
-
-} LLNode;
-
-typedef struct {
-
-    LLNode* head;
-
-} LinkedList;
-
-/**************************************************
- * pushTail
- * 
- * Arguments: LinkedList* list, struct packet* pck
- * Returns: void
- * 
- * Creates a new LLNode that points to the
- * given pck, and pushes it on to the end of the
- * given list
- *************************************************/
-void pushTail(LinkedList* list, struct packet* pck);
-
-/**************************************************
- * pop
- * 
- * Arguments: LinkedList* list
- * Returns: packet*
- * 
- * Pop's off the head of the linked list and
- * returns the packet contained in it
- * 
- * Returns NULL if the list was empty
- *************************************************/
-struct packet* pop(LinkedList* list);
-
-/**************************************************
- * clearAckdPackets
- * 
- * Arguments: LinkedList* list, uint32_t ackN
- * Returns: void
- * 
- * Deletes all packets in the linked list that
- * have a seqN less than ackN
- *************************************************/
-void clearAckdPackets(LinkedList* list, uint32_t ackN);
-
-/**************************************************
- * clearList
- * 
- * Arguments: LinkedList* list
- * Returns: void
- * 
- * Deletes everything in the linked list
- *************************************************/
-void clearList(LinkedList* list);
+struct handoffHeader {
+    uint32_t magic;
+    uint32_t version;       // HANDOFF_VERSION, so a process never reads state of another layout
+    uint32_t headerLength;  // sizeof(struct handoffHeader) of the sender
+    uint32_t sectionLengths[HANDOFF_SECTION_COUNT]; // sizeof() of each of the sender's connection state structs
+    int32_t sessionID;
+    uint32_t seqN;
+    uint32_t ackN;
+    uint32_t clientConnected;
+    uint32_t serverConnected;
+    uint32_t isNewTelnetSession;
+    uint32_t pauseDaemonData;
+    uint32_t isRestoredSession;
+    uint32_t packetCount;  // Number of unacknowledged packets that follow the header
+    uint32_t spooledLength; // Bytes of the daemon's output kept in the spool, which follow the packets
+    Hello agreedHello;
+    struct sockaddr_storage toClientAddress; // Over UDP, where cproxy is
+    socklen_t toClientAddressLength;
+};
 
 /*************************************
  * max
@@ -156,90 +216,103 @@ void clearList(LinkedList* list);
 int max(int a, int b);
 
 /******************************************
- * newPacket
+ * sendToClient
  * 
- * Arguments: uint32_t type, seqN, ackN,
- *                     length
- * Returns: struct packet*
+ * Arguments: ProxyStats* stats, int socketFD,
+ *            int isDatagram, void* buffer,
+ *            int length,
+ *            struct sockaddr_storage* address,
+ *            socklen_t addressLength
+ * Returns: int
  * 
- * Allocates space for a new packet and
- * packet payload, and sets the given
- * attributes
+ * Sends length bytes of frames to cproxy: on
+ * the connection over TCP, or as a datagram to
+ * address over UDP, and counts them in stats.
+ * Nothing is sent over UDP while addressLength
+ * is 0, before cproxy's address is known
+ * 
+ * Returns the result of sendto(), or 0 if
+ * nothing was sent
  *****************************************/
-struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length);
+int sendToClient(ProxyStats* stats, int socketFD, int isDatagram, void* buffer, int length, struct sockaddr_storage* address, socklen_t addressLength);
 
-/******************************************
- * deletePacket
+/**********************************************************
+ * handOffSession
  * 
- * Arguments: struct packet* pck
+ * Arguments: int upgradeListenFD,
+ *            struct handoffHeader header, LinkedList* list,
+ *            OutputSpool* spool, LZSession* compression,
+ *            FecSession* fec, FrameWriter* writer,
+ *            FrameReader* reader, FrameCipher* cipher,
+ *            int* fds, int fdCount
  * Returns: void
  * 
- * Frees the memory allocated for the
- * given packet and packet payload
- *****************************************/
-void deletePacket(struct packet* pck);
+ * Accepts a new sproxy process on upgradeListenFD, and sends
+ * it fds (listen socket, then client and server sockets if
+ * connected) along with the header, every packet in list,
+ * the daemon's output kept in spool, and the compression,
+ * FEC, framing and encryption state of the connection to
+ * cproxy, including any partly read packet.
+ * 
+ * Exits the process once the new process took the session
+ * (see handoff.h). Returns only if the handoff failed, in
+ * which case this process should keep serving the session
+ *********************************************************/
+void handOffSession(int upgradeListenFD, struct handoffHeader header, LinkedList* list, OutputSpool* spool, LZSession* compression,
+    FecSession* fec, FrameWriter* writer, FrameReader* reader, FrameCipher* cipher, int* fds, int fdCount);
 
-/******************************************
- * compressPacket
+/**********************************************************
+ * takeOverSession
  * 
- * Arguments: char* buffer, struct packet
+ * Arguments: int upgradeFD, struct handoffHeader* header,
+ *            LinkedList* list, OutputSpool* spool,
+ *            LZSession* compression, FecSession* fec,
+ *            FrameWriter* writer, FrameReader* reader,
+ *            FrameCipher* cipher, int* fds, int* fdCount
  * Returns: int
  * 
- * Takes the given packet and compresses all
- * the data into a single buffer, which can
- * then be sent later using send()
+ * Receives a handoff from the old sproxy process connected
+ * on upgradeFD. Fills in header, compression, fec, writer,
+ * reader, fds and fdCount, pushes the unacknowledged
+ * packets on to list, and keeps the daemon's output in
+ * spool. cipher takes the keys of the current
+ * connection but keeps its own pre-shared key for the next.
+ * A handoff of another version or layout is refused, and the
+ * old process keeps serving the session
  * 
- * Returns the number of bytes now stored
- * in buffer
- *****************************************/
-int compressPacket(void* buffer, struct packet);
+ * Returns 0 once the old process released the session, or
+ * -1 if this process must not serve it
+ *********************************************************/
+int takeOverSession(int upgradeFD, struct handoffHeader* header, LinkedList* list, OutputSpool* spool, LZSession* compression,
+    FecSession* fec, FrameWriter* writer, FrameReader* reader, FrameCipher* cipher, int* fds, int* fdCount);
 
 /**********************************************************
- * addToPacket
- * 
- * Arguments: void* buffer, struct packet* pck, int n,
- *            segmentType* currentSegment, int remaining
- * 
- * buffer: Buffer containing data to be added to the
- * packet
- * 
- * This function places data from buffer into the pck packet
- * in the following way: It first reads n bytes from buffer,
- * and copies them in to the memory pointed to by pck->payload
- * + index
- * 
- * index is calulated as the length of the
- * currentSegment - remaining
+ * resumeWithSnapshot
  * 
- * If the end of a segment is reached during the runtime
- * of this function, it copies the data from pck->payload into
- * the proper segment, and updates currentSegment to be
- * the next expected segment, unless the last segment read
- * was actually the packet payload. The function returns the
- * number of bytes remaining to be read for any segment it
- * does not finish.
- * 
- * If the function returns 0, with currentSegment being set
- * to PACKET_TYPE, this indicates the end of an entire
- * packet was read.
+ * Arguments: TerminalModel* terminal, OutputSpool* spool,
+ *            ProxyStats* stats
+ * Returns: void
  * 
- * Otherwise, the data added in pck is unreliable, and should
- * be passed to subsequent calls to addToPacket to continue
- * building it out
+ * As cproxy resumes the session, replaces the daemon's
+ * output kept in spool with a snapshot of terminal, if
+ * there is a model, at least TERMINAL_SNAPSHOT_MIN_LEN
+ * bytes were kept, and the snapshot is the smaller
  *********************************************************/
-int addToPacket(void* buffer, struct packet* pck, int n, segmentType* currentSegment, int remaining);
+void resumeWithSnapshot(TerminalModel* terminal, OutputSpool* spool, ProxyStats* stats);
 
 int main(int argc, char** argv)
 {
     int sessionID = 0;
     uint32_t seqN = 0;
     uint32_t ackN = 0;
+    uint32_t sentAckN = 0; // ackN last sent to cproxy, in a heartbeat or data packet
 
     int isNewTelnetSession = 0; // Is true if new socket to telnet daemon was just opened
-    int pauseDaemonData = 0; // Is true if we need to hold off sending data to client
+    int pauseDaemonData = 0; // Is true if we need to hold off sending data to client, until its heartbeat names the session
+    int isRestoredSession = 0; // Is true if the session was reloaded from the state file
+    int clientCanResume = 0; // Is true if cproxy announced it ends sessions with HEARTBEAT_CLOSING
+    int clientIsClosing = 0; // Is true if cproxy announced the telnet session ended
 
-    segmentType segmentExpected = PACKET_TYPE;
-    int bytesExpected = sizeof(uint32_t); // Size of packet.type
     int bytesRead = 0;
 
     LinkedList unAckdPackets = {
@@ -254,76 +327,275 @@ int main(int argc, char** argv)
     // Timevals that keep track of next select() timeout, and last message received
     struct timeval timeLastMessageReceived;
     struct timeval nextTimeout;
+    struct timeval timeSessionHeard = { 0 }; // last heartbeat of the current session, 0 until there is one
     
-    int listenSocketFD, clientSocketFD, serverSocketFD; // Socket file descriptor
+    int listenSocketFD, clientSocketFD; // Socket file descriptor
+    int serverSocketFD = -1; // -1 until sproxy first connects to the daemon
     fd_set socketSet;
+    fd_set writeSet; // local ends of streams with bytes kept for them
     in_port_t listenPort;
-    struct sockaddr_in listenAddress, serverAddress;
-    struct sockaddr clientAddress;
+    struct sockaddr_in serverAddress;
+    struct sockaddr_storage clientAddress;
     socklen_t clientAddressLength;
     void* toClientBuffer = NULL;
-    void* fromClientBuffer = NULL;
+    char* stateFilePath = NULL;
+    SessionState* sessionState = NULL;
+    char* upgradeSocketPath = NULL;
+    int upgradeListenFD = -1;
+    int isTakenOver = 0; // Is true if the session was handed over by an old sproxy process
+    int isUpgradeRequested = 0; // Is true if a new sproxy process is waiting to take over
+    const char* keyPath = NULL; // Pre-shared key file given with -k, if any
+    int isDatagram = 0; // Is true if cproxy sends its packets over UDP
+    struct sockaddr_storage toClientAddress; // Over UDP, where to send packets to cproxy
+    socklen_t toClientAddressLength = 0; // 0 over TCP, or until cproxy's address is known
+    int isPassthrough = 0; // Is true if bytes are relayed to the daemon as they are, without packets
+    const char* statsSocketPath = NULL; // Unix socket to serve stats on, given with -s
+    int isVerbose = 0; // Is true if every packet is logged
+    int isTerminalModeled = 0; // Is true if the daemon's terminal is modeled, to resume with a snapshot
+    const char* mapPath = NULL; // Map file of the services to forward, given with -m
+    int isSocksAllowed = 0; // Is true if streams are connected to the targets of SOCKS clients, given with -D
+
+    // Get options from command line
+    int option;
+    while ((option = getopt(argc, argv, "f:u:k:UPs:vtm:D")) != -1)
+    {
+        switch (option)
+        {
+            case 'f':
+                stateFilePath = optarg;
+                break;
+            case 'u':
+                upgradeSocketPath = optarg;
+                break;
+            case 'k':
+                keyPath = optarg;
+                break;
+            case 'U':
+                isDatagram = 1;
+                break;
+            case 'P':
+                isPassthrough = 1;
+                break;
+            case 's':
+                statsSocketPath = optarg;
+                break;
+            case 'v':
+                isVerbose = 1;
+                break;
+            case 't':
+                isTerminalModeled = 1;
+                break;
+            case 'm':
+                mapPath = optarg;
+                break;
+            case 'D':
+                isSocksAllowed = 1;
+                break;
+            default:
+                printf("Usage: ./sproxy [-f stateFile] [-u upgradeSocket] [-k keyFile] [-U] [-P] [-s statsSocket] [-v] [-t] [-m mapFile] [-D] portNumber\n");
+                return -1;
+        }
+    }
 
     // Get port number to listen on from command line
-    if (argc < 2)
+    if (optind >= argc)
     {
         printf(
-            "ERROR: No port specified!\nUsage: ./sproxy portNumber\n"
+            "ERROR: No port specified!\nUsage: ./sproxy [-f stateFile] [-u upgradeSocket] [-k keyFile] [-U] [-P] [-s statsSocket] [-v] [-t] [-m mapFile] [-D] portNumber\n"
         );
         return -1;
     }
-    listenPort = atoi(argv[1]);
+    listenPort = atoi(argv[optind]);
+    if (isPassthrough != 0 && (stateFilePath != NULL || upgradeSocketPath != NULL || keyPath != NULL || isDatagram != 0
+        || statsSocketPath != NULL || isTerminalModeled != 0 || mapPath != NULL || isSocksAllowed != 0))
+    {
+        printf("Passthrough relays plain TCP, ignoring -f, -u, -k, -U, -s, -t, -m and -D\n");
+        stateFilePath = NULL;
+        upgradeSocketPath = NULL;
+        keyPath = NULL;
+        isDatagram = 0;
+        statsSocketPath = NULL;
+        isTerminalModeled = 0;
+        mapPath = NULL;
+        isSocksAllowed = 0;
+    }
+    startLog(isVerbose ? LOG_DEBUG : LOG_INFO);
 
     // defining the heartbeat packet with session ID
+    struct heartbeatPayload heartbeatData;
     struct packet heartbeatPacket;
     heartbeatPacket.type = (uint32_t) 0;
-    heartbeatPacket.length = (uint32_t) sizeof(int);
-    heartbeatPacket.payload = (void*) &sessionID;
+    heartbeatPacket.length = (uint32_t) sizeof(struct heartbeatPayload);
+    heartbeatPacket.payload = (void*) &heartbeatData;
+
+    // Encryption of the connection to cproxy, required once a key is loaded
+    FrameCipher cipher;
+    initCipher(&cipher, 0);
+    cipher.isDatagram = isDatagram;
+    if (keyPath != NULL && loadCipherKey(&cipher, keyPath) < 0)
+    {
+        return -1;
+    }
+
+    // Services to forward, from the map file, and whether SOCKS clients' targets are
+    StreamTable streams;
+    initStreamTable(&streams, 0);
+    if (mapPath != NULL && loadStreamMap(&streams, mapPath) < 0)
+    {
+        return -1;
+    }
+    streams.isSocksAllowed = isSocksAllowed;
+
+    // Features sproxy offers, what an older cproxy supports, and what was agreed with cproxy.
+    // Compression needs every packet in order, so it is not offered over UDP, and FEC is only offered there
+    Hello localHello, oldPeerHello, agreedHello;
+    initHello(&localHello, HELLO_COMPACT_FRAMES | HELLO_EXTENDED_TYPES | (isDatagram ? HELLO_FEC | HELLO_MULTIPATH : HELLO_COMPRESSION) | (cipher.isRequired ? HELLO_ENCRYPTION : 0)
+        | (streams.serviceCount > 0 ? HELLO_STREAMS : 0) | (isSocksAllowed ? HELLO_SOCKS : 0),
+        isDatagram ? BUFFER_LEN - FEC_PARITY_HEADER_LEN : BUFFER_LEN, WINDOW_LEN);
+    readHello(&oldPeerHello, NULL, 0);
+    negotiateHello(&agreedHello, &localHello, &oldPeerHello);
+    heartbeatData.hello = localHello;
 
     // Create the receivedPacket
     struct packet* receivedPacket = newPacket(0,0,0,0);
 
+    // Compression and framing state for the connection to cproxy
+    LZSession* compression = newLZSession();
+    FecSession* fec = newFecSession();
+    OutputSpool* spool = newOutputSpool();
+    TerminalModel* terminal = isTerminalModeled ? newTerminalModel() : NULL;
+    ProxyStats* stats = newProxyStats("sproxy");
+    if (startTraceSignal(&stats->trace, "sproxy") < 0)
+    {
+        logMessage(LOG_WARNING, "sproxy will not print its latency by stage on SIGUSR1\n");
+    }
+    FrameWriter toClientFrames;
+    FrameReader fromClientFrames;
+    toClientFrames.isDatagram = isDatagram;
+    fromClientFrames.isDatagram = isDatagram;
+    resetFrameWriter(&toClientFrames);
+    resetFrameReader(&fromClientFrames);
+
     // Attempt to allocate space for toClientBuffer
-    toClientBuffer = malloc(4*sizeof(uint32_t) + BUFFER_LEN);
+    toClientBuffer = malloc(FRAME_MAX_OVERHEAD + BUFFER_LEN);
     if (toClientBuffer == NULL)
     {
         perror("Unable to allocate space for the toClientBuffer");
         return -1;
     }
 
-    // Attempt to allocate space for fromClientBuffer
-    fromClientBuffer = malloc(BUFFER_LEN);
-    if (fromClientBuffer == NULL)
+    listenSocketFD = -1;
+
+    // Open the state file
+    if (stateFilePath != NULL)
     {
-        perror("Unable to allocate space for the toClientBuffer");
-        return -1;
+        sessionState = openSessionState(stateFilePath);
+        if (sessionState == NULL)
+        {
+            return -1;
+        }
     }
 
-    // Create listen socket
-    listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenSocketFD < 0) // socket returns -1 on error
+    // If an old sproxy process is running, take over its sockets and session
+    if (upgradeSocketPath != NULL)
     {
-        perror("sproxy unable to create listen socket");
-        return -1;
-    }
+        int upgradeFD = connectUpgradeSocket(upgradeSocketPath);
+        if (upgradeFD >= 0)
+        {
+            logMessage(LOG_INFO, "sproxy taking over from the running process...\n");
+
+            struct handoffHeader header;
+            int fds[HANDOFF_MAX_FDS];
+            int fdCount;
+            if (takeOverSession(upgradeFD, &header, &unAckdPackets, spool, compression, fec, &toClientFrames, &fromClientFrames, &cipher, fds, &fdCount) < 0)
+            {
+                // The old process still serves the session, and the sockets this one got are copies of its own
+                logMessage(LOG_ERROR, "FATAL: sproxy unable to take over from the running process\n");
+                return -1;
+            }
+            close(upgradeFD);
+
+            sessionID = header.sessionID;
+            seqN = header.seqN;
+            ackN = header.ackN;
+            clientConnected = header.clientConnected;
+            serverConnected = header.serverConnected;
+            isNewTelnetSession = header.isNewTelnetSession;
+            pauseDaemonData = header.pauseDaemonData;
+            isRestoredSession = header.isRestoredSession;
+            agreedHello = header.agreedHello;
+            toClientAddress = header.toClientAddress;
+            toClientAddressLength = header.toClientAddressLength;
+            memcpy(heartbeatData.hello.nonce, cipher.localNonce, CIPHER_NONCE_LEN);
+
+            // Sockets arrive in the order listen, client, server
+            int fdIndex = 0;
+            listenSocketFD = fds[fdIndex++];
+            if (clientConnected != 0)
+            {
+                clientSocketFD = fds[fdIndex++];
+            }
+            if (serverConnected != 0)
+            {
+                serverSocketFD = fds[fdIndex++];
+            }
+            gettimeofday(&timeLastMessageReceived, NULL);
+            timeSessionHeard = timeLastMessageReceived;
+
+            isTakenOver = 1;
+            setStatGauge(stats, STAT_SPOOLED_BYTES, spool->length);
+            if (terminal != NULL)
+            {
+                resetTerminalModel(terminal, 0); // The old process saw the output so far, not this one
+            }
+            logMessage(LOG_INFO, "sproxy took over session %i with seqN %i ackN %i\n", sessionID, seqN, ackN);
+        }
 
-    // Bind listen socket to port
-    listenAddress.sin_family = AF_INET;
-    listenAddress.sin_addr.s_addr = INADDR_ANY;
-    listenAddress.sin_port = htons(listenPort);
+        upgradeListenFD = openUpgradeSocket(upgradeSocketPath);
+        if (upgradeListenFD < 0)
+        {
+            logMessage(LOG_WARNING, "sproxy will not be able to hand off to a new process\n");
+        }
+    }
 
-    // bind returns -1 on error
-    if (bind(listenSocketFD, (struct sockaddr*) &listenAddress, sizeof(listenAddress)) < 0)
+    // Reload the session held in the state file, if there is one
+    if (isTakenOver == 0 && sessionState != NULL)
     {
-        perror("sproxy unable to bind listen socket to port");
-        return -1;
+        if (canRestoreSession(sessionState))
+        {
+            sessionID = sessionState->sessionID;
+            seqN = sessionState->seqN;
+            ackN = sessionState->ackN;
+
+            for (uint32_t n = sessionState->unAckdN; n != seqN; n++)
+            {
+                SessionSlot* slot = getSessionSlot(sessionState, n);
+                struct packet* restoredPacket = newPacket(slot->type, slot->seqN, slot->ackN, slot->length);
+                memcpy(restoredPacket->payload, slot->payload, slot->length);
+                pushTail(&unAckdPackets, restoredPacket);
+            }
+
+            isRestoredSession = 1;
+            logMessage(LOG_INFO, "Restored session %i with seqN %i ackN %i\n", sessionID, seqN, ackN);
+        }
     }
 
-    // set to listen to incoming connections
-    if (listen(listenSocketFD, 5) < 0) // listen returns -1 on error
+    // Create listen socket, unless one was handed over
+    if (listenSocketFD < 0)
     {
-        perror("sproxy unable to listen to port");
-        return -1;
+        // Taking cproxy over IPv6 as well as IPv4 (see dial.h)
+        listenSocketFD = bindDualStack(isDatagram ? SOCK_DGRAM : SOCK_STREAM, listenPort);
+        if (listenSocketFD < 0) // bindDualStack returns -1 on error
+        {
+            return -1;
+        }
+
+        // set to listen to incoming connections
+        if (isDatagram == 0 && listen(listenSocketFD, 5) < 0) // listen returns -1 on error
+        {
+            perror("sproxy unable to listen to port");
+            return -1;
+        }
     }
 
     // populate info for telnet daemon into serverAddress
@@ -331,17 +603,124 @@ int main(int argc, char** argv)
     serverAddress.sin_addr.s_addr = inet_addr(LOCALHOST);
     serverAddress.sin_port = htons(TELNET_PORT);
 
+    // In passthrough mode, relay each connection from cproxy to the daemon until it closes, and nothing else
+    if (isPassthrough != 0)
+    {
+        return servePassthrough(listenSocketFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress));
+    }
+
+    // Serve stats, counting the session from here if one was taken over or restored
+    startStatsSession(stats, sessionID);
+    if (statsSocketPath != NULL && openStatsSocket(stats, statsSocketPath) < 0)
+    {
+        logMessage(LOG_WARNING, "sproxy will run without a stats socket\n");
+    }
+
     // Infinite loop, continue to listen for new connections
     while (1)
     {
+        // Hand the session over if a new sproxy process asked for it
+        if (isUpgradeRequested != 0)
+        {
+            isUpgradeRequested = 0;
+
+            struct handoffHeader header = {
+                .magic = HANDOFF_MAGIC,
+                .sessionID = sessionID,
+                .seqN = seqN,
+                .ackN = ackN,
+                .clientConnected = clientConnected,
+                .serverConnected = serverConnected,
+                .isNewTelnetSession = isNewTelnetSession,
+                .pauseDaemonData = pauseDaemonData,
+                .isRestoredSession = isRestoredSession,
+                .agreedHello = agreedHello,
+                .toClientAddress = toClientAddress,
+                .toClientAddressLength = toClientAddressLength
+            };
+
+            // Sockets are sent in the order listen, client, server
+            int fds[3];
+            int fdCount = 0;
+            fds[fdCount++] = listenSocketFD;
+            if (clientConnected != 0)
+            {
+                fds[fdCount++] = clientSocketFD;
+            }
+            if (serverConnected != 0)
+            {
+                fds[fdCount++] = serverSocketFD;
+            }
+
+            handOffSession(upgradeListenFD, header, &unAckdPackets, spool, compression, fec, &toClientFrames, &fromClientFrames, &cipher, fds, fdCount);
+            logMessage(LOG_WARNING, "sproxy unable to hand off, continuing to serve the session\n");
+        }
+
         if (clientConnected == 0)
         {
-            printf("client is not connected. Connecting...\n");
+            logMessage(LOG_INFO, "client is not connected. Connecting...\n");
             
+            // Wait for a new client, or for a new sproxy process that wants to take over. Meanwhile keep
+            // the daemon's output, so it does not block on a full socket while cproxy is away
+            logMessage(LOG_INFO, "sproxy waiting for new connection...\n");
+            int isListenReady = 0;
+            while (isListenReady == 0 && isUpgradeRequested == 0)
+            {
+                int isSpooling = serverConnected != 0 && serverSocketFD >= 0 && spool->isDaemonEnded == 0 && spoolRoom(spool) > 0;
+                FD_ZERO(&socketSet); // zero out socketSet
+                FD_SET(listenSocketFD, &socketSet); // add listen socket
+                if (upgradeListenFD >= 0)
+                {
+                    FD_SET(upgradeListenFD, &socketSet); // add upgrade socket
+                }
+                if (isSpooling != 0)
+                {
+                    FD_SET(serverSocketFD, &socketSet); // add server socket
+                }
+
+                if (select(max(max(listenSocketFD, upgradeListenFD), isSpooling ? serverSocketFD : -1) + 1, &socketSet, NULL, NULL, NULL) < 0)
+                {
+                    perror("sproxy unable to use select to wait for a new connection");
+                    continue;
+                }
+                if (upgradeListenFD >= 0 && FD_ISSET(upgradeListenFD, &socketSet))
+                {
+                    isUpgradeRequested = 1;
+                }
+                if (isSpooling != 0 && FD_ISSET(serverSocketFD, &socketSet))
+                {
+                    int bytesSpooled = readInToSpool(spool, serverSocketFD, terminal);
+                    if (bytesSpooled > 0)
+                    {
+                        addStat(stats, STAT_LOCAL_BYTES_READ, bytesSpooled);
+                        setStatGauge(stats, STAT_SPOOLED_BYTES, spool->length);
+                        logMessage(LOG_DEBUG, "Spooled %i bytes of the daemon's output, %i waiting\n", bytesSpooled, spool->length);
+                    }
+                    else
+                    {
+                        logMessage(LOG_INFO, "The daemon closed while cproxy was away, %i bytes of its output waiting\n", spool->length);
+                    }
+                }
+                isListenReady = FD_ISSET(listenSocketFD, &socketSet);
+            }
+            if (isUpgradeRequested != 0)
+            {
+                continue;
+            }
+
             // accept a new client
-            printf("sproxy waiting for new connection...\n");
-            clientAddressLength = sizeof(struct sockaddr); // Should solve INVALID ARGUMENT error
-            clientSocketFD = accept(listenSocketFD, &clientAddress, &clientAddressLength);
+            if (isDatagram != 0)
+            {
+                // Over UDP the first datagram starts a connection. It is left for the frame reader, on a
+                // copy of the socket, so closing the connection never closes the socket
+                clientSocketFD = dup(listenSocketFD);
+                toClientAddressLength = 0;
+            }
+            else
+            {
+                clientAddressLength = sizeof(clientAddress); // Should solve INVALID ARGUMENT error
+                clientSocketFD = accept(listenSocketFD, (struct sockaddr*) &clientAddress, &clientAddressLength);
+            }
             if (clientSocketFD < 0) // accept returns -1 on error
             {
                 perror("sproxy unable to receive connection from client.");
@@ -349,16 +728,33 @@ int main(int argc, char** argv)
             }
             else
             {
+                // Every frame is written whole, so send each at once instead of letting Nagle's algorithm hold
+                // it until cproxy acknowledges the last, which stalls output whenever cproxy has nothing to send
+                int noDelay = 1;
+                if (isDatagram == 0 && setsockopt(clientSocketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) < 0)
+                {
+                    perror("sproxy unable to set TCP_NODELAY on client socket");
+                }
+
                 clientConnected = 1;
+                resetLZSession(compression);
+                resetFecSession(fec);
+                resetFrameWriter(&toClientFrames);
+                resetFrameReader(&fromClientFrames);
+                resetCipher(&cipher);
+                memcpy(heartbeatData.hello.nonce, cipher.localNonce, CIPHER_NONCE_LEN);
+                negotiateHello(&agreedHello, &localHello, &oldPeerHello); // Until cproxy's Hello arrives
                 pauseDaemonData = 1;
+                clientCanResume = 0;
+                clientIsClosing = 0;
                 gettimeofday(&timeLastMessageReceived, NULL);
-                printf("sproxy accepted new connection from client!\n");
+                logMessage(LOG_INFO, "sproxy accepted new connection from client!\n");
             }
         }
 
         if (serverConnected == 0)
         {
-            printf("server is not connected. Connecting...\n");
+            logMessage(LOG_INFO, "server is not connected. Connecting...\n");
             
             // Create server socket
             serverSocketFD = socket(AF_INET, SOCK_STREAM, 0);
@@ -375,8 +771,15 @@ int main(int argc, char** argv)
                 continue; // move to attempt to reconnect to telnet daemon
             }
 
+            // Keep the daemon's output that waits in the kernel, ahead of any echo, small (see priority.h)
+            int receiveBufferLength = PRIORITY_LOCAL_BUFFER_LEN;
+            if (setsockopt(serverSocketFD, SOL_SOCKET, SO_RCVBUF, &receiveBufferLength, sizeof(receiveBufferLength)) < 0)
+            {
+                perror("sproxy unable to set the receive buffer of the server socket");
+            }
+
             // Connect to server
-            printf("sproxy attempting to connect to %s %i...\n", LOCALHOST, htons(serverAddress.sin_port));
+            logMessage(LOG_INFO, "sproxy attempting to connect to %s %i...\n", LOCALHOST, htons(serverAddress.sin_port));
             if (connect(serverSocketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
             {
                 struct timeval timeout;
@@ -410,7 +813,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to client\n");
                         }
 
                         return -1;
@@ -426,9 +829,17 @@ int main(int argc, char** argv)
                         {
                             serverConnected = 1;
                             isNewTelnetSession = 1;
-                            clearList(&unAckdPackets);
-                            pauseDaemonData = 0;
-                            printf("sproxy successfully connected to server!\n");
+                            clearSpool(spool); // Output kept from the last daemon is no use to the new one
+                            setStatGauge(stats, STAT_SPOOLED_BYTES, 0);
+                            if (terminal != NULL) // A restored session's screen shows the last daemon's output
+                            {
+                                resetTerminalModel(terminal, isRestoredSession == 0);
+                            }
+                            if (isRestoredSession == 0) // Restored packets are still owed to cproxy
+                            {
+                                clearList(&unAckdPackets);
+                            }
+                            logMessage(LOG_INFO, "sproxy successfully connected to server!\n");
                             continue;
                         }
                     }
@@ -452,18 +863,22 @@ int main(int argc, char** argv)
 
             serverConnected = 1;
             isNewTelnetSession = 1;
-            clearList(&unAckdPackets);
-            pauseDaemonData = 0;
-            printf("sproxy successfully connected to telnet daemon!\n");
+            clearSpool(spool); // Output kept from the last daemon is no use to the new one
+            setStatGauge(stats, STAT_SPOOLED_BYTES, 0);
+            if (terminal != NULL) // A restored session's screen shows the last daemon's output
+            {
+                resetTerminalModel(terminal, isRestoredSession == 0);
+            }
+            if (isRestoredSession == 0) // Restored packets are still owed to cproxy
+            {
+                clearList(&unAckdPackets);
+            }
+            logMessage(LOG_INFO, "sproxy successfully connected to telnet daemon!\n");
         }
 
         if ((serverConnected != 0) && (clientConnected != 0))
         {
-            printf("Client and Server are both connected\n");
-            
-            // Reset segmentExpected to PACKET_TYPE and bytesExpected to sizeof(uint32_t)
-            segmentExpected = PACKET_TYPE;
-            bytesExpected = sizeof(uint32_t);
+            logMessage(LOG_INFO, "Client and Server are both connected\n");
             
             // Set nextTimeout to current time to ensure the first message sent is a heartbeat
             gettimeofday(&nextTimeout, NULL);
@@ -471,17 +886,68 @@ int main(int argc, char** argv)
             // Use select for data to be ready on both serverSocket and clientSocket
             while (1)
             {   
+                setStatGauge(stats, STAT_PEER_CONNECTED, 1);
+                setStatGauge(stats, STAT_UNACKED_PACKETS, (unAckdPackets.head == NULL) ? 0 : seqN - unAckdPackets.head->pck->seqN);
+
                 // Reset socketSet
                 FD_ZERO(&socketSet); // zero out socketSet
-                FD_SET(serverSocketFD, &socketSet); // add server socket
+                FD_ZERO(&writeSet);
                 FD_SET(clientSocketFD, &socketSet); // add client socket
 
+                // Only send more of the daemon's output while the agreed window of unacknowledged packets has room,
+                // and not while daemon data is paused or encryption is required but not keyed yet,
+                // so a waiting daemon can not hold off heartbeats. Bulk output only gets its share of the window,
+                // and the rest is kept for echoes and other small output (see priority.h)
+                int isHeld = pauseDaemonData != 0 || (cipher.isRequired != 0 && cipher.isKeyed == 0);
+                uint32_t inFlight = (unAckdPackets.head == NULL) ? 0 : seqN - unAckdPackets.head->pck->seqN;
+                int readLength = (isHeld == 0) ? priorityReadLength(serverSocketFD, inFlight, agreedHello.windowLength,
+                    agreedHello.maxPayloadLength) : 0;
+
+                // What was spooled goes first, as bulk, without waiting on the daemon, and the daemon is read again
+                // once it is all sent. While output is held, it is spooled instead of left to block the daemon
+                int isSpoolReady = readLength == agreedHello.maxPayloadLength && spool->length > 0;
+                if ((readLength > 0 && spool->length == 0)
+                    || (isHeld != 0 && spool->isDaemonEnded == 0 && spoolRoom(spool) > 0))
+                {
+                    FD_SET(serverSocketFD, &socketSet); // add server socket
+                }
+                if (upgradeListenFD >= 0)
+                {
+                    FD_SET(upgradeListenFD, &socketSet); // add upgrade socket
+                }
+
+                // Forwarded streams share the window the same way, and are held along with the daemon's output (see stream.h)
+                int maxFD = addStreamsToSet(&streams, &socketSet, &writeSet, max(max(serverSocketFD, clientSocketFD), upgradeListenFD),
+                    0, isHeld == 0, inFlight, agreedHello.windowLength, agreedHello.maxPayloadLength);
+                int isStreamReady = hasStreamControl(&streams);
+
+                // cproxy's window only opens as its packets are acknowledged, and while the daemon is quiet that is
+                // only by heartbeats, so acknowledge every half of the share of the agreed window that bulk input may
+                // fill (see priority.h) straight away, instead of leaving cproxy's window full until the next one
+                if (agreedHello.windowLength != 0 && (cipher.isRequired == 0 || cipher.isKeyed != 0)
+                    && (int32_t) (ackN - sentAckN) >= (int32_t) (agreedHello.windowLength * PRIORITY_BULK_PERCENT / 200))
+                {
+                    heartbeatPacket.seqN = seqN;
+                    heartbeatPacket.ackN = ackN;
+                    heartbeatData.sessionID = sessionID;
+                    heartbeatData.flags = HEARTBEAT_CAN_RESUME;
+                    heartbeatData.hello.lossPermille = (fec->isEnabled != 0) ? fec->lossPermille : 0;
+                    stampHello(stats, &heartbeatData.hello);
+                    int bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                        heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                    if (bytesToSend < 0 || sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength) < 0)
+                    {
+                        perror("Unable to send an acknowledgement to cproxy");
+                    }
+                    sentAckN = ackN;
+                }
+
                 // Calculate new timeout value (passing a returned timeout value from a previous select call does not work on all OSs)
                 struct timeval currentTime;
                 gettimeofday(&currentTime, NULL);
                 struct timeval timeout;
                 timersub(&nextTimeout, &currentTime, &timeout);
-                if (timeout.tv_sec < 0) // If it came back negative, set to zero
+                if (timeout.tv_sec < 0 || isSpoolReady != 0 || isStreamReady != 0) // If it came back negative, set to zero
                 {
                     timeout.tv_sec = 0;
                     timeout.tv_usec = 0;
@@ -489,14 +955,21 @@ int main(int argc, char** argv)
 
                 // Wait up to one second for input to be available using select
                 int resultOfSelect = select(
-                        max(serverSocketFD, clientSocketFD) + 1,
+                        maxFD + 1,
                         &socketSet,
-                        NULL,
+                        &writeSet,
                         NULL,
                         &timeout
                     );
-                // If select timed out, check for a heartbeat from cproxy, and also send one
-                if(resultOfSelect == 0 )
+                if (resultOfSelect > 0)
+                {
+                    acceptStreams(&streams, &socketSet); // sproxy takes no new streams, but connects those looked up
+                    writeStreams(&streams, &writeSet);
+                }
+
+                // If select timed out, check for a heartbeat from cproxy, and also send one. With spooled output or a
+                // stream's OPEN or CLOSE to send select does not wait, so then only once the heartbeat is due
+                if (resultOfSelect == 0 && ((isSpoolReady == 0 && isStreamReady == 0) || timercmp(&currentTime, &nextTimeout, <) == 0))
                 {
                     struct timeval newTime;
                     gettimeofday(&newTime, NULL);
@@ -511,7 +984,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to client\n");
                         }
                         clientConnected = 0;
 
@@ -524,8 +997,33 @@ int main(int argc, char** argv)
                     // Compress and send heartbeat packet
                     heartbeatPacket.seqN = seqN;
                     heartbeatPacket.ackN = ackN;
-                    int bytesToSend = compressPacket(toClientBuffer, heartbeatPacket);
-                    int bytesSent = send(clientSocketFD, toClientBuffer, bytesToSend, 0);
+                    sentAckN = ackN;
+                    heartbeatData.sessionID = sessionID;
+                    heartbeatData.flags = HEARTBEAT_CAN_RESUME;
+                    heartbeatData.hello.lossPermille = (fec->isEnabled != 0) ? measureFecLoss(fec) : 0;
+                    stampHello(stats, &heartbeatData.hello);
+
+                    // Over UDP the heartbeat that carried the nonce may have been lost, so repeat it in
+                    // plaintext until cproxy's first encrypted packet shows it has the keys too
+                    if (isDatagram != 0 && cipher.isKeyed != 0 && cipher.rx.counter == 0)
+                    {
+                        int bytesToSend = writeFrame(&toClientFrames, NULL, toClientBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                            heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                        if (sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength) < 0)
+                        {
+                            perror("Unable to send heartbeat message to cproxy");
+                        }
+                    }
+
+                    int bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                        heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                    int bytesSent = (bytesToSend < 0) ? -1 : sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength);
+
+                    // A plaintext heartbeat carried this connection's nonce, keys may follow now
+                    if (cipher.isRequired != 0 && cipher.isKeyed == 0 && bytesSent >= 0 && sentCipherNonce(&cipher) < 0)
+                    {
+                        bytesSent = -1;
+                    }
 
                     // Report if there was an error (just for debugging, no need to exit)
                     if (bytesSent < 0)
@@ -534,19 +1032,24 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("Sent heartbeat packet with seqN %i ackN %i\n", heartbeatPacket.seqN, heartbeatPacket.ackN);
+                        logMessage(LOG_DEBUG, "Sent heartbeat packet with seqN %i ackN %i\n", heartbeatPacket.seqN, heartbeatPacket.ackN);
                     }
 
                     // Retransmit unackd packets
-                    if (pauseDaemonData == 0)
+                    if (pauseDaemonData == 0 && (cipher.isRequired == 0 || cipher.isKeyed != 0))
                     {
                         if (unAckdPackets.head != NULL)
                         {
                             LLNode* node = unAckdPackets.head;
+                            int retransmittedCount = 0;
+                            int retransmittedBytes = 0;
                             while (node != NULL)
                             {
-                                bytesToSend = compressPacket(toClientBuffer, *node->pck);
-                                bytesSent = send(clientSocketFD, toClientBuffer, bytesToSend, 0);
+                                struct packet wirePacket = *node->pck;
+                                wirePacket.payload = compressPayload(compression, &wirePacket.type, wirePacket.payload, &wirePacket.length);
+                                bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, wirePacket.type, wirePacket.seqN,
+                                    wirePacket.ackN, wirePacket.length, wirePacket.payload);
+                                bytesSent = (bytesToSend < 0) ? -1 : sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength);
 
                                 // Report if there was an error (just for debugging, no need to exit)
                                 if (bytesSent < 0)
@@ -555,11 +1058,19 @@ int main(int argc, char** argv)
                                 }
                                 else
                                 {
-                                    printf("Retransmitted data with seqN %i ackN %i\n", node->pck->seqN, node->pck->ackN);
+                                    logMessage(LOG_DEBUG, "Retransmitted data with seqN %i ackN %i, %i bytes\n", node->pck->seqN, node->pck->ackN, bytesSent);
+                                    addStat(stats, STAT_RETRANSMITTED_FRAMES, 1);
+                                    addStat(stats, STAT_RETRANSMITTED_BYTES, bytesSent);
+                                    retransmittedCount++;
+                                    retransmittedBytes += bytesSent;
                                 }
                                 
                                 node = node->next;
                             }
+                            if (retransmittedCount > 0)
+                            {
+                                logMessage(LOG_INFO, "Retransmitted %i data packets, %i bytes\n", retransmittedCount, retransmittedBytes);
+                            }
                         }
                     }
                 }
@@ -575,7 +1086,7 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("sproxy closed connection to server\n");
+                        logMessage(LOG_INFO, "sproxy closed connection to server\n");
                     }
 
                     // Close client socket, so it doesn't stay open
@@ -585,26 +1096,61 @@ int main(int argc, char** argv)
                     }
                     else
                     {
-                        printf("sproxy closed connection to client\n");
+                        logMessage(LOG_INFO, "sproxy closed connection to client\n");
                     }
 
                     return -1;
                 }
 
+                // If a new sproxy process wants to take over, break out to hand off the session
+                if (upgradeListenFD >= 0 && FD_ISSET(upgradeListenFD, &socketSet))
+                {
+                    isUpgradeRequested = 1;
+                    break;
+                }
+
                 // If input is ready on clientSocket, place data into receivedPacket
                 if (FD_ISSET(clientSocketFD, &socketSet))
                 {   
-                    // Update timeLastMessageReceived
-                    gettimeofday(&timeLastMessageReceived, NULL);
-                    
-                    // Read bytesExpected into fromClientBuffer
-                    bytesRead = recv(clientSocketFD, fromClientBuffer, bytesExpected, 0);
+                    // Read whatever has arrived in to the frame reader
+                    bytesRead = receiveFrames(&fromClientFrames, clientSocketFD);
+                    uint32_t receivedMicros = statsMicros();
+                    if (bytesRead > 0)
+                    {
+                        addStat(stats, STAT_PEER_BYTES_RECEIVED, bytesRead);
+                    }
 
+                    // Over UDP an error is not a disconnect, the heartbeat timeout decides
+                    if (bytesRead < 0 && isDatagram != 0)
+                    {
+                        perror("sproxy unable to receive from cproxy");
+                    }
                     // If bytesRead is 0 or -1, controlled disconnect, disconnect both sockets and
                     // break into outer while loop
-                    if (bytesRead <= 0)
+                    else if (bytesRead <= 0 && isDatagram == 0)
                     {
-                        printf("recv() returned with %i on clientSocketFD\n", bytesRead);
+                        logMessage(LOG_INFO, "recv() returned with %i on clientSocketFD\n", bytesRead);
+
+                        // If cproxy went away without ending the session, the network failed (a reset on the way
+                        // can even look like an orderly close), so keep the daemon and wait for it to reconnect
+                        if (clientCanResume != 0 && clientIsClosing == 0)
+                        {
+                            if (close(clientSocketFD)) // close returns -1 on error
+                            {
+                                perror("sproxy unable to properly close client socket");
+                            }
+                            else
+                            {
+                                logMessage(LOG_INFO, "sproxy lost connection to client\n");
+                            }
+                            clientConnected = 0;
+
+                            break;
+                        }
+
+                        // The session is over, it should not be restored
+                        clearSession(sessionState);
+                        closeStreams(&streams); // Forwarded streams end with the session
 
                         // Close server socket
                         if (close(serverSocketFD)) // close returns -1 on error
@@ -613,7 +1159,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to server\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to server\n");
                         }
                         serverConnected = 0;
 
@@ -624,30 +1170,109 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to client\n");
                         }
                         clientConnected = 0;
                         
                         break;
                     }
 
-                    // add data to packet
-                    bytesExpected = addToPacket(fromClientBuffer, receivedPacket, bytesRead, &segmentExpected, bytesExpected);
+                    // Handle every whole packet that has arrived
+                    int frameResult = 0;
+                    while (clientConnected != 0 && serverConnected != 0
+                        && (frameResult = readFrame(&fromClientFrames, &cipher, &receivedPacket->type, &receivedPacket->seqN,
+                            &receivedPacket->ackN, &receivedPacket->length, receivedPacket->payload, BUFFER_LEN)) > 0)
+                    {
+                        // Update timeLastMessageReceived
+                        gettimeofday(&timeLastMessageReceived, NULL);
+                        addStat(stats, STAT_PEER_FRAMES_RECEIVED, 1);
 
-                    // If bytesExpected is 0, we just finished reading a whole packet
-                    if (bytesExpected == 0)
-                    {           
-                        // Update bytesExpected to sizeof(uint32_t)
-                        bytesExpected = sizeof(uint32_t);
+                        // Send a probe straight back on the path it came in on, without moving replies there
+                        if ((receivedPacket->type & PACKET_TYPE_PROBE) != 0)
+                        {
+                            if (isDatagram != 0 && receivedPacket->length >= sizeof(PathProbe))
+                            {
+                                ((PathProbe*) receivedPacket->payload)->isReply = 1;
+                                int bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, PACKET_TYPE_PROBE, seqN, ackN,
+                                    sizeof(PathProbe), receivedPacket->payload);
+                                if (bytesToSend < 0 || sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend,
+                                    &fromClientFrames.fromAddress, fromClientFrames.fromAddressLength) < 0)
+                                {
+                                    perror("Unable to answer a probe from cproxy");
+                                }
+                            }
+                        }
+                        // If the packet is a parity packet, it may rebuild a lost data packet
+                        else if ((receivedPacket->type & PACKET_TYPE_PARITY) != 0)
+                        {
+                            logMessage(LOG_DEBUG, "Parity packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
 
+                            if (fec->isEnabled != 0 && pauseDaemonData == 0
+                                && rebuildFecPacket(fec, receivedPacket->seqN, receivedPacket->type, receivedPacket->payload,
+                                    receivedPacket->length, ackN) > 0)
+                            {
+                                logMessage(LOG_DEBUG, "Rebuilt a lost data packet from parity\n");
+                            }
+
+                            countAcks(stats, &unAckdPackets, receivedPacket->ackN);
+                            clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
+                            savePeerAckN(sessionState, receivedPacket->ackN);
+                        }
                         // If the packet is a data packet, send the payload to server
-                        if (receivedPacket->type != 0)
+                        else if (receivedPacket->type != 0)
                         {
-                            printf("Data packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+                            logMessage(LOG_DEBUG, "Data packet received seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+
+                            // Every data packet goes through the compression history, even duplicates.
+                            // If that fails the history is lost, so wait for cproxy to reconnect
+                            if (decompressPayload(compression, &receivedPacket->type, receivedPacket->payload, &receivedPacket->length, BUFFER_LEN) < 0)
+                            {
+                                if (close(clientSocketFD)) // close returns -1 on error
+                                {
+                                    perror("sproxy unable to properly close client socket");
+                                }
+                                else
+                                {
+                                    logMessage(LOG_INFO, "sproxy closed connection to client\n");
+                                }
+                                clientConnected = 0;
+
+                                break;
+                            }
+
+                            // Until cproxy's heartbeat names the session, its seqNs can't be placed. Over UDP
+                            // that heartbeat may be lost and data arrive first, so leave it to be retransmitted
+                            if (pauseDaemonData != 0)
+                            {
+                                logMessage(LOG_DEBUG, "Data received before cproxy's session ID. Discarding\n");
+                                addStat(stats, STAT_DISCARDED_PACKETS, 1);
+                                continue;
+                            }
                             
-                            if (receivedPacket->seqN == ackN)
+                            // With FEC, packets that arrive ahead of ackN are kept until the gap is filled
+                            if (fec->isEnabled != 0)
+                            {
+                                storeFecPacket(fec, receivedPacket->seqN, receivedPacket->type, receivedPacket->payload, receivedPacket->length, ackN);
+                                if (receivedPacket->seqN > ackN)
+                                {
+                                    traceGap(&stats->trace);
+                                }
+                            }
+                            else if (receivedPacket->seqN == ackN && (receivedPacket->type & PACKET_TYPE_STREAM) != 0)
+                            {
+                                int bytesSent = deliverStreamPacket(&streams, receivedPacket->payload, receivedPacket->length);
+                                traceDeliveredPacket(&stats->trace, ackN, receivedMicros);
+                                ackN++;
+                                saveAckN(sessionState, ackN);
+                                addStat(stats, STAT_LOCAL_BYTES_WRITTEN, bytesSent);
+                            }
+                            else if (receivedPacket->seqN == ackN)
                             {
                                 int bytesSent = send(serverSocketFD, receivedPacket->payload, receivedPacket->length, 0);
+                                if (bytesSent > 0 && terminal != NULL)
+                                {
+                                    feedTerminalInput(terminal, receivedPacket->payload, bytesSent);
+                                }
 
                                 // Report if there was an error (just for debugging, no need to exit)
                                 if (bytesSent < 0)
@@ -657,41 +1282,155 @@ int main(int argc, char** argv)
                                 }
                                 else
                                 {
+                                    traceDeliveredPacket(&stats->trace, ackN, receivedMicros);
                                     ackN++;
+                                    saveAckN(sessionState, ackN);
+                                    addStat(stats, STAT_LOCAL_BYTES_WRITTEN, bytesSent);
                                 } 
                             }
                             else
                             {
-                                printf("Data's seqN %i does not match ackN %i. Discarding\n", receivedPacket->seqN, ackN);
+                                logMessage(LOG_DEBUG, "Data's seqN %i does not match ackN %i. Discarding\n", receivedPacket->seqN, ackN);
+                                addStat(stats, STAT_DISCARDED_PACKETS, 1);
+                                if (receivedPacket->seqN > ackN)
+                                {
+                                    traceGap(&stats->trace);
+                                }
                             }
 
+                            countAcks(stats, &unAckdPackets, receivedPacket->ackN);
                             clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
+                            savePeerAckN(sessionState, receivedPacket->ackN);
                         }
                         // If the packet is a heartbeat packet, check if new session ID matches the current session ID
                         else
                         {
-                            printf("Heartbeat received with seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
+                            logMessage(LOG_DEBUG, "Heartbeat received with seqN %i ackN %i\n", receivedPacket->seqN, receivedPacket->ackN);
 
                             int newID = *(int*) receivedPacket->payload;
 
+                            // Before cproxy's first encrypted frame, a heartbeat is only trusted for its Hello, and once
+                            // keyed not even for that, as a plaintext heartbeat may then be anyone's
+                            int isTrusted = (cipher.isRequired == 0 || cipher.rx.counter > 0);
+
+                            // Over UDP any datagram can claim to be cproxy's. One of another session from another
+                            // address is ignored until the current session's heartbeats stop for the heartbeat
+                            // timeout, so a stray or spoofed one neither moves nor ends the session, and a second
+                            // cproxy waits as it would in TCP's accept backlog
+                            int isNewAddress = isDatagram != 0 && (toClientAddressLength != fromClientFrames.fromAddressLength
+                                || memcmp(&toClientAddress, &fromClientFrames.fromAddress, toClientAddressLength) != 0);
+                            struct timeval sinceSessionHeard;
+                            timersub(&timeLastMessageReceived, &timeSessionHeard, &sinceSessionHeard);
+                            int isSessionLive = timerisset(&timeSessionHeard) && sinceSessionHeard.tv_sec < 3;
+                            if (newID != sessionID && toClientAddressLength != 0 && isNewAddress != 0 && isSessionLive != 0)
+                            {
+                                logMessage(LOG_DEBUG, "Ignored a heartbeat of another session from another address\n");
+                                continue;
+                            }
+
+                            // Over UDP, reply to wherever cproxy's heartbeats come from, so it can change address
+                            // without reconnecting, but only for heartbeats of its session once they are
+                            // authenticated, or of a new one that got past the check above. The first heartbeat
+                            // still says where to answer the Hello that keys the connection
+                            if (isDatagram != 0 && toClientAddressLength == 0)
+                            {
+                                toClientAddress = fromClientFrames.fromAddress;
+                                toClientAddressLength = fromClientFrames.fromAddressLength;
+                            }
+                            else if (isNewAddress != 0 && isTrusted != 0 && (newID == sessionID || isSessionLive == 0))
+                            {
+                                logMessage(LOG_INFO, "cproxy is now at a new address\n");
+                                toClientAddress = fromClientFrames.fromAddress;
+                                toClientAddressLength = fromClientFrames.fromAddressLength;
+
+                                // Replies sent to the old address may be lost, so retransmit them with a heartbeat now
+                                gettimeofday(&nextTimeout, NULL);
+                            }
+
+                            // Agree with cproxy on the features to use, older versions send no Hello. The Hello that
+                            // keys the connection is taken as it is, and after that only authenticated ones
+                            Hello peerHello;
+                            readHello(&peerHello, (char*) receivedPacket->payload + offsetof(struct heartbeatPayload, hello),
+                                (int) receivedPacket->length - (int) offsetof(struct heartbeatPayload, hello));
+                            if (isTrusted != 0 || cipher.isKeyed == 0)
+                            {
+                                negotiateHello(&agreedHello, &localHello, &peerHello);
+                                compression->isEnabled = (agreedHello.features & HELLO_COMPRESSION) != 0;
+                                fec->isEnabled = (agreedHello.features & HELLO_FEC) != 0;
+                                toClientFrames.isCompact = (agreedHello.features & HELLO_COMPACT_FRAMES) != 0;
+                                toClientFrames.isExtended = (agreedHello.features & HELLO_EXTENDED_TYPES) != 0;
+                            }
+
+                            // With a key loaded, only talk to a cproxy that has one too
+                            if (cipher.isRequired != 0 && cipher.isKeyed == 0)
+                            {
+                                if ((agreedHello.features & HELLO_ENCRYPTION) == 0 || keyCipher(&cipher, peerHello.nonce) < 0)
+                                {
+                                    logMessage(LOG_WARNING, "cproxy does not support encryption, disconnecting\n");
+                                    if (close(clientSocketFD)) // close returns -1 on error
+                                    {
+                                        perror("sproxy unable to properly close client socket");
+                                    }
+                                    clientConnected = 0;
+
+                                    break;
+                                }
+
+                                // Send a heartbeat now, to carry the nonce or to start the encrypted stream
+                                gettimeofday(&nextTimeout, NULL);
+                            }
+
+                            if (isTrusted == 0)
+                            {
+                                continue;
+                            }
+
+                            noteHello(stats, &peerHello);
+                            timeSessionHeard = timeLastMessageReceived; // the session is this heartbeat's from here on
+
+                            // Newer versions of cproxy send flags after the session ID
+                            if (receivedPacket->length >= offsetof(struct heartbeatPayload, hello))
+                            {
+                                uint32_t flags = ((struct heartbeatPayload*) receivedPacket->payload)->flags;
+                                clientCanResume = flags & HEARTBEAT_CAN_RESUME;
+                                clientIsClosing = flags & HEARTBEAT_CLOSING;
+                            }
+
+                            // Cover more packets with parity the more cproxy sees lost, and measure what it loses
+                            setFecLoss(fec, peerHello.lossPermille);
+                            countFecHeartbeat(fec, receivedPacket->seqN);
+
                             if (newID != sessionID)
                             {
-                                printf("Client has new sessionID\n");
+                                logMessage(LOG_INFO, "Client has new sessionID\n");
 
+                                // cproxy numbers a new session's packets from 0. Any it sent before this heartbeat
+                                // got through were discarded, so take them from the start, not from its seqN
                                 sessionID = newID;
+                                closeStreams(&streams); // Forwarded streams end with the session
                                 seqN = receivedPacket->ackN;
-                                ackN = receivedPacket->seqN;
+                                ackN = 0;
+                                saveSession(sessionState, sessionID, seqN, ackN);
+                                startStatsSession(stats, sessionID);
+                                countConnection(stats, 0);
+
+                                // Packets restored from the state file belong to the old session
+                                if (isRestoredSession != 0)
+                                {
+                                    isRestoredSession = 0;
+                                    clearList(&unAckdPackets);
+                                }
 
                                 if (isNewTelnetSession != 0)
                                 {
-                                    printf("This is already a brand new telnet daemon session, no need to start a new one\n");
+                                    logMessage(LOG_INFO, "This is already a brand new telnet daemon session, no need to start a new one\n");
 
                                     isNewTelnetSession = 0;
                                     pauseDaemonData = 0;
                                 }
                                 else
                                 {
-                                    printf("Closing current connection to telnet daemon\n");
+                                    logMessage(LOG_INFO, "Closing current connection to telnet daemon\n");
                                     
                                     if (close(serverSocketFD) < 0)
                                     {
@@ -699,27 +1438,100 @@ int main(int argc, char** argv)
                                     }
                                     serverConnected = 0;
 
-                                    printf("Closed connection to telnet daemon\n");
+                                    // The session is known now, so the new daemon's output can go to cproxy
+                                    pauseDaemonData = 0;
+
+                                    logMessage(LOG_INFO, "Closed connection to telnet daemon\n");
                                 }
                             }
                             else
                             {
-                                printf("Client has old sessionID, maintaining current telnet session\n");
+                                logMessage(LOG_INFO, "Client has old sessionID, maintaining current telnet session\n");
+
+                                // cproxy has just reconnected, so retransmit what it missed with a heartbeat now
+                                if (pauseDaemonData != 0)
+                                {
+                                    gettimeofday(&nextTimeout, NULL);
+                                    countConnection(stats, 1);
+                                    resumeWithSnapshot(terminal, spool, stats);
+                                }
+                                isNewTelnetSession = 0;
+                                isRestoredSession = 0;
                                 pauseDaemonData = 0;
+                                countAcks(stats, &unAckdPackets, receivedPacket->ackN);
                                 clearAckdPackets(&unAckdPackets, receivedPacket->ackN);
+                                savePeerAckN(sessionState, receivedPacket->ackN);
                             }
                         }
+
+                        // Hand on the packets FEC has kept, in order, up to the next gap
+                        FecSlot* slot;
+                        while (serverConnected != 0 && fec->isEnabled != 0 && (slot = nextFecPacket(fec, ackN)) != NULL)
+                        {
+                            int bytesSent;
+                            if ((slot->type & PACKET_TYPE_STREAM) != 0)
+                            {
+                                bytesSent = deliverStreamPacket(&streams, slot->payload, slot->length);
+                            }
+                            else if (send(serverSocketFD, slot->payload, slot->length, 0) < 0)
+                            {
+                                perror("Unable to send data to telnet daemon");
+                                break; // Don't update ackN, so that data will be retransmitted
+                            }
+                            else
+                            {
+                                bytesSent = slot->length;
+                                if (terminal != NULL)
+                                {
+                                    feedTerminalInput(terminal, slot->payload, slot->length);
+                                }
+                            }
+                            traceDeliveredPacket(&stats->trace, ackN, receivedMicros);
+                            ackN++;
+                            saveAckN(sessionState, ackN);
+                            addStat(stats, STAT_LOCAL_BYTES_WRITTEN, bytesSent);
+                        }
+                    }
+
+                    // If the bytes are not a valid packet the stream is lost, so wait for cproxy to reconnect.
+                    // Over UDP only that datagram is lost, and the next one is read on its own
+                    if (clientConnected != 0 && frameResult < 0 && isDatagram == 0)
+                    {
+                        if (close(clientSocketFD)) // close returns -1 on error
+                        {
+                            perror("sproxy unable to properly close client socket");
+                        }
+                        else
+                        {
+                            logMessage(LOG_INFO, "sproxy closed connection to client\n");
+                        }
+                        clientConnected = 0;
                     }
                 }
 
-                // Break in to outer while loop if server was disconnected
-                if (serverConnected == 0)
+                // Break in to outer while loop if either side was disconnected
+                if (serverConnected == 0 || clientConnected == 0)
                 {
                     break;
                 }
 
-                // If input is ready on serverSocket, construct a packet and send to client socket
-                if (FD_ISSET(serverSocketFD, &socketSet))
+                // While the daemon's output is held, keep it in the spool
+                if (isHeld != 0 && FD_ISSET(serverSocketFD, &socketSet))
+                {
+                    int bytesSpooled = readInToSpool(spool, serverSocketFD, terminal);
+                    if (bytesSpooled > 0)
+                    {
+                        addStat(stats, STAT_LOCAL_BYTES_READ, bytesSpooled);
+                        setStatGauge(stats, STAT_SPOOLED_BYTES, spool->length);
+                    }
+                    continue;
+                }
+
+                // If input is ready on serverSocket, or output was spooled, or a forwarded stream has something to send,
+                // the daemon and the streams taking turns, construct a packet and send to client socket
+                int isServerReady = isSpoolReady != 0 || FD_ISSET(serverSocketFD, &socketSet);
+                Stream* stream = nextStreamToSend(&streams, &socketSet, isServerReady);
+                if (stream != NULL || isServerReady)
                 {   
                     // If it is indicated that daemon data should be paused, don't do anything
                     if (pauseDaemonData != 0)
@@ -728,17 +1540,70 @@ int main(int argc, char** argv)
                     }
                     
                     // Create data packet
-                    struct packet* dataPacket = newPacket(1, seqN, ackN, 0);
+                    struct packet* dataPacket = newPacket((stream != NULL) ? 1 | PACKET_TYPE_STREAM : 1, seqN, ackN, 0);
+                    sentAckN = ackN;
                     
-                    int serverBytesRead = recv(serverSocketFD, dataPacket->payload, BUFFER_LEN, 0);
+                    // A stream's packet may be its OPEN or CLOSE, with nothing read. Spooled output is taken in
+                    // whole packets, up to the largest payload cproxy reads
+                    int serverBytesRead;
+                    if (stream != NULL)
+                    {
+                        int streamBytesRead;
+                        serverBytesRead = readStreamPacket(&streams, stream, dataPacket->payload, &streamBytesRead);
+                        addStat(stats, STAT_LOCAL_BYTES_READ, streamBytesRead);
+                        if (streamBytesRead > 0 && stream->readLength + (int) STREAM_HEADER_LEN < agreedHello.maxPayloadLength)
+                        {
+                            addStat(stats, STAT_PRIORITY_FRAMES, 1);
+                        }
+                    }
+                    else if (isSpoolReady != 0)
+                    {
+                        serverBytesRead = takeFromSpool(spool, dataPacket->payload, agreedHello.maxPayloadLength);
+                        setStatGauge(stats, STAT_SPOOLED_BYTES, spool->length);
+                        if (spool->length == 0 && terminal != NULL)
+                        {
+                            forgetTerminalCommands(terminal); // They went out with the rest
+                        }
+                    }
+                    else
+                    {
+                        serverBytesRead = recv(serverSocketFD, dataPacket->payload, readLength, 0);
+                        if (serverBytesRead > 0)
+                        {
+                            addStat(stats, STAT_LOCAL_BYTES_READ, serverBytesRead);
+                            if (readLength < agreedHello.maxPayloadLength)
+                            {
+                                addStat(stats, STAT_PRIORITY_FRAMES, 1);
+                            }
+                            if (terminal != NULL)
+                            {
+                                feedTerminalOutput(terminal, dataPacket->payload, serverBytesRead, 0);
+                            }
+                        }
+                    }
                     // If bytesRead is 0 or -1, controlled disconnect, disconnect both sockets and
                     // break into outer while loop
                     if (serverBytesRead <= 0)
                     {
-                        printf("recv() returned with %i on serverSocketFD\n", serverBytesRead);
+                        logMessage(LOG_INFO, "recv() returned with %i on serverSocketFD\n", serverBytesRead);
 
                         // Delete packet
                         deletePacket(dataPacket);
+
+                        // Tell cproxy the session is over, so it does not try to reconnect
+                        heartbeatPacket.seqN = seqN;
+                        heartbeatPacket.ackN = ackN;
+                        heartbeatData.sessionID = sessionID;
+                        heartbeatData.flags = HEARTBEAT_CAN_RESUME | HEARTBEAT_CLOSING;
+                        stampHello(stats, &heartbeatData.hello);
+                        int bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, heartbeatPacket.type, heartbeatPacket.seqN,
+                            heartbeatPacket.ackN, heartbeatPacket.length, heartbeatPacket.payload);
+                        if (bytesToSend < 0 || sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength) < 0)
+                        {
+                            perror("Unable to send closing heartbeat to cproxy");
+                        }
+                        clearSession(sessionState);
+                        closeStreams(&streams); // Forwarded streams end with the session
                         
                         // Close server socket
                         if (close(serverSocketFD)) // close returns -1 on error
@@ -747,7 +1612,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to server\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to server\n");
                         }
                         serverConnected = 0;
 
@@ -758,7 +1623,7 @@ int main(int argc, char** argv)
                         }
                         else
                         {
-                            printf("sproxy closed connection to client\n");
+                            logMessage(LOG_INFO, "sproxy closed connection to client\n");
                         }
                         clientConnected = 0;
 
@@ -767,8 +1632,14 @@ int main(int argc, char** argv)
 
                     // Create packet and send to clientSocketFD
                     dataPacket->length = serverBytesRead;
-                    int bytesToSend = compressPacket(toClientBuffer, *dataPacket);
-                    int bytesSent = send(clientSocketFD, toClientBuffer, bytesToSend, 0);
+                    dataPacket->sentMicros = statsMicros();
+                    struct packet wirePacket = *dataPacket;
+                    wirePacket.payload = compressPayload(compression, &wirePacket.type, wirePacket.payload, &wirePacket.length);
+                    int bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, wirePacket.type, wirePacket.seqN,
+                        wirePacket.ackN, wirePacket.length, wirePacket.payload);
+                    uint32_t framedMicros = statsMicros();
+                    int bytesSent = (bytesToSend < 0) ? -1 : sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend, &toClientAddress, toClientAddressLength);
+                    uint32_t sentMicros = statsMicros();
                     // Report if there was an error (just for debugging, no need to exit)
                     if (bytesSent < 0)
                     {
@@ -776,13 +1647,38 @@ int main(int argc, char** argv)
                     }
                     seqN++;
                     pushTail(&unAckdPackets, dataPacket);
-                    printf("Data packet sent with seqN %i ackN %i\n", dataPacket->seqN, dataPacket->ackN);
+                    saveSentPacket(sessionState, dataPacket->type, dataPacket->seqN, dataPacket->ackN, dataPacket->length, dataPacket->payload);
+                    traceSentPacket(&stats->trace, dataPacket->seqN, dataPacket->sentMicros, framedMicros, sentMicros);
+                    logMessage(LOG_DEBUG, "Data packet sent with seqN %i ackN %i\n", dataPacket->seqN, dataPacket->ackN);
+
+                    // Follow with parity once the group is full, or the daemon has nothing more to send for now
+                    int parityCount = addFecPacket(fec, dataPacket->seqN, dataPacket->type, dataPacket->payload,
+                        dataPacket->length, dataPacket->length < agreedHello.maxPayloadLength);
+                    if (parityCount != 0)
+                    {
+                        uint32_t paritySeqN, parityType, parityLength;
+                        void* parity = takeFecParity(fec, &paritySeqN, &parityType, &parityLength);
+                        for (int i = 0; i < parityCount; i++)
+                        {
+                            // Framed again each time, so each copy is sealed with a frame count of its own
+                            bytesToSend = writeFrame(&toClientFrames, &cipher, toClientBuffer, parityType, paritySeqN,
+                                ackN, parityLength, parity);
+                            if (bytesToSend < 0 || sendToClient(stats, clientSocketFD, isDatagram, toClientBuffer, bytesToSend,
+                                &toClientAddress, toClientAddressLength) < 0)
+                            {
+                                perror("Unable to send parity to cproxy");
+                                break;
+                            }
+                        }
+                    }
                 }
             }
+
+            setStatGauge(stats, STAT_PEER_CONNECTED, clientConnected);
         }
     }
 
-    printf("Error! Outer while loop was broken!!!!\n");
+    logMessage(LOG_ERROR, "Error! Outer while loop was broken!!!!\n");
 
     // Close listen socket
     if (close(listenSocketFD)) // close returns -1 on error
@@ -793,247 +1689,284 @@ int main(int argc, char** argv)
     // free buffers
     deletePacket(receivedPacket);
     free(toClientBuffer);
-    free(fromClientBuffer);
+    deleteLZSession(compression);
+    deleteFecSession(fec);
+    deleteOutputSpool(spool);
+    deleteTerminalModel(terminal);
+    closeSessionState(sessionState);
+    closeStreams(&streams);
 
     return 0;
 }
 
-void pushTail(LinkedList* list, struct packet* pck)
+int max(int a, int b)
 {
-    LLNode* newNode = malloc(sizeof(LLNode));
-    if (newNode == NULL)
+    if (a > b)
     {
-        perror("Unable to allocate space for new linked list node");
-        exit(-1);
+        return a;
     }
 
-    // Populate node
-    newNode->pck = pck;
-    newNode->next = NULL;
+    return b;
+}
 
-    // If the list is empty, insert at the head
-    if (list->head == NULL)
+int sendToClient(ProxyStats* stats, int socketFD, int isDatagram, void* buffer, int length, struct sockaddr_storage* address, socklen_t addressLength)
+{
+    if (isDatagram != 0 && addressLength == 0)
     {
-        list->head = newNode;
-        return;
+        return 0;
     }
 
-    // Insert at the end of the list
-    LLNode* lastNode = list->head;
-    while (lastNode->next != NULL)
+    int bytesSent = (isDatagram == 0) ? send(socketFD, buffer, length, 0)
+        : sendto(socketFD, buffer, length, 0, (struct sockaddr*) address, addressLength);
+    if (bytesSent > 0)
     {
-        lastNode = lastNode->next;
+        addStat(stats, STAT_PEER_BYTES_SENT, bytesSent);
+        addStat(stats, STAT_PEER_FRAMES_SENT, 1);
     }
 
-    lastNode->next = newNode;
+    return bytesSent;
 }
 
-struct packet* pop(LinkedList* list)
+void handOffSession(int upgradeListenFD, struct handoffHeader header, LinkedList* list, OutputSpool* spool, LZSession* compression,
+    FecSession* fec, FrameWriter* writer, FrameReader* reader, FrameCipher* cipher, int* fds, int fdCount)
 {
-    if (list->head == NULL)
+    int upgradeFD = acceptUpgradeSocket(upgradeListenFD);
+    if (upgradeFD < 0)
     {
-        return NULL;
+        return;
     }
 
-    LLNode* poppedNode = list->head;
-    list->head = poppedNode->next;
-
-    struct packet* pck = poppedNode->pck;
-    free(poppedNode);
+    header.version = HANDOFF_VERSION;
+    header.headerLength = sizeof(struct handoffHeader);
+    header.sectionLengths[HANDOFF_COMPRESSION] = sizeof(LZSession);
+    header.sectionLengths[HANDOFF_FEC] = sizeof(FecSession);
+    header.sectionLengths[HANDOFF_WRITER] = sizeof(FrameWriter);
+    header.sectionLengths[HANDOFF_READER] = sizeof(FrameReader);
+    header.sectionLengths[HANDOFF_CIPHER] = sizeof(FrameCipher);
+
+    // Count the packets and the space needed to serialize them, and the connection state after them
+    size_t length = sizeof(struct handoffHeader) + sizeof(LZSession) + sizeof(FecSession) + sizeof(FrameWriter) + sizeof(FrameReader)
+        + sizeof(FrameCipher);
+    header.packetCount = 0;
+    for (LLNode* node = list->head; node != NULL; node = node->next)
+    {
+        header.packetCount++;
+        length += 4*sizeof(uint32_t) + node->pck->length;
+    }
+    header.spooledLength = spool->length;
+    length += header.spooledLength;
 
-    return pck;
-}
+    void* buffer = malloc(length);
+    if (buffer == NULL)
+    {
+        perror("Unable to allocate space for the handoff buffer");
+        close(upgradeFD);
+        return;
+    }
 
-void clearAckdPackets(LinkedList* list, uint32_t ackN)
-{
-    while (list->head != NULL)
+    // Serialize the header, then each packet in the same format as on the wire
+    memcpy(buffer, &header, sizeof(struct handoffHeader));
+    int index = sizeof(struct handoffHeader);
+    for (LLNode* node = list->head; node != NULL; node = node->next)
+    {
+        index += compressPacket(buffer + index, *node->pck);
+    }
+    int spoolIndex = index;
+    while (spool->length > 0)
     {
-        if (list->head->pck->seqN >= ackN)
+        int taken = takeFromSpool(spool, buffer + index, spool->length);
+        if (taken < 0)
         {
-            return;
+            // What the spill file still held is lost either way, so hand off what was taken
+            length -= spool->length;
+            header.spooledLength -= spool->length;
+            memcpy(buffer, &header, sizeof(struct handoffHeader));
+            clearSpool(spool);
+            break;
         }
-
-        struct packet* poppedPacket = pop(list);
-        deletePacket(poppedPacket);
+        index += taken;
     }
-}
-
-void clearList(LinkedList* list)
-{
-    while (list->head != NULL)
+    memcpy(buffer + index, compression, sizeof(LZSession));
+    index += sizeof(LZSession);
+    memcpy(buffer + index, fec, sizeof(FecSession));
+    index += sizeof(FecSession);
+    memcpy(buffer + index, writer, sizeof(FrameWriter));
+    index += sizeof(FrameWriter);
+    memcpy(buffer + index, reader, sizeof(FrameReader));
+    index += sizeof(FrameReader);
+    memcpy(buffer + index, cipher, sizeof(FrameCipher));
+
+    // Until the new process says it took the state, the session stays this process's
+    if (sendHandoff(upgradeFD, fds, fdCount, buffer, length) < 0 || releaseHandoff(upgradeFD) < 0)
     {
-        struct packet* poppedPacket = pop(list);
-        deletePacket(poppedPacket);
+        // This process keeps serving the session, so it keeps the output too
+        appendToSpool(spool, buffer + spoolIndex, header.spooledLength);
+        free(buffer);
+        close(upgradeFD);
+        return;
     }
+
+    logMessage(LOG_INFO, "sproxy handed session %i off to new process, exiting\n", header.sessionID);
+    exit(0);
 }
 
-int max(int a, int b)
+int takeOverSession(int upgradeFD, struct handoffHeader* header, LinkedList* list, OutputSpool* spool, LZSession* compression,
+    FecSession* fec, FrameWriter* writer, FrameReader* reader, FrameCipher* cipher, int* fds, int* fdCount)
 {
-    if (a > b)
+    void* buffer;
+    size_t length;
+    if (receiveHandoff(upgradeFD, fds, fdCount, &buffer, &length) < 0)
     {
-        return a;
+        return -1;
     }
 
-    return b;
-}
-
-struct packet* newPacket(uint32_t type, uint32_t seqN, uint32_t ackN, uint32_t length)
-{
-    struct packet* newPacket = malloc(sizeof(struct packet));
-    if (newPacket == NULL)
+    // The magic and version come first in every version, so they are checked before the rest is read
+    uint32_t format[2];
+    if (length < sizeof(format))
     {
-        perror("Unable to allocate space for new packet");
-        exit(-1);
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is too short\n");
+        free(buffer);
+        return -1;
     }
-
-    newPacket->payload = malloc(BUFFER_LEN);
-    if (newPacket->payload == NULL)
+    memcpy(format, buffer, sizeof(format));
+    if (format[0] != HANDOFF_MAGIC || format[1] != HANDOFF_VERSION)
     {
-        perror("Unable to allocate space for packet payload");
-        exit(-1);
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is of another version, it keeps the session\n");
+        free(buffer);
+        return -1;
     }
 
-    newPacket->type = type;
-    newPacket->seqN = seqN;
-    newPacket->ackN = ackN;
-    newPacket->length = length;
-
-    return newPacket;
-}
+    if (length < sizeof(struct handoffHeader))
+    {
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is too short\n");
+        free(buffer);
+        return -1;
+    }
+    memcpy(header, buffer, sizeof(struct handoffHeader));
+
+    // A build whose structs differ, by compiler or by a change the version missed, is refused just the same
+    uint32_t sectionLengths[HANDOFF_SECTION_COUNT] = {
+        [HANDOFF_COMPRESSION] = sizeof(LZSession),
+        [HANDOFF_FEC] = sizeof(FecSession),
+        [HANDOFF_WRITER] = sizeof(FrameWriter),
+        [HANDOFF_READER] = sizeof(FrameReader),
+        [HANDOFF_CIPHER] = sizeof(FrameCipher)
+    };
+    if (header->headerLength != sizeof(struct handoffHeader)
+        || memcmp(header->sectionLengths, sectionLengths, sizeof(sectionLengths)) != 0)
+    {
+        logMessage(LOG_WARNING, "Handoff from old sproxy process has another layout, it keeps the session\n");
+        free(buffer);
+        return -1;
+    }
 
-void deletePacket(struct packet* pck)
-{
-    free(pck->payload);
-    free(pck);
-}
+    // The listen socket, and a socket for each connected side, must be present
+    int fdsExpected = 1 + (header->clientConnected != 0) + (header->serverConnected != 0);
+    if (*fdCount != fdsExpected)
+    {
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is not valid\n");
+        free(buffer);
+        return -1;
+    }
 
-int compressPacket(void* buffer, struct packet pck)
-{
-    int index = 0;
+    // Rebuild the unacknowledged packets
+    size_t index = sizeof(struct handoffHeader);
+    for (uint32_t i = 0; i < header->packetCount; i++)
+    {
+        if (index + 4*sizeof(uint32_t) > length)
+        {
+            logMessage(LOG_WARNING, "Handoff from old sproxy process is truncated\n");
+            free(buffer);
+            return -1;
+        }
 
-    // Write in packet type
-    *(uint32_t*) (buffer+index) = pck.type;
-    index += sizeof(uint32_t);
+        uint32_t* fields = (uint32_t*) (buffer + index);
+        index += 4*sizeof(uint32_t);
+        if (fields[3] > BUFFER_LEN || index + fields[3] > length)
+        {
+            logMessage(LOG_WARNING, "Handoff from old sproxy process is truncated\n");
+            free(buffer);
+            return -1;
+        }
 
-    // Write in seqN
-    *(uint32_t*) (buffer+index) = pck.seqN;
-    index += sizeof(uint32_t);
+        struct packet* pck = newPacket(fields[0], fields[1], fields[2], fields[3]);
+        memcpy(pck->payload, buffer + index, pck->length);
+        index += pck->length;
+        pushTail(list, pck);
+    }
 
-    // Write in ackN
-    *(uint32_t*) (buffer+index) = pck.ackN;
-    index += sizeof(uint32_t);
+    // Keep the daemon's output the old process had not sent yet
+    if (header->spooledLength > spoolRoom(spool) || index + header->spooledLength > length
+        || appendToSpool(spool, buffer + index, header->spooledLength) < 0)
+    {
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is truncated\n");
+        free(buffer);
+        return -1;
+    }
+    index += header->spooledLength;
 
-    // Write in payload length
-    *(uint32_t*) (buffer+index) = pck.length;
-    index += sizeof(uint32_t);
+    if (index + sizeof(LZSession) + sizeof(FecSession) + sizeof(FrameWriter) + sizeof(FrameReader) + sizeof(FrameCipher) != length)
+    {
+        logMessage(LOG_WARNING, "Handoff from old sproxy process is truncated\n");
+        free(buffer);
+        return -1;
+    }
+    memcpy(compression, buffer + index, sizeof(LZSession));
+    index += sizeof(LZSession);
+    memcpy(fec, buffer + index, sizeof(FecSession));
+    index += sizeof(FecSession);
+    memcpy(writer, buffer + index, sizeof(FrameWriter));
+    index += sizeof(FrameWriter);
+    memcpy(reader, buffer + index, sizeof(FrameReader));
+    index += sizeof(FrameReader);
+
+    // The current connection keeps its keys, the next one uses this process's key file
+    FrameCipher nextCipher = *cipher;
+    memcpy(cipher, buffer + index, sizeof(FrameCipher));
+    cipher->isRequired = nextCipher.isRequired;
+    memcpy(cipher->preSharedKey, nextCipher.preSharedKey, CIPHER_KEY_LEN);
+    free(buffer);
+    if (restoreCipher(cipher) < 0)
+    {
+        return -1;
+    }
 
-    // Write in the payload
-    memcpy(buffer+index, pck.payload, pck.length);
-    index += pck.length;
+    // Only once the old process let go of the session may this one serve it
+    if (confirmHandoff(upgradeFD) < 0)
+    {
+        logMessage(LOG_WARNING, "Old sproxy process did not release the session, it keeps serving it\n");
+        return -1;
+    }
 
-    return index; // This should now equal the size of the data in buffer
+    return 0;
 }
 
-int addToPacket(void* buffer, struct packet* pck, int n, segmentType* currentSegment, int remaining)
+void resumeWithSnapshot(TerminalModel* terminal, OutputSpool* spool, ProxyStats* stats)
 {
-    int bufferIndex = 0;
-    
-    // As long as there are still bytes to read
-    while (n > 0)
+    if (terminal == NULL || spool->length < TERMINAL_SNAPSHOT_MIN_LEN)
     {
-        // Calculate payloadIndex
-        int payloadIndex;
-        if (*currentSegment != PAYLOAD)
-        {
-            payloadIndex = sizeof(uint32_t) - remaining;
-        }
-        else
-        {
-            payloadIndex = pck->length - remaining;
-        }
+        return;
+    }
 
-        // Check that payloadIndex is not negative
-        if (payloadIndex < 0)
-        {
-            printf("Error in addToPacket: the given \"remaining\" argument is too high: %i\n", remaining);
-            return remaining;
-        }
-        
-        // If there are more bytes remaining than n, copy n bytes and return
-        if (remaining > n)
+    int snapshotLength;
+    char* snapshot = writeTerminalSnapshot(terminal, &snapshotLength);
+    if (snapshot == NULL)
+    {
+        logMessage(LOG_INFO, "No screen snapshot to send, sending all %i bytes of output kept\n", spool->length);
+        return;
+    }
+    if ((uint32_t) snapshotLength < spool->length)
+    {
+        uint32_t spooledLength = spool->length;
+        if (replaceSpool(spool, snapshot, snapshotLength) < 0)
         {
-            memcpy(pck->payload + payloadIndex, buffer + bufferIndex, n);
-            return remaining - n;
+            logMessage(LOG_ERROR, "Unable to keep the screen snapshot, the output it replaced is lost\n");
         }
         else
         {
-            // Copy remaining bytes
-            memcpy(pck->payload + payloadIndex, buffer + bufferIndex, remaining);
-            bufferIndex += remaining;
-            n -= remaining;
-
-            // Update segment type
-            switch (*currentSegment)
-            {
-                case PACKET_TYPE:
-
-                    // Copy packet type data into pck->type
-                    pck->type = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to SEQ
-                    *currentSegment = SEQ;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;
-                case SEQ:
-
-                    // Copy packet seqN data into pck->seqN
-                    pck->seqN = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to ACK
-                    *currentSegment = ACK;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;
-                case ACK:
-
-                    // Copy packet ackN data into pck->ackN
-                    pck->ackN = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to LENGTH
-                    *currentSegment = LENGTH;
-
-                    // Update remaining to sizeof(uint32_t)
-                    remaining = sizeof(uint32_t);
-
-                    break;   
-                case LENGTH:
-
-                    // Copy packet length data into pck->length
-                    pck->length = *(uint32_t*) pck->payload;
-
-                    // Change currentSegment to PAYLOAD
-                    *currentSegment = PAYLOAD;
-
-                    // Update remaining to pck->length
-                    remaining = pck->length;
-
-                    break;
-                case PAYLOAD:
-                    
-                    // pck->payload should contain the correct payload now
-
-                    // Change currentSegment to PACKET_TYPE
-                    *currentSegment = PACKET_TYPE;
-
-                    return 0;
-            }
+            logMessage(LOG_INFO, "Sending a %i byte screen snapshot instead of %u bytes of output\n", snapshotLength, spooledLength);
         }
+        setStatGauge(stats, STAT_SPOOLED_BYTES, spool->length);
     }
-
-    return remaining;
-}
\ No newline at end of file
+    free(snapshot);
+}
@@ -0,0 +1,451 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       stats.c
+
+Note:       Implementation of the live stats and their socket. See stats.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "stats.h"
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_OUTPUT_LEN 32768      // more than all the metrics take
+#define STATS_REQUEST_TIMEOUT_MS 200 // how long to wait for a request before answering anyway
+
+// Upper bound of each histogram bucket but the last, in microseconds
+static const uint32_t bucketBounds[STATS_BUCKET_COUNT - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+static const char* counterNames[STAT_COUNT] = {
+    "peer_bytes_sent_total",
+    "peer_bytes_received_total",
+    "peer_frames_sent_total",
+    "peer_frames_received_total",
+    "local_bytes_read_total",
+    "local_bytes_written_total",
+    "retransmitted_frames_total",
+    "retransmitted_bytes_total",
+    "discarded_packets_total",
+    "connections_total",
+    "reconnects_total",
+    "priority_frames_total"
+};
+
+static const char* counterHelp[STAT_COUNT] = {
+    "Bytes sent to the other proxy, frame headers included",
+    "Bytes received from the other proxy, frame headers included",
+    "Frames sent to the other proxy",
+    "Frames received from the other proxy",
+    "Bytes read from the local telnet side and forwarded streams",
+    "Bytes written to the local telnet side and forwarded streams",
+    "Data packets sent again because they were not acknowledged in time",
+    "Bytes of retransmitted data packets",
+    "Data packets discarded as duplicates or out of order",
+    "Connections made to or accepted from the other proxy",
+    "Connections that resumed a session",
+    "Data packets sent in the part of the window kept for interactive data"
+};
+
+static const char* histogramNames[STAT_HISTOGRAM_COUNT] = {
+    "heartbeat_rtt_seconds",
+    "ack_latency_seconds"
+};
+
+static const char* histogramHelp[STAT_HISTOGRAM_COUNT] = {
+    "Round trip time to the other proxy, measured by heartbeats",
+    "Time from sending a data packet until the other proxy acknowledged it"
+};
+
+static const char* gaugeNames[STAT_GAUGE_COUNT] = {
+    "unacked_packets",
+    "peer_connected",
+    "spooled_bytes"
+};
+
+static const char* gaugeHelp[STAT_GAUGE_COUNT] = {
+    "Data packets sent and not yet acknowledged",
+    "1 while connected to the other proxy",
+    "Bytes of the daemon's output kept until they can be sent"
+};
+
+typedef struct {
+
+    char* buffer;
+    int length;
+
+} StatsOutput;
+
+/******************************************
+ * bumpValue
+ *
+ * Arguments: uint64_t* value, uint64_t amount
+ * Returns: void
+ *
+ * Adds amount to a value only this thread
+ * writes, so that other threads never see
+ * a torn value
+ *****************************************/
+static void bumpValue(uint64_t* value, uint64_t amount)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/******************************************
+ * appendOutput
+ *
+ * Arguments: StatsOutput* output,
+ *            const char* format, ...
+ * Returns: void
+ *
+ * printf()s on to the end of output, as much
+ * as fits
+ *****************************************/
+static void appendOutput(StatsOutput* output, const char* format, ...)
+{
+    if (output->length >= STATS_OUTPUT_LEN)
+    {
+        return;
+    }
+
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(output->buffer + output->length, STATS_OUTPUT_LEN - output->length, format, arguments);
+    va_end(arguments);
+
+    if (length > 0)
+    {
+        output->length += length;
+    }
+    if (output->length > STATS_OUTPUT_LEN)
+    {
+        output->length = STATS_OUTPUT_LEN;
+    }
+}
+
+/******************************************
+ * writeBlock
+ *
+ * Arguments: StatsOutput* output,
+ *            const char* prefix,
+ *            StatsBlock* block,
+ *            const char* labels
+ * Returns: void
+ *
+ * Writes the counters and histograms of a
+ * block, with names starting with prefix and
+ * with labels (with a trailing comma), which
+ * may be ""
+ *****************************************/
+static void writeBlock(StatsOutput* output, const char* prefix, StatsBlock* block, const char* labels)
+{
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        appendOutput(output, "# HELP %s%s %s\n# TYPE %s%s counter\n", prefix, counterNames[i], counterHelp[i],
+            prefix, counterNames[i]);
+
+        uint64_t value = __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+        if (labels[0] == '\0')
+        {
+            appendOutput(output, "%s%s %llu\n", prefix, counterNames[i], (unsigned long long) value);
+        }
+        else
+        {
+            // The labels end with a comma, which is dropped here
+            appendOutput(output, "%s%s{%.*s} %llu\n", prefix, counterNames[i], (int) strlen(labels) - 1, labels,
+                (unsigned long long) value);
+        }
+    }
+
+    for (int i = 0; i < STAT_HISTOGRAM_COUNT; i++)
+    {
+        appendOutput(output, "# HELP %s%s %s\n# TYPE %s%s histogram\n", prefix, histogramNames[i], histogramHelp[i],
+            prefix, histogramNames[i]);
+
+        uint64_t count = 0;
+        for (int bucket = 0; bucket < STATS_BUCKET_COUNT; bucket++)
+        {
+            count += __atomic_load_n(&block->buckets[i][bucket], __ATOMIC_RELAXED);
+            if (bucket < STATS_BUCKET_COUNT - 1)
+            {
+                appendOutput(output, "%s%s_bucket{%sle=\"%g\"} %llu\n", prefix, histogramNames[i], labels,
+                    bucketBounds[bucket] / 1e6, (unsigned long long) count);
+            }
+            else
+            {
+                appendOutput(output, "%s%s_bucket{%sle=\"+Inf\"} %llu\n", prefix, histogramNames[i], labels,
+                    (unsigned long long) count);
+            }
+        }
+
+        uint64_t sum = __atomic_load_n(&block->sums[i], __ATOMIC_RELAXED);
+        if (labels[0] == '\0')
+        {
+            appendOutput(output, "%s%s_sum %.6f\n%s%s_count %llu\n", prefix, histogramNames[i], sum / 1e6,
+                prefix, histogramNames[i], (unsigned long long) count);
+        }
+        else
+        {
+            appendOutput(output, "%s%s_sum{%.*s} %.6f\n%s%s_count{%.*s} %llu\n", prefix, histogramNames[i],
+                (int) strlen(labels) - 1, labels, sum / 1e6, prefix, histogramNames[i], (int) strlen(labels) - 1, labels,
+                (unsigned long long) count);
+        }
+    }
+}
+
+/******************************************
+ * writeStats
+ *
+ * Arguments: ProxyStats* stats,
+ *            StatsOutput* output
+ * Returns: void
+ *
+ * Writes every metric in the Prometheus
+ * text format
+ *****************************************/
+static void writeStats(ProxyStats* stats, StatsOutput* output)
+{
+    char prefix[64];
+    char labels[64];
+
+    snprintf(prefix, sizeof(prefix), "%s_", stats->programName);
+    writeBlock(output, prefix, &stats->process, "");
+
+    for (int i = 0; i < STAT_GAUGE_COUNT; i++)
+    {
+        appendOutput(output, "# HELP %s%s %s\n# TYPE %s%s gauge\n%s%s %lld\n", prefix, gaugeNames[i], gaugeHelp[i],
+            prefix, gaugeNames[i], prefix, gaugeNames[i],
+            (long long) __atomic_load_n(&stats->gauges[i], __ATOMIC_RELAXED));
+    }
+
+    output->length += writeTraceSummary(&stats->trace, output->buffer + output->length, STATS_OUTPUT_LEN - output->length, prefix);
+
+    snprintf(prefix, sizeof(prefix), "%s_session_", stats->programName);
+    snprintf(labels, sizeof(labels), "session_id=\"%i\",", __atomic_load_n(&stats->sessionID, __ATOMIC_RELAXED));
+    writeBlock(output, prefix, &stats->session, labels);
+}
+
+/******************************************
+ * serveStats
+ *
+ * Arguments: void* argument
+ * Returns: void*
+ *
+ * Body of the stats thread: answers every
+ * connection to the stats socket with the
+ * metrics. Never returns
+ *****************************************/
+static void* serveStats(void* argument)
+{
+    ProxyStats* stats = argument;
+    static char buffer[STATS_OUTPUT_LEN];
+    char request[512];
+
+    while (1)
+    {
+        int socketFD = accept(stats->listenFD, NULL, NULL);
+        if (socketFD < 0)
+        {
+            perror("Unable to accept a connection to the stats socket");
+            continue;
+        }
+
+        // Wait briefly for a request, so an HTTP client gets HTTP, and so it has been read before closing
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = STATS_REQUEST_TIMEOUT_MS * 1000
+        };
+        setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int requestLength = recv(socketFD, request, sizeof(request), 0);
+
+        StatsOutput output = {
+            .buffer = buffer,
+            .length = 0
+        };
+        writeStats(stats, &output);
+
+        if (requestLength >= 4 && memcmp(request, "GET ", 4) == 0)
+        {
+            char header[128];
+            int headerLength = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %i\r\n\r\n", output.length);
+            send(socketFD, header, headerLength, MSG_NOSIGNAL);
+        }
+
+        for (int sent = 0; sent < output.length; )
+        {
+            int bytesSent = send(socketFD, output.buffer + sent, output.length - sent, MSG_NOSIGNAL);
+            if (bytesSent <= 0)
+            {
+                break;
+            }
+            sent += bytesSent;
+        }
+
+        close(socketFD);
+    }
+
+    return NULL;
+}
+
+ProxyStats* newProxyStats(const char* programName)
+{
+    ProxyStats* stats = calloc(1, sizeof(ProxyStats));
+    if (stats == NULL)
+    {
+        perror("Unable to allocate space for stats");
+        exit(-1);
+    }
+
+    stats->programName = programName;
+    stats->listenFD = -1;
+
+    return stats;
+}
+
+int openStatsSocket(ProxyStats* stats, const char* path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        printf("Stats socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    stats->listenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stats->listenFD < 0)
+    {
+        perror("Unable to create the stats socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(stats->listenFD, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(stats->listenFD, 5) < 0)
+    {
+        perror("Unable to listen on the stats socket");
+        close(stats->listenFD);
+        stats->listenFD = -1;
+        return -1;
+    }
+
+    // Started with every signal blocked, so that signals go to the proxy's own thread
+    sigset_t signals, oldSignals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    int result = pthread_create(&stats->thread, NULL, serveStats, stats);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (result != 0)
+    {
+        printf("Unable to start the stats thread: %s\n", strerror(result));
+        close(stats->listenFD);
+        stats->listenFD = -1;
+        return -1;
+    }
+    pthread_detach(stats->thread);
+
+    return 0;
+}
+
+uint32_t statsMicros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) now.tv_sec * 1000000u + (uint32_t) (now.tv_nsec / 1000);
+}
+
+void addStat(ProxyStats* stats, int counter, uint64_t value)
+{
+    bumpValue(&stats->process.counters[counter], value);
+    bumpValue(&stats->session.counters[counter], value);
+}
+
+void setStatGauge(ProxyStats* stats, int gauge, int64_t value)
+{
+    __atomic_store_n(&stats->gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void observeStat(ProxyStats* stats, int histogram, uint32_t micros)
+{
+    int bucket = 0;
+    while (bucket < STATS_BUCKET_COUNT - 1 && micros > bucketBounds[bucket])
+    {
+        bucket++;
+    }
+
+    bumpValue(&stats->process.buckets[histogram][bucket], 1);
+    bumpValue(&stats->process.sums[histogram], micros);
+    bumpValue(&stats->session.buckets[histogram][bucket], 1);
+    bumpValue(&stats->session.sums[histogram], micros);
+}
+
+void startStatsSession(ProxyStats* stats, int32_t sessionID)
+{
+    // Store every value on its own, so a scrape in the middle never reads a torn one
+    uint64_t* values = (uint64_t*) &stats->session;
+    for (unsigned int i = 0; i < sizeof(StatsBlock) / sizeof(uint64_t); i++)
+    {
+        __atomic_store_n(&values[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&stats->sessionID, sessionID, __ATOMIC_RELAXED);
+    startTraceSession(&stats->trace);
+}
+
+void countConnection(ProxyStats* stats, int isReconnect)
+{
+    addStat(stats, STAT_CONNECTIONS, 1);
+    resetTraceClock(&stats->trace);
+    if (isReconnect != 0)
+    {
+        addStat(stats, STAT_RECONNECTS, 1);
+    }
+}
+
+void countAcks(ProxyStats* stats, LinkedList* list, uint32_t ackN)
+{
+    uint32_t now = statsMicros();
+    for (LLNode* node = list->head; node != NULL && node->pck->seqN < ackN; node = node->next)
+    {
+        if (node->pck->sentMicros != 0)
+        {
+            observeStat(stats, STAT_ACK_LATENCY, now - node->pck->sentMicros);
+        }
+    }
+}
+
+void stampHello(ProxyStats* stats, Hello* hello)
+{
+    uint32_t now = statsMicros();
+    hello->timestampMicros = now;
+    hello->echoMicros = stats->peerTimestamp;
+    hello->echoDelayMicros = (stats->peerTimestamp != 0) ? now - stats->peerTimestampReceived : 0;
+    stampTrace(&stats->trace, hello);
+}
+
+void noteHello(ProxyStats* stats, Hello* hello)
+{
+    uint32_t now = statsMicros();
+    if (hello->echoMicros != 0)
+    {
+        observeStat(stats, STAT_HEARTBEAT_RTT, now - hello->echoMicros - hello->echoDelayMicros);
+    }
+    noteTrace(&stats->trace, hello, now);
+    if (hello->timestampMicros != 0)
+    {
+        stats->peerTimestamp = hello->timestampMicros;
+        stats->peerTimestampReceived = now;
+    }
+}
@@ -0,0 +1,238 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       stats.h
+
+Note:       Live counters, gauges and histograms of a proxy, served on a
+            local Unix socket in the Prometheus text format.
+
+            Every counter and histogram is kept twice: for the whole
+            process, and for the current session, which starts over at
+            zero (and gets a new session_id label) when a new session
+            starts. Counters are bytes and frames each way, retransmits,
+            discarded data packets, connections and reconnects, and
+            data packets sent in the window's interactive reserve.
+            Histograms are the heartbeat round trip time and the ack
+            latency: the time from sending a data packet until the other
+            proxy acknowledges it.
+
+            Heartbeat round trips are measured without synchronised
+            clocks: each Hello carries the sender's clock, and echoes the
+            latest clock received from the peer along with how long it
+            was held before being sent back, so the peer subtracts both
+            from its own clock.
+
+            A proxy updates its stats from its one thread, so every value
+            has a single writer, and an update is a relaxed atomic load
+            and store: no lock and no locked instruction, the same cost
+            as a plain increment. The stats thread started by
+            openStatsSocket reads them with relaxed loads, so a scrape may
+            see one counter of a packet updated before another, which
+            the next scrape catches up on.
+
+            The socket answers each connection with the metrics and then
+            closes it. A request that starts with "GET " gets them as an
+            HTTP response, so "curl --unix-socket path http://x/metrics"
+            works, and a Prometheus can scrape it through any HTTP to
+            Unix socket bridge. It also serves the latency of each stage
+            of forwarding a packet (see trace.h).
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "hello.h"
+#include "packet.h"
+#include "trace.h"
+
+// Counters
+#define STAT_PEER_BYTES_SENT 0          // bytes sent to the other proxy, frame headers included
+#define STAT_PEER_BYTES_RECEIVED 1
+#define STAT_PEER_FRAMES_SENT 2
+#define STAT_PEER_FRAMES_RECEIVED 3
+#define STAT_LOCAL_BYTES_READ 4         // bytes read from telnet (cproxy) or the daemon (sproxy), and forwarded streams
+#define STAT_LOCAL_BYTES_WRITTEN 5
+#define STAT_RETRANSMITTED_FRAMES 6
+#define STAT_RETRANSMITTED_BYTES 7
+#define STAT_DISCARDED_PACKETS 8        // data packets that were duplicates or arrived out of order
+#define STAT_CONNECTIONS 9              // connections made to (or accepted from) the other proxy
+#define STAT_RECONNECTS 10              // of those, ones that resumed a session
+#define STAT_PRIORITY_FRAMES 11         // data packets sent in the part of the window kept for interactive data
+#define STAT_COUNT 12
+
+// Histograms
+#define STAT_HEARTBEAT_RTT 0
+#define STAT_ACK_LATENCY 1
+#define STAT_HISTOGRAM_COUNT 2
+#define STATS_BUCKET_COUNT 17           // upper bounds from 100 us to 10 s, then +Inf
+
+// Gauges, for the process only
+#define STAT_UNACKED_PACKETS 0          // data packets sent but not yet acknowledged
+#define STAT_PEER_CONNECTED 1
+#define STAT_SPOOLED_BYTES 2            // daemon output sproxy kept while it could not send it (see spool.h)
+#define STAT_GAUGE_COUNT 3
+
+typedef struct {
+
+    uint64_t counters[STAT_COUNT];
+    uint64_t buckets[STAT_HISTOGRAM_COUNT][STATS_BUCKET_COUNT]; // not cumulative, the scrape adds them up
+    uint64_t sums[STAT_HISTOGRAM_COUNT];                        // in microseconds
+
+} StatsBlock;
+
+typedef struct {
+
+    StatsBlock process;
+    StatsBlock session;
+    int32_t sessionID;
+    int64_t gauges[STAT_GAUGE_COUNT];
+
+    // The latest clock received from the peer, to echo in the next Hello
+    uint32_t peerTimestamp;
+    uint32_t peerTimestampReceived; // our clock when it arrived
+
+    // Latency of each stage of forwarding a data packet
+    LatencyTrace trace;
+
+    // Stats socket
+    const char* programName;        // prefix of every metric name
+    int listenFD;
+    pthread_t thread;
+
+} ProxyStats;
+
+/**************************************************
+ * newProxyStats
+ *
+ * Arguments: const char* programName
+ * Returns: ProxyStats*
+ *
+ * Allocates stats, all zero, whose metric names
+ * start with programName
+ *
+ * Exits on failure like the other allocators
+ *************************************************/
+ProxyStats* newProxyStats(const char* programName);
+
+/**************************************************
+ * openStatsSocket
+ *
+ * Arguments: ProxyStats* stats, const char* path
+ * Returns: int
+ *
+ * Listens on a Unix socket at path, replacing any
+ * socket already there (a previous process's, say,
+ * after a crash or a handoff), and starts a thread
+ * that answers it
+ *
+ * Returns 0 on success, or -1 on error
+ *************************************************/
+int openStatsSocket(ProxyStats* stats, const char* path);
+
+/**************************************************
+ * statsMicros
+ *
+ * Arguments: none
+ * Returns: uint32_t
+ *
+ * Microseconds on the monotonic clock, wrapping
+ * every 71 minutes, so only differences of less
+ * than that mean anything
+ *************************************************/
+uint32_t statsMicros();
+
+/**************************************************
+ * addStat
+ *
+ * Arguments: ProxyStats* stats, int counter,
+ *            uint64_t value
+ * Returns: void
+ *
+ * Adds value to a STAT_* counter, for the
+ * process and the session
+ *************************************************/
+void addStat(ProxyStats* stats, int counter, uint64_t value);
+
+/**************************************************
+ * setStatGauge
+ *
+ * Arguments: ProxyStats* stats, int gauge,
+ *            int64_t value
+ * Returns: void
+ *
+ * Sets a STAT_* gauge
+ *************************************************/
+void setStatGauge(ProxyStats* stats, int gauge, int64_t value);
+
+/**************************************************
+ * observeStat
+ *
+ * Arguments: ProxyStats* stats, int histogram,
+ *            uint32_t micros
+ * Returns: void
+ *
+ * Adds a sample to a STAT_* histogram, for the
+ * process and the session
+ *************************************************/
+void observeStat(ProxyStats* stats, int histogram, uint32_t micros);
+
+/**************************************************
+ * startStatsSession
+ *
+ * Arguments: ProxyStats* stats, int32_t sessionID
+ * Returns: void
+ *
+ * Starts the session's counters and histograms
+ * over, for a new session
+ *************************************************/
+void startStatsSession(ProxyStats* stats, int32_t sessionID);
+
+/**************************************************
+ * countConnection
+ *
+ * Arguments: ProxyStats* stats, int isReconnect
+ * Returns: void
+ *
+ * Counts a connection to the other proxy, and if
+ * isReconnect, one that resumed a session
+ *************************************************/
+void countConnection(ProxyStats* stats, int isReconnect);
+
+/**************************************************
+ * countAcks
+ *
+ * Arguments: ProxyStats* stats,
+ *            LinkedList* list, uint32_t ackN
+ * Returns: void
+ *
+ * Adds the ack latency of every packet in list
+ * that ackN acknowledges, and was sent since it
+ * was made. Call before clearAckdPackets
+ *************************************************/
+void countAcks(ProxyStats* stats, LinkedList* list, uint32_t ackN);
+
+/**************************************************
+ * stampHello
+ *
+ * Arguments: ProxyStats* stats, Hello* hello
+ * Returns: void
+ *
+ * Fills in the clock fields of a Hello about to
+ * be sent in a heartbeat
+ *************************************************/
+void stampHello(ProxyStats* stats, Hello* hello);
+
+/**************************************************
+ * noteHello
+ *
+ * Arguments: ProxyStats* stats, Hello* hello
+ * Returns: void
+ *
+ * Takes the clock fields of a Hello received from
+ * the peer, adding a heartbeat round trip time if
+ * it echoes one of ours
+ *************************************************/
+void noteHello(ProxyStats* stats, Hello* hello);
+
+#endif
@@ -0,0 +1,971 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       stream.c
+
+Note:       Implementation of the forwarded TCP services. See stream.h
+*/
+#include "stream.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hello.h"
+#include "log.h"
+#include "priority.h"
+
+#define MAP_LINE_LEN 256
+#define TARGET_TEXT_LEN 264         // a 255 character name, a colon and a port, with a terminating 0
+
+/******************************************
+ * keepUnsent
+ *
+ * Arguments: StreamBacklog* backlog,
+ *            const char* data, int length
+ * Returns: int
+ *
+ * Keeps length bytes of data after the
+ * rest in backlog
+ *
+ * Returns -1 if they do not fit in
+ * STREAM_UNSENT_LEN, 0 otherwise
+ *****************************************/
+static int keepUnsent(StreamBacklog* backlog, const char* data, int length)
+{
+    if (backlog->end - backlog->start + length > STREAM_UNSENT_LEN)
+    {
+        return -1;
+    }
+    if (backlog->data == NULL)
+    {
+        backlog->data = malloc(STREAM_UNSENT_LEN);
+        if (backlog->data == NULL)
+        {
+            perror("Unable to allocate space for a stream's unsent bytes");
+            return -1;
+        }
+    }
+
+    // What was already written makes room at the front
+    if (backlog->end + length > STREAM_UNSENT_LEN)
+    {
+        memmove(backlog->data, backlog->data + backlog->start, backlog->end - backlog->start);
+        backlog->end -= backlog->start;
+        backlog->start = 0;
+    }
+    memcpy(backlog->data + backlog->end, data, length);
+    backlog->end += length;
+
+    return 0;
+}
+
+/******************************************
+ * dropUnsent
+ *
+ * Arguments: StreamBacklog* backlog
+ * Returns: void
+ *
+ * Empties backlog, and frees its bytes
+ *****************************************/
+static void dropUnsent(StreamBacklog* backlog)
+{
+    free(backlog->data);
+    backlog->data = NULL;
+    backlog->start = 0;
+    backlog->end = 0;
+}
+
+/******************************************
+ * writeUnsent
+ *
+ * Arguments: int socketFD,
+ *            StreamBacklog* backlog
+ * Returns: int
+ *
+ * Writes as many of the bytes kept in
+ * backlog to socketFD as it takes now
+ *
+ * Returns the bytes still kept, or -1 on
+ * error
+ *****************************************/
+static int writeUnsent(int socketFD, StreamBacklog* backlog)
+{
+    int bytesSent = send(socketFD, backlog->data + backlog->start, backlog->end - backlog->start, MSG_NOSIGNAL);
+    if (bytesSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Unable to write to a stream");
+        return -1;
+    }
+
+    backlog->start += (bytesSent > 0) ? bytesSent : 0;
+    if (backlog->start == backlog->end)
+    {
+        dropUnsent(backlog);
+    }
+    return backlog->end - backlog->start;
+}
+
+/******************************************
+ * startStream
+ *
+ * Arguments: Stream* stream, int socketFD,
+ *            int service
+ * Returns: void
+ *
+ * Takes stream in to use, for the local end
+ * socketFD of service, -1 if there is none
+ *****************************************/
+static void startStream(Stream* stream, int socketFD, int service)
+{
+    stream->isOpen = 1;
+    stream->socketFD = socketFD;
+    stream->service = service;
+    stream->isOpenPending = 0;
+    stream->isClosePending = (socketFD < 0);
+    stream->isCloseSent = 0;
+    stream->isCloseReceived = 0;
+    stream->readLength = 0;
+    stream->unsent.data = NULL;
+    stream->unsent.start = 0;
+    stream->unsent.end = 0;
+    stream->lookup = NULL;
+    stream->isSocksPending = 0;
+    stream->isGreeted = 0;
+    stream->socksLength = 0;
+}
+
+/******************************************
+ * loseLocalEnd
+ *
+ * Arguments: Stream* stream
+ * Returns: void
+ *
+ * Closes the local end of stream, after an
+ * error, with a CLOSE to send if it was not
+ * sent yet
+ *****************************************/
+static void loseLocalEnd(Stream* stream)
+{
+    if (stream->socketFD >= 0 && close(stream->socketFD) < 0)
+    {
+        perror("Unable to properly close a stream");
+    }
+    stream->socketFD = -1;
+    stream->isClosePending = (stream->isCloseSent == 0);
+    dropUnsent(&stream->unsent);
+    if (stream->lookup != NULL)
+    {
+        abandonSocksLookup(stream->lookup);
+        stream->lookup = NULL;
+    }
+}
+
+/******************************************
+ * endStream
+ *
+ * Arguments: StreamTable* table,
+ *            Stream* stream
+ * Returns: void
+ *
+ * Frees stream, once CLOSE went both ways.
+ * Bytes still kept for its local end are
+ * written as it finishes, in table
+ *****************************************/
+static void endStream(StreamTable* table, Stream* stream)
+{
+    if (stream->isCloseSent == 0 || stream->isCloseReceived == 0)
+    {
+        return;
+    }
+    stream->isOpen = 0;
+
+    FinishingStream* finishing = NULL;
+    for (int i = 0; i < STREAM_LEN && finishing == NULL && stream->unsent.data != NULL && stream->socketFD >= 0; i++)
+    {
+        finishing = (table->finishing[i].socketFD < 0) ? &table->finishing[i] : NULL;
+    }
+    if (finishing != NULL)
+    {
+        finishing->socketFD = stream->socketFD;
+        finishing->unsent = stream->unsent;
+        stream->unsent.data = NULL;
+        stream->socketFD = -1;
+        return;
+    }
+
+    if (stream->unsent.data != NULL)
+    {
+        logMessage(LOG_WARNING, "Dropping %i bytes a stream's local end did not take\n", stream->unsent.end - stream->unsent.start);
+    }
+    dropUnsent(&stream->unsent);
+    if (stream->socketFD >= 0 && close(stream->socketFD) < 0)
+    {
+        perror("Unable to properly close a stream");
+    }
+    stream->socketFD = -1;
+}
+
+/******************************************
+ * connectTo
+ *
+ * Arguments: const struct sockaddr_storage*
+ *            address, socklen_t addressLength,
+ *            const char* target
+ * Returns: int
+ *
+ * Starts connecting a stream to address,
+ * described by target. A failure to connect
+ * shows up as the first read or write
+ *
+ * Returns the socket, or -1 on error
+ *****************************************/
+static int connectTo(const struct sockaddr_storage* address, socklen_t addressLength, const char* target)
+{
+    // Connect without waiting, so a slow target does not hold up the session, and data for it is kept meanwhile
+    int socketFD = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socketFD < 0)
+    {
+        perror("Unable to create a socket for a stream");
+        return -1;
+    }
+    if (connect(socketFD, (const struct sockaddr*) address, addressLength) < 0 && errno != EINPROGRESS)
+    {
+        perror("Unable to connect a stream");
+        close(socketFD);
+        return -1;
+    }
+
+    logMessage(LOG_INFO, "Opened a stream to %s\n", target);
+    return socketFD;
+}
+
+/******************************************
+ * connectStream
+ *
+ * Arguments: StreamTable* table, int kind,
+ *            const char* data, int length,
+ *            int* service,
+ *            SocksLookup** lookup
+ * Returns: int
+ *
+ * Starts sproxy's connection for an OPEN or
+ * a CONNECT, with length bytes of data: to
+ * the service it names, setting service to
+ * its index, or to the target of a SOCKS
+ * request, setting service to -1. A name in
+ * the target is looked up first, setting
+ * lookup, or else lookup is set to NULL
+ *
+ * Returns the socket, or -1 on error or
+ * while the name is looked up
+ *****************************************/
+static int connectStream(StreamTable* table, int kind, const char* data, int length, int* service, SocksLookup** lookup)
+{
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    char target[TARGET_TEXT_LEN];
+    *service = -1;
+    *lookup = NULL;
+
+    if (kind == STREAM_OPEN)
+    {
+        int nameLength = (length < STREAM_NAME_LEN) ? length : STREAM_NAME_LEN - 1;
+        memcpy(target, data, nameLength);
+        target[nameLength] = '\0';
+        for (int i = 0; i < table->serviceCount; i++)
+        {
+            if (strcmp(table->services[i].name, target) == 0)
+            {
+                *service = i;
+            }
+        }
+        if (table->isOpener != 0 || *service < 0)
+        {
+            logMessage(LOG_WARNING, "Refusing a stream for unknown service %s\n", target);
+            return -1;
+        }
+        addressLength = sizeof(table->services[*service].address);
+        memcpy(&address, &table->services[*service].address, addressLength);
+    }
+    else
+    {
+        if (table->isOpener != 0 || table->isSocksAllowed == 0)
+        {
+            logMessage(LOG_WARNING, "Refusing a stream to a SOCKS target, which needs -D\n");
+            return -1;
+        }
+        if (resolveSocksTarget(data, length, &address, &addressLength, lookup) != 0)
+        {
+            return -1;
+        }
+        describeSocksTarget(data, length, target, sizeof(target));
+    }
+
+    return connectTo(&address, addressLength, target);
+}
+
+/******************************************
+ * connectLookedUp
+ *
+ * Arguments: Stream* stream
+ * Returns: void
+ *
+ * Connects stream to the answer of its
+ * lookup, which is done, or loses it if
+ * there is none
+ *****************************************/
+static void connectLookedUp(Stream* stream)
+{
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    char target[TARGET_TEXT_LEN];
+    SocksLookup* lookup = stream->lookup;
+    stream->lookup = NULL;
+    if (finishSocksLookup(lookup, &address, &addressLength, target, sizeof(target)) == 0)
+    {
+        stream->socketFD = connectTo(&address, addressLength, target);
+    }
+    if (stream->socketFD < 0)
+    {
+        loseLocalEnd(stream);
+        return;
+    }
+
+    // A CLOSE that came meanwhile is acted on once the data before it is written, see writeStreams
+    if (stream->isCloseReceived != 0 && stream->unsent.data == NULL && shutdown(stream->socketFD, SHUT_WR) < 0)
+    {
+        perror("Unable to shut down the writing half of a stream");
+    }
+}
+
+/******************************************
+ * listenOn
+ *
+ * Arguments: in_addr_t address,
+ *            in_port_t port
+ * Returns: int
+ *
+ * Opens a listen socket on port of address
+ *
+ * Returns the socket, or -1 on error
+ *****************************************/
+static int listenOn(in_addr_t address, in_port_t port)
+{
+    int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFD < 0)
+    {
+        perror("Unable to create a listen socket for streams");
+        return -1;
+    }
+
+    int reuseAddress = 1;
+    if (setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)) < 0)
+    {
+        perror("Unable to set SO_REUSEADDR on a listen socket for streams");
+    }
+
+    struct sockaddr_in listenAddress = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(address),
+        .sin_port = htons(port)
+    };
+    if (bind(socketFD, (struct sockaddr*) &listenAddress, sizeof(listenAddress)) < 0 || listen(socketFD, 5) < 0)
+    {
+        perror("Unable to listen on a port for streams");
+        close(socketFD);
+        return -1;
+    }
+
+    return socketFD;
+}
+
+/******************************************
+ * takeStream
+ *
+ * Arguments: StreamTable* table,
+ *            int listenSocketFD, int service,
+ *            const char* name
+ * Returns: Stream*
+ *
+ * Takes a connection on listenSocketFD, for
+ * service, or -1 for a SOCKS client, named
+ * name, as a new stream
+ *
+ * Returns the stream, or NULL if none was
+ * taken
+ *****************************************/
+static Stream* takeStream(StreamTable* table, int listenSocketFD, int service, const char* name)
+{
+    int socketFD = accept(listenSocketFD, NULL, NULL);
+    if (socketFD < 0)
+    {
+        perror("Unable to accept a connection for a stream");
+        return NULL;
+    }
+
+    Stream* stream = NULL;
+    for (int i = 0; i < STREAM_LEN && stream == NULL; i++)
+    {
+        stream = (table->streams[i].isOpen == 0) ? &table->streams[i] : NULL;
+    }
+    if (stream == NULL)
+    {
+        logMessage(LOG_WARNING, "All %i streams are in use, refusing a connection for %s\n", STREAM_LEN, name);
+        close(socketFD);
+        return NULL;
+    }
+
+    if (fcntl(socketFD, F_SETFL, O_NONBLOCK) < 0)
+    {
+        perror("Unable to make a stream non-blocking");
+        close(socketFD);
+        return NULL;
+    }
+    startStream(stream, socketFD, service);
+    return stream;
+}
+
+/******************************************
+ * dropSocksClient
+ *
+ * Arguments: Stream* stream
+ * Returns: void
+ *
+ * Closes a SOCKS client's stream before
+ * sproxy was told of it, and frees it
+ *****************************************/
+static void dropSocksClient(Stream* stream)
+{
+    if (close(stream->socketFD) < 0)
+    {
+        perror("Unable to properly close a SOCKS client");
+    }
+    stream->socketFD = -1;
+    stream->isOpen = 0;
+}
+
+/******************************************
+ * readSocks
+ *
+ * Arguments: Stream* stream
+ * Returns: void
+ *
+ * Reads what came next from a SOCKS client,
+ * and answers its greeting, then its
+ * request, once either is whole. A request
+ * that can be forwarded leaves a CONNECT to
+ * send
+ *****************************************/
+static void readSocks(Stream* stream)
+{
+    // Only as much as the message is missing is read, so the stream's own data is left on the socket
+    int missingLength = socksMissingLength(stream->socksMessage, stream->socksLength, stream->isGreeted);
+    int length = recv(stream->socketFD, stream->socksMessage + stream->socksLength, missingLength, 0);
+    if (length <= 0)
+    {
+        if (length < 0)
+        {
+            perror("Unable to read from a SOCKS client");
+        }
+        dropSocksClient(stream);
+        return;
+    }
+    stream->socksLength += length;
+
+    missingLength = socksMissingLength(stream->socksMessage, stream->socksLength, stream->isGreeted);
+    if (missingLength > 0)
+    {
+        return;
+    }
+    if (missingLength < 0)
+    {
+        logMessage(LOG_WARNING, "Dropping a client that does not speak SOCKS5\n");
+        dropSocksClient(stream);
+        return;
+    }
+
+    uint8_t reply[SOCKS_REPLY_LEN];
+    if (stream->isGreeted == 0)
+    {
+        int isAccepted = (acceptSocksGreeting(stream->socksMessage, reply) == 0);
+        if (isAccepted == 0)
+        {
+            logMessage(LOG_WARNING, "Refusing a SOCKS client that wants authentication\n");
+        }
+        if (send(stream->socketFD, reply, 2, MSG_NOSIGNAL) != 2 || isAccepted == 0)
+        {
+            dropSocksClient(stream);
+            return;
+        }
+        stream->isGreeted = 1;
+        stream->socksLength = 0;
+        return;
+    }
+
+    // The CONNECT is taken to succeed once it is sent, see stream.h
+    int status = socksRequestStatus(stream->socksMessage);
+    int replyLength = writeSocksReply(reply, status);
+    if (status != SOCKS_SUCCEEDED)
+    {
+        logMessage(LOG_WARNING, "Refusing a SOCKS request with status %i\n", status);
+    }
+    if (send(stream->socketFD, reply, replyLength, MSG_NOSIGNAL) != replyLength || status != SOCKS_SUCCEEDED)
+    {
+        dropSocksClient(stream);
+        return;
+    }
+    stream->isSocksPending = 0;
+    stream->isOpenPending = 1;
+
+    char target[TARGET_TEXT_LEN];
+    describeSocksTarget(stream->socksMessage + SOCKS_TARGET_OFFSET, stream->socksLength - SOCKS_TARGET_OFFSET, target,
+        sizeof(target));
+    logMessage(LOG_INFO, "Opening a stream to %s\n", target);
+}
+
+void initStreamTable(StreamTable* table, int isOpener)
+{
+    table->isOpener = isOpener;
+    table->serviceCount = 0;
+    table->socksPort = 0;
+    table->socksListenSocketFD = -1;
+    table->isSocksAllowed = 0;
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        table->streams[i].isOpen = 0;
+        table->streams[i].socketFD = -1;
+        table->streams[i].unsent.data = NULL;
+        table->streams[i].lookup = NULL;
+        table->finishing[i].socketFD = -1;
+        table->finishing[i].unsent.data = NULL;
+    }
+    table->next = 0;
+    table->isClientTurn = 0;
+    table->isControlReady = 0;
+}
+
+int loadStreamMap(StreamTable* table, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror("Unable to open map file");
+        return -1;
+    }
+
+    char line[MAP_LINE_LEN];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        // name lport host port, and nothing else
+        char name[STREAM_NAME_LEN];
+        char host[INET_ADDRSTRLEN];
+        int listenPort, port;
+        char extra;
+        int fields = sscanf(line, "%31s %d %15s %d %c", name, &listenPort, host, &port, &extra);
+        if (fields <= 0)
+        {
+            continue;
+        }
+
+        if (fields != 4 || listenPort <= 0 || listenPort > 65535 || port <= 0 || port > 65535
+            || inet_addr(host) == INADDR_NONE || table->serviceCount == STREAM_SERVICE_LEN)
+        {
+            logMessage(LOG_ERROR, "Map file %s line %i must be: name lport host port, with an IPv4 host and at most %i services\n",
+                path, lineNumber, STREAM_SERVICE_LEN);
+            fclose(file);
+            return -1;
+        }
+        StreamService* service = &table->services[table->serviceCount];
+        strcpy(service->name, name);
+        service->listenPort = listenPort;
+        service->address.sin_family = AF_INET;
+        service->address.sin_addr.s_addr = inet_addr(host);
+        service->address.sin_port = htons(port);
+        service->listenSocketFD = -1;
+        table->serviceCount++;
+    }
+    fclose(file);
+
+    return 0;
+}
+
+int listenForStreams(StreamTable* table)
+{
+    for (int i = 0; i < table->serviceCount; i++)
+    {
+        table->services[i].listenSocketFD = listenOn(INADDR_ANY, table->services[i].listenPort);
+        if (table->services[i].listenSocketFD < 0)
+        {
+            return -1;
+        }
+    }
+
+    // A SOCKS client can ask for anything, so only this host's own are taken
+    if (table->socksPort != 0)
+    {
+        table->socksListenSocketFD = listenOn(INADDR_LOOPBACK, table->socksPort);
+        if (table->socksListenSocketFD < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int addStreamsToSet(StreamTable* table, fd_set* set, fd_set* writeSet, int maxFD, uint32_t features, int isSending,
+    uint32_t inFlight, uint32_t windowLength, int maxPayloadLength)
+{
+    for (int i = 0; (features & HELLO_STREAMS) != 0 && i < table->serviceCount; i++)
+    {
+        if (table->services[i].listenSocketFD >= 0)
+        {
+            FD_SET(table->services[i].listenSocketFD, set);
+            maxFD = (table->services[i].listenSocketFD > maxFD) ? table->services[i].listenSocketFD : maxFD;
+        }
+    }
+    if ((features & HELLO_SOCKS) != 0 && table->socksListenSocketFD >= 0)
+    {
+        FD_SET(table->socksListenSocketFD, set);
+        maxFD = (table->socksListenSocketFD > maxFD) ? table->socksListenSocketFD : maxFD;
+    }
+
+    // OPEN and CLOSE are small, so they only need room in the window, as a keystroke does
+    table->isControlReady = isSending != 0 && (windowLength == 0 || inFlight < windowLength);
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        stream->readLength = 0;
+
+        // Bytes kept for a local end are written whenever it takes them, as are those of a finishing stream
+        if (stream->isOpen != 0 && stream->socketFD >= 0 && stream->unsent.data != NULL)
+        {
+            FD_SET(stream->socketFD, writeSet);
+            maxFD = (stream->socketFD > maxFD) ? stream->socketFD : maxFD;
+        }
+        if (table->finishing[i].socketFD >= 0)
+        {
+            FD_SET(table->finishing[i].socketFD, writeSet);
+            maxFD = (table->finishing[i].socketFD > maxFD) ? table->finishing[i].socketFD : maxFD;
+        }
+        if (stream->isOpen != 0 && stream->lookup != NULL)
+        {
+            FD_SET(stream->lookup->wakeFDs[0], set);
+            maxFD = (stream->lookup->wakeFDs[0] > maxFD) ? stream->lookup->wakeFDs[0] : maxFD;
+        }
+
+        // A SOCKS client is answered by cproxy itself, so it is read whether or not anything may be sent
+        if (stream->isOpen != 0 && stream->isSocksPending != 0)
+        {
+            FD_SET(stream->socketFD, set);
+            maxFD = (stream->socketFD > maxFD) ? stream->socketFD : maxFD;
+            continue;
+        }
+        if (isSending == 0 || stream->isOpen == 0 || stream->socketFD < 0 || stream->isCloseSent != 0
+            || stream->isClosePending != 0)
+        {
+            continue;
+        }
+
+        stream->readLength = priorityReadLength(stream->socketFD, inFlight, windowLength, maxPayloadLength - STREAM_HEADER_LEN);
+        if (stream->readLength > 0)
+        {
+            FD_SET(stream->socketFD, set);
+            maxFD = (stream->socketFD > maxFD) ? stream->socketFD : maxFD;
+        }
+    }
+
+    return maxFD;
+}
+
+int hasStreamControl(StreamTable* table)
+{
+    for (int i = 0; table->isControlReady != 0 && i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        if (stream->isOpen != 0 && (stream->isOpenPending != 0 || stream->isClosePending != 0))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void acceptStreams(StreamTable* table, fd_set* set)
+{
+    for (int i = 0; i < table->serviceCount; i++)
+    {
+        StreamService* service = &table->services[i];
+        if (service->listenSocketFD < 0 || FD_ISSET(service->listenSocketFD, set) == 0)
+        {
+            continue;
+        }
+
+        Stream* stream = takeStream(table, service->listenSocketFD, i, service->name);
+        if (stream != NULL)
+        {
+            stream->isOpenPending = 1;
+            logMessage(LOG_INFO, "Opening a stream to %s\n", service->name);
+        }
+    }
+
+    // A new SOCKS client is only read once it sent something
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        if (stream->isOpen != 0 && stream->isSocksPending != 0 && FD_ISSET(stream->socketFD, set))
+        {
+            readSocks(stream);
+        }
+    }
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        if (stream->isOpen != 0 && stream->lookup != NULL && FD_ISSET(stream->lookup->wakeFDs[0], set))
+        {
+            connectLookedUp(stream);
+        }
+    }
+    if (table->socksListenSocketFD >= 0 && FD_ISSET(table->socksListenSocketFD, set))
+    {
+        Stream* stream = takeStream(table, table->socksListenSocketFD, -1, "SOCKS");
+        if (stream != NULL)
+        {
+            stream->isSocksPending = 1;
+        }
+    }
+}
+
+void writeStreams(StreamTable* table, fd_set* writeSet)
+{
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        if (stream->isOpen != 0 && stream->socketFD >= 0 && stream->unsent.data != NULL
+            && FD_ISSET(stream->socketFD, writeSet))
+        {
+            int unsentLength = writeUnsent(stream->socketFD, &stream->unsent);
+            if (unsentLength < 0)
+            {
+                loseLocalEnd(stream);
+            }
+            else if (unsentLength == 0 && stream->isCloseReceived != 0 && shutdown(stream->socketFD, SHUT_WR) < 0)
+            {
+                perror("Unable to shut down the writing half of a stream");
+            }
+        }
+
+        // A finishing stream is closed once its bytes are written, or can not be
+        FinishingStream* finishing = &table->finishing[i];
+        if (finishing->socketFD >= 0 && FD_ISSET(finishing->socketFD, writeSet)
+            && writeUnsent(finishing->socketFD, &finishing->unsent) <= 0)
+        {
+            if (close(finishing->socketFD) < 0)
+            {
+                perror("Unable to properly close a stream");
+            }
+            finishing->socketFD = -1;
+            dropUnsent(&finishing->unsent);
+        }
+    }
+}
+
+Stream* nextStreamToSend(StreamTable* table, fd_set* set, int isClientReady)
+{
+    if (isClientReady != 0 && table->isClientTurn != 0)
+    {
+        table->isClientTurn = 0;
+        return NULL;
+    }
+
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        int streamID = (table->next + i) % STREAM_LEN;
+        Stream* stream = &table->streams[streamID];
+        if (stream->isOpen == 0)
+        {
+            continue;
+        }
+
+        if ((table->isControlReady != 0 && (stream->isOpenPending != 0 || stream->isClosePending != 0))
+            || (stream->readLength > 0 && stream->socketFD >= 0 && FD_ISSET(stream->socketFD, set)))
+        {
+            table->next = (streamID + 1) % STREAM_LEN;
+            table->isClientTurn = 1;
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+int readStreamPacket(StreamTable* table, Stream* stream, void* payload, int* bytesRead)
+{
+    StreamHeader* header = payload;
+    char* data = (char*) payload + STREAM_HEADER_LEN;
+    header->streamID = stream - table->streams;
+    *bytesRead = 0;
+
+    if (stream->isOpenPending != 0)
+    {
+        stream->isOpenPending = 0;
+        if (stream->service < 0)
+        {
+            header->kind = STREAM_CONNECT;
+            int targetLength = stream->socksLength - SOCKS_TARGET_OFFSET;
+            memcpy(data, stream->socksMessage + SOCKS_TARGET_OFFSET, targetLength);
+            return STREAM_HEADER_LEN + targetLength;
+        }
+        header->kind = STREAM_OPEN;
+        int nameLength = strlen(table->services[stream->service].name);
+        memcpy(data, table->services[stream->service].name, nameLength);
+        return STREAM_HEADER_LEN + nameLength;
+    }
+
+    if (stream->isClosePending == 0)
+    {
+        int length = recv(stream->socketFD, data, stream->readLength, 0);
+        if (length > 0)
+        {
+            header->kind = STREAM_DATA;
+            *bytesRead = length;
+            return STREAM_HEADER_LEN + length;
+        }
+        if (length < 0)
+        {
+            perror("Unable to read from a stream");
+            loseLocalEnd(stream);
+        }
+    }
+
+    // The local end was read to the end, or lost, but it may still be written to until CLOSE comes back
+    stream->isClosePending = 0;
+    stream->isCloseSent = 1;
+    header->kind = STREAM_CLOSE;
+    endStream(table, stream);
+    return STREAM_HEADER_LEN;
+}
+
+int deliverStreamPacket(StreamTable* table, void* payload, int length)
+{
+    StreamHeader* header = payload;
+    char* data = (char*) payload + STREAM_HEADER_LEN;
+    int dataLength = length - (int) STREAM_HEADER_LEN;
+    if (dataLength < 0 || header->streamID >= STREAM_LEN)
+    {
+        return 0;
+    }
+    Stream* stream = &table->streams[header->streamID];
+
+    if (header->kind == STREAM_OPEN || header->kind == STREAM_CONNECT)
+    {
+        // A stream ID still in use is left over from before, and is dropped
+        if (stream->isOpen != 0)
+        {
+            loseLocalEnd(stream);
+        }
+
+        // A stream whose name is looked up first has no local end yet, but is not lost
+        int service;
+        SocksLookup* lookup;
+        int socketFD = connectStream(table, header->kind, data, dataLength, &service, &lookup);
+        startStream(stream, socketFD, service);
+        stream->lookup = lookup;
+        stream->isClosePending = (socketFD < 0 && lookup == NULL);
+        return 0;
+    }
+
+    // The other side is answered with CLOSE for a stream it has and this side does not
+    if (stream->isOpen == 0)
+    {
+        if (header->kind == STREAM_DATA)
+        {
+            startStream(stream, -1, -1);
+        }
+        return 0;
+    }
+
+    if (header->kind == STREAM_CLOSE)
+    {
+        // Bytes still kept for the local end go first, see writeStreams
+        stream->isCloseReceived = 1;
+        if (stream->socketFD >= 0 && stream->unsent.data == NULL && shutdown(stream->socketFD, SHUT_WR) < 0)
+        {
+            perror("Unable to shut down the writing half of a stream");
+        }
+        endStream(table, stream);
+        return 0;
+    }
+
+    if (header->kind != STREAM_DATA || (stream->socketFD < 0 && stream->lookup == NULL) || stream->isCloseReceived != 0)
+    {
+        return 0;
+    }
+
+    // Written now if the local end is connected and takes it, with nothing kept for it that would have to go first
+    int bytesSent = 0;
+    if (stream->socketFD >= 0 && stream->unsent.data == NULL)
+    {
+        bytesSent = send(stream->socketFD, data, dataLength, MSG_NOSIGNAL);
+        if (bytesSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            perror("Unable to write to a stream");
+            loseLocalEnd(stream);
+            return 0;
+        }
+        bytesSent = (bytesSent > 0) ? bytesSent : 0;
+    }
+    if (bytesSent < dataLength && keepUnsent(&stream->unsent, data + bytesSent, dataLength - bytesSent) < 0)
+    {
+        logMessage(LOG_WARNING, "A stream's local end fell more than %i bytes behind, closing it\n", STREAM_UNSENT_LEN);
+        loseLocalEnd(stream);
+        return bytesSent;
+    }
+
+    return dataLength;
+}
+
+void closeStreams(StreamTable* table)
+{
+    for (int i = 0; i < STREAM_LEN; i++)
+    {
+        Stream* stream = &table->streams[i];
+        if (stream->isOpen != 0 && stream->socketFD >= 0 && close(stream->socketFD) < 0)
+        {
+            perror("Unable to properly close a stream");
+        }
+        stream->isOpen = 0;
+        stream->socketFD = -1;
+        dropUnsent(&stream->unsent);
+        if (stream->lookup != NULL)
+        {
+            abandonSocksLookup(stream->lookup);
+            stream->lookup = NULL;
+        }
+
+        // What finishing streams still had is lost with the session too
+        FinishingStream* finishing = &table->finishing[i];
+        if (finishing->socketFD >= 0 && close(finishing->socketFD) < 0)
+        {
+            perror("Unable to properly close a stream");
+        }
+        finishing->socketFD = -1;
+        dropUnsent(&finishing->unsent);
+    }
+    table->next = 0;
+    table->isClientTurn = 0;
+}
@@ -0,0 +1,326 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       stream.h
+
+Note:       TCP services other than telnet, forwarded over the session,
+            such as SSH, a database or an internal web server.
+
+            Both proxies are given the same map file with -m. Each line
+            names a service, the port cproxy listens on for it, and the
+            host and port sproxy connects it to:
+
+                # name      lport   host        port
+                ssh         2222    127.0.0.1   22
+                db          5433    10.0.0.5    5432
+
+            A connection cproxy takes on a service's port is a stream.
+            cproxy picks a free stream ID for it and sends OPEN with the
+            service's name, so the target is chosen per stream, by the
+            map sproxy was given, and sproxy connects to it. Data each
+            way is sent as DATA, and CLOSE says the sender read its end
+            of the stream to the end, or lost it. A proxy that gets CLOSE
+            shuts down the writing half of its end, so half closed
+            connections work, and a stream ID is free again once CLOSE
+            went both ways. A stream that can not be opened, or that
+            the other side does not know, is answered with CLOSE.
+
+            Stream packets are data packets with PACKET_TYPE_STREAM set,
+            and their payload starts with a StreamHeader. They take
+            seqNs in between the telnet session's own packets, so they
+            share its window, acknowledgements, retransmission,
+            encryption and parity, and survive a reconnect the same way.
+            PACKET_TYPE_STREAM is above the type bits of a version 2
+            frame's flags, so its frames carry the rest of the type after
+            them (see frame.h). Streams are only opened once both sides
+            agreed to HELLO_STREAMS, until when cproxy leaves
+            connections waiting on its service ports. Local data is read
+            for a stream as for telnet (see priority.h), and a stream and
+            the telnet client with both data waiting take turns.
+
+            With -D port, cproxy also takes SOCKS5 connections (see
+            socks.h) on that port of the loopback address, and each
+            becomes a stream too, once the client asked to CONNECT. Its
+            OPEN is a CONNECT instead, which carries the target from the
+            request, so any address or name, and any port, can be
+            reached without a line in the map file for it. sproxy only
+            connects those if it was started with -D as well, as it
+            lets whoever joins the session reach anything sproxy can.
+            It looks a name up without holding up the session (see
+            socks.h), keeping the stream's data meanwhile, and connects
+            the stream once the answer comes. cproxy tells the client
+            the CONNECT succeeded as soon as it sends it, rather than a
+            round trip later, so a target sproxy can not reach shows up
+            as a connection that is closed at once.
+
+            Streams only exist within a session: they end with it, and
+            sproxy hands none of them over in an upgrade. Every stream
+            shares one ordered byte stream each way, and the proxies'
+            one loop, so a local end is never waited on: its socket is
+            non-blocking, and what it does not take at once, such as
+            data that arrives while sproxy is still connecting it, is
+            kept, up to STREAM_UNSENT_LEN bytes, and written once select
+            says it can take more. A local end that falls further behind
+            than that is lost, and its stream closed, rather than holding
+            up every other stream and telnet. A stream that ends while
+            bytes are still kept for its local end frees its stream ID,
+            and the bytes are still written, and its writing half shut
+            down after them, as it finishes.
+*/
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "socks.h"
+
+#define STREAM_LEN 16               // most streams open at once
+#define STREAM_SERVICE_LEN 16       // most services in a map file
+#define STREAM_NAME_LEN 32          // longest service name, with its terminating 0
+#define STREAM_UNSENT_LEN (1 << 20) // most bytes kept for a local end that is not taking them, before the stream is lost
+
+#define PACKET_TYPE_STREAM 0x40     // payload is a StreamHeader followed by what it carries
+
+// Kinds of StreamHeader
+#define STREAM_OPEN 1               // followed by the name of the service to connect to
+#define STREAM_DATA 2               // followed by data
+#define STREAM_CLOSE 3              // the sender sends nothing more on the stream
+#define STREAM_CONNECT 4            // followed by the target of a SOCKS request, to connect to
+
+typedef struct {
+
+    uint8_t streamID;
+    uint8_t kind;           // STREAM_OPEN, STREAM_DATA or STREAM_CLOSE
+
+} StreamHeader;
+
+#define STREAM_HEADER_LEN sizeof(StreamHeader)
+
+typedef struct {
+
+    char name[STREAM_NAME_LEN];
+    in_port_t listenPort;           // where cproxy takes connections for it
+    struct sockaddr_in address;     // where sproxy connects them
+    int listenSocketFD;             // cproxy's, -1 if not listening
+
+} StreamService;
+
+typedef struct {
+
+    // Kept from start up to end
+    char* data;             // allocated with the first byte kept, and freed once they are all written
+    int start;
+    int end;
+
+} StreamBacklog;
+
+typedef struct {
+
+    int isOpen;             // is true while the stream ID is in use
+    int socketFD;           // the local end, -1 once lost
+    int service;            // index of its service, -1 for a SOCKS client's
+    int isOpenPending;      // is true until OPEN is sent
+    int isClosePending;     // is true once the local end was lost, until CLOSE is sent
+    int isCloseSent;
+    int isCloseReceived;
+    int readLength;         // most bytes to read from socketFD this time round, 0 for none
+    StreamBacklog unsent;   // bytes for socketFD it did not take yet, or for a stream still being looked up
+    SocksLookup* lookup;    // sproxy's lookup of the name the stream connects to, NULL once done or if none
+
+    // A SOCKS client's greeting, then its request, as it is read, until the request is whole
+    int isSocksPending;     // is true while they are read
+    int isGreeted;          // is true once the greeting was answered
+    uint8_t socksMessage[SOCKS_MESSAGE_LEN];
+    int socksLength;
+
+} Stream;
+
+typedef struct {
+
+    int socketFD;           // the local end of a stream that ended, -1 while not in use
+    StreamBacklog unsent;   // bytes still to write to it before its writing half is shut down
+
+} FinishingStream;
+
+typedef struct {
+
+    int isOpener;           // is true for cproxy, which opens streams, and refuses to open any for sproxy
+    StreamService services[STREAM_SERVICE_LEN];
+    int serviceCount;
+    in_port_t socksPort;    // cproxy's port for SOCKS clients, 0 for none
+    int socksListenSocketFD;
+    int isSocksAllowed;     // is true for sproxy if it connects streams to the targets of SOCKS requests
+    Stream streams[STREAM_LEN];
+    FinishingStream finishing[STREAM_LEN];
+    int next;               // the stream looked at first for something to send, so each gets its turn
+    int isClientTurn;       // is true if the telnet side goes first when it has something to send too
+    int isControlReady;     // is true if OPEN and CLOSE may be sent this time round
+
+} StreamTable;
+
+/**************************************************
+ * initStreamTable
+ *
+ * Arguments: StreamTable* table, int isOpener
+ * Returns: void
+ *
+ * Empties table, with no services, for cproxy if
+ * isOpener is true, or for sproxy
+ *************************************************/
+void initStreamTable(StreamTable* table, int isOpener);
+
+/**************************************************
+ * loadStreamMap
+ *
+ * Arguments: StreamTable* table, const char* path
+ * Returns: int
+ *
+ * Reads the services in the map file at path in
+ * to table
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int loadStreamMap(StreamTable* table, const char* path);
+
+/**************************************************
+ * listenForStreams
+ *
+ * Arguments: StreamTable* table
+ * Returns: int
+ *
+ * Opens cproxy's listen socket on the port of
+ * every service, and on its SOCKS port
+ *
+ * Returns -1 on error, 0 otherwise
+ *************************************************/
+int listenForStreams(StreamTable* table);
+
+/**************************************************
+ * addStreamsToSet
+ *
+ * Arguments: StreamTable* table, fd_set* set,
+ *            fd_set* writeSet, int maxFD,
+ *            uint32_t features, int isSending,
+ *            uint32_t inFlight,
+ *            uint32_t windowLength,
+ *            int maxPayloadLength
+ * Returns: int
+ *
+ * Adds to set the listen sockets for what the
+ * agreed HELLO_STREAMS and HELLO_SOCKS in features
+ * allow, the SOCKS clients still being read, the
+ * pipes of the lookups still running and,
+ * if isSending, the local end of every stream
+ * with data that may be read now, with
+ * inFlight data packets out of windowLength (see
+ * priority.h) and payloads of up to
+ * maxPayloadLength. Adds to writeSet every local
+ * end with bytes kept for it
+ *
+ * Returns the largest of maxFD and those added
+ *************************************************/
+int addStreamsToSet(StreamTable* table, fd_set* set, fd_set* writeSet, int maxFD, uint32_t features, int isSending,
+    uint32_t inFlight, uint32_t windowLength, int maxPayloadLength);
+
+/**************************************************
+ * hasStreamControl
+ *
+ * Arguments: StreamTable* table
+ * Returns: int
+ *
+ * Is true if an OPEN, CONNECT or CLOSE may be
+ * sent now, so select should not wait
+ *************************************************/
+int hasStreamControl(StreamTable* table);
+
+/**************************************************
+ * acceptStreams
+ *
+ * Arguments: StreamTable* table, fd_set* set
+ * Returns: void
+ *
+ * Takes a connection on every listen socket
+ * ready in set, as a new stream, and reads what
+ * SOCKS clients ready in set sent. A stream has
+ * its OPEN or CONNECT to send once it is known
+ * where it goes. Connects the streams whose
+ * lookups are ready in set
+ *************************************************/
+void acceptStreams(StreamTable* table, fd_set* set);
+
+/**************************************************
+ * writeStreams
+ *
+ * Arguments: StreamTable* table, fd_set* writeSet
+ * Returns: void
+ *
+ * Writes the bytes kept for every local end ready
+ * in writeSet, as many as it takes
+ *************************************************/
+void writeStreams(StreamTable* table, fd_set* writeSet);
+
+/**************************************************
+ * nextStreamToSend
+ *
+ * Arguments: StreamTable* table, fd_set* set,
+ *            int isClientReady
+ * Returns: Stream*
+ *
+ * Picks the next stream, after the last one
+ * picked, with an OPEN, CONNECT or CLOSE to send
+ * or data ready in set. isClientReady should be
+ * true if the telnet side has data to send too
+ *
+ * Returns the stream, or NULL if there is none or
+ * it is the telnet side's turn
+ *************************************************/
+Stream* nextStreamToSend(StreamTable* table, fd_set* set, int isClientReady);
+
+/**************************************************
+ * readStreamPacket
+ *
+ * Arguments: StreamTable* table, Stream* stream,
+ *            void* payload, int* bytesRead
+ * Returns: int
+ *
+ * Writes the payload of the next packet to send
+ * for stream in to payload: its OPEN, CONNECT or
+ * CLOSE, or data read from its local end, or a
+ * CLOSE if that ended. Sets bytesRead to the
+ * bytes read from the local end
+ *
+ * Returns the length of the payload
+ *************************************************/
+int readStreamPacket(StreamTable* table, Stream* stream, void* payload, int* bytesRead);
+
+/**************************************************
+ * deliverStreamPacket
+ *
+ * Arguments: StreamTable* table, void* payload,
+ *            int length
+ * Returns: int
+ *
+ * Acts on the payload of a stream packet that
+ * arrived in order: opens, writes to or closes
+ * the local end of its stream, without waiting
+ * for it. A stream that fails, or falls too far
+ * behind, is closed, with a CLOSE to send
+ *
+ * Returns the bytes written to, or kept for, the
+ * local end
+ *************************************************/
+int deliverStreamPacket(StreamTable* table, void* payload, int length);
+
+/**************************************************
+ * closeStreams
+ *
+ * Arguments: StreamTable* table
+ * Returns: void
+ *
+ * Closes every stream, as the session they
+ * belong to ends
+ *************************************************/
+void closeStreams(StreamTable* table);
+
+#endif
@@ -0,0 +1,1631 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       terminal.c
+
+Note:       Implementation of the terminal model. See terminal.h
+*/
+#include "terminal.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Output parser states
+#define STATE_GROUND 0
+#define STATE_ESCAPE 1
+#define STATE_ESCAPE_INTERMEDIATE 2 // ESC followed by ( ) # or the like, before its final byte
+#define STATE_CSI 3
+#define STATE_STRING 4              // OSC, DCS and the like, skipped up to BEL or ST
+#define STATE_STRING_ESCAPE 5
+
+// Telnet parser states, for output and input
+#define TELNET_DATA 0
+#define TELNET_IAC 1
+#define TELNET_OPTION 2             // after WILL, WONT, DO or DONT
+#define TELNET_SUB 3                // in a subnegotiation
+#define TELNET_SUB_IAC 4
+#define TELNET_SUB_OPTION 5         // after SB, before the option
+
+// Telnet bytes
+#define IAC 255
+#define SB 250
+#define SE 240
+#define WILL 251
+#define WONT 252
+#define DONT 254
+#define ECHO 1
+#define NAWS 31
+
+#define SNAPSHOT_INITIAL_LEN 16384
+
+typedef struct {
+
+    char* data;
+    int length;
+    int capacity;
+    int isFailed;
+
+} Snapshot;
+
+/******************************************
+ * getCell
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int screen, int x, int y
+ * Returns: TerminalCell*
+ *
+ * The cell at column x of row y of a screen
+ *****************************************/
+static TerminalCell* getCell(TerminalModel* terminal, int screen, int x, int y)
+{
+    return &terminal->screens[screen][y * terminal->columns + x];
+}
+
+/******************************************
+ * blankCell
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: TerminalCell
+ *
+ * An erased cell, which keeps the pen's
+ * background as a VT220 and xterm do
+ *****************************************/
+static TerminalCell blankCell(TerminalModel* terminal)
+{
+    TerminalCell cell = {
+        .character = ' ',
+        .foreground = TERMINAL_DEFAULT_COLOR,
+        .background = terminal->pen.background,
+        .attributes = 0
+    };
+    return cell;
+}
+
+/******************************************
+ * eraseCells
+ *
+ * Arguments: TerminalModel* terminal, int y,
+ *            int fromX, int toX
+ * Returns: void
+ *
+ * Blanks row y of the screen in use from
+ * fromX up to, not including, toX
+ *****************************************/
+static void eraseCells(TerminalModel* terminal, int y, int fromX, int toX)
+{
+    TerminalCell blank = blankCell(terminal);
+    for (int x = fromX; x < toX; x++)
+    {
+        *getCell(terminal, terminal->isAlternate, x, y) = blank;
+    }
+}
+
+/******************************************
+ * scrollUp
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int top, int bottom, int count
+ * Returns: void
+ *
+ * Moves rows top to bottom of the screen in
+ * use up count rows, blanking the ones left
+ * at the bottom
+ *****************************************/
+static void scrollUp(TerminalModel* terminal, int top, int bottom, int count)
+{
+    if (count > bottom - top + 1)
+    {
+        count = bottom - top + 1;
+    }
+    memmove(getCell(terminal, terminal->isAlternate, 0, top), getCell(terminal, terminal->isAlternate, 0, top + count),
+        (bottom - top + 1 - count) * terminal->columns * sizeof(TerminalCell));
+    for (int y = bottom - count + 1; y <= bottom; y++)
+    {
+        eraseCells(terminal, y, 0, terminal->columns);
+    }
+}
+
+/******************************************
+ * scrollDown
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int top, int bottom, int count
+ * Returns: void
+ *
+ * Moves rows top to bottom of the screen in
+ * use down count rows, blanking the ones
+ * left at the top
+ *****************************************/
+static void scrollDown(TerminalModel* terminal, int top, int bottom, int count)
+{
+    if (count > bottom - top + 1)
+    {
+        count = bottom - top + 1;
+    }
+    memmove(getCell(terminal, terminal->isAlternate, 0, top + count), getCell(terminal, terminal->isAlternate, 0, top),
+        (bottom - top + 1 - count) * terminal->columns * sizeof(TerminalCell));
+    for (int y = top; y < top + count; y++)
+    {
+        eraseCells(terminal, y, 0, terminal->columns);
+    }
+}
+
+/******************************************
+ * lineFeed
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Moves the cursor down a row, scrolling
+ * the scroll region at its bottom
+ *****************************************/
+static void lineFeed(TerminalModel* terminal)
+{
+    if (terminal->cursorY == terminal->scrollBottom)
+    {
+        scrollUp(terminal, terminal->scrollTop, terminal->scrollBottom, 1);
+    }
+    else if (terminal->cursorY < terminal->rows - 1)
+    {
+        terminal->cursorY++;
+    }
+    terminal->isWrapPending = 0;
+}
+
+/******************************************
+ * reverseIndex
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Moves the cursor up a row, scrolling the
+ * scroll region at its top
+ *****************************************/
+static void reverseIndex(TerminalModel* terminal)
+{
+    if (terminal->cursorY == terminal->scrollTop)
+    {
+        scrollDown(terminal, terminal->scrollTop, terminal->scrollBottom, 1);
+    }
+    else if (terminal->cursorY > 0)
+    {
+        terminal->cursorY--;
+    }
+    terminal->isWrapPending = 0;
+}
+
+/******************************************
+ * moveCursor
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int x, int y
+ * Returns: void
+ *
+ * Moves the cursor, kept on the screen, or
+ * in the scroll region in origin mode
+ *****************************************/
+static void moveCursor(TerminalModel* terminal, int x, int y)
+{
+    if ((terminal->modes & TERMINAL_ORIGIN) != 0)
+    {
+        y = (y < terminal->scrollTop) ? terminal->scrollTop : (y > terminal->scrollBottom) ? terminal->scrollBottom : y;
+    }
+    terminal->cursorX = (x < 0) ? 0 : (x >= terminal->columns) ? terminal->columns - 1 : x;
+    terminal->cursorY = (y < 0) ? 0 : (y >= terminal->rows) ? terminal->rows - 1 : y;
+    terminal->isWrapPending = 0;
+}
+
+/******************************************
+ * putCharacter
+ *
+ * Arguments: TerminalModel* terminal,
+ *            uint32_t character
+ * Returns: void
+ *
+ * Writes a character at the cursor and
+ * moves it on, wrapping at the end of a row
+ *****************************************/
+static void putCharacter(TerminalModel* terminal, uint32_t character)
+{
+    if (terminal->isWrapPending != 0)
+    {
+        terminal->cursorX = 0;
+        lineFeed(terminal);
+    }
+
+    TerminalCell* cell = getCell(terminal, terminal->isAlternate, terminal->cursorX, terminal->cursorY);
+    *cell = terminal->pen;
+    cell->character = character;
+    if (terminal->charsets[terminal->shift] != 0 && character >= 0x5f && character <= 0x7e)
+    {
+        cell->attributes |= TERMINAL_LINE_DRAWING;
+    }
+
+    if (terminal->cursorX < terminal->columns - 1)
+    {
+        terminal->cursorX++;
+    }
+    else if ((terminal->modes & TERMINAL_AUTOWRAP) != 0)
+    {
+        terminal->isWrapPending = 1;
+    }
+}
+
+/******************************************
+ * saveCursor
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Saves the cursor, pen and charsets, as
+ * DECSC does
+ *****************************************/
+static void saveCursor(TerminalModel* terminal)
+{
+    terminal->savedX = terminal->cursorX;
+    terminal->savedY = terminal->cursorY;
+    terminal->savedPen = terminal->pen;
+    memcpy(terminal->savedCharsets, terminal->charsets, sizeof(terminal->charsets));
+}
+
+/******************************************
+ * restoreCursor
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Restores what saveCursor saved, as DECRC
+ * does
+ *****************************************/
+static void restoreCursor(TerminalModel* terminal)
+{
+    moveCursor(terminal, terminal->savedX, terminal->savedY);
+    terminal->pen = terminal->savedPen;
+    memcpy(terminal->charsets, terminal->savedCharsets, sizeof(terminal->charsets));
+}
+
+/******************************************
+ * clearScreen
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int screen
+ * Returns: void
+ *
+ * Blanks a whole screen with default colors
+ *****************************************/
+static void clearScreen(TerminalModel* terminal, int screen)
+{
+    TerminalCell blank = {
+        .character = ' ',
+        .foreground = TERMINAL_DEFAULT_COLOR,
+        .background = TERMINAL_DEFAULT_COLOR,
+        .attributes = 0
+    };
+    for (int i = 0; i < terminal->rows * terminal->columns; i++)
+    {
+        terminal->screens[screen][i] = blank;
+    }
+}
+
+/******************************************
+ * resetState
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Resets the cursor, pen, modes and scroll
+ * region, as RIS does
+ *****************************************/
+static void resetState(TerminalModel* terminal)
+{
+    terminal->isAlternate = 0;
+    terminal->cursorX = 0;
+    terminal->cursorY = 0;
+    terminal->isWrapPending = 0;
+    terminal->scrollTop = 0;
+    terminal->scrollBottom = terminal->rows - 1;
+    terminal->pen.character = ' ';
+    terminal->pen.foreground = TERMINAL_DEFAULT_COLOR;
+    terminal->pen.background = TERMINAL_DEFAULT_COLOR;
+    terminal->pen.attributes = 0;
+    terminal->modes = TERMINAL_AUTOWRAP | TERMINAL_CURSOR_VISIBLE;
+    terminal->charsets[0] = 0;
+    terminal->charsets[1] = 0;
+    terminal->shift = 0;
+    saveCursor(terminal);
+    clearScreen(terminal, 0);
+    clearScreen(terminal, 1);
+}
+
+/******************************************
+ * resizeTerminal
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int columns, int rows
+ * Returns: void
+ *
+ * Changes the size, keeping what fits at the
+ * top left of each screen
+ *****************************************/
+static void resizeTerminal(TerminalModel* terminal, int columns, int rows)
+{
+    if (columns < 1 || rows < 1 || (columns == terminal->columns && rows == terminal->rows))
+    {
+        return;
+    }
+    columns = (columns > TERMINAL_MAX_COLUMNS) ? TERMINAL_MAX_COLUMNS : columns;
+    rows = (rows > TERMINAL_MAX_ROWS) ? TERMINAL_MAX_ROWS : rows;
+
+    for (int screen = 0; screen < 2; screen++)
+    {
+        TerminalCell* cells = malloc(columns * rows * sizeof(TerminalCell));
+        if (cells == NULL)
+        {
+            perror("Unable to allocate space for the terminal screen");
+            return;
+        }
+        for (int y = 0; y < rows; y++)
+        {
+            for (int x = 0; x < columns; x++)
+            {
+                TerminalCell blank = {
+                    .character = ' ',
+                    .foreground = TERMINAL_DEFAULT_COLOR,
+                    .background = TERMINAL_DEFAULT_COLOR,
+                    .attributes = 0
+                };
+                cells[y * columns + x] = (x < terminal->columns && y < terminal->rows) ? *getCell(terminal, screen, x, y) : blank;
+            }
+        }
+        free(terminal->screens[screen]);
+        terminal->screens[screen] = cells;
+    }
+
+    // getCell uses the old size, so the new one is only set once both screens are copied
+    terminal->columns = columns;
+    terminal->rows = rows;
+    terminal->scrollTop = 0;
+    terminal->scrollBottom = rows - 1;
+    moveCursor(terminal, terminal->cursorX, terminal->cursorY);
+    terminal->savedX = (terminal->savedX >= columns) ? columns - 1 : terminal->savedX;
+    terminal->savedY = (terminal->savedY >= rows) ? rows - 1 : terminal->savedY;
+}
+
+/******************************************
+ * getParam
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int index, int otherwise
+ * Returns: int
+ *
+ * A parameter of the control sequence, or
+ * otherwise if it was left out or 0
+ *****************************************/
+static int getParam(TerminalModel* terminal, int index, int otherwise)
+{
+    if (index >= terminal->paramCount || terminal->params[index] <= 0)
+    {
+        return otherwise;
+    }
+    return terminal->params[index];
+}
+
+/******************************************
+ * selectGraphic
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Applies an SGR sequence to the pen
+ *****************************************/
+static void selectGraphic(TerminalModel* terminal)
+{
+    TerminalCell* pen = &terminal->pen;
+    if (terminal->paramCount == 0)
+    {
+        terminal->params[terminal->paramCount++] = 0;
+    }
+
+    for (int i = 0; i < terminal->paramCount; i++)
+    {
+        int param = terminal->params[i];
+        if (param == 0)
+        {
+            pen->foreground = TERMINAL_DEFAULT_COLOR;
+            pen->background = TERMINAL_DEFAULT_COLOR;
+            pen->attributes = 0;
+        }
+        else if (param == 1)
+        {
+            pen->attributes |= TERMINAL_BOLD;
+        }
+        else if (param == 2)
+        {
+            pen->attributes |= TERMINAL_DIM;
+        }
+        else if (param == 3)
+        {
+            pen->attributes |= TERMINAL_ITALIC;
+        }
+        else if (param == 4)
+        {
+            pen->attributes |= TERMINAL_UNDERLINE;
+        }
+        else if (param == 5)
+        {
+            pen->attributes |= TERMINAL_BLINK;
+        }
+        else if (param == 7)
+        {
+            pen->attributes |= TERMINAL_REVERSE;
+        }
+        else if (param == 22)
+        {
+            pen->attributes &= ~(TERMINAL_BOLD | TERMINAL_DIM);
+        }
+        else if (param == 23)
+        {
+            pen->attributes &= ~TERMINAL_ITALIC;
+        }
+        else if (param == 24)
+        {
+            pen->attributes &= ~TERMINAL_UNDERLINE;
+        }
+        else if (param == 25)
+        {
+            pen->attributes &= ~TERMINAL_BLINK;
+        }
+        else if (param == 27)
+        {
+            pen->attributes &= ~TERMINAL_REVERSE;
+        }
+        else if (param >= 30 && param <= 37)
+        {
+            pen->foreground = param - 30;
+        }
+        else if (param == 39)
+        {
+            pen->foreground = TERMINAL_DEFAULT_COLOR;
+        }
+        else if (param >= 40 && param <= 47)
+        {
+            pen->background = param - 40;
+        }
+        else if (param == 49)
+        {
+            pen->background = TERMINAL_DEFAULT_COLOR;
+        }
+        else if (param >= 90 && param <= 97)
+        {
+            pen->foreground = param - 90 + 8;
+        }
+        else if (param >= 100 && param <= 107)
+        {
+            pen->background = param - 100 + 8;
+        }
+        else if (param == 38 || param == 48)
+        {
+            // 256 colors as 38;5;n, truecolor as 38;2;r;g;b, which falls back to the default
+            uint16_t color = TERMINAL_DEFAULT_COLOR;
+            if (getParam(terminal, i + 1, 0) == 5 && i + 2 < terminal->paramCount)
+            {
+                color = terminal->params[i + 2] & 0xff;
+                i += 2;
+            }
+            else if (getParam(terminal, i + 1, 0) == 2)
+            {
+                i += 4;
+            }
+            if (param == 38)
+            {
+                pen->foreground = color;
+            }
+            else
+            {
+                pen->background = color;
+            }
+        }
+    }
+}
+
+/******************************************
+ * setMode
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int isSet
+ * Returns: void
+ *
+ * Applies a DEC private mode sequence (CSI ?
+ * h or l)
+ *****************************************/
+static void setMode(TerminalModel* terminal, int isSet)
+{
+    for (int i = 0; i < terminal->paramCount; i++)
+    {
+        uint32_t mode = 0;
+        switch (terminal->params[i])
+        {
+            case 1:
+                mode = TERMINAL_CURSOR_KEYS;
+                break;
+            case 6:
+                mode = TERMINAL_ORIGIN;
+                moveCursor(terminal, 0, isSet ? terminal->scrollTop : 0);
+                break;
+            case 7:
+                mode = TERMINAL_AUTOWRAP;
+                break;
+            case 25:
+                mode = TERMINAL_CURSOR_VISIBLE;
+                break;
+            case 1000:
+                mode = TERMINAL_MOUSE_CLICKS;
+                break;
+            case 1002:
+                mode = TERMINAL_MOUSE_DRAGS;
+                break;
+            case 1003:
+                mode = TERMINAL_MOUSE_MOTION;
+                break;
+            case 1006:
+                mode = TERMINAL_MOUSE_SGR;
+                break;
+            case 2004:
+                mode = TERMINAL_BRACKETED_PASTE;
+                break;
+            case 47:
+            case 1047:
+            case 1049:
+                // The alternate screen. 1049 also saves the cursor and clears the screen on the way in, and
+                // 1047 clears it on the way out
+                if (isSet != 0 && terminal->isAlternate == 0)
+                {
+                    if (terminal->params[i] == 1049)
+                    {
+                        saveCursor(terminal);
+                        clearScreen(terminal, 1);
+                    }
+                    terminal->isAlternate = 1;
+                }
+                else if (isSet == 0)
+                {
+                    if (terminal->params[i] == 1047 && terminal->isAlternate != 0)
+                    {
+                        clearScreen(terminal, 1);
+                    }
+                    terminal->isAlternate = 0;
+
+                    // As in xterm, the cursor is restored even if the main screen was already in use
+                    if (terminal->params[i] == 1049)
+                    {
+                        restoreCursor(terminal);
+                    }
+                }
+                break;
+        }
+
+        // Mouse reporting is one setting, so setting one kind replaces the others, and resetting any turns it off
+        if ((mode & (TERMINAL_MOUSE_CLICKS | TERMINAL_MOUSE_DRAGS | TERMINAL_MOUSE_MOTION)) != 0)
+        {
+            terminal->modes &= ~(TERMINAL_MOUSE_CLICKS | TERMINAL_MOUSE_DRAGS | TERMINAL_MOUSE_MOTION);
+        }
+        if (isSet != 0)
+        {
+            terminal->modes |= mode;
+        }
+        else
+        {
+            terminal->modes &= ~mode;
+        }
+    }
+}
+
+/******************************************
+ * executeCsi
+ *
+ * Arguments: TerminalModel* terminal,
+ *            char final
+ * Returns: void
+ *
+ * Carries out a control sequence, ESC [
+ * parameters final
+ *****************************************/
+static void executeCsi(TerminalModel* terminal, char final)
+{
+    int count = getParam(terminal, 0, 1);
+    int x = terminal->cursorX;
+    int y = terminal->cursorY;
+    int columns = terminal->columns;
+
+    if (terminal->prefix == '?')
+    {
+        if (final == 'h' || final == 'l')
+        {
+            setMode(terminal, final == 'h');
+        }
+        return;
+    }
+    else if (terminal->prefix != 0 || terminal->intermediate != 0)
+    {
+        return;
+    }
+
+    switch (final)
+    {
+        case '@': // ICH, insert blank characters
+            count = (count > columns - x) ? columns - x : count;
+            memmove(getCell(terminal, terminal->isAlternate, x + count, y), getCell(terminal, terminal->isAlternate, x, y),
+                (columns - x - count) * sizeof(TerminalCell));
+            eraseCells(terminal, y, x, x + count);
+            terminal->isWrapPending = 0;
+            break;
+        case 'A': // CUU
+            moveCursor(terminal, x, (y >= terminal->scrollTop && y - count < terminal->scrollTop) ? terminal->scrollTop : y - count);
+            break;
+        case 'B': // CUD
+        case 'e': // VPR
+            moveCursor(terminal, x, (y <= terminal->scrollBottom && y + count > terminal->scrollBottom) ? terminal->scrollBottom : y + count);
+            break;
+        case 'C': // CUF
+        case 'a': // HPR
+            moveCursor(terminal, x + count, y);
+            break;
+        case 'D': // CUB
+            moveCursor(terminal, x - count, y);
+            break;
+        case 'E': // CNL
+            moveCursor(terminal, 0, y + count);
+            break;
+        case 'F': // CPL
+            moveCursor(terminal, 0, y - count);
+            break;
+        case 'G': // CHA
+        case '`': // HPA
+            moveCursor(terminal, count - 1, y);
+            break;
+        case 'H': // CUP
+        case 'f': // HVP
+            if ((terminal->modes & TERMINAL_ORIGIN) != 0)
+            {
+                int row = terminal->scrollTop + getParam(terminal, 0, 1) - 1;
+                moveCursor(terminal, getParam(terminal, 1, 1) - 1, (row > terminal->scrollBottom) ? terminal->scrollBottom : row);
+            }
+            else
+            {
+                moveCursor(terminal, getParam(terminal, 1, 1) - 1, getParam(terminal, 0, 1) - 1);
+            }
+            break;
+        case 'd': // VPA
+            moveCursor(terminal, x, count - 1);
+            break;
+        case 'J': // ED
+            if (getParam(terminal, 0, 0) == 0)
+            {
+                eraseCells(terminal, y, x, columns);
+                for (int row = y + 1; row < terminal->rows; row++)
+                {
+                    eraseCells(terminal, row, 0, columns);
+                }
+            }
+            else if (getParam(terminal, 0, 0) == 1)
+            {
+                for (int row = 0; row < y; row++)
+                {
+                    eraseCells(terminal, row, 0, columns);
+                }
+                eraseCells(terminal, y, 0, x + 1);
+            }
+            else
+            {
+                for (int row = 0; row < terminal->rows; row++)
+                {
+                    eraseCells(terminal, row, 0, columns);
+                }
+
+                // The whole screen is known from here, whatever came before
+                if (terminal->isAlternate == 0)
+                {
+                    terminal->isSynced = 1;
+                }
+            }
+            break;
+        case 'K': // EL
+            if (getParam(terminal, 0, 0) == 0)
+            {
+                eraseCells(terminal, y, x, columns);
+            }
+            else if (getParam(terminal, 0, 0) == 1)
+            {
+                eraseCells(terminal, y, 0, x + 1);
+            }
+            else
+            {
+                eraseCells(terminal, y, 0, columns);
+            }
+            break;
+        case 'L': // IL
+            if (y >= terminal->scrollTop && y <= terminal->scrollBottom)
+            {
+                scrollDown(terminal, y, terminal->scrollBottom, count);
+                terminal->cursorX = 0;
+                terminal->isWrapPending = 0;
+            }
+            break;
+        case 'M': // DL
+            if (y >= terminal->scrollTop && y <= terminal->scrollBottom)
+            {
+                scrollUp(terminal, y, terminal->scrollBottom, count);
+                terminal->cursorX = 0;
+                terminal->isWrapPending = 0;
+            }
+            break;
+        case 'P': // DCH
+            count = (count > columns - x) ? columns - x : count;
+            memmove(getCell(terminal, terminal->isAlternate, x, y), getCell(terminal, terminal->isAlternate, x + count, y),
+                (columns - x - count) * sizeof(TerminalCell));
+            eraseCells(terminal, y, columns - count, columns);
+            terminal->isWrapPending = 0;
+            break;
+        case 'S': // SU
+            scrollUp(terminal, terminal->scrollTop, terminal->scrollBottom, count);
+            break;
+        case 'T': // SD
+            if (terminal->paramCount <= 1)
+            {
+                scrollDown(terminal, terminal->scrollTop, terminal->scrollBottom, count);
+            }
+            break;
+        case 'X': // ECH
+            eraseCells(terminal, y, x, (x + count > columns) ? columns : x + count);
+            terminal->isWrapPending = 0;
+            break;
+        case 'm': // SGR
+            selectGraphic(terminal);
+            break;
+        case 'r': // DECSTBM
+        {
+            int top = getParam(terminal, 0, 1) - 1;
+            int bottom = getParam(terminal, 1, terminal->rows) - 1;
+            bottom = (bottom >= terminal->rows) ? terminal->rows - 1 : bottom;
+            if (top < bottom)
+            {
+                terminal->scrollTop = top;
+                terminal->scrollBottom = bottom;
+                moveCursor(terminal, 0, ((terminal->modes & TERMINAL_ORIGIN) != 0) ? top : 0);
+            }
+            break;
+        }
+        case 's': // SCOSC
+            saveCursor(terminal);
+            break;
+        case 'u': // SCORC
+            restoreCursor(terminal);
+            break;
+    }
+}
+
+/******************************************
+ * executeEscape
+ *
+ * Arguments: TerminalModel* terminal,
+ *            char final
+ * Returns: void
+ *
+ * Carries out an escape sequence, ESC
+ * (intermediate) final
+ *****************************************/
+static void executeEscape(TerminalModel* terminal, char final)
+{
+    if (terminal->intermediate == '(' || terminal->intermediate == ')')
+    {
+        terminal->charsets[terminal->intermediate == ')'] = (final == '0');
+        return;
+    }
+    else if (terminal->intermediate != 0)
+    {
+        return;
+    }
+
+    switch (final)
+    {
+        case '7': // DECSC
+            saveCursor(terminal);
+            break;
+        case '8': // DECRC
+            restoreCursor(terminal);
+            break;
+        case 'D': // IND
+            lineFeed(terminal);
+            break;
+        case 'E': // NEL
+            terminal->cursorX = 0;
+            lineFeed(terminal);
+            break;
+        case 'M': // RI
+            reverseIndex(terminal);
+            break;
+        case '=': // DECKPAM
+            terminal->modes |= TERMINAL_KEYPAD;
+            break;
+        case '>': // DECKPNM
+            terminal->modes &= ~TERMINAL_KEYPAD;
+            break;
+        case 'c': // RIS
+            resetState(terminal);
+            terminal->isSynced = 1;
+            break;
+    }
+}
+
+/******************************************
+ * executeControl
+ *
+ * Arguments: TerminalModel* terminal,
+ *            unsigned char byte
+ * Returns: void
+ *
+ * Carries out a C0 control character
+ *****************************************/
+static void executeControl(TerminalModel* terminal, unsigned char byte)
+{
+    switch (byte)
+    {
+        case '\b':
+            if (terminal->cursorX > 0)
+            {
+                terminal->cursorX--;
+            }
+            terminal->isWrapPending = 0;
+            break;
+        case '\t':
+            moveCursor(terminal, (terminal->cursorX / 8 + 1) * 8, terminal->cursorY);
+            break;
+        case '\n':
+        case '\v':
+        case '\f':
+            lineFeed(terminal);
+            break;
+        case '\r':
+            terminal->cursorX = 0;
+            terminal->isWrapPending = 0;
+            break;
+        case 0x0e: // SO
+            terminal->shift = 1;
+            break;
+        case 0x0f: // SI
+            terminal->shift = 0;
+            break;
+    }
+}
+
+/******************************************
+ * feedByte
+ *
+ * Arguments: TerminalModel* terminal,
+ *            unsigned char byte
+ * Returns: void
+ *
+ * Runs one byte of terminal output, with
+ * telnet commands already taken out,
+ * through the parser
+ *****************************************/
+static void feedByte(TerminalModel* terminal, unsigned char byte)
+{
+    // CAN and SUB cancel a sequence, and ESC starts a new one, wherever they come
+    if (byte == 0x18 || byte == 0x1a)
+    {
+        terminal->state = STATE_GROUND;
+        return;
+    }
+    if (byte == 0x1b)
+    {
+        terminal->state = (terminal->state == STATE_STRING) ? STATE_STRING_ESCAPE : STATE_ESCAPE;
+        terminal->intermediate = 0;
+        terminal->utf8Remaining = 0;
+        return;
+    }
+
+    switch (terminal->state)
+    {
+        case STATE_GROUND:
+            if (byte < 0x20)
+            {
+                executeControl(terminal, byte);
+                terminal->utf8Remaining = 0;
+            }
+            else if (byte < 0x7f)
+            {
+                putCharacter(terminal, byte);
+                terminal->utf8Remaining = 0;
+            }
+            else if (byte >= 0x80 && byte < 0xc0 && terminal->utf8Remaining > 0)
+            {
+                terminal->codePoint = (terminal->codePoint << 6) | (byte & 0x3f);
+                if (--terminal->utf8Remaining == 0)
+                {
+                    putCharacter(terminal, terminal->codePoint);
+                }
+            }
+            else if (byte >= 0xc2 && byte < 0xf5)
+            {
+                terminal->utf8Remaining = (byte >= 0xf0) ? 3 : (byte >= 0xe0) ? 2 : 1;
+                terminal->codePoint = byte & (0x3f >> terminal->utf8Remaining);
+            }
+            else if (byte != 0x7f)
+            {
+                putCharacter(terminal, 0xfffd);
+                terminal->utf8Remaining = 0;
+            }
+            break;
+
+        case STATE_ESCAPE:
+        case STATE_ESCAPE_INTERMEDIATE:
+            if (byte < 0x20)
+            {
+                executeControl(terminal, byte);
+            }
+            else if (byte < 0x30)
+            {
+                terminal->intermediate = byte;
+                terminal->state = STATE_ESCAPE_INTERMEDIATE;
+            }
+            else if (terminal->state == STATE_ESCAPE && byte == '[')
+            {
+                terminal->state = STATE_CSI;
+                terminal->paramCount = 0;
+                terminal->prefix = 0;
+            }
+            else if (terminal->state == STATE_ESCAPE && (byte == ']' || byte == 'P' || byte == '_' || byte == '^' || byte == 'X'))
+            {
+                terminal->state = STATE_STRING;
+            }
+            else
+            {
+                executeEscape(terminal, byte);
+                terminal->state = STATE_GROUND;
+            }
+            break;
+
+        case STATE_CSI:
+            if (byte < 0x20)
+            {
+                executeControl(terminal, byte);
+            }
+            else if (byte >= '0' && byte <= '9')
+            {
+                if (terminal->paramCount == 0)
+                {
+                    terminal->params[terminal->paramCount++] = 0;
+                }
+                int* param = &terminal->params[terminal->paramCount - 1];
+                *param = (*param > 100000) ? *param : *param * 10 + (byte - '0');
+            }
+            else if (byte == ';' || byte == ':')
+            {
+                if (terminal->paramCount == 0)
+                {
+                    terminal->params[terminal->paramCount++] = 0;
+                }
+                if (terminal->paramCount < TERMINAL_PARAM_COUNT)
+                {
+                    terminal->params[terminal->paramCount++] = 0;
+                }
+            }
+            else if (byte >= 0x3c && byte <= 0x3f)
+            {
+                terminal->prefix = byte;
+            }
+            else if (byte < 0x40)
+            {
+                terminal->intermediate = byte;
+            }
+            else
+            {
+                executeCsi(terminal, byte);
+                terminal->state = STATE_GROUND;
+            }
+            break;
+
+        case STATE_STRING:
+            if (byte == 0x07)
+            {
+                terminal->state = STATE_GROUND;
+            }
+            break;
+
+        case STATE_STRING_ESCAPE:
+            // ST is ESC backslash, anything else after ESC in a string ends it too
+            terminal->state = STATE_GROUND;
+            if (byte != '\\')
+            {
+                terminal->state = STATE_ESCAPE;
+                feedByte(terminal, byte);
+            }
+            break;
+    }
+}
+
+/******************************************
+ * keepCommand
+ *
+ * Arguments: TerminalModel* terminal,
+ *            unsigned char byte, int isHeld
+ * Returns: void
+ *
+ * Keeps a byte of a telnet command from held
+ * output for the next snapshot
+ *****************************************/
+static void keepCommand(TerminalModel* terminal, unsigned char byte, int isHeld)
+{
+    if (isHeld == 0)
+    {
+        return;
+    }
+    if (terminal->commandsLength == TERMINAL_COMMANDS_LEN)
+    {
+        terminal->isCommandsOverflowed = 1;
+        return;
+    }
+    terminal->commands[terminal->commandsLength++] = byte;
+}
+
+TerminalModel* newTerminalModel()
+{
+    TerminalModel* terminal = malloc(sizeof(TerminalModel));
+    if (terminal == NULL)
+    {
+        perror("Unable to allocate space for the terminal model");
+        exit(-1);
+    }
+
+    terminal->columns = TERMINAL_DEFAULT_COLUMNS;
+    terminal->rows = TERMINAL_DEFAULT_ROWS;
+    for (int screen = 0; screen < 2; screen++)
+    {
+        terminal->screens[screen] = malloc(terminal->columns * terminal->rows * sizeof(TerminalCell));
+        if (terminal->screens[screen] == NULL)
+        {
+            perror("Unable to allocate space for the terminal screen");
+            exit(-1);
+        }
+    }
+    terminal->inputState = TELNET_DATA;
+    resetTerminalModel(terminal, 1);
+
+    return terminal;
+}
+
+void deleteTerminalModel(TerminalModel* terminal)
+{
+    if (terminal == NULL)
+    {
+        return;
+    }
+    free(terminal->screens[0]);
+    free(terminal->screens[1]);
+    free(terminal);
+}
+
+void resetTerminalModel(TerminalModel* terminal, int isSynced)
+{
+    resetState(terminal);
+    terminal->state = STATE_GROUND;
+    terminal->utf8Remaining = 0;
+    terminal->telnetState = TELNET_DATA;
+    terminal->isRemoteEcho = 0;
+    forgetTerminalCommands(terminal);
+    terminal->isSynced = isSynced;
+}
+
+void feedTerminalOutput(TerminalModel* terminal, const void* data, int length, int isHeld)
+{
+    const unsigned char* bytes = data;
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char byte = bytes[i];
+        switch (terminal->telnetState)
+        {
+            case TELNET_DATA:
+                if (byte == IAC)
+                {
+                    terminal->telnetState = TELNET_IAC;
+                }
+                else
+                {
+                    feedByte(terminal, byte);
+                }
+                break;
+
+            case TELNET_IAC:
+                if (byte == IAC) // an escaped 255 in the data
+                {
+                    feedByte(terminal, byte);
+                    terminal->telnetState = TELNET_DATA;
+                    break;
+                }
+                keepCommand(terminal, IAC, isHeld);
+                keepCommand(terminal, byte, isHeld);
+                terminal->telnetCommand = byte;
+                terminal->telnetState = (byte == SB) ? TELNET_SUB : (byte >= WILL && byte <= DONT) ? TELNET_OPTION : TELNET_DATA;
+                break;
+
+            case TELNET_OPTION:
+                keepCommand(terminal, byte, isHeld);
+                if (byte == ECHO && (terminal->telnetCommand == WILL || terminal->telnetCommand == WONT))
+                {
+                    terminal->isRemoteEcho = (terminal->telnetCommand == WILL);
+                }
+                terminal->telnetState = TELNET_DATA;
+                break;
+
+            case TELNET_SUB:
+                keepCommand(terminal, byte, isHeld);
+                terminal->telnetState = (byte == IAC) ? TELNET_SUB_IAC : TELNET_SUB;
+                break;
+
+            case TELNET_SUB_IAC:
+                keepCommand(terminal, byte, isHeld);
+                terminal->telnetState = (byte == SE) ? TELNET_DATA : TELNET_SUB;
+                break;
+        }
+    }
+}
+
+void feedTerminalInput(TerminalModel* terminal, const void* data, int length)
+{
+    const unsigned char* bytes = data;
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char byte = bytes[i];
+        switch (terminal->inputState)
+        {
+            case TELNET_DATA:
+                terminal->inputState = (byte == IAC) ? TELNET_IAC : TELNET_DATA;
+                break;
+
+            case TELNET_IAC:
+                terminal->inputState = (byte == SB) ? TELNET_SUB_OPTION : (byte >= WILL && byte <= DONT) ? TELNET_OPTION : TELNET_DATA;
+                break;
+
+            case TELNET_OPTION:
+                terminal->inputState = TELNET_DATA;
+                break;
+
+            case TELNET_SUB_OPTION:
+                terminal->isNaws = (byte == NAWS);
+                terminal->nawsLength = 0;
+                terminal->inputState = TELNET_SUB;
+                break;
+
+            case TELNET_SUB:
+                if (byte == IAC)
+                {
+                    terminal->inputState = TELNET_SUB_IAC;
+                }
+                else if (terminal->isNaws != 0 && terminal->nawsLength < 4)
+                {
+                    terminal->naws[terminal->nawsLength++] = byte;
+                }
+                break;
+
+            case TELNET_SUB_IAC:
+                if (byte == IAC) // an escaped 255 in the subnegotiation
+                {
+                    if (terminal->isNaws != 0 && terminal->nawsLength < 4)
+                    {
+                        terminal->naws[terminal->nawsLength++] = byte;
+                    }
+                    terminal->inputState = TELNET_SUB;
+                    break;
+                }
+                if (byte == SE && terminal->isNaws != 0 && terminal->nawsLength == 4)
+                {
+                    resizeTerminal(terminal, (terminal->naws[0] << 8) | terminal->naws[1], (terminal->naws[2] << 8) | terminal->naws[3]);
+                }
+                terminal->inputState = TELNET_DATA;
+                break;
+        }
+    }
+}
+
+void forgetTerminalCommands(TerminalModel* terminal)
+{
+    terminal->commandsLength = 0;
+    terminal->isCommandsOverflowed = 0;
+}
+
+int isTerminalAtRest(TerminalModel* terminal)
+{
+    return terminal->state == STATE_GROUND && terminal->utf8Remaining == 0 && terminal->telnetState == TELNET_DATA;
+}
+
+int isTerminalInputData(TerminalModel* terminal)
+{
+    return terminal->inputState == TELNET_DATA;
+}
+
+/******************************************
+ * putBytes
+ *
+ * Arguments: Snapshot* snapshot,
+ *            const void* bytes, int length
+ * Returns: void
+ *
+ * Appends bytes to a snapshot, growing it
+ * as needed
+ *****************************************/
+static void putBytes(Snapshot* snapshot, const void* bytes, int length)
+{
+    if (snapshot->isFailed != 0)
+    {
+        return;
+    }
+    if (snapshot->length + length > snapshot->capacity)
+    {
+        int capacity = snapshot->capacity * 2 + length;
+        char* data = realloc(snapshot->data, capacity);
+        if (data == NULL)
+        {
+            perror("Unable to allocate space for the terminal snapshot");
+            snapshot->isFailed = 1;
+            return;
+        }
+        snapshot->data = data;
+        snapshot->capacity = capacity;
+    }
+    memcpy(snapshot->data + snapshot->length, bytes, length);
+    snapshot->length += length;
+}
+
+/******************************************
+ * putFormat
+ *
+ * Arguments: Snapshot* snapshot,
+ *            const char* format, ...
+ * Returns: void
+ *
+ * Appends printf() style text to a snapshot
+ *****************************************/
+static void putFormat(Snapshot* snapshot, const char* format, ...)
+{
+    char text[64];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    putBytes(snapshot, text, (length < (int) sizeof(text)) ? length : (int) sizeof(text) - 1);
+}
+
+/******************************************
+ * putColor
+ *
+ * Arguments: Snapshot* snapshot, int color,
+ *            int base
+ * Returns: void
+ *
+ * Appends the SGR parameter for a color,
+ * base 30 for foreground or 40 for
+ * background
+ *****************************************/
+static void putColor(Snapshot* snapshot, int color, int base)
+{
+    if (color == TERMINAL_DEFAULT_COLOR)
+    {
+        return;
+    }
+    if (color < 8)
+    {
+        putFormat(snapshot, ";%i", base + color);
+    }
+    else if (color < 16)
+    {
+        putFormat(snapshot, ";%i", base + 60 + color - 8);
+    }
+    else
+    {
+        putFormat(snapshot, ";%i;5;%i", base + 8, color);
+    }
+}
+
+/******************************************
+ * putGraphic
+ *
+ * Arguments: Snapshot* snapshot,
+ *            TerminalCell* cell
+ * Returns: void
+ *
+ * Appends the SGR sequence that sets the
+ * attributes and colors of cell
+ *****************************************/
+static void putGraphic(Snapshot* snapshot, TerminalCell* cell)
+{
+    static const int attributeParams[] = { 1, 2, 3, 4, 5, 7 };
+
+    putBytes(snapshot, "\033[0", 3);
+    for (int i = 0; i < 6; i++)
+    {
+        if ((cell->attributes & (1 << i)) != 0)
+        {
+            putFormat(snapshot, ";%i", attributeParams[i]);
+        }
+    }
+    putColor(snapshot, cell->foreground, 30);
+    putColor(snapshot, cell->background, 40);
+    putBytes(snapshot, "m", 1);
+}
+
+/******************************************
+ * putCharacterBytes
+ *
+ * Arguments: Snapshot* snapshot,
+ *            uint32_t character
+ * Returns: void
+ *
+ * Appends a character in UTF-8
+ *****************************************/
+static void putCharacterBytes(Snapshot* snapshot, uint32_t character)
+{
+    unsigned char bytes[4];
+    int length;
+    if (character < 0x80)
+    {
+        bytes[0] = character;
+        length = 1;
+    }
+    else if (character < 0x800)
+    {
+        bytes[0] = 0xc0 | (character >> 6);
+        bytes[1] = 0x80 | (character & 0x3f);
+        length = 2;
+    }
+    else if (character < 0x10000)
+    {
+        bytes[0] = 0xe0 | (character >> 12);
+        bytes[1] = 0x80 | ((character >> 6) & 0x3f);
+        bytes[2] = 0x80 | (character & 0x3f);
+        length = 3;
+    }
+    else
+    {
+        bytes[0] = 0xf0 | ((character >> 18) & 0x07);
+        bytes[1] = 0x80 | ((character >> 12) & 0x3f);
+        bytes[2] = 0x80 | ((character >> 6) & 0x3f);
+        bytes[3] = 0x80 | (character & 0x3f);
+        length = 4;
+    }
+    putBytes(snapshot, bytes, length);
+}
+
+/******************************************
+ * putScreen
+ *
+ * Arguments: TerminalModel* terminal,
+ *            Snapshot* snapshot, int screen
+ * Returns: void
+ *
+ * Appends what redraws a screen from a blank
+ * one, row by row, leaving out the blanks at
+ * the end of each row
+ *****************************************/
+static void putScreen(TerminalModel* terminal, Snapshot* snapshot, int screen)
+{
+    TerminalCell current = {
+        .foreground = TERMINAL_DEFAULT_COLOR,
+        .background = TERMINAL_DEFAULT_COLOR,
+        .attributes = 0
+    };
+    int isLineDrawing = 0;
+
+    putBytes(snapshot, "\033[0m\033(B\017\033[H\033[2J", 15);
+    for (int y = 0; y < terminal->rows; y++)
+    {
+        int end = terminal->columns;
+        while (end > 0)
+        {
+            TerminalCell* cell = getCell(terminal, screen, end - 1, y);
+            if (cell->character != ' ' || cell->attributes != 0 || cell->background != TERMINAL_DEFAULT_COLOR)
+            {
+                break;
+            }
+            end--;
+        }
+        if (end == 0)
+        {
+            continue;
+        }
+
+        putFormat(snapshot, "\033[%i;1H", y + 1);
+        for (int x = 0; x < end; x++)
+        {
+            TerminalCell* cell = getCell(terminal, screen, x, y);
+            int attributes = cell->attributes & ~TERMINAL_LINE_DRAWING;
+            if (attributes != current.attributes || cell->foreground != current.foreground || cell->background != current.background)
+            {
+                current = *cell;
+                current.attributes = attributes;
+                putGraphic(snapshot, &current);
+            }
+            if (((cell->attributes & TERMINAL_LINE_DRAWING) != 0) != isLineDrawing)
+            {
+                isLineDrawing = !isLineDrawing;
+                putBytes(snapshot, isLineDrawing ? "\033(0" : "\033(B", 3);
+            }
+            putCharacterBytes(snapshot, cell->character);
+        }
+    }
+    if (isLineDrawing != 0)
+    {
+        putBytes(snapshot, "\033(B", 3);
+    }
+}
+
+/******************************************
+ * putPen
+ *
+ * Arguments: Snapshot* snapshot,
+ *            TerminalCell* pen, int* charsets
+ * Returns: void
+ *
+ * Appends what puts the pen and charsets
+ * back
+ *****************************************/
+static void putPen(Snapshot* snapshot, TerminalCell* pen, int* charsets)
+{
+    putGraphic(snapshot, pen);
+    putBytes(snapshot, charsets[0] ? "\033(0" : "\033(B", 3);
+    putBytes(snapshot, charsets[1] ? "\033)0" : "\033)B", 3);
+}
+
+/******************************************
+ * putCursor
+ *
+ * Arguments: TerminalModel* terminal,
+ *            Snapshot* snapshot
+ * Returns: void
+ *
+ * Appends what puts the cursor, a pending
+ * wrap, the pen and the charsets back, on
+ * a terminal already in the model's modes
+ *****************************************/
+static void putCursor(TerminalModel* terminal, Snapshot* snapshot)
+{
+    // In origin mode the cursor is placed from the top of the scroll region
+    int cursorRow = terminal->cursorY;
+    if ((terminal->modes & TERMINAL_ORIGIN) != 0)
+    {
+        cursorRow -= terminal->scrollTop;
+    }
+    putFormat(snapshot, "\033[%i;%iH", cursorRow + 1, terminal->cursorX + 1);
+
+    // A wrap pending after the last column is left again by writing that column's character again, with autowrap on
+    if (terminal->isWrapPending != 0)
+    {
+        TerminalCell* cell = getCell(terminal, terminal->isAlternate, terminal->cursorX, terminal->cursorY);
+        putGraphic(snapshot, cell);
+        putBytes(snapshot, ((cell->attributes & TERMINAL_LINE_DRAWING) != 0) ? "\033(0" : "\033(B", 3);
+        putCharacterBytes(snapshot, cell->character);
+    }
+    putPen(snapshot, &terminal->pen, terminal->charsets);
+    putBytes(snapshot, terminal->shift ? "\016" : "\017", 1);
+}
+
+char* writeTerminalSnapshot(TerminalModel* terminal, int* length)
+{
+    static const struct {
+        uint32_t mode;
+        const char* set;
+        const char* reset;
+    } modes[] = {
+        { TERMINAL_CURSOR_KEYS, "\033[?1h", "\033[?1l" },
+        { TERMINAL_KEYPAD, "\033=", "\033>" },
+        { TERMINAL_AUTOWRAP, "\033[?7h", "\033[?7l" },
+        { TERMINAL_CURSOR_VISIBLE, "\033[?25h", "\033[?25l" },
+        { TERMINAL_MOUSE_CLICKS, "\033[?1000h", "" },  // the three are reset together, below
+        { TERMINAL_MOUSE_DRAGS, "\033[?1002h", "" },
+        { TERMINAL_MOUSE_MOTION, "\033[?1003h", "" },
+        { TERMINAL_MOUSE_SGR, "\033[?1006h", "\033[?1006l" },
+        { TERMINAL_BRACKETED_PASTE, "\033[?2004h", "\033[?2004l" }
+    };
+
+    if (terminal->isSynced == 0 || terminal->isCommandsOverflowed != 0)
+    {
+        return NULL;
+    }
+
+    Snapshot snapshot = {
+        .data = malloc(SNAPSHOT_INITIAL_LEN),
+        .length = 0,
+        .capacity = SNAPSHOT_INITIAL_LEN,
+        .isFailed = 0
+    };
+    if (snapshot.data == NULL)
+    {
+        perror("Unable to allocate space for the terminal snapshot");
+        return NULL;
+    }
+
+    // Telnet commands first, as they came before the output they are in. Then the main screen, from the
+    // main screen, with no scroll region or origin mode to get in the way of drawing it
+    putBytes(&snapshot, terminal->commands, terminal->commandsLength);
+    putBytes(&snapshot, "\033[?1049l\033[r\033[?6l\033[?7l", 21);
+    putScreen(terminal, &snapshot, 0);
+
+    // The saved cursor goes back with DECSC, or on the alternate screen with the switch to it, which saves it
+    putFormat(&snapshot, "\033[%i;%iH", terminal->savedY + 1, terminal->savedX + 1);
+    putPen(&snapshot, &terminal->savedPen, terminal->savedCharsets);
+    if (terminal->isAlternate != 0)
+    {
+        putBytes(&snapshot, "\033[?1049h", 8);
+        putScreen(terminal, &snapshot, 1);
+    }
+    else
+    {
+        putBytes(&snapshot, "\0337", 2);
+    }
+
+    if (terminal->scrollTop != 0 || terminal->scrollBottom != terminal->rows - 1)
+    {
+        putFormat(&snapshot, "\033[%i;%ir", terminal->scrollTop + 1, terminal->scrollBottom + 1);
+    }
+    putBytes(&snapshot, "\033[?1000l", 8);
+    for (int i = 0; i < (int) (sizeof(modes) / sizeof(modes[0])); i++)
+    {
+        const char* sequence = ((terminal->modes & modes[i].mode) != 0) ? modes[i].set : modes[i].reset;
+        putBytes(&snapshot, sequence, strlen(sequence));
+    }
+
+    if ((terminal->modes & TERMINAL_ORIGIN) != 0)
+    {
+        putBytes(&snapshot, "\033[?6h", 5);
+    }
+    putCursor(terminal, &snapshot);
+
+    if (snapshot.isFailed != 0)
+    {
+        free(snapshot.data);
+        return NULL;
+    }
+
+    forgetTerminalCommands(terminal);
+    *length = snapshot.length;
+    return snapshot.data;
+}
+
+char* writeTerminalCells(TerminalModel* terminal, int x, int y, int count, int* length)
+{
+    Snapshot cells = {
+        .data = malloc(SNAPSHOT_INITIAL_LEN),
+        .length = 0,
+        .capacity = SNAPSHOT_INITIAL_LEN,
+        .isFailed = 0
+    };
+    if (cells.data == NULL)
+    {
+        perror("Unable to allocate space for the terminal cells");
+        return NULL;
+    }
+
+    // The row is placed from the top of the scroll region in origin mode, as the cursor is
+    int row = ((terminal->modes & TERMINAL_ORIGIN) != 0) ? y - terminal->scrollTop : y;
+    putFormat(&cells, "\033[%i;%iH\017", row + 1, x + 1);
+    for (int i = x; i < x + count && i < terminal->columns; i++)
+    {
+        TerminalCell* cell = getCell(terminal, terminal->isAlternate, i, y);
+        putGraphic(&cells, cell);
+        putBytes(&cells, ((cell->attributes & TERMINAL_LINE_DRAWING) != 0) ? "\033(0" : "\033(B", 3);
+        putCharacterBytes(&cells, cell->character);
+    }
+    putCursor(terminal, &cells);
+
+    if (cells.isFailed != 0)
+    {
+        free(cells.data);
+        return NULL;
+    }
+
+    *length = cells.length;
+    return cells.data;
+}
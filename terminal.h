@@ -0,0 +1,264 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       terminal.h
+
+Note:       A small model of the terminal at the far end of a session,
+            which sproxy can keep with -t, so that after a long
+            disconnect it sends cproxy what the screen should show
+            instead of every byte the daemon wrote meanwhile.
+
+            The model reads the daemon's output the way a VT100 (or
+            xterm) would: printable characters in UTF-8, the C0
+            controls, cursor movement, erasing, inserting and deleting
+            characters and lines, scroll regions, SGR attributes and
+            colors (8, 16 and 256, truecolor is dropped), the DEC line
+            drawing set, the alternate screen, and the modes that change
+            what the terminal sends (cursor keys, keypad, bracketed paste
+            and mouse reporting). Strings (OSC, DCS) are skipped, wide
+            characters take one column, and there is no scrollback.
+            Telnet commands in the output are skipped too, and the ones
+            in output that is being held back are kept, up to
+            TERMINAL_COMMANDS_LEN bytes, so a snapshot can pass them on.
+            The size starts at 80x24 and follows the window size the
+            telnet client reports (NAWS) in its input.
+
+            A snapshot is a byte stream that redraws the terminal from
+            whatever it shows: the kept telnet commands, then each row
+            of the main screen, then the alternate screen if it is in
+            use, then the scroll region, cursor, attributes and modes.
+            Only a model that has seen its daemon's output from the
+            start, or since the screen was last cleared, can write one.
+
+            cproxy keeps a model too, with -e, of what its client's
+            screen shows, to guess the echo of a keystroke and to take
+            a wrong guess back (see predict.h). For that the model
+            follows whether the daemon echoes what is typed (telnet
+            WILL ECHO), and can redraw a few cells of a row.
+*/
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+#include <stdint.h>
+
+#define TERMINAL_DEFAULT_COLUMNS 80
+#define TERMINAL_DEFAULT_ROWS 24
+#define TERMINAL_MAX_COLUMNS 512
+#define TERMINAL_MAX_ROWS 256
+#define TERMINAL_PARAM_COUNT 16         // most parameters of a control sequence that are kept
+#define TERMINAL_COMMANDS_LEN 512       // telnet commands kept from held output
+#define TERMINAL_SNAPSHOT_MIN_LEN 65536 // held output past which sproxy sends a snapshot instead
+
+// Cell attributes
+#define TERMINAL_BOLD 0x1
+#define TERMINAL_DIM 0x2
+#define TERMINAL_ITALIC 0x4
+#define TERMINAL_UNDERLINE 0x8
+#define TERMINAL_BLINK 0x10
+#define TERMINAL_REVERSE 0x20
+#define TERMINAL_LINE_DRAWING 0x40  // the character is from the DEC line drawing set
+
+#define TERMINAL_DEFAULT_COLOR 0xffff
+
+// Modes a snapshot restores
+#define TERMINAL_CURSOR_KEYS 0x1        // DECCKM, ?1
+#define TERMINAL_KEYPAD 0x2             // DECKPAM, ESC =
+#define TERMINAL_ORIGIN 0x4             // DECOM, ?6
+#define TERMINAL_AUTOWRAP 0x8           // DECAWM, ?7
+#define TERMINAL_CURSOR_VISIBLE 0x10    // DECTCEM, ?25
+#define TERMINAL_MOUSE_CLICKS 0x20      // ?1000
+#define TERMINAL_MOUSE_DRAGS 0x40       // ?1002
+#define TERMINAL_MOUSE_MOTION 0x80      // ?1003
+#define TERMINAL_MOUSE_SGR 0x100        // ?1006
+#define TERMINAL_BRACKETED_PASTE 0x200  // ?2004
+
+typedef struct {
+
+    uint32_t character;     // a Unicode code point
+    uint16_t foreground;    // 0 to 255, or TERMINAL_DEFAULT_COLOR
+    uint16_t background;
+    uint8_t attributes;
+
+} TerminalCell;
+
+typedef struct {
+
+    // The main and alternate screens, rows * columns cells each
+    TerminalCell* screens[2];
+    int isAlternate;
+    int columns;
+    int rows;
+
+    int cursorX;
+    int cursorY;
+    int isWrapPending;      // a character was written in the last column
+    int scrollTop;          // rows that scroll, from 0
+    int scrollBottom;
+    TerminalCell pen;       // attributes and colors of new characters
+    uint32_t modes;
+    int charsets[2];        // G0 and G1, 1 for line drawing
+    int shift;              // which of them is in use
+
+    // Saved by DECSC (ESC 7) and on switching to the alternate screen
+    int savedX;
+    int savedY;
+    TerminalCell savedPen;
+    int savedCharsets[2];
+
+    // Parsing the output
+    int state;
+    int params[TERMINAL_PARAM_COUNT];
+    int paramCount;
+    char prefix;            // '?', '>' or '=' before the parameters, or 0
+    char intermediate;      // of an escape sequence, such as '(' for a charset
+    uint32_t codePoint;     // of a UTF-8 character in progress
+    int utf8Remaining;
+    int telnetState;
+    unsigned char telnetCommand;    // the WILL, WONT, DO or DONT before an option
+    int isRemoteEcho;       // the daemon said WILL ECHO, so it echoes what is typed
+
+    // Telnet commands in held output, to be passed on by a snapshot
+    char commands[TERMINAL_COMMANDS_LEN];
+    int commandsLength;
+    int isCommandsOverflowed;
+
+    // Parsing the input for the window size
+    int inputState;
+    int isNaws;
+    uint8_t naws[4];
+    int nawsLength;
+
+    int isSynced;           // is true if the model has seen all output that is on the screen
+
+} TerminalModel;
+
+/**************************************************
+ * newTerminalModel
+ *
+ * Arguments: none
+ * Returns: TerminalModel*
+ *
+ * Allocates a model of a blank 80x24 terminal,
+ * exits the process if it can't
+ *************************************************/
+TerminalModel* newTerminalModel();
+
+/**************************************************
+ * deleteTerminalModel
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Frees a model
+ *************************************************/
+void deleteTerminalModel(TerminalModel* terminal);
+
+/**************************************************
+ * resetTerminalModel
+ *
+ * Arguments: TerminalModel* terminal,
+ *            int isSynced
+ * Returns: void
+ *
+ * Blanks the screens and resets every mode, at the
+ * same size, for a new connection to the daemon
+ * (isSynced true), or for one whose output so far
+ * was not seen (isSynced false)
+ *************************************************/
+void resetTerminalModel(TerminalModel* terminal, int isSynced);
+
+/**************************************************
+ * feedTerminalOutput
+ *
+ * Arguments: TerminalModel* terminal,
+ *            const void* data, int length,
+ *            int isHeld
+ * Returns: void
+ *
+ * Updates the model with output from the daemon,
+ * keeping its telnet commands if isHeld is true
+ *************************************************/
+void feedTerminalOutput(TerminalModel* terminal, const void* data, int length, int isHeld);
+
+/**************************************************
+ * feedTerminalInput
+ *
+ * Arguments: TerminalModel* terminal,
+ *            const void* data, int length
+ * Returns: void
+ *
+ * Follows the window size in input from the
+ * telnet client to the daemon
+ *************************************************/
+void feedTerminalInput(TerminalModel* terminal, const void* data, int length);
+
+/**************************************************
+ * forgetTerminalCommands
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: void
+ *
+ * Drops the telnet commands kept, once the output
+ * that held them has been sent after all
+ *************************************************/
+void forgetTerminalCommands(TerminalModel* terminal);
+
+/**************************************************
+ * writeTerminalSnapshot
+ *
+ * Arguments: TerminalModel* terminal, int* length
+ * Returns: char*
+ *
+ * Writes a snapshot of the terminal, and drops
+ * the telnet commands kept, which it holds
+ *
+ * Returns the snapshot, which the caller frees,
+ * with its length in length, or NULL if the model
+ * is not synced, kept too many telnet commands or
+ * memory ran out
+ *************************************************/
+char* writeTerminalSnapshot(TerminalModel* terminal, int* length);
+
+/**************************************************
+ * isTerminalAtRest
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: int
+ *
+ * Is true if the output so far did not stop in
+ * the middle of a control sequence, a UTF-8
+ * character or a telnet command, so the next
+ * printable byte is written as a character
+ *************************************************/
+int isTerminalAtRest(TerminalModel* terminal);
+
+/**************************************************
+ * isTerminalInputData
+ *
+ * Arguments: TerminalModel* terminal
+ * Returns: int
+ *
+ * Is true if the input so far did not stop in the
+ * middle of a telnet command, so the next byte is
+ * a key typed, unless it is IAC
+ *************************************************/
+int isTerminalInputData(TerminalModel* terminal);
+
+/**************************************************
+ * writeTerminalCells
+ *
+ * Arguments: TerminalModel* terminal, int x,
+ *            int y, int count, int* length
+ * Returns: char*
+ *
+ * Writes what redraws count cells of row y of the
+ * screen in use, from column x, as the model has
+ * them, on a terminal that otherwise matches the
+ * model, and then puts the cursor and pen back
+ *
+ * Returns the bytes, which the caller frees, with
+ * their length in length, or NULL if memory ran
+ * out
+ *************************************************/
+char* writeTerminalCells(TerminalModel* terminal, int x, int y, int count, int* length);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       trace.c
+
+Note:       Implementation of the per stage latency histograms. See
+            trace.h
+*/
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+
+#define TRACE_HALF_BUCKETS (1 << (TRACE_SUB_BUCKET_BITS - 1))
+
+static const char* stageNames[TRACE_STAGE_COUNT] = {
+    "frame",
+    "send",
+    "enqueue",
+    "wire",
+    "reorder",
+    "deliver",
+    "total"
+};
+
+// Percentiles printed for every stage, and their quantile labels
+static const double percentiles[] = { 50, 90, 99, 99.9 };
+static const char* quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+#define PERCENTILE_COUNT 4
+
+typedef struct {
+
+    LatencyTrace* trace;
+    const char* programName;
+
+} TraceSignal;
+
+/******************************************
+ * bumpHdrValue
+ *
+ * Arguments: uint64_t* value, uint64_t amount
+ * Returns: void
+ *
+ * Adds amount to a value only this thread
+ * writes, so that other threads never see
+ * a torn value
+ *****************************************/
+static void bumpHdrValue(uint64_t* value, uint64_t amount)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/******************************************
+ * bucketTop
+ *
+ * Arguments: int index
+ * Returns: uint32_t
+ *
+ * The highest value counted in a bucket
+ *****************************************/
+static uint32_t bucketTop(int index)
+{
+    if (index < 2 * TRACE_HALF_BUCKETS)
+    {
+        return index;
+    }
+
+    int shift = index / TRACE_HALF_BUCKETS - 1;
+    uint64_t subBucket = index % TRACE_HALF_BUCKETS + TRACE_HALF_BUCKETS;
+    return (uint32_t) (((subBucket + 1) << shift) - 1);
+}
+
+/******************************************
+ * elapsedMicros
+ *
+ * Arguments: uint32_t end, uint32_t start
+ * Returns: uint32_t
+ *
+ * end - start, or 0 if end is before start,
+ * which a clock offset that is a little out
+ * can make it
+ *****************************************/
+static uint32_t elapsedMicros(uint32_t end, uint32_t start)
+{
+    int32_t elapsed = (int32_t) (end - start);
+    return (elapsed < 0) ? 0 : (uint32_t) elapsed;
+}
+
+/******************************************
+ * appendSummary
+ *
+ * Arguments: char* buffer, int length,
+ *            int* used, const char* format, ...
+ * Returns: void
+ *
+ * printf()s on to the end of buffer, as much
+ * as fits
+ *****************************************/
+static void appendSummary(char* buffer, int length, int* used, const char* format, ...)
+{
+    if (*used >= length)
+    {
+        return;
+    }
+
+    va_list arguments;
+    va_start(arguments, format);
+    int written = vsnprintf(buffer + *used, length - *used, format, arguments);
+    va_end(arguments);
+
+    *used = (written < 0 || *used + written > length) ? length : *used + written;
+}
+
+/******************************************
+ * printTraceTable
+ *
+ * Arguments: void* argument, the TraceSignal
+ * Returns: void
+ *
+ * Prints the count and percentiles of every
+ * stage to stdout. Called by the log thread,
+ * see logReport
+ *****************************************/
+static void printTraceTable(void* argument)
+{
+    TraceSignal* traceSignal = argument;
+    LatencyTrace* trace = traceSignal->trace;
+    const char* programName = traceSignal->programName;
+
+    printf("%s latency by stage, in ms:\n%-8s %10s", programName, "stage", "count");
+    for (int i = 0; i < PERCENTILE_COUNT; i++)
+    {
+        printf(" %8gth", percentiles[i]);
+    }
+    printf(" %10s\n", "max");
+
+    for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++)
+    {
+        HdrHistogram* histogram = &trace->stages[stage];
+        printf("%-8s %10llu", stageNames[stage], (unsigned long long) __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+        for (int i = 0; i < PERCENTILE_COUNT; i++)
+        {
+            printf(" %10.3f", hdrPercentile(histogram, percentiles[i]) / 1e3);
+        }
+        printf(" %10.3f\n", __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1e3);
+    }
+}
+
+/******************************************
+ * waitForSignals
+ *
+ * Arguments: void* argument
+ * Returns: void*
+ *
+ * Body of the trace signal thread: has the log
+ * thread print the table on every SIGUSR1, so
+ * it never lands in the middle of a message.
+ * Never returns
+ *****************************************/
+static void* waitForSignals(void* argument)
+{
+    TraceSignal* traceSignal = argument;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (1)
+    {
+        int signal;
+        if (sigwait(&signals, &signal) == 0)
+        {
+            logReport(printTraceTable, traceSignal);
+        }
+    }
+
+    return NULL;
+}
+
+void recordHdr(HdrHistogram* histogram, uint32_t micros)
+{
+    int index;
+    if (micros < 2 * TRACE_HALF_BUCKETS)
+    {
+        index = micros;
+    }
+    else
+    {
+        // Keep the top TRACE_SUB_BUCKET_BITS bits of the value, the highest of which is always set
+        int shift = (31 - __builtin_clz(micros)) - (TRACE_SUB_BUCKET_BITS - 1);
+        index = (shift + 1) * TRACE_HALF_BUCKETS + (int) (micros >> shift) - TRACE_HALF_BUCKETS;
+    }
+
+    bumpHdrValue(&histogram->counts[index], 1);
+    bumpHdrValue(&histogram->count, 1);
+    bumpHdrValue(&histogram->sum, micros);
+    if (micros > __atomic_load_n(&histogram->max, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&histogram->max, micros, __ATOMIC_RELAXED);
+    }
+}
+
+uint32_t hdrPercentile(HdrHistogram* histogram, double percentile)
+{
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t) (percentile / 100 * count + 0.999999);
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    // The buckets may be counted a little ahead of count, so stop at the one that reaches it
+    uint64_t seen = 0;
+    uint32_t max = (uint32_t) __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    for (int i = 0; i < TRACE_BUCKET_COUNT; i++)
+    {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= target)
+        {
+            uint32_t top = bucketTop(i);
+            return (top < max) ? top : max;
+        }
+    }
+
+    return max;
+}
+
+void traceSentPacket(LatencyTrace* trace, uint32_t seqN, uint32_t readMicros, uint32_t framedMicros, uint32_t sentMicros)
+{
+    recordHdr(&trace->stages[TRACE_FRAME], framedMicros - readMicros);
+    recordHdr(&trace->stages[TRACE_SEND], sentMicros - framedMicros);
+    recordHdr(&trace->stages[TRACE_ENQUEUE], statsMicros() - sentMicros);
+
+    TraceSent* sent = &trace->sent[seqN % TRACE_SENT_LEN];
+    sent->seqN = seqN;
+    sent->readMicros = readMicros;
+    sent->sentMicros = sentMicros;
+}
+
+void traceGap(LatencyTrace* trace)
+{
+    if (trace->gapMicros == 0)
+    {
+        trace->gapMicros = statsMicros() | 1; // never 0, which means no gap
+    }
+}
+
+void traceDeliveredPacket(LatencyTrace* trace, uint32_t seqN, uint32_t receivedMicros)
+{
+    uint32_t now = statsMicros();
+    recordHdr(&trace->stages[TRACE_DELIVER], now - receivedMicros);
+    if (trace->gapMicros != 0)
+    {
+        recordHdr(&trace->stages[TRACE_REORDER], now - trace->gapMicros);
+        trace->gapMicros = 0;
+    }
+
+    trace->deliveredSeqN = seqN;
+    trace->deliveredReceivedMicros = receivedMicros;
+    trace->deliveredMicros = now | 1; // never 0, which means reported
+}
+
+void stampTrace(LatencyTrace* trace, Hello* hello)
+{
+    hello->traceSeqN = trace->deliveredSeqN;
+    hello->traceReceivedMicros = trace->deliveredReceivedMicros;
+    hello->traceDeliveredMicros = trace->deliveredMicros;
+    trace->deliveredMicros = 0;
+}
+
+void noteTrace(LatencyTrace* trace, Hello* hello, uint32_t now)
+{
+    // The offset is the mean of the peer's clock less ours on the way out and on the way back,
+    // (T2 - T1 + T3 - T4) / 2, taken as the difference between the two so that it survives wrapping
+    if (hello->echoMicros != 0 && hello->timestampMicros != 0)
+    {
+        uint32_t roundTrip = now - hello->echoMicros - hello->echoDelayMicros;
+        uint32_t outbound = hello->timestampMicros - hello->echoDelayMicros - hello->echoMicros;
+        uint32_t inbound = hello->timestampMicros - now;
+        uint32_t offset = outbound + (uint32_t) ((int32_t) (inbound - outbound) / 2);
+
+        if (trace->isOffsetKnown == 0 || roundTrip <= trace->offsetRoundTrip
+            || now - trace->offsetMicros > TRACE_OFFSET_MAX_AGE_MS * 1000u)
+        {
+            trace->peerClockOffset = offset;
+            trace->offsetRoundTrip = roundTrip;
+            trace->offsetMicros = now;
+            trace->isOffsetKnown = 1;
+        }
+    }
+
+    if (hello->traceDeliveredMicros == 0 || trace->isOffsetKnown == 0)
+    {
+        return;
+    }
+    TraceSent* sent = &trace->sent[hello->traceSeqN % TRACE_SENT_LEN];
+    if (sent->readMicros == 0 || sent->seqN != hello->traceSeqN)
+    {
+        return;
+    }
+
+    uint32_t received = hello->traceReceivedMicros - trace->peerClockOffset;
+    uint32_t delivered = hello->traceDeliveredMicros - trace->peerClockOffset;
+    recordHdr(&trace->stages[TRACE_WIRE], elapsedMicros(received, sent->sentMicros));
+    recordHdr(&trace->stages[TRACE_TOTAL], elapsedMicros(delivered, sent->readMicros));
+    sent->readMicros = 0; // a report is only counted once
+}
+
+void resetTraceClock(LatencyTrace* trace)
+{
+    trace->isOffsetKnown = 0;
+}
+
+void startTraceSession(LatencyTrace* trace)
+{
+    memset(trace->sent, 0, sizeof(trace->sent));
+    trace->deliveredMicros = 0;
+    trace->gapMicros = 0;
+}
+
+int startTraceSignal(LatencyTrace* trace, const char* programName)
+{
+    static TraceSignal traceSignal;
+    traceSignal.trace = trace;
+    traceSignal.programName = programName;
+
+    // Blocked here, SIGUSR1 goes to the thread waiting for it, and threads started from now on block it too
+    sigset_t signals, oldSignals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &oldSignals);
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, waitForSignals, &traceSignal);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (result != 0)
+    {
+        printf("Unable to start the trace signal thread: %s\n", strerror(result));
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+int writeTraceSummary(LatencyTrace* trace, char* buffer, int length, const char* prefix)
+{
+    int used = 0;
+    appendSummary(buffer, length, &used, "# HELP %sstage_latency_seconds Time data packets spent in each stage of forwarding (see trace.h)\n"
+        "# TYPE %sstage_latency_seconds summary\n", prefix, prefix);
+
+    for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++)
+    {
+        HdrHistogram* histogram = &trace->stages[stage];
+        for (int i = 0; i < PERCENTILE_COUNT; i++)
+        {
+            appendSummary(buffer, length, &used, "%sstage_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.6f\n", prefix,
+                stageNames[stage], quantiles[i], hdrPercentile(histogram, percentiles[i]) / 1e6);
+        }
+        appendSummary(buffer, length, &used, "%sstage_latency_seconds{stage=\"%s\",quantile=\"1\"} %.6f\n", prefix,
+            stageNames[stage], __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1e6);
+        appendSummary(buffer, length, &used, "%sstage_latency_seconds_sum{stage=\"%s\"} %.6f\n", prefix,
+            stageNames[stage], __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e6);
+        appendSummary(buffer, length, &used, "%sstage_latency_seconds_count{stage=\"%s\"} %llu\n", prefix,
+            stageNames[stage], (unsigned long long) __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+    }
+
+    return used;
+}
@@ -0,0 +1,252 @@
+/*
+Authors:    Keith Smith, Sean Callahan
+File:       trace.h
+
+Note:       Where the time goes between bytes arriving on one side of the
+            proxies and leaving the other: per stage latency histograms
+            of every data packet, kept with the stats (see stats.h).
+
+            The stages of a data packet, in order, are
+
+                frame       read from telnet (cproxy) or the daemon
+                            (sproxy) until compressed, encrypted and
+                            framed
+                send        until send() to the other proxy returned
+                enqueue     until kept on the list of unacknowledged
+                            packets (and in the state file)
+                wire        until the other proxy received it, including
+                            any wait for a retransmission
+                reorder     how long the other proxy waited for a lost
+                            packet, from the first packet after the gap
+                            arriving until the gap was filled
+                deliver     from the other proxy receiving it until
+                            written to the daemon (sproxy) or telnet
+                            (cproxy)
+                total       from read here until written by the other
+                            proxy
+
+            So a proxy's histograms hold the frame, send, enqueue, wire
+            and total stages of the packets it sends, and the reorder and
+            deliver stages of the packets it receives: each direction is
+            split between the two proxies' stats. Every packet is timed
+            in the local stages. wire and total cross from one proxy's clock to the other's:
+            each heartbeat reports the latest packet delivered since the
+            last one, with the times it was received and delivered, and
+            the proxy that sent it converts those to its own clock with
+            the offset measured by the heartbeats' timestamps (see
+            stats.h), taken from the round trip with the lowest time in
+            the last TRACE_OFFSET_MAX_AGE_MS. They are sampled, one
+            packet per heartbeat, and an asymmetric path skews them by up
+            to half the round trip time.
+
+            The histograms are HDR histograms: a value is counted in a
+            bucket within 1/16th of it, from 1 us up to the 71 minutes a
+            uint32_t of us holds, so a percentile is as exact at 10 us as
+            at 10 s, and recording one is a shift and an add. They are
+            kept for the life of the process, and served with the other
+            stats on the stats socket as summaries with quantiles, or
+            printed as a table on SIGUSR1.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "hello.h"
+
+// Stages
+#define TRACE_FRAME 0
+#define TRACE_SEND 1
+#define TRACE_ENQUEUE 2
+#define TRACE_WIRE 3
+#define TRACE_REORDER 4
+#define TRACE_DELIVER 5
+#define TRACE_TOTAL 6
+#define TRACE_STAGE_COUNT 7
+
+#define TRACE_SUB_BUCKET_BITS 5     // 32 sub-buckets, the upper half of which split each power of 2 in to 16
+#define TRACE_BUCKET_COUNT ((32 - TRACE_SUB_BUCKET_BITS + 2) << (TRACE_SUB_BUCKET_BITS - 1))
+#define TRACE_SENT_LEN 256          // sent packets remembered for the peer's reports, more than a window
+#define TRACE_OFFSET_MAX_AGE_MS 60000 // longest the clock offset of one round trip is kept
+
+typedef struct {
+
+    uint64_t counts[TRACE_BUCKET_COUNT];
+    uint64_t count;
+    uint64_t sum;       // in microseconds
+    uint64_t max;
+
+} HdrHistogram;
+
+typedef struct {
+
+    uint32_t seqN;
+    uint32_t readMicros;
+    uint32_t sentMicros;
+
+} TraceSent;
+
+typedef struct {
+
+    HdrHistogram stages[TRACE_STAGE_COUNT];
+
+    // Packets sent, by seqN, for the peer's reports
+    TraceSent sent[TRACE_SENT_LEN];
+
+    // The latest packet delivered, until a heartbeat reports it
+    uint32_t deliveredSeqN;
+    uint32_t deliveredReceivedMicros;
+    uint32_t deliveredMicros;   // 0 once reported
+    uint32_t gapMicros;         // when a packet past a gap arrived, 0 if there is no gap
+
+    // The peer's clock less ours, from the round trip with the lowest time
+    uint32_t peerClockOffset;
+    uint32_t offsetRoundTrip;
+    uint32_t offsetMicros;      // when it was measured
+    int32_t isOffsetKnown;
+
+} LatencyTrace;
+
+/**************************************************
+ * recordHdr
+ *
+ * Arguments: HdrHistogram* histogram,
+ *            uint32_t micros
+ * Returns: void
+ *
+ * Counts a value. Only one thread may record in
+ * a histogram, others may read it
+ *************************************************/
+void recordHdr(HdrHistogram* histogram, uint32_t micros);
+
+/**************************************************
+ * hdrPercentile
+ *
+ * Arguments: HdrHistogram* histogram,
+ *            double percentile
+ * Returns: uint32_t
+ *
+ * The value below which percentile percent of the
+ * values fall, rounded up to the top of its
+ * bucket, or 0 if there are none
+ *************************************************/
+uint32_t hdrPercentile(HdrHistogram* histogram, double percentile);
+
+/**************************************************
+ * traceSentPacket
+ *
+ * Arguments: LatencyTrace* trace, uint32_t seqN,
+ *            uint32_t readMicros,
+ *            uint32_t framedMicros,
+ *            uint32_t sentMicros
+ * Returns: void
+ *
+ * Times the frame, send and enqueue stages of a
+ * data packet just sent and queued, and keeps its
+ * times for the peer's report
+ *************************************************/
+void traceSentPacket(LatencyTrace* trace, uint32_t seqN, uint32_t readMicros, uint32_t framedMicros, uint32_t sentMicros);
+
+/**************************************************
+ * traceGap
+ *
+ * Arguments: LatencyTrace* trace
+ * Returns: void
+ *
+ * Notes a data packet that arrived ahead of the
+ * next one expected
+ *************************************************/
+void traceGap(LatencyTrace* trace);
+
+/**************************************************
+ * traceDeliveredPacket
+ *
+ * Arguments: LatencyTrace* trace, uint32_t seqN,
+ *            uint32_t receivedMicros
+ * Returns: void
+ *
+ * Times the deliver stage of a data packet just
+ * written, and the reorder stage if it filled a
+ * gap, and keeps it for the next heartbeat to
+ * report
+ *************************************************/
+void traceDeliveredPacket(LatencyTrace* trace, uint32_t seqN, uint32_t receivedMicros);
+
+/**************************************************
+ * stampTrace
+ *
+ * Arguments: LatencyTrace* trace, Hello* hello
+ * Returns: void
+ *
+ * Fills in the delivery report of a Hello about
+ * to be sent in a heartbeat
+ *************************************************/
+void stampTrace(LatencyTrace* trace, Hello* hello);
+
+/**************************************************
+ * noteTrace
+ *
+ * Arguments: LatencyTrace* trace, Hello* hello,
+ *            uint32_t now
+ * Returns: void
+ *
+ * Takes the clock offset from a Hello received
+ * from the peer that echoes one of ours, and
+ * times the wire and total stages of the packet
+ * it reports, if it is one still remembered
+ *************************************************/
+void noteTrace(LatencyTrace* trace, Hello* hello, uint32_t now);
+
+/**************************************************
+ * resetTraceClock
+ *
+ * Arguments: LatencyTrace* trace
+ * Returns: void
+ *
+ * Forgets the peer's clock offset, for a new
+ * connection, which may be to another process
+ *************************************************/
+void resetTraceClock(LatencyTrace* trace);
+
+/**************************************************
+ * startTraceSession
+ *
+ * Arguments: LatencyTrace* trace
+ * Returns: void
+ *
+ * Forgets the packets sent and delivered, for a
+ * new session, whose seqNs start over
+ *************************************************/
+void startTraceSession(LatencyTrace* trace);
+
+/**************************************************
+ * startTraceSignal
+ *
+ * Arguments: LatencyTrace* trace,
+ *            const char* programName
+ * Returns: int
+ *
+ * Blocks SIGUSR1 in the calling thread, and starts
+ * a thread that prints a table of the stages to
+ * stdout each time one arrives
+ *
+ * Returns 0 on success, or -1 on error
+ *************************************************/
+int startTraceSignal(LatencyTrace* trace, const char* programName);
+
+/**************************************************
+ * writeTraceSummary
+ *
+ * Arguments: LatencyTrace* trace, char* buffer,
+ *            int length, const char* prefix
+ * Returns: int
+ *
+ * Writes the stages as a Prometheus summary named
+ * prefix + "stage_latency_seconds" in to buffer,
+ * as much as fits in length
+ *
+ * Returns the number of bytes written
+ *************************************************/
+int writeTraceSummary(LatencyTrace* trace, char* buffer, int length, const char* prefix);
+
+#endif